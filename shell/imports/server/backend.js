@@ -19,7 +19,10 @@ import { inMeteor, waitPromise } from "/imports/server/async-helpers";
 import Capnp from "/imports/server/capnp";
 import { globalDb } from "/imports/db-deprecated";
 
-let storageUsageUnimplemented = false;
+let storageUsageUnimplementedUntil = 0;
+// The back-end says per-user storage usage is unimplemented until it has learned every grain's
+// owner and size, so ask again every so often.
+const STORAGE_USAGE_RETRY_MILLIS = 10 * 60 * 1000;
 
 const shouldRestartGrain = (error, retryCount) => {
   // Given an error thrown by an RPC call to a grain, return whether or not it makes sense to try
@@ -173,7 +176,7 @@ class SandstormBackend {
 
     let storagePromise = undefined;
     let ownerId = undefined;
-    if (this._db.isQuotaEnabled() && !storageUsageUnimplemented) {
+    if (this._db.isQuotaEnabled() && Date.now() >= storageUsageUnimplementedUntil) {
       let grain = globalDb.collections.grains.findOne(grainId);
       if (!grain) return;  // must have been deleted
       ownerId = grain.userId;
@@ -206,7 +209,7 @@ class SandstormBackend {
         //   Otherwise a constantly-active grain could consume arbitrary space without being stopped.
       } catch (err) {
         if (err.kjType === "unimplemented") {
-          storageUsageUnimplemented = true;
+          storageUsageUnimplementedUntil = Date.now() + STORAGE_USAGE_RETRY_MILLIS;
         } else {
           console.error("error getting user storage usage:", err.stack);
         }
@@ -18,9 +18,19 @@
 #include <kj/debug.h>
 #include "util.h"
 #include "spk.h"
+#include "backup.h"
+#include "chunk-store.h"
+#include "snapshot.h"
 #include <capnp/serialize.h>
 #include <capnp/serialize-async.h>
+#include <capnp/membrane.h>
+#include <capnp/schema.h>
+#include <kj/thread.h>
 #include <stdio.h>  // rename()
+#include <signal.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <time.h>
 
 namespace sandstorm {
 
@@ -29,7 +39,10 @@ static kj::StringPtr validateId(kj::StringPtr id) {
   return id;
 }
 
-static void tryRecursivelyDelete(kj::StringPtr path) {
+static kj::Maybe<kj::String> moveToTrash(kj::StringPtr path) {
+  // Renames `path` into the temp directory, to be deleted from there, and returns the new name.
+  // Returns null if `path` doesn't exist.
+
   KJ_REQUIRE(!path.endsWith("/"),
       "refusing to recursively delete directory name with trailing / to reduce risk of "
       "catastrophic empty-string bugs");
@@ -39,35 +52,81 @@ static void tryRecursivelyDelete(kj::StringPtr path) {
   while (rename(path.cStr(), tmpPath.cStr()) < 0) {
     int error = errno;
     if (error == ENOENT) {
-      return;
+      return nullptr;
     } else if (error != EINTR) {
       KJ_FAIL_SYSCALL("rename(path, tmpPath)", error, path, tmpPath);
     }
   }
 
-  recursivelyDelete(tmpPath);
+  return kj::mv(tmpPath);
+}
+
+static void tryRecursivelyDelete(kj::StringPtr path) {
+  KJ_IF_MAYBE(tmpPath, moveToTrash(path)) {
+    recursivelyDelete(*tmpPath);
+  }
 }
 
 BackendImpl::BackendImpl(
   kj::LowLevelAsyncIoProvider& ioProvider,
+  kj::UnixEventPort& eventPort,
   kj::Network& network,
   SandstormCoreFactory::Client&& sandstormCoreFactory,
   kj::Maybe<Cgroup>&& cgroup,
   kj::Maybe<uid_t> sandboxUid,
   bool useExperimentalSeccompFilter,
-  bool logSeccompViolations)
-    : ioProvider(ioProvider), network(network), coreFactory(kj::mv(sandstormCoreFactory)),
+  bool logSeccompViolations,
+  kj::Duration hibernationTimeout,
+  uint64_t hibernationReclaimBytes,
+  Cgroup::Limits grainLimits,
+  std::map<kj::String, Cgroup::Limits> packageGrainLimits,
+  bool grainMemoryMerge,
+  std::map<kj::String, bool> packageGrainMemoryMerge,
+  bool incrementalBackups)
+    : ioProvider(ioProvider), eventPort(eventPort), network(network),
+      coreFactory(kj::mv(sandstormCoreFactory)),
       sandboxUid(sandboxUid),
       tasks(*this),
       cgroup(kj::mv(cgroup)),
       useExperimentalSeccompFilter(useExperimentalSeccompFilter),
-      logSeccompViolations(logSeccompViolations)
-    {}
+      logSeccompViolations(logSeccompViolations),
+      timer(ioProvider.getTimer()),
+      hibernationTimeout(this->cgroup == nullptr ? 0 * kj::SECONDS : hibernationTimeout),
+      hibernationReclaimBytes(hibernationReclaimBytes),
+      grainLimits(kj::mv(grainLimits)),
+      packageGrainLimits(kj::mv(packageGrainLimits)),
+      grainMemoryMerge(grainMemoryMerge),
+      packageGrainMemoryMerge(kj::mv(packageGrainMemoryMerge)),
+      incrementalBackups(incrementalBackups),
+      subprocessSet(eventPort),
+      workers(WORKER_THREADS, MAX_HEAVY_JOBS) {
+  refillWarmSupervisors();
+
+  loadStorageUsage();
+  tasks.add(storageUsageLoop());
+
+  if (this->hibernationTimeout > 0 * kj::SECONDS) {
+    tasks.add(hibernationLoop());
+  }
+
+  startMemoryPressureWatch();
+}
 
 void BackendImpl::taskFailed(kj::Exception&& exception) {
   KJ_LOG(ERROR, exception);
 }
 
+kj::Promise<void> BackendImpl::deleteInBackground(kj::StringPtr path) {
+  // Renaming is quick, and means nobody sees a half-deleted tree.
+  KJ_IF_MAYBE(tmpPath, moveToTrash(path)) {
+    return workers.runHeavy([tmpPath = kj::mv(*tmpPath)]() {
+      recursivelyDelete(tmpPath);
+    });
+  } else {
+    return kj::READY_NOW;
+  }
+}
+
 // =======================================================================================
 
 kj::Promise<Supervisor::Client> BackendImpl::bootGrain(
@@ -91,10 +150,8 @@ kj::Promise<Supervisor::Client> BackendImpl::bootGrain(
             .then([=](Supervisor::Client&& client) mutable {
           // We should send a keepAlive() to make sure the supervisor is still up. We should also
           // send a new SandstormCore capability in case the front-end has restarted.
-          auto coreReq = coreFactory.getSandstormCoreRequest();
-          coreReq.setGrainId(grainId);
           auto keepAliveReq = client.keepAliveRequest();
-          keepAliveReq.setCore(coreReq.send().getCore());
+          keepAliveReq.setCore(getCore(grainId));
           auto promise = keepAliveReq.send();
           return promise.then([KJ_MVCAP(client)](auto) mutable -> kj::Promise<Supervisor::Client> {
             // Success.
@@ -119,7 +176,7 @@ kj::Promise<Supervisor::Client> BackendImpl::bootGrain(
   }
 
   // Grain is not currently running, so let's start it.
-  kj::Own<kj::AsyncInputStream> stdoutPipe;
+  auto startTime = timer.now();
   kj::Vector<kj::String> argv;
 
   argv.add(kj::heapString("supervisor"));
@@ -129,6 +186,9 @@ kj::Promise<Supervisor::Client> BackendImpl::bootGrain(
     argv.add(kj::str(*u));
   }
 
+  // Everything after this point depends on the grain, and is what a warm supervisor receives.
+  size_t grainArgsStart = argv.size();
+
   if (isNew) {
     argv.add(kj::heapString("-n"));
   }
@@ -149,6 +209,21 @@ kj::Promise<Supervisor::Client> BackendImpl::bootGrain(
     argv.add(kj::heapString("--log-seccomp-violations"));
   }
 
+  if (hibernationTimeout > 0 * kj::SECONDS) {
+    argv.add(kj::heapString("--hibernate"));
+  }
+
+  {
+    bool memoryMerge = grainMemoryMerge;
+    auto iter = packageGrainMemoryMerge.find(kj::heapString(packageId));
+    if (iter != packageGrainMemoryMerge.end()) {
+      memoryMerge = iter->second;
+    }
+    if (memoryMerge) {
+      argv.add(kj::heapString("--memory-merge"));
+    }
+  }
+
   for (auto env: command.getEnviron()) {
     argv.add(kj::str("-e", env.getKey(), "=", env.getValue()));
   }
@@ -165,27 +240,31 @@ kj::Promise<Supervisor::Client> BackendImpl::bootGrain(
     argv.add(kj::heapString(arg));
   }
 
-  Subprocess::Options options(KJ_MAP(a, argv) -> const kj::StringPtr { return a; });
-  options.executable = "/sandstorm";
-
-  if (sandboxUid != nullptr) {
-    // Supervisor must run as root since user namespaces are not available.
-    options.uid = uid_t(0);
+  kj::Own<SupervisorProcess> supervisor;
+  bool warm = false;
+  if (!devMode) {
+    KJ_IF_MAYBE(s, takeWarmSupervisor(argv.asPtr().slice(grainArgsStart, argv.size()))) {
+      supervisor = kj::mv(*s);
+      warm = true;
+    }
   }
-
-  int pipefds[2];
-  KJ_SYSCALL(pipe2(pipefds, O_CLOEXEC));
-  kj::AutoCloseFd stdoutOut(pipefds[1]);
-  stdoutPipe = ioProvider.wrapInputFd(pipefds[0],
-      kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP |
-      kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC);
-  options.stdout = stdoutOut;
-  Subprocess process(kj::mv(options));
+  if (!warm) {
+    supervisor = spawnSupervisor(argv.asPtr(), false);
+  }
+  auto stdoutPipe = kj::mv(supervisor->stdout);
+  Subprocess process = kj::mv(supervisor->process);
+  supervisor = nullptr;
 
   // Wait until supervisor prints something on stdout, indicating that it is ready.
   static byte dummy[256];
   auto promise = stdoutPipe->read(dummy, 1, sizeof(dummy));
 
+  auto limits = grainLimits;
+  auto packageLimits = packageGrainLimits.find(kj::heapString(packageId));
+  if (packageLimits != packageGrainLimits.end()) {
+    limits = limits.overriddenBy(packageLimits->second);
+  }
+
   // Meanwhile parse the socket address.
   auto addressPromise =
       network.parseAddress(kj::str("unix:/var/sandstorm/grains/", grainId, "/socket"));
@@ -197,24 +276,29 @@ kj::Promise<Supervisor::Client> BackendImpl::bootGrain(
     return kj::mv(addressPromise);
   }).then([](kj::Own<kj::NetworkAddress>&& address) {
     return address->connect();
-  }).then([this,KJ_MVCAP(stdoutPipe),KJ_MVCAP(process),grainId = kj::heapString(grainId)]
+  }).then([this,KJ_MVCAP(stdoutPipe),KJ_MVCAP(process),grainId = kj::heapString(grainId),
+             startTime,warm,limits]
           (kj::Own<kj::AsyncIoStream>&& connection) mutable {
+    recordBootLatency(timer.now() - startTime, warm);
 
+    kj::Maybe<Cgroup> grainCgroup;
     KJ_IF_MAYBE(cg, cgroup) {
-      cg->getOrMakeChild(grainId)
-          .addPid(process.getPid());
+      auto child = cg->getOrMakeChild(grainId);
+      if (!child.applyLimits(limits) && !warnedAboutLimits) {
+        KJ_LOG(WARNING, "some grain resource limits could not be applied because the cgroup "
+                        "controller is not enabled");
+        warnedAboutLimits = true;
+      }
+      child.addPid(process.getPid());
+      grainCgroup = kj::mv(child);
     }
 
     // Connected. Create the RunningGrain and fulfill promises.
-    auto ignorePromise = ignoreAll(*stdoutPipe);
-    tasks.add(ignorePromise.attach(kj::mv(stdoutPipe)));
-
-    auto coreRequest = coreFactory.getSandstormCoreRequest();
-    coreRequest.setGrainId(grainId);
-    auto core = coreRequest.send().getCore();
-    auto grain = kj::heap<RunningGrain>(*this, kj::mv(grainId), kj::mv(connection), kj::mv(core));
+    auto core = getCore(grainId);
+    auto grain = kj::heap<RunningGrain>(*this, kj::mv(grainId), kj::mv(process),
+        kj::mv(stdoutPipe), kj::mv(connection), kj::mv(core), kj::mv(grainCgroup));
     auto client = grain->getSupervisor();
-    tasks.add(grain->onDisconnect().attach(kj::mv(grain), kj::mv(process)));
+    tasks.add(grain->onDisconnect().attach(kj::mv(grain)));
     return client;
   }).fork();
 
@@ -230,16 +314,124 @@ kj::Promise<Supervisor::Client> BackendImpl::bootGrain(
   return result;
 }
 
-kj::Promise<void> BackendImpl::ignoreAll(kj::AsyncInputStream& input) {
-  static byte dummy[256];
-  return input.tryRead(dummy, sizeof(dummy), sizeof(dummy))
-      .then([&input](size_t n) -> kj::Promise<void> {
-    if (n < sizeof(dummy)) {
-      return kj::READY_NOW;
+kj::Own<BackendImpl::SupervisorProcess> BackendImpl::spawnSupervisor(
+    kj::ArrayPtr<const kj::String> argv, bool warm) {
+  Subprocess::Options options(KJ_MAP(a, argv) -> const kj::StringPtr { return a; });
+  options.executable = "/sandstorm";
+
+  if (sandboxUid != nullptr) {
+    // Supervisor must run as root since user namespaces are not available.
+    options.uid = uid_t(0);
+  }
+
+  auto stdoutPipe = Pipe::make();
+  options.stdout = stdoutPipe.writeEnd;
+
+  Pipe stdinPipe;
+  if (warm) {
+    stdinPipe = Pipe::make();
+    options.stdin = stdinPipe.readEnd;
+  }
+
+  Subprocess process(kj::mv(options));
+
+  return kj::heap<SupervisorProcess>(SupervisorProcess {
+    kj::mv(process),
+    ioProvider.wrapInputFd(stdoutPipe.readEnd.release(),
+        kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP |
+        kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC),
+    kj::mv(stdinPipe.writeEnd)
+  });
+}
+
+void BackendImpl::refillWarmSupervisors() {
+  if (warmSupervisorsFailed) return;
+
+  while (warmSupervisors.size() + warmSupervisorsStarting < WARM_SUPERVISOR_POOL_SIZE) {
+    kj::Vector<kj::String> argv;
+    argv.add(kj::heapString("warm-supervisor"));
+    KJ_IF_MAYBE(u, sandboxUid) {
+      argv.add(kj::heapString("--uid"));
+      argv.add(kj::str(*u));
+    }
+
+    auto supervisor = spawnSupervisor(argv.asPtr(), true);
+
+    // The warm supervisor writes exactly "Warm...\n" once its setup is done. Read exactly that
+    // much so that the next read sees the "Listening" line written after it gets a grain.
+    static byte dummy[8];
+    auto promise = supervisor->stdout->read(dummy, sizeof(dummy));
+    ++warmSupervisorsStarting;
+    tasks.add(promise.then([this,KJ_MVCAP(supervisor)]() mutable {
+      --warmSupervisorsStarting;
+      warmSupervisors.add(kj::mv(supervisor));
+    }, [this](kj::Exception&& e) {
+      --warmSupervisorsStarting;
+      warmSupervisorsFailed = true;
+      warmSupervisors.clear();
+      KJ_LOG(ERROR, "warm supervisor failed to start; grains will be started cold", e);
+    }));
+  }
+}
+
+kj::Maybe<kj::Own<BackendImpl::SupervisorProcess>> BackendImpl::takeWarmSupervisor(
+    kj::ArrayPtr<const kj::String> grainArgs) {
+  KJ_DEFER(refillWarmSupervisors());
+
+  while (!warmSupervisors.empty()) {
+    auto supervisor = kj::mv(warmSupervisors.back());
+    warmSupervisors.removeLast();
+
+    kj::Vector<char> buffer;
+    for (auto i: kj::indices(grainArgs)) {
+      if (i > 0) buffer.add('\0');
+      buffer.addAll(grainArgs[i]);
+    }
+
+    // The arguments are small, and the supervisor is blocked reading them, so a blocking write
+    // is fine here.
+    KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() {
+      kj::FdOutputStream(supervisor->stdin.get()).write(buffer.begin(), buffer.size());
+    })) {
+      // Probably died while parked. Try the next one.
+      KJ_LOG(WARNING, "couldn't hand grain to warm supervisor", *e);
+      continue;
+    }
+    supervisor->stdin = nullptr;
+    return kj::mv(supervisor);
+  }
+
+  return nullptr;
+}
+
+void BackendImpl::BootLatencyHistogram::add(kj::Duration latency) {
+  uint i = 0;
+  while (i + 1 < BUCKET_COUNT && latency >= (32 << i) * kj::MILLISECONDS) {
+    ++i;
+  }
+  ++buckets[i];
+}
+
+kj::String BackendImpl::BootLatencyHistogram::toString() const {
+  kj::Vector<kj::String> parts(BUCKET_COUNT);
+  for (uint i = 0; i < BUCKET_COUNT; i++) {
+    if (i + 1 < BUCKET_COUNT) {
+      parts.add(kj::str("<", 32 << i, "ms:", buckets[i]));
     } else {
-      return ignoreAll(input);
+      parts.add(kj::str(">=", 32 << (i - 1), "ms:", buckets[i]));
     }
-  });
+  }
+  return kj::strArray(parts, " ");
+}
+
+void BackendImpl::recordBootLatency(kj::Duration latency, bool warm) {
+  (warm ? warmBootLatency : coldBootLatency).add(latency);
+
+  if (++bootCount % BOOT_LATENCY_LOG_INTERVAL == 0) {
+    KJ_LOG(INFO, "grain boot latency", bootCount,
+        kj::str("warm: ", warmBootLatency.toString()),
+        kj::str("cold: ", coldBootLatency.toString()));
+  }
 }
 
 kj::Promise<kj::String> BackendImpl::readAll(kj::AsyncInputStream& input, kj::Vector<char> soFar) {
@@ -257,25 +449,384 @@ kj::Promise<kj::String> BackendImpl::readAll(kj::AsyncInputStream& input, kj::Ve
   });
 }
 
+class BackendImpl::ThawMembranePolicy final: public capnp::MembranePolicy, public kj::Refcounted {
+public:
+  ThawMembranePolicy(kj::Own<GrainActivity> activity, kj::Timer& timer)
+      : activity(kj::mv(activity)), timer(timer) {}
+
+  kj::Maybe<capnp::Capability::Client> inboundCall(
+      uint64_t interfaceId, uint16_t methodId, capnp::Capability::Client target) override {
+    activity->lastUsed = timer.now();
+
+    if (activity->holds > 0) {
+      // A backup is reading the grain's files, so don't thaw it. Deliver the call once the backup
+      // is done, back through this membrane so that it thaws the grain then.
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      activity->waitingForRelease.add(kj::mv(paf.fulfiller));
+      return capnp::Capability::Client(paf.promise.then(
+          [self = kj::addRef(*this), target = kj::mv(target)]() mutable {
+        return capnp::membrane(kj::mv(target), kj::mv(self));
+      }));
+    }
+
+    // Thaw before the call is forwarded, so that it doesn't sit in the socket buffer.
+    activity->hibernating = false;
+    activity->freezeHandle = nullptr;
+    return nullptr;
+  }
+
+  kj::Maybe<capnp::Capability::Client> outboundCall(
+      uint64_t interfaceId, uint16_t methodId, capnp::Capability::Client target) override {
+    return nullptr;
+  }
+
+  kj::Own<capnp::MembranePolicy> addRef() override {
+    return kj::addRef(*this);
+  }
+
+private:
+  kj::Own<GrainActivity> activity;
+  kj::Timer& timer;
+};
+
 BackendImpl::RunningGrain::RunningGrain(
-    BackendImpl& backend, kj::String grainId, kj::Own<kj::AsyncIoStream> stream,
-    SandstormCore::Client&& core)
-    : backend(backend), grainId(kj::mv(grainId)),
-      stream(kj::mv(stream)), client(*this->stream, kj::mv(core)) {}
+    BackendImpl& backend, kj::String grainId, Subprocess process,
+    kj::Own<kj::AsyncInputStream> stdout, kj::Own<kj::AsyncIoStream> stream,
+    SandstormCore::Client&& core, kj::Maybe<Cgroup> cgroup)
+    : backend(backend), grainId(kj::mv(grainId)), process(kj::mv(process)),
+      stdout(kj::mv(stdout)), stream(kj::mv(stream)), client(*this->stream, kj::mv(core)),
+      activity(kj::refcounted<GrainActivity>(backend.timer.now())),
+      cgroup(kj::mv(cgroup)),
+      watchTask(watchSupervisor().eagerlyEvaluate([this](kj::Exception&& e) {
+        KJ_LOG(ERROR, "error reading supervisor stdout", this->grainId, e);
+      })) {
+  backend.runningGrains[this->grainId] = this;
+}
 
 BackendImpl::RunningGrain::~RunningGrain() noexcept(false) {
+  // Thaw first, since the freeze handle refers to the cgroup we're about to remove.
+  activity->freezeHandle = nullptr;
+
+  backend.runningGrains.erase(grainId);
   backend.supervisors.erase(grainId);
   KJ_IF_MAYBE(cg, backend.cgroup) {
     cg->removeChild(grainId);
   }
 }
 
+Supervisor::Client BackendImpl::RunningGrain::getSupervisor() {
+  return capnp::membrane(client.bootstrap(),
+      kj::refcounted<ThawMembranePolicy>(kj::addRef(*activity), backend.timer))
+      .castAs<Supervisor>();
+}
+
+kj::Maybe<kj::TimePoint> BackendImpl::RunningGrain::getFrozenSince() {
+  if (activity->hibernating) {
+    return activity->frozenSince;
+  } else {
+    return nullptr;
+  }
+}
+
+void BackendImpl::RunningGrain::stop() {
+  activity->hibernating = false;
+  if (activity->holds == 0) {
+    activity->freezeHandle = nullptr;
+  }
+  stopping = true;
+
+  // SIGTERM lets the supervisor kill the app before exiting. When it does, onDisconnect()
+  // resolves and the grain is cleaned up as usual.
+  process.signal(SIGTERM);
+}
+
+kj::Promise<void> BackendImpl::RunningGrain::watchSupervisor() {
+  static constexpr size_t CHUNK = 64;
+  stdoutBuffer.resize(stdoutBuffer.size() + CHUNK);
+  return stdout->tryRead(stdoutBuffer.end() - CHUNK, 1, CHUNK)
+      .then([this](size_t n) -> kj::Promise<void> {
+    stdoutBuffer.resize(stdoutBuffer.size() - CHUNK + n);
+    if (n == 0) {
+      // EOF; the supervisor is gone.
+      return kj::READY_NOW;
+    }
+
+    // Handle each complete line, keeping any partial line for next time.
+    auto lines = split(stdoutBuffer.asPtr(), '\n');
+    for (auto& line: lines.asPtr().slice(0, lines.size() - 1)) {
+      auto text = kj::str(line);
+      if (text == "Idle...") {
+        hibernate();
+      } else if (text == "Wakelock") {
+        wakelock = true;
+      } else if (text == "NoWakelock") {
+        wakelock = false;
+      } else if (text.startsWith("KsmMergedBytes ")) {
+        KJ_IF_MAYBE(n, parseUInt64(text.slice(strlen("KsmMergedBytes ")), 10)) {
+          ksmMergedBytes = *n;
+        }
+      } else {
+        KJ_LOG(WARNING, "unexpected output from supervisor", grainId, text);
+      }
+    }
+    auto rest = kj::heapArray(lines.back());
+    stdoutBuffer.clear();
+    stdoutBuffer.addAll(rest);
+
+    return watchSupervisor();
+  });
+}
+
+kj::Maybe<kj::Own<BackendImpl::GrainActivity>> BackendImpl::RunningGrain::hold() {
+  KJ_IF_MAYBE(cg, cgroup) {
+    if (activity->freezeHandle == nullptr) {
+      activity->freezeHandle = cg->freeze();
+      if (activity->freezeHandle == nullptr) return nullptr;
+    }
+    ++activity->holds;
+    return kj::addRef(*activity);
+  } else {
+    return nullptr;
+  }
+}
+
+void BackendImpl::GrainActivity::release() {
+  KJ_ASSERT(holds > 0);
+  if (--holds > 0) return;
+
+  if (!waitingForRelease.empty()) {
+    hibernating = false;
+    for (auto& fulfiller: waitingForRelease) {
+      fulfiller->fulfill();
+    }
+    waitingForRelease.clear();
+  }
+  if (!hibernating) {
+    freezeHandle = nullptr;
+  }
+}
+
+void BackendImpl::RunningGrain::hibernate() {
+  if (activity->hibernating) return;
+
+  KJ_IF_MAYBE(cg, cgroup) {
+    if (activity->freezeHandle == nullptr) {
+      activity->freezeHandle = cg->freeze();
+    }
+    if (activity->freezeHandle != nullptr) {
+      activity->hibernating = true;
+      activity->frozenSince = backend.timer.now();
+
+      // Reclaiming after freezing means the app can't fault pages straight back in.
+      if (backend.hibernationReclaimBytes > 0) {
+        cg->reclaimMemory(backend.hibernationReclaimBytes);
+      }
+    }
+  }
+}
+
+kj::Maybe<Cgroup::Usage> BackendImpl::RunningGrain::getUsage() {
+  KJ_IF_MAYBE(cg, cgroup) {
+    return cg->getUsage();
+  } else {
+    return nullptr;
+  }
+}
+
+kj::Promise<void> BackendImpl::hibernationLoop() {
+  return timer.afterDelay(1 * kj::MINUTES).then([this]() {
+    auto now = timer.now();
+
+    // Collect first, since stopping a grain may eventually modify the map.
+    kj::Vector<RunningGrain*> expired;
+    for (auto& entry: runningGrains) {
+      KJ_IF_MAYBE(since, entry.second->getFrozenSince()) {
+        if (now - *since >= hibernationTimeout) {
+          expired.add(entry.second);
+        }
+      }
+    }
+
+    for (auto grain: expired) {
+      KJ_LOG(INFO, "shutting down hibernated grain", grain->getGrainId());
+      grain->stop();
+    }
+
+    return hibernationLoop();
+  });
+}
+
+static constexpr double MEMORY_PRESSURE_THRESHOLD = 10.0;
+// Percentage of time some grain task was stalled on memory (PSI "some") that counts as pressure.
+
+static constexpr uint EVICTIONS_PER_ROUND = 4;
+static constexpr kj::Duration EVICTION_COOLDOWN = 10 * kj::SECONDS;
+static constexpr kj::Duration EVICTION_MIN_IDLE = 1 * kj::MINUTES;
+// Under memory pressure we shut down up to EVICTIONS_PER_ROUND grains at a time, at most once
+// per EVICTION_COOLDOWN, skipping anything used within EVICTION_MIN_IDLE. The cooldown gives
+// the kernel time to actually free the memory before we decide whether to evict more.
+
+void BackendImpl::startMemoryPressureWatch() {
+  KJ_IF_MAYBE(cg, cgroup) {
+    // 150ms of stall in a 2s window is about the same as MEMORY_PRESSURE_THRESHOLD, and a 2s
+    // window is the smallest that unprivileged processes may use.
+    KJ_IF_MAYBE(fd, cg->monitorPressure("memory", 150 * kj::MILLISECONDS, 2 * kj::SECONDS)) {
+      auto observer = kj::heap<kj::UnixEventPort::FdObserver>(
+          eventPort, *fd, kj::UnixEventPort::FdObserver::OBSERVE_URGENT);
+      tasks.add(watchMemoryPressure(*observer));
+      memoryPressureObserver = kj::mv(observer);
+      memoryPressureTrigger = kj::mv(*fd);
+    } else if (cg->getPressureAvg10("memory") != nullptr) {
+      tasks.add(pollMemoryPressure());
+    } else {
+      KJ_LOG(WARNING, "PSI not available; grains will not be evicted under memory pressure");
+    }
+  }
+}
+
+kj::Promise<void> BackendImpl::watchMemoryPressure(kj::UnixEventPort::FdObserver& observer) {
+  return observer.whenUrgentDataAvailable().then([this,&observer]() {
+    relieveMemoryPressure("memory pressure trigger fired");
+    return watchMemoryPressure(observer);
+  });
+}
+
+kj::Promise<void> BackendImpl::pollMemoryPressure() {
+  return timer.afterDelay(5 * kj::SECONDS).then([this]() {
+    KJ_IF_MAYBE(cg, cgroup) {
+      KJ_IF_MAYBE(avg10, cg->getPressureAvg10("memory")) {
+        if (*avg10 >= MEMORY_PRESSURE_THRESHOLD) {
+          relieveMemoryPressure(kj::str("memory pressure avg10=", *avg10));
+        }
+      }
+    }
+    return pollMemoryPressure();
+  });
+}
+
+void BackendImpl::relieveMemoryPressure(kj::StringPtr reason) {
+  auto now = timer.now();
+  if (now - lastEviction < EVICTION_COOLDOWN) return;
+
+  kj::Vector<RunningGrain*> candidates;
+  for (auto& entry: runningGrains) {
+    auto grain = entry.second;
+    if (!grain->isStopping() && !grain->hasWakelock() &&
+        now - grain->getLastUsed() >= EVICTION_MIN_IDLE) {
+      candidates.add(grain);
+    }
+  }
+
+  if (candidates.empty()) {
+    KJ_LOG(WARNING, "under memory pressure but no grain is eligible for eviction", reason);
+    return;
+  }
+  lastEviction = now;
+
+  std::sort(candidates.begin(), candidates.end(), [](RunningGrain* a, RunningGrain* b) {
+    return a->getLastUsed() < b->getLastUsed();
+  });
+
+  auto count = kj::min(candidates.size(), size_t(EVICTIONS_PER_ROUND));
+  for (auto grain: candidates.asPtr().slice(0, count)) {
+    uint64_t memory = 0;
+    KJ_IF_MAYBE(usage, grain->getUsage()) {
+      memory = usage->memoryBytes;
+    }
+    KJ_LOG(WARNING, "evicting grain", grain->getGrainId(), reason,
+           kj::str(memory >> 20, "MiB"),
+           kj::str("idle ", (now - grain->getLastUsed()) / kj::SECONDS, "s"),
+           grain->getFrozenSince() == nullptr ? "running" : "hibernating");
+    grain->stop();
+  }
+}
+
+kj::Vector<BackendImpl::GrainUsage> BackendImpl::sampleResourceUsage(
+    UsageBaseline& baseline, Backend::ResourceUsageOrder sortBy, uint limit) {
+  auto now = timer.now();
+  kj::Vector<GrainUsage> result(runningGrains.size());
+  std::map<kj::StringPtr, UsageBaseline::Grain> next;
+  for (auto& entry: runningGrains) {
+    KJ_IF_MAYBE(usage, entry.second->getUsage()) {
+      GrainUsage sample;
+      sample.grain = entry.second;
+      sample.usage = *usage;
+
+      auto last = baseline.grains.find(entry.first);
+      if (last != baseline.grains.end()) {
+        double seconds = (now - last->second.time) / kj::MILLISECONDS / 1000.0;
+        if (seconds > 0) {
+          // Counters only go up, but guard against a reset anyway (e.g. the grain restarted)
+          // rather than report a huge rate.
+          auto delta = [&](uint64_t current, uint64_t previous) {
+            return current >= previous ? (current - previous) / seconds : 0.0;
+          };
+          auto& previous = last->second.usage;
+          sample.cpuPercent =
+              delta(usage->cpuUsageUsec, previous.cpuUsageUsec) / 10000.0;  // usec/s -> %
+          sample.ioReadBytesPerSecond = delta(usage->ioReadBytes, previous.ioReadBytes);
+          sample.ioWriteBytesPerSecond = delta(usage->ioWriteBytes, previous.ioWriteBytes);
+        }
+      }
+
+      UsageBaseline::Grain current { kj::str(entry.first), *usage, now };
+      kj::StringPtr key = current.id;
+      next.insert(std::make_pair(key, kj::mv(current)));
+      result.add(kj::mv(sample));
+    }
+  }
+  baseline.grains = kj::mv(next);
+
+  auto weight = [sortBy](const GrainUsage& g) -> double {
+    switch (sortBy) {
+      case Backend::ResourceUsageOrder::CPU:
+        return g.cpuPercent;
+      case Backend::ResourceUsageOrder::MEMORY:
+        return g.usage.memoryBytes;
+      case Backend::ResourceUsageOrder::IO:
+        return g.ioReadBytesPerSecond + g.ioWriteBytesPerSecond;
+    }
+    return 0;
+  };
+  std::sort(result.begin(), result.end(), [&](const GrainUsage& a, const GrainUsage& b) {
+    return weight(a) > weight(b);
+  });
+
+  if (limit > 0 && result.size() > limit) {
+    result.resize(limit);
+  }
+  return result;
+}
+
+void BackendImpl::fillResourceUsage(kj::ArrayPtr<const GrainUsage> grains,
+                                    capnp::List<Backend::GrainResourceUsage>::Builder builder) {
+  for (auto i: kj::indices(grains)) {
+    auto& grain = grains[i];
+    auto& usage = grain.usage;
+    auto out = builder[i];
+    out.setGrainId(grain.grain->getGrainId());
+    out.setCpuUsageMicros(usage.cpuUsageUsec);
+    out.setCpuPercent(grain.cpuPercent);
+    out.setMemoryBytes(usage.memoryBytes);
+    out.setAnonBytes(usage.anonBytes);
+    out.setFileBytes(usage.fileBytes);
+    out.setIoReadBytes(usage.ioReadBytes);
+    out.setIoWriteBytes(usage.ioWriteBytes);
+    out.setIoReadBytesPerSecond(grain.ioReadBytesPerSecond);
+    out.setIoWriteBytesPerSecond(grain.ioWriteBytesPerSecond);
+    out.setPids(usage.pids);
+    out.setKsmMergedBytes(grain.grain->getKsmMergedBytes());
+    out.setHibernating(grain.grain->getFrozenSince() != nullptr);
+  }
+}
+
 kj::Promise<void> BackendImpl::ping(PingContext context) {
   return kj::READY_NOW;
 }
 
 kj::Promise<void> BackendImpl::startGrain(StartGrainContext context) {
   auto params = context.getParams();
+  noteGrainOwner(validateId(params.getGrainId()), params.getOwnerId());
   return bootGrain(validateId(params.getGrainId()),
                    validateId(params.getPackageId()), params.getCommand(),
                    params.getIsNew(), params.getDevMode(), params.getMountProc(), false)
@@ -286,6 +837,7 @@ kj::Promise<void> BackendImpl::startGrain(StartGrainContext context) {
 
 kj::Promise<void> BackendImpl::getGrain(GetGrainContext context) {
   auto grainId = context.getParams().getGrainId();
+  noteGrainOwner(validateId(grainId), context.getParams().getOwnerId());
   auto iter = supervisors.find(validateId(grainId));
   if (iter != supervisors.end()) {
     KJ_SWITCH_ONEOF(iter->second) {
@@ -300,10 +852,8 @@ kj::Promise<void> BackendImpl::getGrain(GetGrainContext context) {
             .then([this,context,grainId](Supervisor::Client client) mutable {
           // We should send a keepAlive() to make sure the supervisor is still up. We should also
           // send a new SandstormCore capability in case the front-end has restarted.
-          auto coreReq = coreFactory.getSandstormCoreRequest();
-          coreReq.setGrainId(grainId);
           auto keepAliveReq = client.keepAliveRequest();
-          keepAliveReq.setCore(coreReq.send().getCore());
+          keepAliveReq.setCore(getCore(grainId));
           return keepAliveReq.send()
               .then([context,KJ_MVCAP(client)](auto&&) mutable -> kj::Promise<void> {
             context.getResults().setSupervisor(kj::mv(client));
@@ -354,13 +904,19 @@ kj::Promise<void> BackendImpl::deleteGrain(DeleteGrainContext context) {
     shutdownPromise = kj::READY_NOW;
   }
 
-  return shutdownPromise.then([grainId]() {
-    tryRecursivelyDelete(kj::str("/var/sandstorm/grains/", grainId));
+  return shutdownPromise.then([this, grainId]() {
+    auto promise = deleteInBackground(kj::str("/var/sandstorm/grains/", grainId));
+    // The files are already out of the grain's directory.
+    storageUsage.removeGrain(grainId);
+    saveStorageUsageSoon();
+    return promise;
   });
 }
 
 kj::Promise<void> BackendImpl::transferGrain(TransferGrainContext context) {
-  // Nothing to do: Grains aren't stored by owner.
+  // Grains aren't stored by owner, so there's nothing to move, but the new owner is now charged.
+  auto params = context.getParams();
+  noteGrainOwner(validateId(params.getGrainId()), params.getNewOwnerId());
   return kj::READY_NOW;
 }
 
@@ -525,139 +1081,412 @@ kj::Promise<void> BackendImpl::tryGetPackage(TryGetPackageContext context) {
 
 kj::Promise<void> BackendImpl::deletePackage(DeletePackageContext context) {
   auto path = kj::str("/var/sandstorm/apps/", validateId(context.getParams().getPackageId()));
-  if (access(path.cStr(), F_OK) >= 0) {
-    tryRecursivelyDelete(path);
-  }
-  return kj::READY_NOW;
+  return deleteInBackground(path);
 }
 
 // =======================================================================================
 
-kj::Promise<void> BackendImpl::backupGrain(BackupGrainContext context) {
-  kj::Maybe<Cgroup::FreezeHandle> freezeHandle;
-  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> backupFulfiller;
+static const char BACKUPS_DIR[] = "/var/sandstorm/backups";
+static const char CHUNKS_DIR[] = "/var/sandstorm/backups/chunks";
+// Backup files are named for their backup IDs. Incremental backups' contents are in CHUNKS_DIR.
 
-  auto params = context.getParams();
+namespace {
 
-  auto grainId = params.getGrainId();
-  auto path = kj::str("/var/sandstorm/backups/", params.getBackupId());
+class BackgroundThread final: public kj::AsyncInputStream {
+  // Runs blocking work on a thread of its own, so as not to stall the event loop. The work is
+  // passed the write end of a pipe, and this stream reads the other end. End-of-stream is only
+  // reported once the work has returned, and if it threw, reads throw the same.
+  //
+  // Destroying this closes our end of the pipe, so that a thread still writing fails promptly,
+  // and then waits for the thread to exit.
+  //
+  // This is for work that streams its output, and so occupies its thread for as long as the
+  // reader takes. Other blocking work goes to `workers`.
 
-  auto iter = supervisors.find(grainId);
-  if(iter == supervisors.end()) {
-    // Not running. Mark the grain as backing up, so nobody tries to boot it
-    // until we're done:
-    auto paf = kj::newPromiseAndFulfiller<void>();
-    supervisors.insert(std::make_pair(grainId, BackingUpGrain{paf.promise.fork()}));
-    backupFulfiller = kj::mv(paf.fulfiller);
-  } else {
-    // If cgroups is available, freeze the corresponding cgroup
-    // during the backup:
-    KJ_IF_MAYBE(cg, cgroup) {
-      auto grainCgroup = cg->getChild(grainId);
-      freezeHandle = grainCgroup.freeze();
+public:
+  BackgroundThread(kj::LowLevelAsyncIoProvider& ioProvider, kj::Function<void(int fd)> func) {
+    auto pipe = Pipe::make();
+    readEnd = kj::mv(pipe.readEnd);
+    input = ioProvider.wrapInputFd(readEnd, kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC);
+    thread = kj::heap<kj::Thread>([this, KJ_MVCAP(func), out = kj::mv(pipe.writeEnd)]() mutable {
+      KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() { func(out); })) {
+        exception = kj::mv(*e);
+      }
+      out = nullptr;
+    });
+  }
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return input->tryRead(buffer, minBytes, maxBytes).then([this, minBytes](size_t n) {
+      if (n < minBytes) {
+        // The thread has closed the pipe, so it's done, one way or the other.
+        KJ_IF_MAYBE(e, exception) {
+          kj::throwFatalException(kj::mv(*e));
+        }
+      }
+      return n;
+    });
+  }
+
+private:
+  kj::Maybe<kj::Exception> exception;
+  kj::Own<kj::Thread> thread;
+  kj::AutoCloseFd readEnd;
+  kj::Own<kj::AsyncInputStream> input;
+  // Destroyed in reverse order: the pipe is closed before the thread is joined.
+};
+
+}  // namespace
+
+class BackendImpl::BackupSlot {
+public:
+  explicit BackupSlot(BackendImpl& backend): backend(backend) {
+    ++backend.backupsRunning;
+  }
+  ~BackupSlot() noexcept(false) {
+    --backend.backupsRunning;
+
+    // Hand the slot straight to the next in line, skipping any that have given up waiting.
+    while (!backend.backupQueue.empty()) {
+      auto fulfiller = kj::mv(backend.backupQueue.front());
+      backend.backupQueue.pop_front();
+      if (fulfiller->isWaiting()) {
+        fulfiller->fulfill(kj::heap<BackupSlot>(backend));
+        break;
+      }
     }
   }
+  KJ_DISALLOW_COPY(BackupSlot);
 
-  recursivelyCreateParent(path);
-  auto grainDir = kj::str("/var/sandstorm/grains/", grainId);
+private:
+  BackendImpl& backend;
+};
 
-  // Similar to the supervisor, the "backup" command sets up its own sandbox, and for that to work
-  // we need to pass along root privileges to it.
-  kj::Vector<kj::StringPtr> argv;
-  kj::String ownUid;
-  argv.add("backup");
-  KJ_IF_MAYBE(u, sandboxUid) {
-    argv.add("--uid");
-    ownUid = kj::str(*u);
-    argv.add(ownUid);
+kj::Promise<kj::Own<BackendImpl::BackupSlot>> BackendImpl::acquireBackupSlot() {
+  if (backupsRunning < MAX_CONCURRENT_BACKUPS) {
+    return kj::heap<BackupSlot>(*this);
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<kj::Own<BackupSlot>>();
+  backupQueue.push_back(kj::mv(paf.fulfiller));
+  return kj::mv(paf.promise);
+}
+
+class BackendImpl::GrainHold {
+public:
+  GrainHold(BackendImpl& backend, kj::StringPtr grainId)
+      : backend(backend), grainId(kj::heapString(grainId)) {
+    auto iter = backend.supervisors.find(grainId);
+    if (iter == backend.supervisors.end()) {
+      // Not running. Mark the grain as backing up, so nobody tries to boot it
+      // until we're done:
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      BackingUpGrain backingUp { kj::heapString(grainId), paf.promise.fork() };
+      kj::StringPtr key = backingUp.grainId;
+      backend.supervisors.insert(std::make_pair(key, kj::mv(backingUp)));
+      fulfiller = kj::mv(paf.fulfiller);
+    } else {
+      // If cgroups is available, freeze the grain during the backup. A running grain is frozen
+      // through its GrainActivity, which it shares with hibernation, so that neither thaws the
+      // grain out from under the other.
+      auto running = backend.runningGrains.find(grainId);
+      if (running != backend.runningGrains.end()) {
+        activity = running->second->hold();
+      } else KJ_IF_MAYBE(cg, backend.cgroup) {
+        // Still starting, so it can't be hibernating or taking calls yet.
+        auto grainCgroup = cg->getChild(grainId);
+        freezeHandle = grainCgroup.freeze();
+      }
+    }
+  }
+  ~GrainHold() noexcept(false) {
+    KJ_IF_MAYBE(a, activity) {
+      (*a)->release();
+    }
+
+    // Let anyone waiting to boot the grain go ahead.
+    KJ_IF_MAYBE(f, fulfiller) {
+      (*f)->fulfill();
+      backend.supervisors.erase(grainId);
+    }
   }
-  argv.add(path);
-  argv.add(grainDir);
+  KJ_DISALLOW_COPY(GrainHold);
 
-  Subprocess::Options processOptions(argv.asPtr());
-  if (sandboxUid != nullptr) processOptions.uid = uid_t(0);
-  processOptions.executable = "/proc/self/exe";
-  auto inPipe = Pipe::make();
-  processOptions.stdin = inPipe.readEnd;
-  Subprocess process(kj::mv(processOptions));
-  inPipe.readEnd = nullptr;
+private:
+  BackendImpl& backend;
+  kj::String grainId;
+  kj::Maybe<kj::Own<GrainActivity>> activity;
+  kj::Maybe<Cgroup::FreezeHandle> freezeHandle;
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> fulfiller;
+};
+
+static constexpr kj::Duration BACKUP_PROGRESS_INTERVAL = 1 * kj::SECONDS;
+
+void BackendImpl::reportBackupStarted(kj::Maybe<Backend::BackupProgress::Client>& progress) {
+  KJ_IF_MAYBE(p, progress) {
+    tasks.add(p->startedRequest().send().catch_([](kj::Exception&&) {}));
+  }
+}
+
+kj::Promise<void> BackendImpl::reportBackupProgress(
+    kj::String path, Backend::BackupProgress::Client progress, uint64_t reportedSize) {
+  return timer.afterDelay(BACKUP_PROGRESS_INTERVAL)
+      .then([this, KJ_MVCAP(path), KJ_MVCAP(progress), reportedSize]() mutable
+            -> kj::Promise<void> {
+    struct stat stats;
+    if (stat(path.cStr(), &stats) < 0 || uint64_t(stats.st_size) == reportedSize) {
+      return reportBackupProgress(kj::mv(path), kj::mv(progress), reportedSize);
+    }
+
+    uint64_t size = stats.st_size;
+    auto req = progress.writtenRequest();
+    req.setBytes(size);
+    return req.send().then([this, KJ_MVCAP(path), KJ_MVCAP(progress), size]() mutable {
+      return reportBackupProgress(kj::mv(path), kj::mv(progress), size);
+    });
+  });
+}
+
+kj::Promise<void> BackendImpl::backupGrain(BackupGrainContext context) {
+  auto params = context.getParams();
+
+  auto grainId = kj::heapString(params.getGrainId());
+  auto path = kj::str("/var/sandstorm/backups/", params.getBackupId());
+  noteGrainOwner(validateId(grainId), params.getOwnerId());
+  kj::Maybe<Backend::BackupProgress::Client> progress;
+  if (params.hasProgress()) {
+    progress = params.getProgress();
+  }
 
   auto metadata = params.getInfo();
   auto metadataMsg = kj::heap<capnp::MallocMessageBuilder>(metadata.totalSize().wordCount + 4);
   metadataMsg->setRoot(metadata);
   context.releaseParams();
-  auto metadataStreamFd = kj::mv(inPipe.writeEnd);
-  auto output = ioProvider.wrapOutputFd(
-      metadataStreamFd, kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC);
-  auto promise = capnp::writeMessage(*output, *metadataMsg);
-
-  return promise.attach(kj::mv(metadataMsg), kj::mv(metadataStreamFd), kj::mv(output))
-      .then([
-          this,
-          grainId,
-          KJ_MVCAP(process),
-          KJ_MVCAP(freezeHandle),
-          KJ_MVCAP(backupFulfiller)
-      ]() mutable {
-    // TODO(cleanup): We should probably use a SubprocessSet to wait asynchronously, but that
-    //   means we need to use SubprocessSet everywhere...
-    process.waitForSuccess();
-    KJ_IF_MAYBE(f, backupFulfiller) {
-      (*f)->fulfill();
-      supervisors.erase(grainId);
+
+  return acquireBackupSlot().then([
+      this,
+      KJ_MVCAP(grainId),
+      KJ_MVCAP(path),
+      KJ_MVCAP(progress),
+      KJ_MVCAP(metadataMsg)
+  ](kj::Own<BackupSlot>&& slot) mutable {
+    reportBackupStarted(progress);
+
+    // Only now decide how to keep the grain consistent, since it may have started or stopped while
+    // we were queued.
+    auto hold = kj::heap<GrainHold>(*this, grainId);
+
+    recursivelyCreateParent(path);
+    auto grainDir = kj::str("/var/sandstorm/grains/", grainId);
+
+    // If the filesystem can make a snapshot, back that up instead, so that the grain is only held
+    // for as long as the snapshot takes.
+    auto promise = snapshotGrain(grainDir);
+    return promise.then([
+        this,
+        KJ_MVCAP(path),
+        KJ_MVCAP(progress),
+        KJ_MVCAP(metadataMsg),
+        KJ_MVCAP(slot),
+        KJ_MVCAP(hold),
+        KJ_MVCAP(grainDir)
+    ](kj::Maybe<kj::String>&& snapshot) mutable {
+      kj::StringPtr sourceDir = grainDir;
+      bool fromSnapshot = false;
+      KJ_IF_MAYBE(s, snapshot) {
+        sourceDir = *s;
+        fromSnapshot = true;
+        hold = nullptr;
+      }
+      auto removeSnapshot = kj::defer([this, KJ_MVCAP(snapshot)]() mutable {
+        KJ_IF_MAYBE(s, snapshot) {
+          deleteSnapshot(kj::mv(*s));
+        }
+      });
+      auto lastBackup = kj::str(grainDir, "/last-backup");
+
+      // Similar to the supervisor, the "backup" command sets up its own sandbox, and for that to
+      // work we need to pass along root privileges to it.
+      kj::Vector<kj::StringPtr> argv;
+      kj::String ownUid;
+      argv.add("backup");
+      KJ_IF_MAYBE(u, sandboxUid) {
+        argv.add("--uid");
+        ownUid = kj::str(*u);
+        argv.add(ownUid);
+      }
+      if (incrementalBackups) {
+        ChunkStore::create(CHUNKS_DIR);
+        argv.add("--chunks");
+        argv.add(CHUNKS_DIR);
+
+        // Files that haven't changed since the grain's last incremental backup needn't be read.
+        KJ_IF_MAYBE(previous, raiiOpenIfExists(lastBackup, O_RDONLY | O_CLOEXEC)) {
+          if (isBackupManifest(*previous)) {
+            argv.add("--previous");
+            argv.add(lastBackup);
+          }
+        }
+      }
+      if (fromSnapshot) {
+        argv.add("--snapshot");
+      }
+      argv.add(path);
+      argv.add(sourceDir);
+
+      Subprocess::Options processOptions(argv.asPtr());
+      if (sandboxUid != nullptr) processOptions.uid = uid_t(0);
+      processOptions.executable = "/proc/self/exe";
+      auto inPipe = Pipe::make();
+      processOptions.stdin = inPipe.readEnd;
+      auto process = kj::heap<Subprocess>(kj::mv(processOptions));
+      inPipe.readEnd = nullptr;
+
+      auto metadataStreamFd = kj::mv(inPipe.writeEnd);
+      auto output = ioProvider.wrapOutputFd(
+          metadataStreamFd, kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC);
+      auto promise = capnp::writeMessage(*output, *metadataMsg)
+          .attach(kj::mv(metadataMsg), kj::mv(metadataStreamFd), kj::mv(output));
+
+      kj::Promise<void> progressTask = nullptr;
+      KJ_IF_MAYBE(p, progress) {
+        progressTask = reportBackupProgress(kj::heapString(path), kj::mv(*p), 0)
+            .eagerlyEvaluate([](kj::Exception&&) {});
+      } else {
+        progressTask = kj::READY_NOW;
+      }
+
+      auto& processRef = *process;
+      return promise.then([this, &processRef]() {
+        return subprocessSet.waitForSuccess(processRef);
+      }).then([this, KJ_MVCAP(path), KJ_MVCAP(lastBackup)]() {
+        if (incrementalBackups) {
+          // Point the grain at this backup, for next time.
+          auto tmpLink = kj::str(lastBackup, ".new");
+          unlink(tmpLink.cStr());
+          KJ_SYSCALL(symlink(path.cStr(), tmpLink.cStr()), tmpLink);
+          KJ_SYSCALL(rename(tmpLink.cStr(), lastBackup.cStr()), lastBackup);
+        }
+      }).attach(kj::mv(progressTask), kj::mv(process), kj::mv(removeSnapshot), kj::mv(hold),
+                kj::mv(slot));
+    });
+  });
+}
+
+kj::Promise<kj::Maybe<kj::String>> BackendImpl::snapshotGrain(kj::StringPtr grainDir) {
+  // Same filesystem as the grains, or reflinks couldn't work; see tryRecursivelyDelete().
+  auto snapshotDir = kj::str("/var/sandstorm/tmp/snapshot.", time(nullptr), ".",
+                             snapshotCounter++);
+
+  // This isn't a heavy job, even though it walks the grain, because the grain is held until it's
+  // done. False means the filesystem can't do reflinks, which is normal.
+  auto promise = workers.run([from = kj::heapString(grainDir), to = kj::heapString(snapshotDir)]() {
+    return snapshotBackupSource(from, to);
+  });
+  return promise.catch_([](kj::Exception&& exception) {
+    KJ_LOG(WARNING, "couldn't snapshot grain; backing it up in place", exception);
+    return false;
+  }).then([this, KJ_MVCAP(snapshotDir)](bool success) mutable -> kj::Maybe<kj::String> {
+    if (success) {
+      return kj::mv(snapshotDir);
+    } else {
+      deleteSnapshot(kj::mv(snapshotDir));
+      return nullptr;
     }
   });
 }
 
+void BackendImpl::deleteSnapshot(kj::String path) {
+  tasks.add(workers.runHeavy([KJ_MVCAP(path)]() {
+    sandstorm::deleteSnapshot(path);
+  }));
+}
+
 kj::Promise<void> BackendImpl::restoreGrain(RestoreGrainContext context) {
   auto params = context.getParams();
 
   auto path = kj::str("/var/sandstorm/backups/", params.getBackupId());
-  auto grainDir = kj::str("/var/sandstorm/grains/", params.getGrainId());
-
-  // Similar to the supervisor, the "backup" command sets up its own sandbox, and for that to work
-  // we need to pass along root privileges to it.
-  kj::Vector<kj::StringPtr> argv;
-  kj::String ownUid;
-  argv.add("backup");
-  KJ_IF_MAYBE(u, sandboxUid) {
-    argv.add("--uid");
-    ownUid = kj::str(*u);
-    argv.add(ownUid);
-  }
-  argv.add("-r");
-  argv.add(path);
-  argv.add(grainDir);
-
-  KJ_SYSCALL(mkdir(grainDir.cStr(), 0777));
-  Subprocess::Options processOptions(argv.asPtr());
-  if (sandboxUid != nullptr) processOptions.uid = uid_t(0);
-  processOptions.executable = "/proc/self/exe";
-  auto outPipe = Pipe::make();
-  processOptions.stdout = outPipe.writeEnd;
-  Subprocess process(kj::mv(processOptions));
-  outPipe.writeEnd = nullptr;
+  auto grainId = kj::heapString(validateId(params.getGrainId()));
+  auto ownerId = kj::heapString(params.getOwnerId());
+  auto grainDir = kj::str("/var/sandstorm/grains/", grainId);
+  kj::Maybe<Backend::BackupProgress::Client> progress;
+  if (params.hasProgress()) {
+    progress = params.getProgress();
+  }
 
   context.releaseParams();
 
-  auto input = kj::mv(outPipe.readEnd);
-  auto asyncInput = ioProvider.wrapInputFd(input, kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC);
-
-  auto promise = capnp::readMessage(*asyncInput);
-  return promise.attach(kj::mv(input), kj::mv(asyncInput), kj::mv(process))
-      .then([context](kj::Own<capnp::MessageReader>&& message) mutable {
-    auto metadata = message->getRoot<GrainInfo>();
-    context.getResults(capnp::MessageSize { metadata.totalSize().wordCount + 4, 0 })
-        .setInfo(metadata);
+  return acquireBackupSlot().then([
+      this,
+      context,
+      KJ_MVCAP(path),
+      KJ_MVCAP(grainId),
+      KJ_MVCAP(ownerId),
+      KJ_MVCAP(grainDir),
+      KJ_MVCAP(progress)
+  ](kj::Own<BackupSlot>&& slot) mutable {
+    reportBackupStarted(progress);
+
+    // Similar to the supervisor, the "backup" command sets up its own sandbox, and for that to
+    // work we need to pass along root privileges to it.
+    kj::Vector<kj::StringPtr> argv;
+    kj::String ownUid;
+    argv.add("backup");
+    KJ_IF_MAYBE(u, sandboxUid) {
+      argv.add("--uid");
+      ownUid = kj::str(*u);
+      argv.add(ownUid);
+    }
+    argv.add("-r");
+    if (access(CHUNKS_DIR, F_OK) == 0) {
+      // In case this is an incremental backup.
+      argv.add("--chunks");
+      argv.add(CHUNKS_DIR);
+    }
+    argv.add(path);
+    argv.add(grainDir);
+
+    KJ_SYSCALL(mkdir(grainDir.cStr(), 0777));
+    Subprocess::Options processOptions(argv.asPtr());
+    if (sandboxUid != nullptr) processOptions.uid = uid_t(0);
+    processOptions.executable = "/proc/self/exe";
+    auto outPipe = Pipe::make();
+    processOptions.stdout = outPipe.writeEnd;
+    auto process = kj::heap<Subprocess>(kj::mv(processOptions));
+    outPipe.writeEnd = nullptr;
+
+    auto input = kj::mv(outPipe.readEnd);
+    auto asyncInput = ioProvider.wrapInputFd(input, kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC);
+
+    // The metadata comes out once everything is unpacked, but the restore only counts as done
+    // when the process exits successfully.
+    auto& processRef = *process;
+    auto promise = capnp::readMessage(*asyncInput);
+    return promise.attach(kj::mv(input), kj::mv(asyncInput))
+        .then([this, context, &processRef, KJ_MVCAP(grainId), KJ_MVCAP(ownerId)](
+            kj::Own<capnp::MessageReader>&& message) mutable {
+      return subprocessSet.waitForSuccess(processRef)
+          .then([this, context, KJ_MVCAP(message), KJ_MVCAP(grainId), KJ_MVCAP(ownerId)]()
+              mutable {
+        auto metadata = message->getRoot<GrainInfo>();
+        context.getResults(capnp::MessageSize { metadata.totalSize().wordCount + 4, 0 })
+            .setInfo(metadata);
+
+        // Forget whatever we knew about any earlier grain by this ID, and measure this one.
+        storageUsage.invalidate(grainId);
+        noteGrainOwner(grainId, ownerId);
+      });
+    }).attach(kj::mv(process), kj::mv(slot));
   });
 }
 
 class BackendImpl::FileUploadStream final: public ByteStream::Server {
 public:
-  FileUploadStream(kj::String finalPath)
-      : tmpPath(kj::str(finalPath, ".uploading")),
+  FileUploadStream(WorkerPool& workers, kj::String finalPath)
+      : workers(workers),
+        tmpPath(kj::str(finalPath, ".uploading")),
         finalPath(kj::mv(finalPath)),
-        fd(raiiOpen(tmpPath, O_WRONLY | O_CREAT | O_EXCL)) {}
+        fd(raiiOpen(tmpPath, O_RDWR | O_CREAT | O_EXCL)) {}
 
   ~FileUploadStream() noexcept(false) {
     if (!isDone) {
@@ -668,16 +1497,33 @@ public:
 
 protected:
   kj::Promise<void> write(WriteContext context) override {
-    auto data = context.getParams().getData();
-    kj::FdOutputStream(fd.get()).write(data.begin(), data.size());
-    return kj::READY_NOW;
+    // Writes happen on a worker, one at a time, in order. Each job gets its own copy of the data
+    // and of the fd, since it might outlive the call, and this stream, if they're cancelled.
+    auto data = kj::heapArray(context.getParams().getData());
+    auto promise = lastWrite.addBranch()
+        .then([this, KJ_MVCAP(data), out = duplicateFd()]() mutable {
+      return workers.run([KJ_MVCAP(data), KJ_MVCAP(out)]() {
+        kj::FdOutputStream(out.get()).write(data.begin(), data.size());
+      });
+    }).fork();
+    auto result = promise.addBranch();
+    lastWrite = kj::mv(promise);
+    return kj::mv(result);
   }
 
   kj::Promise<void> done(DoneContext context) override {
-    KJ_SYSCALL(fsync(fd));
-    KJ_SYSCALL(rename(tmpPath.cStr(), finalPath.cStr()));
-    isDone = true;
-    return kj::READY_NOW;
+    return lastWrite.addBranch().then([this]() {
+      return workers.run([out = duplicateFd(), tmpPath = kj::heapString(tmpPath),
+                          finalPath = kj::heapString(finalPath)]() {
+        // Only the server may create incremental backups: a manifest can name any chunk in the
+        // shared chunk store, including other users'.
+        KJ_REQUIRE(!isBackupManifest(out), "uploaded backup must be a zip");
+        KJ_SYSCALL(fsync(out));
+        KJ_SYSCALL(rename(tmpPath.cStr(), finalPath.cStr()));
+      });
+    }).then([this]() {
+      isDone = true;
+    });
   }
 
   kj::Promise<void> expectSize(ExpectSizeContext context) override {
@@ -686,10 +1532,18 @@ protected:
   }
 
 private:
+  WorkerPool& workers;
   kj::String tmpPath;
   kj::String finalPath;
   kj::AutoCloseFd fd;
   bool isDone = false;
+  kj::ForkedPromise<void> lastWrite = kj::Promise<void>(kj::READY_NOW).fork();
+
+  kj::AutoCloseFd duplicateFd() {
+    int result;
+    KJ_SYSCALL(result = fcntl(fd, F_DUPFD_CLOEXEC, 0));
+    return kj::AutoCloseFd(result);
+  }
 
   static kj::String dirname(kj::StringPtr path) {
     KJ_IF_MAYBE(pos, path.findLast('/')) {
@@ -707,7 +1561,7 @@ kj::Promise<void> BackendImpl::uploadBackup(UploadBackupContext context) {
   recursivelyCreateParent(path);
 
   context.getResults(capnp::MessageSize { 4, 1 }).setStream(
-      kj::heap<FileUploadStream>(kj::mv(path)));
+      kj::heap<FileUploadStream>(workers, kj::mv(path)));
   return kj::READY_NOW;
 }
 
@@ -718,6 +1572,16 @@ kj::Promise<void> BackendImpl::downloadBackup(DownloadBackupContext context) {
   context.releaseParams();
 
   auto fd = raiiOpen(path, O_RDONLY | O_CLOEXEC);
+  if (isBackupManifest(fd)) {
+    // An incremental backup. Zip it up as we go. We can't know the size in advance.
+    auto zip = kj::heap<BackgroundThread>(ioProvider, [KJ_MVCAP(fd)](int out) {
+      ChunkStore chunks(CHUNKS_DIR);
+      writeBackupZip(fd, chunks, out);
+    });
+    auto promise = pump(*zip, kj::mv(stream));
+    return promise.attach(kj::mv(zip));
+  }
+
   struct stat stats;
   KJ_SYSCALL(fstat(fd, &stats));
   auto expectReq = stream.expectSizeRequest();
@@ -732,6 +1596,11 @@ kj::Promise<void> BackendImpl::downloadBackup(DownloadBackupContext context) {
 
 kj::Promise<void> BackendImpl::deleteBackup(DeleteBackupContext context) {
   auto path = kj::str("/var/sandstorm/backups/", context.getParams().getBackupId());
+  bool incremental = false;
+  KJ_IF_MAYBE(fd, raiiOpenIfExists(path, O_RDONLY | O_CLOEXEC)) {
+    incremental = isBackupManifest(*fd);
+  }
+
   while (unlink(path.cStr()) < 0) {
     int error = errno;
     if (error == ENOENT) {
@@ -740,38 +1609,279 @@ kj::Promise<void> BackendImpl::deleteBackup(DeleteBackupContext context) {
       KJ_FAIL_SYSCALL("unlink", error, path);
     }
   }
+
+  if (incremental) {
+    scheduleChunkCollection();
+  }
   return kj::READY_NOW;
 }
 
+void BackendImpl::scheduleChunkCollection() {
+  if (collectingChunks) {
+    collectChunksAgain = true;
+    return;
+  }
+
+  collectingChunks = true;
+  tasks.add(collectChunks(kj::Vector<kj::Own<BackupSlot>>())
+      .catch_([this](kj::Exception&& exception) {
+    collectingChunks = false;
+    KJ_LOG(ERROR, "failed to delete unused backup chunks", exception);
+  }));
+}
+
+kj::Promise<void> BackendImpl::collectChunks(kj::Vector<kj::Own<BackupSlot>> slots) {
+  if (slots.size() < MAX_CONCURRENT_BACKUPS) {
+    return acquireBackupSlot().then([this, KJ_MVCAP(slots)](kj::Own<BackupSlot>&& slot) mutable {
+      slots.add(kj::mv(slot));
+      return collectChunks(kj::mv(slots));
+    });
+  }
+
+  // Backups deleted from here on might be missed by this collection.
+  collectChunksAgain = false;
+
+  auto promise = workers.runHeavy([]() {
+    ChunkStore chunks(CHUNKS_DIR);
+    uint64_t count = collectBackupGarbage(BACKUPS_DIR, chunks);
+    KJ_LOG(INFO, "deleted unused backup chunks", count);
+  });
+  return promise.attach(kj::mv(slots)).then([this]() -> kj::Promise<void> {
+    if (collectChunksAgain) {
+      return collectChunks(kj::Vector<kj::Own<BackupSlot>>());
+    }
+    collectingChunks = false;
+    return kj::READY_NOW;
+  });
+}
+
 // =======================================================================================
 
-static uint64_t recursivelyCountSize(kj::StringPtr path) {
-  KJ_REQUIRE(!path.endsWith("/"),
-      "refusing to recursively traverse directory name with trailing / to reduce risk of "
-      "catastrophic empty-string bugs");
+static constexpr const char* STORAGE_USAGE_PATH = "/var/sandstorm/storage-usage";
+static constexpr kj::Duration STORAGE_USAGE_SAVE_DELAY = 10 * kj::SECONDS;
+static constexpr int64_t STORAGE_USAGE_RESCAN_SECONDS = 24 * 60 * 60;
+static constexpr kj::Duration STORAGE_USAGE_IDLE_DELAY = 1 * kj::HOURS;
+static constexpr kj::Duration STORAGE_USAGE_SCAN_PAUSE = 10 * kj::SECONDS;
+static constexpr uint STORAGE_USAGE_SCAN_RATE = 2000;
+// Rescans stat at most STORAGE_USAGE_SCAN_RATE files per second, and pause between grains, so
+// they leave nearly all of the disk's time to grains and backups.
+
+void BackendImpl::loadStorageUsage() {
+  KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+    if (access(STORAGE_USAGE_PATH, F_OK) == 0) {
+      storageUsage.load(sandstorm::readAll(STORAGE_USAGE_PATH));
+    }
 
-  struct stat stats;
-  KJ_SYSCALL(lstat(path.cStr(), &stats));
+    // Grains may have come and gone while we weren't running, e.g. under a version of Sandstorm
+    // that didn't keep the cache.
+    kj::Vector<kj::String> grainIds;
+    for (auto& name: listDirectory("/var/sandstorm/grains")) {
+      if (!name.startsWith(".")) grainIds.add(kj::mv(name));
+    }
+    storageUsage.reconcile(grainIds);
+  })) {
+    KJ_LOG(ERROR, "couldn't load storage usage cache", *exception);
+  }
+
+  saveStorageUsageSoon();
+}
+
+void BackendImpl::saveStorageUsageSoon() {
+  if (savingStorageUsage || !storageUsage.isDirty()) return;
+  savingStorageUsage = true;
+
+  tasks.add(timer.afterDelay(STORAGE_USAGE_SAVE_DELAY).then([this]() {
+    return workers.run([text = storageUsage.save()]() {
+      auto tmpPath = kj::str(STORAGE_USAGE_PATH, ".tmp");
+      auto fd = raiiOpen(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+      kj::FdOutputStream(fd.get()).write(text.begin(), text.size());
+      KJ_SYSCALL(fdatasync(fd));
+      KJ_SYSCALL(rename(tmpPath.cStr(), STORAGE_USAGE_PATH));
+    });
+  }).then([this]() {
+    savingStorageUsage = false;
+    // Save whatever changed while we were writing.
+    saveStorageUsageSoon();
+  }, [this](kj::Exception&& e) {
+    savingStorageUsage = false;
+    KJ_LOG(ERROR, "couldn't save storage usage cache", e);
+  }));
+}
+
+kj::Promise<void> BackendImpl::storageUsageLoop() {
+  int64_t now = time(nullptr);
+  KJ_IF_MAYBE(stalest, storageUsage.getStalestGrain(now - STORAGE_USAGE_RESCAN_SECONDS)) {
+    auto grainId = kj::mv(*stalest);
+    return workers.runHeavy([path = kj::str("/var/sandstorm/grains/", grainId)]()
+                            -> kj::Maybe<uint64_t> {
+      // A new grain's directory may not have been created yet. That's not a size of zero; its
+      // supervisor will report the real one.
+      if (access(path.cStr(), F_OK) < 0) return nullptr;
+      return measureStorageUsage(path, STORAGE_USAGE_SCAN_RATE);
+    }).then([this, KJ_MVCAP(grainId), now](kj::Maybe<uint64_t> size) {
+      KJ_IF_MAYBE(s, size) {
+        storageUsage.setMeasuredSize(grainId, *s, now);
+      } else {
+        storageUsage.setMissing(grainId, now);
+      }
+      saveStorageUsageSoon();
+      return timer.afterDelay(STORAGE_USAGE_SCAN_PAUSE);
+    }, [this](kj::Exception&& e) {
+      // Most likely the grain was deleted while we measured it. Try the others before retrying.
+      KJ_LOG(WARNING, "couldn't measure grain storage", e);
+      return timer.afterDelay(STORAGE_USAGE_SCAN_PAUSE);
+    }).then([this]() {
+      return storageUsageLoop();
+    });
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  storageUsageLoopIdle = kj::mv(paf.fulfiller);
+  return timer.afterDelay(STORAGE_USAGE_IDLE_DELAY).exclusiveJoin(kj::mv(paf.promise))
+      .then([this]() {
+    storageUsageLoopIdle = nullptr;
+    return storageUsageLoop();
+  });
+}
 
-  // Count blocks, not length, because what we care about is allocated space.
-  uint64_t total = stats.st_blocks * 512;
+void BackendImpl::noteGrainOwner(kj::StringPtr grainId, kj::StringPtr ownerId) {
+  // IDs are saved space-separated.
+  if (ownerId.size() == 0) return;
+  for (char c: ownerId) {
+    if (c <= ' ') return;
+  }
+
+  storageUsage.addGrain(grainId, ownerId);
+  saveStorageUsageSoon();
 
-  if (S_ISDIR(stats.st_mode)) {
-    for (auto& file: listDirectory(path)) {
-      total += recursivelyCountSize(kj::str(path, '/', file));
+  if (storageUsage.getGrainSize(grainId) == nullptr) {
+    // Have the loop measure it now, rather than in up to an hour.
+    KJ_IF_MAYBE(idle, storageUsageLoopIdle) {
+      (*idle)->fulfill();
     }
-  } else if (stats.st_nlink != 0) {
-    // Don't overcount hard links. (Note that st_nlink can in fact be zero in cases where we are
-    // racing with directory modifications, so we check for that to avoid divide-by-zero crashes.)
-    total /= stats.st_nlink;
   }
+}
 
-  return total;
+class BackendImpl::SizeReportingCore final: public capnp::Capability::Server {
+  // Forwards everything to a grain's SandstormCore, after noting the sizes it reports.
+
+public:
+  SizeReportingCore(BackendImpl& backend, kj::String grainId, SandstormCore::Client core)
+      : backend(backend), grainId(kj::mv(grainId)), core(kj::mv(core)) {}
+
+  DispatchCallResult dispatchCall(
+      uint64_t interfaceId, uint16_t methodId,
+      capnp::CallContext<capnp::AnyPointer, capnp::AnyPointer> context) override {
+    static const uint16_t REPORT_GRAIN_SIZE = capnp::Schema::from<SandstormCore>()
+        .getMethodByName("reportGrainSize").getOrdinal();
+
+    capnp::AnyPointer::Reader params = context.getParams();
+    if (interfaceId == capnp::typeId<SandstormCore>() && methodId == REPORT_GRAIN_SIZE) {
+      backend.storageUsage.setReportedSize(grainId,
+          params.getAs<SandstormCore::ReportGrainSizeParams>().getBytes());
+      backend.saveStorageUsageSoon();
+    }
+
+    auto req = core.typelessRequest(interfaceId, methodId, params.targetSize());
+    req.set(params);
+    context.releaseParams();
+
+    // As in CapRedirector, the front-end applies stream queueing where appropriate.
+    return { context.tailCall(kj::mv(req)), false };
+  }
+
+private:
+  BackendImpl& backend;
+  kj::String grainId;
+  SandstormCore::Client core;
+};
+
+SandstormCore::Client BackendImpl::getCore(kj::StringPtr grainId) {
+  auto req = coreFactory.getSandstormCoreRequest();
+  req.setGrainId(grainId);
+  return capnp::Capability::Client(kj::heap<SizeReportingCore>(
+      *this, kj::str(grainId), req.send().getCore())).castAs<SandstormCore>();
+}
+
+kj::Promise<void> BackendImpl::getUserStorageUsage(GetUserStorageUsageContext context) {
+  KJ_IF_MAYBE(size, storageUsage.getUserSize(context.getParams().getUserId())) {
+    context.getResults(capnp::MessageSize { 4, 0 }).setSize(*size);
+    return kj::READY_NOW;
+  } else {
+    // We haven't yet learned every grain's owner, or measured all of this user's grains. The
+    // front-end falls back to adding up its own record of the user's grain sizes.
+    return KJ_EXCEPTION(UNIMPLEMENTED, "user's storage usage not known yet");
+  }
 }
 
 kj::Promise<void> BackendImpl::getGrainStorageUsage(GetGrainStorageUsageContext context) {
-  context.getResults(capnp::MessageSize { 4, 0 }).setSize(recursivelyCountSize(
-      kj::str("/var/sandstorm/grains/", validateId(context.getParams().getGrainId()))));
+  auto params = context.getParams();
+  auto grainId = kj::heapString(validateId(params.getGrainId()));
+  noteGrainOwner(grainId, params.getOwnerId());
+
+  KJ_IF_MAYBE(size, storageUsage.getGrainSize(grainId)) {
+    context.getResults(capnp::MessageSize { 4, 0 }).setSize(*size);
+    return kj::READY_NOW;
+  }
+
+  // Not measured yet. Don't make the caller wait for the throttled rescan.
+  int64_t now = time(nullptr);
+  return workers.runHeavy([path = kj::str("/var/sandstorm/grains/", grainId)]() {
+    return measureStorageUsage(path);
+  }).then([this, context, KJ_MVCAP(grainId), now](uint64_t size) mutable {
+    storageUsage.setMeasuredSize(grainId, size, now);
+    saveStorageUsageSoon();
+    context.getResults(capnp::MessageSize { 4, 0 }).setSize(size);
+  });
+}
+
+kj::Promise<void> BackendImpl::getGrainResourceUsage(GetGrainResourceUsageContext context) {
+  auto params = context.getParams();
+  auto grains = sampleResourceUsage(rpcUsageBaseline, params.getSortBy(), params.getLimit());
+  fillResourceUsage(grains.asPtr(), context.getResults().initGrains(grains.size()));
+  return kj::READY_NOW;
+}
+
+class BackendImpl::ResourceUsageWatcher final: public Handle::Server {
+  // Pushes resource usage to a receiver until dropped. Waits for each report to be acknowledged
+  // before scheduling the next, so a slow receiver can't make reports pile up.
+
+public:
+  ResourceUsageWatcher(BackendImpl& backend, Backend::GrainResourceUsageReceiver::Client receiver,
+                       kj::Duration interval, Backend::ResourceUsageOrder sortBy, uint limit)
+      : backend(backend), receiver(kj::mv(receiver)), interval(interval),
+        sortBy(sortBy), limit(limit),
+        loopTask(loop().eagerlyEvaluate([](kj::Exception&& e) {
+          KJ_LOG(INFO, "grain resource usage watcher stopped", e);
+        })) {}
+
+private:
+  BackendImpl& backend;
+  Backend::GrainResourceUsageReceiver::Client receiver;
+  kj::Duration interval;
+  Backend::ResourceUsageOrder sortBy;
+  uint limit;
+  UsageBaseline baseline;
+  kj::Promise<void> loopTask;
+
+  kj::Promise<void> loop() {
+    return backend.timer.afterDelay(interval).then([this]() {
+      auto grains = backend.sampleResourceUsage(baseline, sortBy, limit);
+      auto request = receiver.reportRequest();
+      fillResourceUsage(grains.asPtr(), request.initGrains(grains.size()));
+      return request.send();
+    }).then([this](capnp::Response<Backend::GrainResourceUsageReceiver::ReportResults>&&) {
+      return loop();
+    });
+  }
+};
+
+kj::Promise<void> BackendImpl::watchGrainResourceUsage(WatchGrainResourceUsageContext context) {
+  auto params = context.getParams();
+  KJ_REQUIRE(params.getIntervalSeconds() > 0, "interval must be at least one second");
+  context.getResults(capnp::MessageSize { 4, 1 }).setHandle(kj::heap<ResourceUsageWatcher>(
+      *this, params.getReceiver(), params.getIntervalSeconds() * kj::SECONDS,
+      params.getSortBy(), params.getLimit()));
   return kj::READY_NOW;
 }
 
@@ -19,11 +19,16 @@
 
 #include <sandstorm/backend.capnp.h>
 #include <map>
+#include <deque>
 #include <kj/async-io.h>
+#include <kj/async-unix.h>
 #include <capnp/rpc-twoparty.h>
 #include <kj/one-of.h>
 #include <kj/vector.h>
 #include <sandstorm/cgroup2.h>
+#include "util.h"
+#include "worker-pool.h"
+#include "storage-usage.h"
 
 namespace kj {
   class InputStream;
@@ -34,12 +39,20 @@ namespace sandstorm {
 class BackendImpl final: public Backend::Server, private kj::TaskSet::ErrorHandler {
 public:
   BackendImpl(kj::LowLevelAsyncIoProvider& ioProvider,
+              kj::UnixEventPort& eventPort,
               kj::Network& network,
               SandstormCoreFactory::Client&& sandstormCoreFactory,
               kj::Maybe<Cgroup>&& cgroup,
               kj::Maybe<uid_t> sandboxUid,
               bool useExperimentalSeccompFilter,
-              bool logSeccompViolations);
+              bool logSeccompViolations,
+              kj::Duration hibernationTimeout,
+              uint64_t hibernationReclaimBytes,
+              Cgroup::Limits grainLimits,
+              std::map<kj::String, Cgroup::Limits> packageGrainLimits,
+              bool grainMemoryMerge,
+              std::map<kj::String, bool> packageGrainMemoryMerge,
+              bool incrementalBackups);
 
 protected:
   kj::Promise<void> ping(PingContext context) override;
@@ -56,10 +69,14 @@ protected:
   kj::Promise<void> uploadBackup(UploadBackupContext context) override;
   kj::Promise<void> downloadBackup(DownloadBackupContext context) override;
   kj::Promise<void> deleteBackup(DeleteBackupContext context) override;
+  kj::Promise<void> getUserStorageUsage(GetUserStorageUsageContext context) override;
   kj::Promise<void> getGrainStorageUsage(GetGrainStorageUsageContext context) override;
+  kj::Promise<void> getGrainResourceUsage(GetGrainResourceUsageContext context) override;
+  kj::Promise<void> watchGrainResourceUsage(WatchGrainResourceUsageContext context) override;
 
 private:
   kj::LowLevelAsyncIoProvider& ioProvider;
+  kj::UnixEventPort& eventPort;
   kj::Network& network;
   SandstormCoreFactory::Client coreFactory;
   kj::Maybe<uid_t> sandboxUid;   // if not using user namespaces
@@ -67,43 +84,299 @@ private:
   kj::Maybe<Cgroup> cgroup;
   bool useExperimentalSeccompFilter;
   bool logSeccompViolations;
+  kj::Timer& timer;
+
+  kj::Duration hibernationTimeout;
+  // How long an idle grain stays frozen before we shut it down. Zero disables hibernation, in
+  // which case supervisors shut themselves down as soon as they are idle.
+
+  uint64_t hibernationReclaimBytes;
+  // How much memory to ask the kernel to reclaim from a grain when freezing it.
+
+  Cgroup::Limits grainLimits;
+  std::map<kj::String, Cgroup::Limits> packageGrainLimits;
+  bool warnedAboutLimits = false;
+  // Resource controls applied to each grain's cgroup, optionally overridden per package.
+
+  bool grainMemoryMerge;
+  std::map<kj::String, bool> packageGrainMemoryMerge;
+  // Whether to start grains with --memory-merge, optionally overridden per package.
+
+  bool incrementalBackups;
+  // Whether new backups store their files in the chunk store rather than in a zip. (Restoring
+  // and downloading incremental backups works either way.)
+
+  struct GrainActivity: public kj::Refcounted {
+    // Freeze state and recency of a running grain. Shared between the RunningGrain, the backups
+    // holding it, and the membrane around its Supervisor capability, which updates `lastUsed`
+    // whenever a call arrives.
+    //
+    // The grain is frozen while it hibernates or while any backup holds it. A call ends
+    // hibernation and thaws the grain, unless a backup holds it, in which case the call waits
+    // until the last hold is released.
+
+    kj::Maybe<Cgroup::FreezeHandle> freezeHandle;
+    // Non-null while the grain is frozen, for whichever reason.
+
+    bool hibernating = false;
+    kj::TimePoint frozenSince = kj::origin<kj::TimePoint>();
+    kj::TimePoint lastUsed;
+
+    uint holds = 0;
+    kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> waitingForRelease;
+    // Calls that arrived while held.
+
+    explicit GrainActivity(kj::TimePoint now): lastUsed(now) {}
+
+    void release();
+    // Drops a hold taken by RunningGrain::hold(). The last one thaws the grain unless it's
+    // hibernating, and lets waiting calls through, which ends hibernation anyway.
+  };
+
+  class ThawMembranePolicy;
 
   class RunningGrain {
   public:
-    RunningGrain(BackendImpl& backend, kj::String grainId, kj::Own<kj::AsyncIoStream> stream,
-                 SandstormCore::Client&& sandstormCoreFactory);
+    RunningGrain(BackendImpl& backend, kj::String grainId, Subprocess process,
+                 kj::Own<kj::AsyncInputStream> stdout, kj::Own<kj::AsyncIoStream> stream,
+                 SandstormCore::Client&& sandstormCoreFactory, kj::Maybe<Cgroup> cgroup);
     ~RunningGrain() noexcept(false);
 
     inline kj::StringPtr getGrainId() { return grainId; }
     inline kj::Promise<void> onDisconnect() { return client.onDisconnect(); }
 
-    inline Supervisor::Client getSupervisor() {
-      return client.bootstrap().castAs<Supervisor>();
-    }
+    Supervisor::Client getSupervisor();
+
+    kj::Maybe<kj::TimePoint> getFrozenSince();
+    // Null if the grain is not hibernating.
+
+    inline kj::TimePoint getLastUsed() { return activity->lastUsed; }
+    inline bool hasWakelock() { return wakelock; }
+    inline bool isStopping() { return stopping; }
+
+    void stop();
+    // Thaw the grain and ask its supervisor to shut down. A grain held by a backup is thawed
+    // once the backup releases it.
+
+    kj::Maybe<kj::Own<GrainActivity>> hold();
+    // Freezes the grain until GrainActivity::release() is called on the result. Null if grains
+    // can't be frozen.
+
+    kj::Maybe<Cgroup::Usage> getUsage();
+    // Reads the grain's cgroup statistics. Null if grains aren't run in cgroups.
+
+    inline uint64_t getKsmMergedBytes() { return ksmMergedBytes; }
+    // As last reported by the supervisor, which can read the app's /proc entries and we can't.
 
   private:
     BackendImpl& backend;
     kj::String grainId;
+    Subprocess process;
     kj::Own<kj::AsyncInputStream> stdout;
     kj::Own<kj::AsyncIoStream> stream;
     capnp::TwoPartyClient client;
+    kj::Own<GrainActivity> activity;
+    bool wakelock = false;
+    bool stopping = false;
+    uint64_t ksmMergedBytes = 0;
+    kj::Vector<char> stdoutBuffer;
+    kj::Maybe<Cgroup> cgroup;
+    kj::Promise<void> watchTask;
+
+    kj::Promise<void> watchSupervisor();
+    // Reads the lines the supervisor writes to stdout after startup, each reporting a change in
+    // the grain's state: "Idle...", "Wakelock", "NoWakelock" or "KsmMergedBytes <n>".
+
+    void hibernate();
+  };
+
+  std::map<kj::StringPtr, RunningGrain*> runningGrains;
+  // Grains whose supervisors have finished starting, keyed by grain ID.
+
+  kj::Promise<void> hibernationLoop();
+  // Periodically shuts down grains that have been frozen for longer than hibernationTimeout.
+
+  kj::Maybe<kj::AutoCloseFd> memoryPressureTrigger;
+  kj::Maybe<kj::Own<kj::UnixEventPort::FdObserver>> memoryPressureObserver;
+  kj::TimePoint lastEviction = kj::origin<kj::TimePoint>();
+
+  void startMemoryPressureWatch();
+  kj::Promise<void> watchMemoryPressure(kj::UnixEventPort::FdObserver& observer);
+  kj::Promise<void> pollMemoryPressure();
+  // Watches memory pressure on the grains cgroup, using a PSI trigger if we're allowed to create
+  // one, and otherwise by polling memory.pressure.
+
+  void relieveMemoryPressure(kj::StringPtr reason);
+  // Shuts down a few of the least-recently-used grains that hold no wakelock.
+
+  struct GrainUsage {
+    RunningGrain* grain;
+    Cgroup::Usage usage;
+    float cpuPercent = 0;
+    float ioReadBytesPerSecond = 0;
+    float ioWriteBytesPerSecond = 0;
+    // Rates since the previous sample in the same UsageBaseline; zero on the first.
+  };
+
+  struct UsageBaseline {
+    // Each running grain's previous sample, as taken by one consumer of samples: the
+    // getGrainResourceUsage() RPC, or one watcher. Rates are computed against these, and each
+    // consumer keeps its own so that consumers don't shorten each other's windows.
+
+    struct Grain {
+      kj::String id;
+      Cgroup::Usage usage;
+      kj::TimePoint time;
+    };
+    std::map<kj::StringPtr, Grain> grains;
   };
 
+  UsageBaseline rpcUsageBaseline;
+
+  kj::Vector<GrainUsage> sampleResourceUsage(UsageBaseline& baseline,
+                                             Backend::ResourceUsageOrder sortBy, uint limit);
+  // Samples every running grain's cgroup in one pass, returning the heaviest `limit` grains (or
+  // all of them if `limit` is zero), heaviest first. Replaces `baseline` with this sample.
+
+  static void fillResourceUsage(kj::ArrayPtr<const GrainUsage> grains,
+                                capnp::List<Backend::GrainResourceUsage>::Builder builder);
+
+  class ResourceUsageWatcher;
+
   struct StartingGrain {
     kj::String grainId;
     kj::ForkedPromise<Supervisor::Client> promise;
   };
 
   struct BackingUpGrain {
+    kj::String grainId;
     kj::ForkedPromise<void> promise;
-    // Promise will be fulfiled when the backup is complete.
+    // Promise will be fulfiled when the backup is done reading the grain's files.
   };
 
   std::map<kj::StringPtr, kj::OneOf<StartingGrain, BackingUpGrain>> supervisors;
   // Map of possibly-running grains. StartingGrain means the grain is actually
   // running, or in the process of booting. BackingUpGrain means the grain is
-  // *not* running, but there is an in-progress backup, and it should not be
-  // started until the backup is complete.
+  // *not* running, but there is an in-progress backup reading its files, and it
+  // should not be started until the backup is done with them.
+
+  struct SupervisorProcess {
+    Subprocess process;
+    kj::Own<kj::AsyncInputStream> stdout;
+    kj::AutoCloseFd stdin;
+    // For warm supervisors, the write end of the pipe on which the grain's supervisor arguments
+    // are to be delivered. Null for supervisors started with a full command line.
+  };
+
+  static constexpr uint WARM_SUPERVISOR_POOL_SIZE = 2;
+  kj::Vector<kj::Own<SupervisorProcess>> warmSupervisors;
+  // Supervisors which have already done the grain-independent part of their setup (see
+  // SupervisorMain::runWarm()) and are waiting to be told which grain to run. Not used for
+  // dev-mode grains.
+
+  uint warmSupervisorsStarting = 0;
+  bool warmSupervisorsFailed = false;
+  // If a warm supervisor ever fails to start we stop trying and always boot cold.
+
+  struct BootLatencyHistogram {
+    static constexpr uint BUCKET_COUNT = 10;
+    uint64_t buckets[BUCKET_COUNT] = {};
+    // buckets[i] counts boots that took less than 32ms << i. The last bucket is unbounded.
+
+    void add(kj::Duration latency);
+    kj::String toString() const;
+  };
+
+  BootLatencyHistogram warmBootLatency;
+  BootLatencyHistogram coldBootLatency;
+  uint64_t bootCount = 0;
+  static constexpr uint BOOT_LATENCY_LOG_INTERVAL = 100;
+  // Time from bootGrain() to the supervisor accepting connections. Logged every
+  // BOOT_LATENCY_LOG_INTERVAL boots.
+
+  kj::Own<SupervisorProcess> spawnSupervisor(kj::ArrayPtr<const kj::String> argv, bool warm);
+  void refillWarmSupervisors();
+  kj::Maybe<kj::Own<SupervisorProcess>> takeWarmSupervisor(
+      kj::ArrayPtr<const kj::String> grainArgs);
+  // Returns a warm supervisor that has been handed `grainArgs`, or null if none is available.
+
+  void recordBootLatency(kj::Duration latency, bool warm);
+
+  SubprocessSet subprocessSet;
+  // Used to wait for backup and restore processes without blocking the event loop. Other
+  // subprocesses are still waited for synchronously.
+
+  static constexpr uint WORKER_THREADS = 4;
+  static constexpr uint MAX_HEAVY_JOBS = 2;
+  WorkerPool workers;
+  // Runs blocking filesystem work off the event loop. Heavy jobs are those that walk a whole
+  // tree, like deleting or measuring a grain.
+
+  kj::Promise<void> deleteInBackground(kj::StringPtr path);
+  // Moves `path` out of the way at once, then deletes it on a worker.
+
+  StorageUsageCache storageUsage;
+  bool savingStorageUsage = false;
+  // Sizes and owners of grains, saved to /var/sandstorm/storage-usage a little while after they
+  // change. Supervisors' size reports keep the sizes of running grains current. storageUsageLoop()
+  // measures grains we know nothing about, and re-measures every grain daily, in the background.
+
+  void loadStorageUsage();
+  void saveStorageUsageSoon();
+  kj::Promise<void> storageUsageLoop();
+
+  void noteGrainOwner(kj::StringPtr grainId, kj::StringPtr ownerId);
+  // Records an owner named by the front-end. Most calls about a grain name its owner, so this is
+  // how we learn whom to charge for grains that existed before the cache did.
+
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> storageUsageLoopIdle;
+  // Fulfilled to wake storageUsageLoop() early, when there's a grain whose size we don't know.
+
+  class SizeReportingCore;
+
+  SandstormCore::Client getCore(kj::StringPtr grainId);
+  // Gets the front-end's SandstormCore for the grain, wrapped so that we see the grain's size
+  // reports as they go by.
+
+  class BackupSlot;
+
+  static constexpr uint MAX_CONCURRENT_BACKUPS = 2;
+  uint backupsRunning = 0;
+  std::deque<kj::Own<kj::PromiseFulfiller<kj::Own<BackupSlot>>>> backupQueue;
+  // Backups and restores are disk-bound, so running many at once mostly slows each of them (and
+  // the grains) down. Those beyond MAX_CONCURRENT_BACKUPS wait here for a slot, in order.
+
+  kj::Promise<kj::Own<BackupSlot>> acquireBackupSlot();
+  // Resolves once a backup or restore may start. The slot is released when the returned object
+  // is destroyed.
+
+  class GrainHold;
+  // Keeps a grain's files from changing while a backup reads them, by freezing the grain if it's
+  // running, or else stopping it from booting.
+
+  uint snapshotCounter = 0;
+
+  kj::Promise<kj::Maybe<kj::String>> snapshotGrain(kj::StringPtr grainDir);
+  // Snapshots the parts of the grain that a backup reads, on a background thread, using reflinks.
+  // Returns the snapshot's path, or null if the filesystem can't do that (or the snapshot failed,
+  // which is logged). Either way, the grain must be held while this runs.
+
+  void deleteSnapshot(kj::String path);
+  // Deletes a snapshot on a worker.
+
+  void reportBackupStarted(kj::Maybe<Backend::BackupProgress::Client>& progress);
+  kj::Promise<void> reportBackupProgress(kj::String path, Backend::BackupProgress::Client progress,
+                                         uint64_t reportedSize);
+  // Progress reports are best-effort: failures are ignored.
+
+  bool collectingChunks = false;
+  bool collectChunksAgain = false;
+
+  void scheduleChunkCollection();
+  kj::Promise<void> collectChunks(kj::Vector<kj::Own<BackupSlot>> slots);
+  // Deletes chunks that no incremental backup uses any more, after one has been deleted. This
+  // takes every backup slot, since a backup in progress may use chunks that no manifest refers
+  // to yet. Deletions during a collection cause another to follow it.
 
   class PackageUploadStreamImpl;
   class FileUploadStream;
@@ -112,7 +385,6 @@ private:
       spk::Manifest::Command::Reader command, bool isNew, bool devMode, bool mountProce,
       bool isRetry);
 
-  static kj::Promise<void> ignoreAll(kj::AsyncInputStream& input);
   static kj::Promise<kj::String> readAll(kj::AsyncInputStream& input,
       kj::Vector<char> soFar = kj::Vector<char>());
 
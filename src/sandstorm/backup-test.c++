@@ -0,0 +1,173 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "backup.h"
+#include "zip.h"
+#include "chunk-store.h"
+#include "test-util.h"
+#include <sandstorm/backup.capnp.h>
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <kj/main.h>
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+namespace sandstorm {
+namespace {
+
+constexpr const char* TEMP_PARENT = "/var/tmp";
+// Where to make temporary grains: not under /tmp, which the backup sandbox mounts a tmpfs over,
+// hiding the grain.
+
+bool canSandbox() {
+  // The backup command sandboxes itself in a user namespace when not run as root, which some
+  // systems don't allow unprivileged users to create.
+  return Subprocess([]() -> int {
+    return unshare(CLONE_NEWUSER | CLONE_NEWPID) == 0 ? 0 : 1;
+  }).waitForExit() == 0;
+}
+
+void runBackupCommand(kj::ArrayPtr<const kj::StringPtr> args, kj::StringPtr stdinPath) {
+  // BackupMain sandboxes the calling process, so it gets a process of its own.
+  Subprocess([&]() -> int {
+    KJ_SYSCALL(dup2(raiiOpen(stdinPath, O_RDONLY | O_CLOEXEC), STDIN_FILENO));
+    kj::TopLevelProcessContext context("sandstorm");
+    BackupMain main(context);
+    main.getMain()("backup", args);
+    return 0;
+  }).waitForSuccess();
+}
+
+KJ_TEST("backup zips the grain from inside its sandbox") {
+  if (!canSandbox()) {
+    KJ_LOG(WARNING, "skipping test because user namespaces aren't available");
+    return;
+  }
+
+  TempDir dir(TEMP_PARENT);
+  auto grain = dir / "grain";
+  KJ_SYSCALL(mkdir(grain.cStr(), 0755));
+  KJ_SYSCALL(mkdir(kj::str(grain, "/sandbox").cStr(), 0755));
+  KJ_SYSCALL(mkdir(kj::str(grain, "/sandbox/sub").cStr(), 0755));
+  writeFile(kj::str(grain, "/sandbox/file.txt"), "hello\n");
+  writeFile(kj::str(grain, "/sandbox/sub/other.txt"), "world\n");
+  writeFile(kj::str(grain, "/log"), "newest\n");
+  writeFile(kj::str(grain, "/log.3.gz"), "sealed");
+  writeFile(kj::str(grain, "/log.4.gz.tmp"), "half-sealed");
+  writeFile(dir / "metadata", "meta");
+
+  // A full backup compresses on the ZipWriter's threads, which the sandbox's PID namespace must
+  // not prevent.
+  auto zipPath = dir / "backup.zip";
+  kj::StringPtr args[] = { zipPath, grain };
+  runBackupCommand(args, dir / "metadata");
+
+  auto out = dir / "out";
+  KJ_SYSCALL(mkdir(out.cStr(), 0755));
+  {
+    auto file = raiiOpen(zipPath, O_RDONLY | O_CLOEXEC);
+    auto outDir = raiiOpen(out, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    ZipReader(file).extract(outDir, [](kj::StringPtr) { return true; });
+  }
+
+  KJ_EXPECT(readAll(kj::str(out, "/data/file.txt")) == "hello\n");
+  KJ_EXPECT(readAll(kj::str(out, "/data/sub/other.txt")) == "world\n");
+  KJ_EXPECT(readAll(kj::str(out, "/metadata")) == "meta");
+  KJ_EXPECT(readAll(kj::str(out, "/log")) == "newest\n");
+  KJ_EXPECT(readAll(kj::str(out, "/log.3.gz")) == "sealed");
+  KJ_EXPECT(access(kj::str(out, "/log.4.gz.tmp").cStr(), F_OK) < 0);
+}
+
+KJ_TEST("backup from a snapshot keeps the whole log") {
+  if (!canSandbox()) {
+    KJ_LOG(WARNING, "skipping test because user namespaces aren't available");
+    return;
+  }
+
+  TempDir dir(TEMP_PARENT);
+  auto grain = dir / "grain";
+  KJ_SYSCALL(mkdir(grain.cStr(), 0755));
+  KJ_SYSCALL(mkdir(kj::str(grain, "/sandbox").cStr(), 0755));
+  writeFile(kj::str(grain, "/sandbox/file.txt"), "hello\n");
+  writeFile(kj::str(grain, "/log"), "newest\n");
+  writeFile(kj::str(grain, "/log.3.gz"), "sealed");
+  writeFile(kj::str(grain, "/log.4.gz.tmp"), "half-sealed");
+  writeFile(kj::str(grain, "/last-backup"), "not backed up");
+  writeFile(dir / "metadata", "meta");
+
+  auto snapshot = dir / "snapshot";
+  if (!snapshotBackupSource(grain, snapshot)) {
+    KJ_LOG(WARNING, "skipping test because the filesystem doesn't support reflinks", dir.path);
+    return;
+  }
+  KJ_EXPECT(access(kj::str(snapshot, "/log.4.gz.tmp").cStr(), F_OK) < 0);
+  KJ_EXPECT(access(kj::str(snapshot, "/last-backup").cStr(), F_OK) < 0);
+
+  auto zipPath = dir / "backup.zip";
+  kj::StringPtr args[] = { "--snapshot", zipPath, snapshot };
+  runBackupCommand(args, dir / "metadata");
+
+  auto out = dir / "out";
+  KJ_SYSCALL(mkdir(out.cStr(), 0755));
+  {
+    auto file = raiiOpen(zipPath, O_RDONLY | O_CLOEXEC);
+    auto outDir = raiiOpen(out, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    ZipReader(file).extract(outDir, [](kj::StringPtr) { return true; });
+  }
+
+  KJ_EXPECT(readAll(kj::str(out, "/data/file.txt")) == "hello\n");
+  KJ_EXPECT(readAll(kj::str(out, "/log")) == "newest\n");
+  KJ_EXPECT(readAll(kj::str(out, "/log.3.gz")) == "sealed");
+}
+
+KJ_TEST("chunk collection skips manifests that don't decode") {
+  TempDir dir(TEMP_PARENT);
+  auto chunksPath = dir / "chunks";
+  ChunkStore::create(chunksPath);
+  ChunkStore chunks(chunksPath);
+  auto live = chunks.add(kj::StringPtr("live chunk").asBytes());
+  auto dead = chunks.add(kj::StringPtr("dead chunk").asBytes());
+  chunks.sync();
+
+  {
+    capnp::MallocMessageBuilder message;
+    auto file = message.initRoot<BackupManifest>().initFiles(1)[0];
+    file.setPath("data/file");
+    auto chunk = file.initRegular().initChunks(1)[0];
+    chunk.setHash(live);
+    chunk.setSize(10);
+
+    auto fd = raiiOpen(dir / "good", O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC);
+    kj::FdOutputStream(fd.get()).write("\x89SBKMAN\n", 8);
+    capnp::writeMessageToFd(fd, message);
+  }
+  writeFile(dir / "corrupt", "\x89SBKMAN\nnot a message");
+  writeFile(dir / "garbage", "\x89SBKMAN\n\x7f\xff\xff\xff\x7f\xff\xff\xff");
+  writeFile(dir / "zip", "PK\x03\x04 whatever");
+  writeFile(dir / "junk", "neither a zip nor a manifest");
+
+  KJ_EXPECT(collectBackupGarbage(dir.path, chunks) == 1);
+  KJ_EXPECT(chunks.get(live, 10).size() == 10);
+  KJ_EXPECT_THROW_MESSAGE("missing", chunks.get(dead, 10));
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -18,6 +18,11 @@
 #include "util.h"
 #include "sandbox.h"
 #include "version.h"
+#include "zip.h"
+#include "chunk-store.h"
+#include "snapshot.h"
+#include <sandstorm/backup.capnp.h>
+#include <capnp/serialize.h>
 #include <kj/debug.h>
 #include <sched.h>
 #include <sys/mount.h>
@@ -26,6 +31,10 @@
 #include <sys/types.h>
 #include <sys/prctl.h>
 #include <sys/capability.h>
+#include <limits.h>
+#include <algorithm>
+#include <map>
+#include <vector>
 
 // In case kernel headers are old.
 #ifndef PR_SET_NO_NEW_PRIVS
@@ -34,6 +43,45 @@
 
 namespace sandstorm {
 
+namespace {
+
+constexpr kj::byte MANIFEST_MAGIC[8] = { 0x89, 'S', 'B', 'K', 'M', 'A', 'N', '\n' };
+// Starts every incremental backup file; see backup.capnp.
+
+kj::Own<capnp::MessageReader> readManifest(int fd) {
+  KJ_REQUIRE(isBackupManifest(fd), "not an incremental backup");
+  KJ_SYSCALL(lseek(fd, sizeof(MANIFEST_MAGIC), SEEK_SET));
+
+  // Manifests of big grains can be big, and we trust them as much as the files they describe.
+  capnp::ReaderOptions options;
+  options.traversalLimitInWords = kj::maxValue;
+  return kj::heap<capnp::StreamFdMessageReader>(fd, options);
+}
+
+void writeManifestFile(int fd, capnp::MessageBuilder& message) {
+  kj::FdOutputStream(fd).write(MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+  capnp::writeMessageToFd(fd, message);
+}
+
+bool isRestoredPath(kj::StringPtr name) {
+  return name == "metadata" || name == "data" || name.startsWith("data/");
+}
+
+int64_t toNanoseconds(const struct timespec& time) {
+  return int64_t(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+struct timespec fromNanoseconds(int64_t ns) {
+  struct timespec result = { time_t(ns / 1000000000), long(ns % 1000000000) };
+  if (result.tv_nsec < 0) {
+    result.tv_nsec += 1000000000;
+    --result.tv_sec;
+  }
+  return result;
+}
+
+}  // namespace
+
 BackupMain::BackupMain(kj::ProcessContext& context): context(context) {}
 
 kj::MainFunc BackupMain::getMain() {
@@ -41,14 +89,26 @@ kj::MainFunc BackupMain::getMain() {
                          "Backs up the grain directory in <grain> to <file>, reading the grain "
                          "metadata struct on stdin. Or, restores the backup in <file>, "
                          "unpacking it to <grain>, and writing the metadata to stdout. In "
-                         "backup mode, <file> can be `-` to write the data to stdout.")
+                         "backup mode, <file> can be `-` to write the data to stdout.\n\n"
+                         "With --chunks, the backup is incremental: <file> is a manifest of "
+                         "the grain's files, whose contents go in the chunk store, where "
+                         "anything already stored by an earlier backup isn't stored again.")
       .addOptionWithArg({"uid"}, KJ_BIND_METHOD(*this, setUid), "<uid>",
                         "Use setuid sandbox rather than userns. Must start as root, but swiches "
                         "to <uid> to run the app.")
       .addOption({'r', "restore"}, KJ_BIND_METHOD(*this, setRestore),
                  "Restore a backup, rather than create a backup.")
       .addOptionWithArg({"root"}, KJ_BIND_METHOD(*this, setRoot), "<root>",
-                 "Set the \"root directory\" to map in, which contains the zip/unzip binaries.")
+                 "Set the \"root directory\" whose /dev to map in.")
+      .addOptionWithArg({"chunks"}, KJ_BIND_METHOD(*this, setChunks), "<dir>",
+                 "Make an incremental backup, storing file contents in the chunk store <dir>. "
+                 "When restoring, this is where to find the chunks of an incremental backup.")
+      .addOptionWithArg({"previous"}, KJ_BIND_METHOD(*this, setPrevious), "<file>",
+                 "An earlier incremental backup of the same grain. Files that haven't changed "
+                 "since then aren't read again.")
+      .addOption({"snapshot"}, KJ_BIND_METHOD(*this, setSnapshot),
+                 "<grain> is a snapshot of the grain. Files' identities, which --previous "
+                 "uses to recognize unchanged files, are those recorded for their originals.")
       .expectArg("<file>", KJ_BIND_METHOD(*this, setFile))
       .expectArg("<grain>", KJ_BIND_METHOD(*this, run))
       .build();
@@ -69,6 +129,21 @@ bool BackupMain::setRoot(kj::StringPtr arg) {
   return true;
 }
 
+bool BackupMain::setChunks(kj::StringPtr arg) {
+  chunkDir = arg;
+  return true;
+}
+
+bool BackupMain::setPrevious(kj::StringPtr arg) {
+  previousPath = arg;
+  return true;
+}
+
+bool BackupMain::setSnapshot() {
+  snapshot = true;
+  return true;
+}
+
 bool BackupMain::setUid(kj::StringPtr arg) {
   KJ_IF_MAYBE(u, parseUInt(arg, 10)) {
     if (getuid() != 0) {
@@ -98,7 +173,7 @@ void BackupMain::bind(kj::StringPtr src, kj::StringPtr dst, unsigned long flags)
 bool BackupMain::run(kj::StringPtr grainDir) {
   // Enable no_new_privs so that once we drop privileges we can never regain them through e.g.
   // execing a suid-root binary, as a backup measure. This is a backup measure in case someone
-  // finds an arbitrary code execution exploit in zip/unzip; it's not needed otherwise.
+  // finds an arbitrary code execution exploit in our zip code; it's not needed otherwise.
   KJ_SYSCALL(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0));
 
   // Create files / directories before we potentially change the UID, so that they are created
@@ -109,6 +184,11 @@ bool BackupMain::run(kj::StringPtr grainDir) {
     // Instead of binding into mount tree later, just open the file and we'll compress to stdout.
     KJ_SYSCALL(dup2(raiiOpen(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC), STDOUT_FILENO));
   }
+  if (!restore && chunkDir != nullptr) {
+    KJ_IF_MAYBE(p, previousPath) {
+      previousManifest = raiiOpen(*p, O_RDONLY | O_CLOEXEC);
+    }
+  }
 
   if (sandboxUid == nullptr) {
     uid_t uid = getuid();
@@ -116,17 +196,30 @@ bool BackupMain::run(kj::StringPtr grainDir) {
 
     KJ_SYSCALL(unshare(CLONE_NEWUSER | CLONE_NEWNS |
         // Unshare other stuff; like no_new_privs, this is only to defend against hypothetical
-        // arbitrary code execution bugs in zip/unzip.
+        // arbitrary code execution bugs in our zip code.
         CLONE_NEWNET | CLONE_NEWIPC | CLONE_NEWPID | CLONE_NEWUTS));
     sandbox::hideUserGroupIds(uid, gid, false);
   } else {
     KJ_SYSCALL(seteuid(0));
     KJ_SYSCALL(unshare(CLONE_NEWNS |
         // Unshare other stuff; like no_new_privs, this is only to defend against hypothetical
-        // arbitrary code execution bugs in zip/unzip.
+        // arbitrary code execution bugs in our zip code.
         CLONE_NEWNET | CLONE_NEWIPC | CLONE_NEWPID | CLONE_NEWUTS));
   }
 
+  // Having unshared the PID namespace, we can't start threads -- the kernel refuses CLONE_THREAD
+  // to a process whose children go in a different PID namespace than its own -- but the zip
+  // writer needs them. Our first child is the new namespace's init and has no such restriction,
+  // so do the rest in it, much as we used to run `zip` in a child.
+  Subprocess([&]() -> int {
+    runSandboxed(grainDir);
+    return 0;
+  }).waitForSuccess();
+
+  return true;
+}
+
+void BackupMain::runSandboxed(kj::StringPtr grainDir) {
   // To really unshare the mount namespace, we also have to make sure all mounts are private.
   // The parameters here were derived by strace'ing `mount --make-rprivate /`.  AFAICT the flags
   // are undocumented.  :(
@@ -136,7 +229,9 @@ bool BackupMain::run(kj::StringPtr grainDir) {
   KJ_SYSCALL(mount("tmpfs", "/tmp", "tmpfs", 0, "size=8m,nr_inodes=128,mode=755"));
 
   // Bind in whitelisted directories.
-  const char* WHITELIST[] = { "dev", "bin", "lib", "lib64", "usr" };
+  // (We used to need the zip and unzip binaries and their libraries too, but now that the zip code
+  // runs in-process, /dev is all that's left.)
+  const char* WHITELIST[] = { "dev" };
   for (const char* dir: WHITELIST) {
     auto src = kj::str(root, "/", dir);
     auto dst = kj::str("/tmp/", dir);
@@ -157,21 +252,42 @@ bool BackupMain::run(kj::StringPtr grainDir) {
   bind(kj::str(grainDir, "/sandbox"), "/tmp/tmp/data",
        MS_NODEV | MS_NOSUID | MS_NOEXEC | (restore ? 0 : MS_RDONLY));
 
-  // Bind in the grain's `log`. When restoring, we discard the log.
+  // Bind in the grain's `log`, along with the older segments that LogRing has sealed into
+  // `log.<n>.gz`. When restoring, we discard the log.
   if (!restore) {
-    auto logfile = kj::str(grainDir, "/log");
     // (The logfile might not exist if this grain has not been opened since being restored from
     // some other backup.)
-    if (access(logfile.cStr(), F_OK) == 0) {
-      KJ_SYSCALL(mknod("/tmp/tmp/log", S_IFREG | 0666, 0));
-      bind(logfile, "/tmp/tmp/log", MS_RDONLY | MS_NOEXEC | MS_NOSUID | MS_NODEV);
+    for (auto& name: listDirectory(grainDir)) {
+      if (isGrainLogFile(name)) {
+        auto src = kj::str(grainDir, '/', name);
+        auto dst = kj::str("/tmp/tmp/", name);
+        KJ_SYSCALL(mknod(dst.cStr(), S_IFREG | 0666, 0));
+        KJ_SYSCALL_HANDLE_ERRORS(mount(src.cStr(), dst.cStr(), nullptr, MS_BIND, nullptr)) {
+          case ENOENT:
+            // If the grain is running, LogRing may have sealed or dropped this segment since we
+            // listed the directory. Back up whatever else is there.
+            KJ_SYSCALL(unlink(dst.cStr()), dst);
+            continue;
+          default:
+            KJ_FAIL_SYSCALL("mount(MS_BIND)", error, src, dst);
+        }
+        KJ_SYSCALL(mount(src.cStr(), dst.cStr(), nullptr,
+                         MS_BIND | MS_REMOUNT | MS_RDONLY | MS_NOEXEC | MS_NOSUID | MS_NODEV,
+                         nullptr), src, dst);
+      }
     }
   }
 
   // Bind in the file.
   if (restore) {
-    KJ_SYSCALL(mknod("/tmp/tmp/file.zip", S_IFREG | 0666, 0));
-    KJ_SYSCALL(mount(filename.cStr(), "/tmp/tmp/file.zip", nullptr, MS_BIND, nullptr));
+    KJ_SYSCALL(mknod("/tmp/tmp/file", S_IFREG | 0666, 0));
+    KJ_SYSCALL(mount(filename.cStr(), "/tmp/tmp/file", nullptr, MS_BIND, nullptr));
+  }
+
+  // Bind in the chunk store, at /chunks once we've pivoted. Restores only need to read it.
+  KJ_IF_MAYBE(dir, chunkDir) {
+    KJ_SYSCALL(mkdir("/tmp/chunks", 0755));
+    bind(*dir, "/tmp/chunks", MS_NODEV | MS_NOSUID | MS_NOEXEC | (restore ? MS_RDONLY : 0));
   }
 
   // Use Andy's ridiculous pivot_root trick to place ourselves into the sandbox.
@@ -189,9 +305,9 @@ bool BackupMain::run(kj::StringPtr grainDir) {
   }
 
   // TODO(security): We could seccomp this pretty tightly, but that would only be necessary to
-  //   defend against *both* zip/unzip *and* the Linux kernel having bugs at the same time. It's
-  //   fairly involved to set up, so maybe not worthwhile, unless we could factor the code out of
-  //   supervisor.c++...
+  //   defend against *both* our zip code *and* the Linux kernel having bugs at the same time.
+  //   It's fairly involved to set up, so maybe not worthwhile, unless we could factor the code
+  //   out of supervisor.c++...
 
   if (!restore) {
     // Read stdin to metadata file.
@@ -211,33 +327,32 @@ bool BackupMain::run(kj::StringPtr grainDir) {
     umask(0007);
   }
 
-  // TODO(someday): Find a zip library that doesn't suck and use it instead of shelling out
-  //   to zip/unzip.
   if (restore) {
-    Subprocess({"unzip", "-q", "file.zip", "data/*", "metadata"}).waitForSuccess();
+    {
+      auto file = raiiOpen("file", O_RDONLY | O_CLOEXEC);
+      if (isBackupManifest(file)) {
+        KJ_REQUIRE(chunkDir != nullptr, "restoring an incremental backup requires --chunks");
+        ChunkStore chunks("/chunks");
+        restoreManifest(file, chunks);
+      } else {
+        ZipReader(file).extract(AT_FDCWD, isRestoredPath);
+      }
+    }
 
     // Read metadata file to stdout.
     kj::FdInputStream in(raiiOpen("metadata", O_RDONLY | O_CLOEXEC));
     kj::FdOutputStream out(STDOUT_FILENO);
     pump(in, out);
+  } else if (chunkDir != nullptr) {
+    ChunkStore chunks("/chunks");
+    writeManifest(chunks);
   } else {
-    Subprocess::Options zipOptions({"zip", "-qy@", "-"});
-    auto inPipe = Pipe::make();
-    zipOptions.stdin = inPipe.readEnd;
-    Subprocess zip(kj::mv(zipOptions));
-    inPipe.readEnd = nullptr;
-
-    {
-      kj::FdOutputStream out(kj::mv(inPipe.writeEnd));
-      for (auto& entry: listDirectory(".")) {
-        findFilesToZip(entry, out);
-      }
+    ZipWriter zip(STDOUT_FILENO);
+    for (auto& entry: listDirectory(".")) {
+      addToZip(entry, zip);
     }
-
-    zip.waitForSuccess();
+    zip.finish();
   }
-
-  return true;
 }
 
 void BackupMain::pump(kj::InputStream& in, kj::OutputStream& out) {
@@ -247,39 +362,31 @@ void BackupMain::pump(kj::InputStream& in, kj::OutputStream& out) {
   }
 }
 
-bool BackupMain::findFilesToZip(kj::StringPtr path, kj::OutputStream& out) {
-  // If the path contains a newline, we cannot correctly pass it to `zip` since `zip` expects
-  // one file per line. For security reasons, we must detect and filter out these files.
-  // Hopefully this never happens legitimately?
-  if (path.findFirst('\n') != nullptr) {
-    KJ_LOG(ERROR, "tried to backup file containing newlines", path);
-    return false;
-  }
-
+bool BackupMain::addToZip(kj::StringPtr path, ZipWriter& zip) {
   struct stat stats;
   KJ_SYSCALL(lstat(path.cStr(), &stats));
-  if (S_ISREG(stats.st_mode) || S_ISLNK(stats.st_mode)) {
-    // Regular file or link can be zipped; write to file stream.
-    kj::ArrayPtr<const byte> pieces[2];
-    pieces[0] = path.asBytes();
-    pieces[1] = kj::StringPtr("\n").asBytes();
-    out.write(pieces);
+  if (S_ISREG(stats.st_mode)) {
+    zip.addFile(path, raiiOpen(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC), stats);
+    return true;
+  } else if (S_ISLNK(stats.st_mode)) {
+    char target[PATH_MAX];
+    ssize_t n;
+    KJ_SYSCALL(n = readlink(path.cStr(), target, sizeof(target)), path);
+    KJ_REQUIRE(size_t(n) < sizeof(target), "symlink target too long", path);
+    zip.addSymlink(path, kj::heapString(target, n), stats);
     return true;
   } else if (S_ISDIR(stats.st_mode)) {
     // Subdirectory; enumerate contents.
     bool packedAny = false;
     for (auto& entry: listDirectory(path)) {
-      if (findFilesToZip(kj::str(path, '/', entry), out)) {
+      if (addToZip(kj::str(path, '/', entry), zip)) {
         packedAny = true;
       }
     }
 
     if (!packedAny) {
       // Empty directory. Need to make sure it gets into the zip.
-      kj::ArrayPtr<const byte> pieces[2];
-      pieces[0] = path.asBytes();
-      pieces[1] = kj::StringPtr("\n").asBytes();
-      out.write(pieces);
+      zip.addDirectory(path, stats);
     }
     return true;
   } else {
@@ -287,5 +394,305 @@ bool BackupMain::findFilesToZip(kj::StringPtr path, kj::OutputStream& out) {
   }
 }
 
+void BackupMain::writeManifest(ChunkStore& chunks) {
+  // Files unchanged since the previous backup keep their chunk lists, found by path.
+  kj::Own<capnp::MessageReader> previous;
+  std::map<kj::StringPtr, BackupManifest::File::Reader> previousFiles;
+  KJ_IF_MAYBE(fd, previousManifest) {
+    previous = readManifest(*fd);
+    for (auto file: previous->getRoot<BackupManifest>().getFiles()) {
+      if (file.isRegular()) {
+        previousFiles.insert(std::make_pair(kj::StringPtr(file.getPath()), file));
+      }
+    }
+  }
+
+  // Find everything that addToZip() would have added.
+  struct Entry {
+    kj::String path;
+    struct stat stats;
+  };
+  kj::Vector<Entry> entries;
+  kj::Function<void(kj::String)> find = [&](kj::String path) {
+    struct stat stats;
+    KJ_SYSCALL(lstat(path.cStr(), &stats));
+    if (S_ISDIR(stats.st_mode)) {
+      auto children = listDirectory(path);
+      for (auto& child: children) {
+        find(kj::str(path, '/', child));
+      }
+      if (children.size() == 0) {
+        entries.add(Entry { kj::mv(path), stats });
+      }
+    } else if (S_ISREG(stats.st_mode) || S_ISLNK(stats.st_mode)) {
+      entries.add(Entry { kj::mv(path), stats });
+    }
+  };
+  for (auto& name: listDirectory(".")) {
+    find(kj::heapString(name));
+  }
+
+  capnp::MallocMessageBuilder message;
+  auto files = message.initRoot<BackupManifest>().initFiles(entries.size());
+  for (auto i: kj::indices(entries)) {
+    auto& entry = entries[i];
+    auto file = files[i];
+    file.setPath(entry.path);
+    file.setMode(entry.stats.st_mode & 07777);
+    file.setMtimeNs(toNanoseconds(entry.stats.st_mtim));
+
+    if (S_ISDIR(entry.stats.st_mode)) {
+      file.setDirectory();
+    } else if (S_ISLNK(entry.stats.st_mode)) {
+      char target[PATH_MAX];
+      ssize_t n;
+      KJ_SYSCALL(n = readlink(entry.path.cStr(), target, sizeof(target)), entry.path);
+      KJ_REQUIRE(size_t(n) < sizeof(target), "symlink target too long", entry.path);
+      file.setSymlink(kj::heapString(target, n));
+    } else {
+      auto regular = file.initRegular();
+      regular.setInode(entry.stats.st_ino);
+      regular.setCtimeNs(toNanoseconds(entry.stats.st_ctim));
+      if (snapshot) {
+        KJ_IF_MAYBE(origin, getSnapshotOrigin(entry.path)) {
+          regular.setInode(origin->inode);
+          regular.setCtimeNs(toNanoseconds(origin->ctime));
+        }
+      }
+
+      auto iter = previousFiles.find(entry.path);
+      if (iter != previousFiles.end() &&
+          iter->second.getMtimeNs() == file.getMtimeNs() &&
+          iter->second.getRegular().getSize() == uint64_t(entry.stats.st_size) &&
+          iter->second.getRegular().getInode() == regular.getInode() &&
+          iter->second.getRegular().getCtimeNs() == regular.getCtimeNs()) {
+        regular.setSize(entry.stats.st_size);
+        regular.setChunks(iter->second.getRegular().getChunks());
+        continue;
+      }
+
+      kj::FdInputStream input(raiiOpen(entry.path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+      ContentChunker chunker(input);
+      kj::Vector<kj::Array<kj::byte>> hashes;
+      kj::Vector<uint32_t> sizes;
+      uint64_t size = 0;
+      for (;;) {
+        auto chunk = chunker.next();
+        if (chunk.size() == 0) break;
+        hashes.add(chunks.add(chunk));
+        sizes.add(chunk.size());
+        size += chunk.size();
+      }
+
+      regular.setSize(size);
+      auto list = regular.initChunks(hashes.size());
+      for (auto j: kj::indices(hashes)) {
+        list[j].setHash(hashes[j]);
+        list[j].setSize(sizes[j]);
+      }
+    }
+  }
+
+  // The chunks must be on disk before anything refers to them.
+  chunks.sync();
+  writeManifestFile(STDOUT_FILENO, message);
+}
+
+void BackupMain::restoreManifest(int fd, ChunkStore& chunks) {
+  auto reader = readManifest(fd);
+  TreeExtractor extractor(AT_FDCWD);
+
+  for (auto file: reader->getRoot<BackupManifest>().getFiles()) {
+    kj::StringPtr path = file.getPath();
+    if (!isRestoredPath(path)) continue;
+    auto mtime = fromNanoseconds(file.getMtimeNs());
+
+    switch (file.which()) {
+      case BackupManifest::File::REGULAR:
+        KJ_IF_MAYBE(out, extractor.createFile(path, file.getMode())) {
+          auto regular = file.getRegular();
+          uint64_t size = 0;
+          {
+            kj::FdOutputStream stream(out->get());
+            for (auto chunk: regular.getChunks()) {
+              auto data = chunks.get(chunk.getHash(), chunk.getSize());
+              stream.write(data.begin(), data.size());
+              size += data.size();
+            }
+          }
+          KJ_REQUIRE(size == regular.getSize(), "backup manifest is corrupt", path);
+          struct timespec times[2] = { { 0, UTIME_OMIT }, mtime };
+          KJ_SYSCALL(futimens(*out, times), path);
+        }
+        break;
+
+      case BackupManifest::File::SYMLINK:
+        extractor.createSymlink(path, file.getSymlink());
+        break;
+
+      case BackupManifest::File::DIRECTORY:
+        extractor.createDirectory(path, file.getMode(), mtime);
+        break;
+    }
+  }
+
+  extractor.finish();
+}
+
+// =======================================================================================
+
+bool isGrainLogFile(kj::StringPtr name) {
+  // Skips LogRing's `.gz.tmp` files, which are segments it hasn't finished writing.
+  return name == "log" || (name.startsWith("log.") && name.endsWith(".gz"));
+}
+
+bool snapshotBackupSource(kj::StringPtr grainDir, kj::StringPtr to) {
+  KJ_SYSCALL(mkdir(to.cStr(), 0700), to);
+  if (!snapshotTree(kj::str(grainDir, "/sandbox"), kj::str(to, "/sandbox"))) return false;
+  for (auto& name: listDirectory(grainDir)) {
+    if (isGrainLogFile(name) &&
+        !snapshotTree(kj::str(grainDir, '/', name), kj::str(to, '/', name))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool isBackupManifest(int fd) {
+  kj::byte magic[sizeof(MANIFEST_MAGIC)];
+  ssize_t n;
+  KJ_SYSCALL(n = pread(fd, magic, sizeof(magic), 0));
+  return n == sizeof(magic) && memcmp(magic, MANIFEST_MAGIC, sizeof(magic)) == 0;
+}
+
+namespace {
+
+class ChunkInputStream final: public kj::InputStream {
+  // Reads a file's contents back from the chunk store.
+
+public:
+  ChunkInputStream(ChunkStore& store, capnp::List<BackupManifest::Chunk>::Reader chunks)
+      : store(store), chunks(chunks) {}
+
+  size_t tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    auto out = reinterpret_cast<kj::byte*>(buffer);
+    size_t total = 0;
+    while (total < minBytes) {
+      if (pos == current.size()) {
+        if (index == chunks.size()) break;
+        auto chunk = chunks[index++];
+        current = store.get(chunk.getHash(), chunk.getSize());
+        pos = 0;
+        continue;
+      }
+      size_t n = kj::min(current.size() - pos, maxBytes - total);
+      memcpy(out + total, current.begin() + pos, n);
+      pos += n;
+      total += n;
+    }
+    return total;
+  }
+
+private:
+  ChunkStore& store;
+  capnp::List<BackupManifest::Chunk>::Reader chunks;
+  uint index = 0;
+  kj::Array<kj::byte> current;
+  size_t pos = 0;
+};
+
+}  // namespace
+
+void writeBackupZip(int manifestFd, ChunkStore& chunks, int outFd) {
+  auto reader = readManifest(manifestFd);
+  ZipWriter zip(outFd);
+
+  for (auto file: reader->getRoot<BackupManifest>().getFiles()) {
+    struct stat stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.st_mtime = fromNanoseconds(file.getMtimeNs()).tv_sec;
+    mode_t mode = file.getMode() & 07777;
+
+    switch (file.which()) {
+      case BackupManifest::File::REGULAR: {
+        auto regular = file.getRegular();
+        stats.st_mode = S_IFREG | mode;
+        stats.st_size = regular.getSize();
+        ChunkInputStream input(chunks, regular.getChunks());
+        zip.addFile(file.getPath(), input, stats);
+        break;
+      }
+
+      case BackupManifest::File::SYMLINK:
+        stats.st_mode = S_IFLNK | mode;
+        zip.addSymlink(file.getPath(), file.getSymlink(), stats);
+        break;
+
+      case BackupManifest::File::DIRECTORY:
+        stats.st_mode = S_IFDIR | mode;
+        zip.addDirectory(file.getPath(), stats);
+        break;
+    }
+  }
+
+  zip.finish();
+}
+
+uint64_t collectBackupGarbage(kj::StringPtr backupsDir, ChunkStore& chunks) {
+  // Only the first 64 bits of each live hash are kept, so that even a very large store's live set
+  // fits in memory. A collision merely lets a dead chunk survive.
+  auto prefix = [](kj::ArrayPtr<const kj::byte> hash) {
+    uint64_t result;
+    memcpy(&result, hash.begin(), sizeof(result));
+    return result;
+  };
+
+  // A manifest that doesn't decode can't be restored either, so rather than let it stop
+  // collection for good, we log it and go on. (Whatever chunks we did decode from it stay live.)
+  // Failing to *read* a manifest is different: the backup may be fine, and sweeping now would
+  // delete its chunks, so that aborts the collection.
+  std::vector<uint64_t> live;
+  for (auto& name: listDirectory(backupsDir)) {
+    if (name.endsWith(".uploading")) continue;
+    auto path = kj::str(backupsDir, '/', name);
+    KJ_IF_MAYBE(fd, raiiOpenIfExists(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) {
+      struct stat stats;
+      KJ_SYSCALL(fstat(*fd, &stats));
+      if (!S_ISREG(stats.st_mode) || !isBackupManifest(*fd)) continue;
+
+      // Read the whole message first, so that the only errors left are in decoding it.
+      size_t size = stats.st_size - sizeof(MANIFEST_MAGIC);
+      if (size % sizeof(capnp::word) != 0) {
+        KJ_LOG(ERROR, "skipping corrupt backup manifest in chunk collection", path);
+        continue;
+      }
+      auto words = kj::heapArray<capnp::word>(size / sizeof(capnp::word));
+      KJ_SYSCALL(lseek(*fd, sizeof(MANIFEST_MAGIC), SEEK_SET));
+      kj::FdInputStream(fd->get()).read(words.begin(), size);
+
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        capnp::ReaderOptions options;
+        options.traversalLimitInWords = kj::maxValue;
+        capnp::FlatArrayMessageReader reader(words, options);
+        for (auto file: reader.getRoot<BackupManifest>().getFiles()) {
+          if (!file.isRegular()) continue;
+          for (auto chunk: file.getRegular().getChunks()) {
+            auto hash = chunk.getHash();
+            KJ_REQUIRE(hash.size() == ChunkStore::HASH_SIZE, "backup manifest is corrupt", path);
+            live.push_back(prefix(hash));
+          }
+        }
+      })) {
+        KJ_LOG(ERROR, "skipping corrupt backup manifest in chunk collection", path, *exception);
+      }
+    }
+  }
+  std::sort(live.begin(), live.end());
+
+  return chunks.sweep([&](kj::ArrayPtr<const kj::byte> hash) {
+    return std::binary_search(live.begin(), live.end(), prefix(hash));
+  });
+}
+
 } // namespace sandstorm
 
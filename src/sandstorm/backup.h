@@ -23,6 +23,9 @@
 
 namespace sandstorm {
 
+class ZipWriter;
+class ChunkStore;
+
 class BackupMain final: public AbstractMain {
   // The main class for the "backup" command, which creates or restores a grain backup.
 public:
@@ -34,22 +37,54 @@ public:
   bool setFile(kj::StringPtr arg);
   bool setRoot(kj::StringPtr arg);
   bool setUid(kj::StringPtr arg);
+  bool setChunks(kj::StringPtr arg);
+  bool setPrevious(kj::StringPtr arg);
+  bool setSnapshot();
   bool run(kj::StringPtr grainDir);
 
 private:
   kj::ProcessContext& context;
   bool restore = false;
+  bool snapshot = false;
   kj::StringPtr filename;
   kj::StringPtr root = "";
   kj::Maybe<uid_t> sandboxUid;
+  kj::Maybe<kj::StringPtr> chunkDir;
+  kj::Maybe<kj::StringPtr> previousPath;
+  kj::Maybe<kj::AutoCloseFd> previousManifest;
 
   void writeSetgroupsIfPresent(const char *contents);
   void writeUserNSMap(const char *type, kj::StringPtr contents);
+  void runSandboxed(kj::StringPtr grainDir);
   void bind(kj::StringPtr src, kj::StringPtr dst, unsigned long flags);
   static void pump(kj::InputStream& in, kj::OutputStream& out);
-  bool findFilesToZip(kj::StringPtr path, kj::OutputStream& out);
+  bool addToZip(kj::StringPtr path, ZipWriter& zip);
+  void writeManifest(ChunkStore& chunks);
+  void restoreManifest(int fd, ChunkStore& chunks);
 };
 
+bool isGrainLogFile(kj::StringPtr name);
+// Whether a file of this name in a grain directory is part of the grain's log: `log` itself, or a
+// segment that LogRing has sealed. Backups include these along with `sandbox`.
+
+bool snapshotBackupSource(kj::StringPtr grainDir, kj::StringPtr to);
+// Snapshots everything in `grainDir` that a backup reads into `to`, which must not exist yet,
+// using snapshotTree(). Returns false if the filesystem can't do that.
+
+bool isBackupManifest(int fd);
+// Whether the backup file open on `fd` is an incremental backup (a BackupManifest, see
+// backup.capnp) rather than a zip.
+
+void writeBackupZip(int manifestFd, ChunkStore& chunks, int outFd);
+// Writes a zip of an incremental backup, with the same contents as the zip a full backup would
+// have produced.
+
+uint64_t collectBackupGarbage(kj::StringPtr backupsDir, ChunkStore& chunks);
+// Deletes the chunks that no incremental backup in `backupsDir` refers to, returning how many
+// were deleted. Must not run while a backup is in progress, since its chunks aren't referenced
+// until it finishes. Manifests that don't decode are skipped, but throws, deleting nothing, if a
+// manifest can't be read.
+
 } // namespace sandstorm
 
 #endif // SANDSTORM_BACKUP_H_
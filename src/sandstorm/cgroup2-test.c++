@@ -0,0 +1,159 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cgroup2.h"
+#include "util.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <unistd.h>
+
+namespace sandstorm {
+namespace {
+
+KJ_TEST("Cgroup::Limits::overriddenBy") {
+  Cgroup::Limits defaults;
+  defaults.cpuWeight = 100;
+  defaults.memoryMax = 1 << 30;
+
+  Cgroup::Limits overrides;
+  overrides.memoryMax = 2u << 30;
+  overrides.pidsMax = 64;
+
+  auto result = defaults.overriddenBy(overrides);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(result.cpuWeight) == 100);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(result.memoryMax) == 2u << 30);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(result.pidsMax) == 64);
+  KJ_EXPECT(result.memoryHigh == nullptr);
+  KJ_EXPECT(result.cpuMax == nullptr);
+  KJ_EXPECT(result.ioWeight == nullptr);
+}
+
+struct TestCgroup {
+  // A child of our own cgroup, removed again when the test is done.
+
+  Cgroup parent;
+  kj::String name;
+  Cgroup cgroup;
+
+  TestCgroup(Cgroup&& parentParam, kj::String nameParam)
+      : parent(kj::mv(parentParam)), name(kj::mv(nameParam)),
+        cgroup(parent.getOrMakeChild(name)) {}
+  ~TestCgroup() noexcept(false) {
+    parent.removeChild(name);
+  }
+  KJ_DISALLOW_COPY(TestCgroup);
+};
+
+kj::Maybe<kj::String> ownCgroupPath() {
+  // /proc/self/cgroup has a line of the form "0::<path>" on a cgroup2 system.
+  for (auto& line: splitLines(readAll("/proc/self/cgroup"))) {
+    if (line.startsWith("0::")) {
+      return kj::str("/sys/fs/cgroup", line.slice(3));
+    }
+  }
+  KJ_LOG(WARNING, "cgroup2 not mounted; skipping test");
+  return nullptr;
+}
+
+kj::Maybe<kj::Own<TestCgroup>> makeTestCgroup() {
+  // Returns null, skipping the test, unless there's a writable cgroup2 hierarchy (e.g. when
+  // running in a container with a delegated cgroup2 mount).
+
+  KJ_IF_MAYBE(path, ownCgroupPath()) {
+    kj::Maybe<kj::Own<TestCgroup>> result;
+    KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() {
+      result = kj::heap<TestCgroup>(Cgroup(*path), kj::str("sandstorm-cgroup2-test.", getpid()));
+    })) {
+      KJ_LOG(WARNING, "no writable cgroup2 hierarchy; skipping test", *e);
+    }
+    return kj::mv(result);
+  } else {
+    return nullptr;
+  }
+}
+
+KJ_TEST("Cgroup resource controls") {
+  KJ_IF_MAYBE(test, makeTestCgroup()) {
+    auto cgroup = &(*test)->cgroup;
+
+    // Each setter returns false if the controller isn't enabled for us, in which case the getter
+    // should agree that it's unavailable.
+    if (cgroup->setCpuWeight(250)) {
+      KJ_EXPECT(KJ_ASSERT_NONNULL(cgroup->getCpuWeight()) == 250);
+    } else {
+      KJ_EXPECT(cgroup->getCpuWeight() == nullptr);
+    }
+
+    Cgroup::CpuMax cpuMax;
+    cpuMax.quotaUsec = 50000;
+    cpuMax.periodUsec = 100000;
+    if (cgroup->setCpuMax(cpuMax)) {
+      auto result = KJ_ASSERT_NONNULL(cgroup->getCpuMax());
+      KJ_EXPECT(result.quotaUsec == 50000);
+      KJ_EXPECT(result.periodUsec == 100000);
+
+      cpuMax.quotaUsec = Cgroup::UNLIMITED;
+      KJ_EXPECT(cgroup->setCpuMax(cpuMax));
+      KJ_EXPECT(KJ_ASSERT_NONNULL(cgroup->getCpuMax()).quotaUsec == Cgroup::UNLIMITED);
+    }
+
+    if (cgroup->setMemoryMax(64 << 20)) {
+      KJ_EXPECT(KJ_ASSERT_NONNULL(cgroup->getMemoryMax()) == 64 << 20);
+      KJ_EXPECT(cgroup->setMemoryHigh(32 << 20));
+      KJ_EXPECT(KJ_ASSERT_NONNULL(cgroup->getMemoryHigh()) == 32 << 20);
+      KJ_EXPECT(cgroup->setMemoryHigh(Cgroup::UNLIMITED));
+      KJ_EXPECT(KJ_ASSERT_NONNULL(cgroup->getMemoryHigh()) == Cgroup::UNLIMITED);
+    } else {
+      KJ_EXPECT(cgroup->getMemoryMax() == nullptr);
+    }
+
+    if (cgroup->setIoWeight(500)) {
+      KJ_EXPECT(KJ_ASSERT_NONNULL(cgroup->getIoWeight()) == 500);
+    }
+
+    if (cgroup->setPidsMax(100)) {
+      KJ_EXPECT(KJ_ASSERT_NONNULL(cgroup->getPidsMax()) == 100);
+    }
+
+    Cgroup::Limits limits;
+    limits.pidsMax = 200;
+    if (cgroup->applyLimits(limits)) {
+      KJ_EXPECT(KJ_ASSERT_NONNULL(cgroup->getPidsMax()) == 200);
+    }
+
+    KJ_EXPECT_THROW_MESSAGE("out of range", cgroup->setCpuWeight(0));
+  }
+}
+
+KJ_TEST("Cgroup::getUsage") {
+  KJ_IF_MAYBE(path, ownCgroupPath()) {
+    // Our own cgroup contains at least this process, which has used some CPU by now.
+    auto usage = Cgroup(*path).getUsage();
+    KJ_EXPECT(usage.cpuUsageUsec > 0);
+    KJ_EXPECT(usage.memoryBytes >= usage.anonBytes);
+  }
+
+  KJ_IF_MAYBE(test, makeTestCgroup()) {
+    // A new cgroup has no processes and hasn't used anything.
+    auto usage = (*test)->cgroup.getUsage();
+    KJ_EXPECT(usage.cpuUsageUsec == 0);
+    KJ_EXPECT(usage.pids == 0);
+    KJ_EXPECT(usage.ioReadBytes == 0);
+  }
+}
+
+}  // namespace
+}  // namespace sandstorm
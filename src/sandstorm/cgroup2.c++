@@ -2,6 +2,10 @@
 #include <sandstorm/util.h>
 
 #include <kj/debug.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace sandstorm {
 Cgroup::Cgroup(kj::StringPtr path)
@@ -47,6 +51,303 @@ kj::Maybe<Cgroup::FreezeHandle> Cgroup::freeze() {
   }
 }
 
+bool Cgroup::reclaimMemory(uint64_t bytes) {
+  KJ_IF_MAYBE(reclaimFd, raiiOpenAtIfExists(dirfd.get(), "memory.reclaim", O_WRONLY)) {
+    auto amount = kj::str(bytes, "\n");
+    KJ_SYSCALL_HANDLE_ERRORS(write(reclaimFd->get(), amount.cStr(), amount.size())) {
+      case EAGAIN:
+        // Less than the requested amount could be reclaimed. That's fine.
+        break;
+      default:
+        KJ_FAIL_SYSCALL("write(memory.reclaim)", error);
+    }
+    return true;
+  } else {
+    return false;
+  }
+}
+
+kj::Maybe<uint64_t> Cgroup::getMemoryCurrent() {
+  KJ_IF_MAYBE(fd, raiiOpenAtIfExists(dirfd.get(), "memory.current", O_RDONLY|O_CLOEXEC)) {
+    return parseUInt64(trim(readAll(fd->get())), 10);
+  } else {
+    return nullptr;
+  }
+}
+
+kj::Maybe<double> Cgroup::getPressureAvg10(kj::StringPtr resource) {
+  // The file looks like:
+  //   some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+  //   full avg10=0.00 avg60=0.00 avg300=0.00 total=0
+  auto name = kj::str(resource, ".pressure");
+  KJ_IF_MAYBE(fd, raiiOpenAtIfExists(dirfd.get(), name, O_RDONLY|O_CLOEXEC)) {
+    auto content = readAll(fd->get());
+    for (auto& line: splitLines(content)) {
+      auto words = splitSpace(line.asArray());
+      if (words.size() < 2 || kj::str(words[0]) != "some") continue;
+      auto field = kj::str(words[1]);
+      if (!field.startsWith("avg10=")) break;
+      char* end;
+      double value = strtod(field.cStr() + strlen("avg10="), &end);
+      if (*end != '\0') break;
+      return value;
+    }
+    KJ_LOG(WARNING, "couldn't parse pressure file", name, content);
+  }
+  return nullptr;
+}
+
+kj::Maybe<kj::AutoCloseFd> Cgroup::monitorPressure(kj::StringPtr resource,
+                                                   kj::Duration stall, kj::Duration window) {
+  auto name = kj::str(resource, ".pressure");
+  KJ_IF_MAYBE(fd, raiiOpenAtIfExists(dirfd.get(), name, O_RDWR|O_NONBLOCK|O_CLOEXEC)) {
+    auto trigger = kj::str("some ", stall / kj::MICROSECONDS, " ", window / kj::MICROSECONDS);
+    // The trailing NUL is part of the expected format.
+    KJ_SYSCALL_HANDLE_ERRORS(write(fd->get(), trigger.cStr(), trigger.size() + 1)) {
+      case EPERM:
+      case EACCES:
+      case EOPNOTSUPP:
+        return nullptr;
+      default:
+        KJ_FAIL_SYSCALL("write(pressure trigger)", error, name, trigger);
+    }
+    return kj::mv(*fd);
+  } else {
+    return nullptr;
+  }
+}
+
+bool Cgroup::writeFile(kj::StringPtr name, kj::StringPtr content) {
+  KJ_IF_MAYBE(fd, raiiOpenAtIfExists(dirfd.get(), name, O_WRONLY|O_CLOEXEC)) {
+    KJ_SYSCALL(write(fd->get(), content.cStr(), content.size()), name, content);
+    return true;
+  } else {
+    return false;
+  }
+}
+
+kj::Maybe<kj::String> Cgroup::readFile(kj::StringPtr name) {
+  KJ_IF_MAYBE(fd, raiiOpenAtIfExists(dirfd.get(), name, O_RDONLY|O_CLOEXEC)) {
+    return trim(readAll(fd->get()));
+  } else {
+    return nullptr;
+  }
+}
+
+static kj::String limitToString(uint64_t value) {
+  return value == Cgroup::UNLIMITED ? kj::str("max") : kj::str(value);
+}
+
+static uint64_t parseLimit(kj::StringPtr text) {
+  if (text == "max") {
+    return Cgroup::UNLIMITED;
+  } else {
+    return KJ_REQUIRE_NONNULL(parseUInt64(text, 10), "bad cgroup limit", text);
+  }
+}
+
+bool Cgroup::enableControllers(kj::ArrayPtr<const kj::StringPtr> controllers) {
+  bool result = true;
+  auto fd = raiiOpenAt(dirfd.get(), "cgroup.subtree_control", O_WRONLY|O_CLOEXEC);
+  for (auto controller: controllers) {
+    // One at a time, so that one unavailable controller doesn't stop the others.
+    auto command = kj::str("+", controller);
+    KJ_SYSCALL_HANDLE_ERRORS(write(fd.get(), command.cStr(), command.size())) {
+      case ENOENT:  // not available in our parent
+      case EINVAL:  // not compiled into this kernel
+      case EBUSY:   // we contain processes
+      case EPERM:
+      case EACCES:
+        result = false;
+        break;
+      default:
+        KJ_FAIL_SYSCALL("write(cgroup.subtree_control)", error, controller);
+    }
+  }
+  return result;
+}
+
+void Cgroup::movePidsTo(Cgroup& other) {
+  auto procsfd = raiiOpenAt(other.dirfd.get(), "cgroup.procs", O_WRONLY|O_CLOEXEC);
+
+  // Processes may be forked while we're doing this, so go until there are none left.
+  for (;;) {
+    auto pids = splitLines(KJ_ASSERT_NONNULL(readFile("cgroup.procs")));
+    if (pids.size() == 0) break;
+    for (auto& pid: pids) {
+      KJ_SYSCALL_HANDLE_ERRORS(write(procsfd.get(), pid.cStr(), pid.size())) {
+        case ESRCH:
+          // Exited in the meantime.
+          break;
+        default:
+          KJ_FAIL_SYSCALL("write(cgroup.procs)", error, pid);
+      }
+    }
+  }
+}
+
+bool Cgroup::setCpuWeight(uint weight) {
+  KJ_REQUIRE(weight >= 1 && weight <= 10000, "cpu.weight out of range", weight);
+  return writeFile("cpu.weight", kj::str(weight));
+}
+
+bool Cgroup::setCpuMax(CpuMax max) {
+  return writeFile("cpu.max", kj::str(limitToString(max.quotaUsec), " ", max.periodUsec));
+}
+
+bool Cgroup::setMemoryHigh(uint64_t bytes) {
+  return writeFile("memory.high", limitToString(bytes));
+}
+
+bool Cgroup::setMemoryMax(uint64_t bytes) {
+  return writeFile("memory.max", limitToString(bytes));
+}
+
+bool Cgroup::setIoWeight(uint weight) {
+  KJ_REQUIRE(weight >= 1 && weight <= 10000, "io.weight out of range", weight);
+  return writeFile("io.weight", kj::str("default ", weight));
+}
+
+bool Cgroup::setPidsMax(uint64_t max) {
+  return writeFile("pids.max", limitToString(max));
+}
+
+kj::Maybe<uint> Cgroup::getCpuWeight() {
+  return readFile("cpu.weight").map([](kj::String&& text) {
+    return KJ_REQUIRE_NONNULL(parseUInt(text, 10), "bad cpu.weight", text);
+  });
+}
+
+kj::Maybe<Cgroup::CpuMax> Cgroup::getCpuMax() {
+  // Format: "<quota|max> <period>"
+  return readFile("cpu.max").map([](kj::String&& text) {
+    auto words = splitSpace(text.asArray());
+    KJ_REQUIRE(words.size() == 2, "bad cpu.max", text);
+    CpuMax result;
+    result.quotaUsec = parseLimit(kj::str(words[0]));
+    result.periodUsec = parseLimit(kj::str(words[1]));
+    return result;
+  });
+}
+
+kj::Maybe<uint64_t> Cgroup::getMemoryHigh() {
+  return readFile("memory.high").map([](kj::String&& text) { return parseLimit(text); });
+}
+
+kj::Maybe<uint64_t> Cgroup::getMemoryMax() {
+  return readFile("memory.max").map([](kj::String&& text) { return parseLimit(text); });
+}
+
+kj::Maybe<uint> Cgroup::getIoWeight() {
+  // Format: "default <weight>", followed by "<major>:<minor> <weight>" lines for any devices
+  // with their own weight.
+  return readFile("io.weight").map([](kj::String&& text) -> uint {
+    for (auto& line: splitLines(text)) {
+      auto words = splitSpace(line.asArray());
+      if (words.size() == 2 && kj::str(words[0]) == "default") {
+        return KJ_REQUIRE_NONNULL(parseUInt(kj::str(words[1]), 10), "bad io.weight", text);
+      }
+    }
+    KJ_FAIL_REQUIRE("io.weight has no default", text) { return 100; }
+  });
+}
+
+kj::Maybe<uint64_t> Cgroup::getPidsMax() {
+  return readFile("pids.max").map([](kj::String&& text) { return parseLimit(text); });
+}
+
+bool Cgroup::applyLimits(const Limits& limits) {
+  bool result = true;
+  KJ_IF_MAYBE(w, limits.cpuWeight) { result = setCpuWeight(*w) && result; }
+  KJ_IF_MAYBE(m, limits.cpuMax) { result = setCpuMax(*m) && result; }
+  // Set memory.max before memory.high so that lowering both at once never has high > max.
+  KJ_IF_MAYBE(m, limits.memoryMax) { result = setMemoryMax(*m) && result; }
+  KJ_IF_MAYBE(h, limits.memoryHigh) { result = setMemoryHigh(*h) && result; }
+  KJ_IF_MAYBE(w, limits.ioWeight) { result = setIoWeight(*w) && result; }
+  KJ_IF_MAYBE(p, limits.pidsMax) { result = setPidsMax(*p) && result; }
+  return result;
+}
+
+static void parseFlatKeyed(kj::StringPtr text,
+                           kj::ArrayPtr<const kj::StringPtr> keys,
+                           kj::ArrayPtr<uint64_t* const> values) {
+  // Parse a "flat keyed" cgroup file (cpu.stat, memory.stat), which has one "<key> <value>" per
+  // line, storing the values of the given keys. Unknown keys are ignored.
+  for (auto& line: splitLines(text)) {
+    auto words = splitSpace(line.asArray());
+    if (words.size() != 2) continue;
+    auto key = kj::str(words[0]);
+    for (auto i: kj::indices(keys)) {
+      if (key == keys[i]) {
+        KJ_IF_MAYBE(value, parseUInt64(kj::str(words[1]), 10)) {
+          *values[i] = *value;
+        }
+      }
+    }
+  }
+}
+
+Cgroup::Usage Cgroup::getUsage() {
+  Usage result;
+
+  KJ_IF_MAYBE(text, readFile("cpu.stat")) {
+    // cpu.stat exists even when the cpu controller is not enabled.
+    const kj::StringPtr keys[] = { "usage_usec" };
+    uint64_t* const values[] = { &result.cpuUsageUsec };
+    parseFlatKeyed(*text, keys, values);
+  }
+
+  KJ_IF_MAYBE(text, readFile("memory.current")) {
+    result.memoryBytes = KJ_REQUIRE_NONNULL(parseUInt64(*text, 10), "bad memory.current", *text);
+  }
+  KJ_IF_MAYBE(text, readFile("memory.stat")) {
+    const kj::StringPtr keys[] = { "anon", "file" };
+    uint64_t* const values[] = { &result.anonBytes, &result.fileBytes };
+    parseFlatKeyed(*text, keys, values);
+  }
+
+  KJ_IF_MAYBE(text, readFile("io.stat")) {
+    // Format: "<major>:<minor> rbytes=N wbytes=N rios=N wios=N dbytes=N dios=N" per device.
+    for (auto& line: splitLines(*text)) {
+      auto words = splitSpace(line.asArray());
+      for (size_t i = 1; i < words.size(); i++) {
+        auto field = kj::str(words[i]);
+        uint64_t* target;
+        size_t prefixLen;
+        if (field.startsWith("rbytes=")) {
+          target = &result.ioReadBytes;
+          prefixLen = strlen("rbytes=");
+        } else if (field.startsWith("wbytes=")) {
+          target = &result.ioWriteBytes;
+          prefixLen = strlen("wbytes=");
+        } else {
+          continue;
+        }
+        KJ_IF_MAYBE(value, parseUInt64(field.slice(prefixLen), 10)) {
+          *target += *value;
+        }
+      }
+    }
+  }
+
+  KJ_IF_MAYBE(text, readFile("pids.current")) {
+    result.pids = KJ_REQUIRE_NONNULL(parseUInt64(*text, 10), "bad pids.current", *text);
+  }
+
+  return result;
+}
+
+Cgroup::Limits Cgroup::Limits::overriddenBy(const Limits& other) const {
+  Limits result = *this;
+  if (other.cpuWeight != nullptr) result.cpuWeight = other.cpuWeight;
+  if (other.cpuMax != nullptr) result.cpuMax = other.cpuMax;
+  if (other.memoryHigh != nullptr) result.memoryHigh = other.memoryHigh;
+  if (other.memoryMax != nullptr) result.memoryMax = other.memoryMax;
+  if (other.ioWeight != nullptr) result.ioWeight = other.ioWeight;
+  if (other.pidsMax != nullptr) result.pidsMax = other.pidsMax;
+  return result;
+}
+
 Cgroup::FreezeHandle::FreezeHandle(kj::AutoCloseFd&& fd) : fd(kj::mv(fd)) {}
 
 Cgroup::FreezeHandle::~FreezeHandle() noexcept(false) {
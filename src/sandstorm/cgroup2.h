@@ -3,6 +3,7 @@
 
 #include <sys/types.h>  // For pid_t
 #include <kj/io.h>
+#include <kj/time.h>
 
 namespace sandstorm {
 class Cgroup {
@@ -26,6 +27,46 @@ class Cgroup {
         FreezeHandle(kj::AutoCloseFd&& fd);
     };
 
+    static constexpr uint64_t UNLIMITED = ~uint64_t(0);
+    // Written as "max" in limit files.
+
+    struct CpuMax {
+      uint64_t quotaUsec = UNLIMITED;
+      uint64_t periodUsec = 100000;
+      // The cgroup may use `quotaUsec` of CPU time per `periodUsec`, summed
+      // over all CPUs.
+    };
+
+    struct Limits {
+      // Resource controls for a cgroup. Null fields are left at whatever
+      // the kernel (or a previous call) set.
+
+      kj::Maybe<uint> cpuWeight;       // cpu.weight, 1-10000, default 100
+      kj::Maybe<CpuMax> cpuMax;        // cpu.max
+      kj::Maybe<uint64_t> memoryHigh;  // memory.high, bytes; throttle and reclaim above this
+      kj::Maybe<uint64_t> memoryMax;   // memory.max, bytes; OOM-kill above this
+      kj::Maybe<uint> ioWeight;        // io.weight, 1-10000, default 100
+      kj::Maybe<uint64_t> pidsMax;     // pids.max
+
+      Limits overriddenBy(const Limits& other) const;
+      // Returns a copy of these limits with every field that is set in
+      // `other` replaced.
+    };
+
+    struct Usage {
+      // A snapshot of the cgroup's resource usage, read from the controllers'
+      // statistics files. Figures from controllers that aren't enabled are
+      // zero.
+
+      uint64_t cpuUsageUsec = 0;   // cpu.stat usage_usec, cumulative
+      uint64_t memoryBytes = 0;    // memory.current
+      uint64_t anonBytes = 0;      // memory.stat anon
+      uint64_t fileBytes = 0;      // memory.stat file (page cache)
+      uint64_t ioReadBytes = 0;    // io.stat rbytes, cumulative, summed over devices
+      uint64_t ioWriteBytes = 0;   // io.stat wbytes, likewise
+      uint64_t pids = 0;           // pids.current
+    };
+
     Cgroup() = delete;
     KJ_DISALLOW_COPY(Cgroup);
     Cgroup(Cgroup&&) noexcept = default;
@@ -55,8 +96,75 @@ class Cgroup {
     // This may return nullptr if the 'cgroup.freeze' file does not exist,
     // which can happen if the feature is not compiled into the running
     // kernel.
+
+    bool reclaimMemory(uint64_t bytes);
+    // Ask the kernel to reclaim up to `bytes` of memory charged to the cgroup, by
+    // dropping page cache or swapping. Returns false if 'memory.reclaim' does not
+    // exist (kernels older than 5.19, or the memory controller is not enabled).
+
+    kj::Maybe<uint64_t> getMemoryCurrent();
+    // Read 'memory.current', the total memory charged to the cgroup and its
+    // descendants. Null if the memory controller is not enabled.
+
+    kj::Maybe<double> getPressureAvg10(kj::StringPtr resource);
+    // Read the "some avg10" figure from '<resource>.pressure' (resource is
+    // "memory", "cpu" or "io"): the percentage of the last 10 seconds in which
+    // at least one task was stalled on the resource. Null if PSI is unavailable.
+
+    kj::Maybe<kj::AutoCloseFd> monitorPressure(kj::StringPtr resource,
+                                               kj::Duration stall, kj::Duration window);
+    // Register a PSI trigger on '<resource>.pressure' that fires when tasks
+    // are stalled on the resource for at least `stall` within any `window`.
+    // The returned fd becomes readable as urgent data (POLLPRI) each time the
+    // trigger fires. Null if PSI is unavailable or we're not permitted to
+    // create the trigger (unprivileged triggers need a window that is a
+    // multiple of 2s, and kernels before 6.5 don't allow them at all).
+
+    bool enableControllers(kj::ArrayPtr<const kj::StringPtr> controllers);
+    // Enable the given controllers (e.g. "cpu", "memory") for this cgroup's
+    // children by writing to 'cgroup.subtree_control'. Returns false if any
+    // could not be enabled because the controller isn't available to us or
+    // because this cgroup contains processes (see "no internal processes" in
+    // the cgroup v2 documentation).
+
+    void movePidsTo(Cgroup& other);
+    // Move every process in this cgroup (not its children) to `other`.
+
+    bool setCpuWeight(uint weight);
+    bool setCpuMax(CpuMax max);
+    bool setMemoryHigh(uint64_t bytes);
+    bool setMemoryMax(uint64_t bytes);
+    bool setIoWeight(uint weight);
+    bool setPidsMax(uint64_t max);
+    // Each returns false if the relevant interface file doesn't exist,
+    // meaning the controller is not enabled for this cgroup.
+
+    kj::Maybe<uint> getCpuWeight();
+    kj::Maybe<CpuMax> getCpuMax();
+    kj::Maybe<uint64_t> getMemoryHigh();
+    kj::Maybe<uint64_t> getMemoryMax();
+    kj::Maybe<uint> getIoWeight();
+    kj::Maybe<uint64_t> getPidsMax();
+    // Each returns null if the controller is not enabled. Limits set to
+    // "max" are returned as UNLIMITED. getIoWeight() returns the default
+    // weight, ignoring per-device overrides.
+
+    bool applyLimits(const Limits& limits);
+    // Set each non-null field of `limits`. Returns false if any of them
+    // could not be set because the controller isn't enabled.
+
+    Usage getUsage();
+    // Read cpu.stat, memory.current, memory.stat, io.stat and pids.current
+    // through this cgroup's directory fd. Cheap enough to call for every
+    // grain in one pass: five small reads, no path lookups beyond the
+    // cgroup directory.
   private:
     Cgroup(kj::AutoCloseFd&& dirfd);
+
+    bool writeFile(kj::StringPtr name, kj::StringPtr content);
+    kj::Maybe<kj::String> readFile(kj::StringPtr name);
+    // Helpers for interface files, which may be missing if a controller is
+    // not enabled.
     kj::AutoCloseFd dirfd;
 };
 };
@@ -0,0 +1,137 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "chunk-store.h"
+#include "test-util.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <kj/encoding.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <set>
+#include <string>
+
+namespace sandstorm {
+namespace {
+
+kj::Array<kj::byte> makeContent(size_t size, uint32_t seed) {
+  auto result = kj::heapArray<kj::byte>(size);
+  uint32_t state = seed;
+  for (auto& b: result) {
+    state = state * 1103515245 + 12345;
+    b = state >> 16;
+  }
+  return result;
+}
+
+kj::Vector<kj::Array<kj::byte>> chunk(kj::ArrayPtr<const kj::byte> data) {
+  kj::ArrayInputStream input(data);
+  ContentChunker chunker(input);
+  kj::Vector<kj::Array<kj::byte>> result;
+  for (;;) {
+    auto piece = chunker.next();
+    if (piece.size() == 0) break;
+    result.add(kj::heapArray(piece));
+  }
+  return result;
+}
+
+KJ_TEST("ContentChunker boundaries follow content") {
+  auto data = makeContent(4 << 20, 1);
+  auto chunks = chunk(data);
+
+  size_t total = 0;
+  for (auto i: kj::indices(chunks)) {
+    auto& piece = chunks[i];
+    KJ_EXPECT(piece.asPtr() == data.slice(total, total + piece.size()));
+    KJ_EXPECT(piece.size() <= ContentChunker::MAX_SIZE);
+    if (i + 1 < chunks.size()) KJ_EXPECT(piece.size() >= ContentChunker::MIN_SIZE);
+    total += piece.size();
+  }
+  KJ_EXPECT(total == data.size());
+  KJ_EXPECT(chunks.size() > 30 && chunks.size() < 130, chunks.size());
+
+  // Insert a few bytes near the start. Only the chunk containing the edit should change.
+  auto edited = kj::heapArray<kj::byte>(data.size() + 3);
+  memcpy(edited.begin(), data.begin(), 1000);
+  memcpy(edited.begin() + 1000, "xyz", 3);
+  memcpy(edited.begin() + 1003, data.begin() + 1000, data.size() - 1000);
+
+  auto key = [](kj::ArrayPtr<const kj::byte> piece) {
+    return std::string(reinterpret_cast<const char*>(piece.begin()), piece.size());
+  };
+  std::set<std::string> before;
+  for (auto& piece: chunks) before.insert(key(piece));
+  size_t changed = 0;
+  for (auto& piece: chunk(edited)) {
+    if (before.count(key(piece)) == 0) ++changed;
+  }
+  KJ_EXPECT(changed <= 2, changed);
+}
+
+struct TempStore {
+  TempDir dir;
+  kj::String storePath = dir / "chunks";
+
+  TempStore() {
+    ChunkStore::create(storePath);
+  }
+};
+
+KJ_TEST("ChunkStore stores each chunk once and verifies it") {
+  TempStore temp;
+  ChunkStore store(temp.storePath);
+
+  auto compressible = kj::heapArray<kj::byte>(50000);
+  memset(compressible.begin(), 'a', compressible.size());
+  auto random = makeContent(50000, 2);
+
+  auto hash1 = store.add(compressible);
+  auto hash2 = store.add(random);
+  KJ_EXPECT(store.add(compressible).asPtr() == hash1.asPtr());
+  KJ_EXPECT(hash1.asPtr() != hash2.asPtr());
+
+  KJ_EXPECT(store.get(hash1, compressible.size()).asPtr() == compressible.asPtr());
+  KJ_EXPECT(store.get(hash2, random.size()).asPtr() == random.asPtr());
+  KJ_EXPECT_THROW_MESSAGE("corrupt", store.get(hash2, random.size() - 1));
+  store.sync();
+
+  // Damage the stored copy of a chunk.
+  auto chunkPath = kj::str(temp.storePath, '/', kj::encodeHex(hash2.slice(0, 1)), '/',
+                           kj::encodeHex(hash2.slice(1, hash2.size())));
+  {
+    auto fd = raiiOpen(chunkPath, O_RDWR | O_CLOEXEC);
+    kj::byte b;
+    KJ_SYSCALL(pread(fd, &b, 1, 100));
+    b ^= 1;
+    KJ_SYSCALL(pwrite(fd, &b, 1, 100));
+  }
+  KJ_EXPECT_THROW_MESSAGE("corrupt", store.get(hash2, random.size()));
+
+  // Sweeping keeps only what's live, and cleans up strays.
+  auto stray = kj::str(temp.storePath, "/00/tmp.123.0");
+  raiiOpen(stray, O_WRONLY | O_CREAT | O_CLOEXEC);
+  KJ_EXPECT(store.sweep([&](kj::ArrayPtr<const kj::byte> hash) {
+    return hash == hash1.asPtr();
+  }) == 2);
+  KJ_EXPECT(store.get(hash1, compressible.size()).asPtr() == compressible.asPtr());
+  KJ_EXPECT_THROW_MESSAGE("missing", store.get(hash2, random.size()));
+  KJ_EXPECT(access(stray.cStr(), F_OK) < 0);
+}
+
+}  // namespace
+}  // namespace sandstorm
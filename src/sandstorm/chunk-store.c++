@@ -0,0 +1,243 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "chunk-store.h"
+#include "util.h"
+#include <kj/debug.h>
+#include <kj/encoding.h>
+#include <sodium/crypto_generichash_blake2b.h>
+#include <zlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace sandstorm {
+
+namespace {
+
+struct GearTable {
+  // 256 random 64-bit values, one per byte value. Generated with splitmix64 from a fixed seed,
+  // since they determine where chunk boundaries fall and so must never change.
+
+  uint64_t values[256] = {};
+
+  constexpr GearTable() {
+    uint64_t state = 0x53414e4453544f52ull;  // "SANDSTOR"
+    for (auto& value: values) {
+      uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      value = z ^ (z >> 31);
+    }
+  }
+};
+
+constexpr GearTable GEAR;
+// Computed at compile time, so there's no global constructor.
+
+// A boundary is where the masked bits of the hash are all zero. Before AVERAGE_SIZE we test more
+// bits, making a boundary less likely, and after it fewer. (We use the high bits because in the
+// gear hash, bit i depends on only the last i + 1 bytes.)
+constexpr uint64_t MASK_BEFORE_AVERAGE = ~uint64_t(0) << (64 - 18);
+constexpr uint64_t MASK_AFTER_AVERAGE = ~uint64_t(0) << (64 - 14);
+
+size_t findBoundary(const kj::byte* data, size_t size) {
+  if (size <= ContentChunker::MIN_SIZE) return size;
+
+  size_t normal = kj::min(size, ContentChunker::AVERAGE_SIZE);
+  size_t limit = kj::min(size, ContentChunker::MAX_SIZE);
+  uint64_t hash = 0;
+  size_t i = ContentChunker::MIN_SIZE;
+  for (; i < normal; i++) {
+    hash = (hash << 1) + GEAR.values[data[i]];
+    if ((hash & MASK_BEFORE_AVERAGE) == 0) return i + 1;
+  }
+  for (; i < limit; i++) {
+    hash = (hash << 1) + GEAR.values[data[i]];
+    if ((hash & MASK_AFTER_AVERAGE) == 0) return i + 1;
+  }
+  return limit;
+}
+
+// The first byte of each chunk file says how the rest is encoded.
+constexpr kj::byte FORMAT_STORED = 0;
+constexpr kj::byte FORMAT_ZLIB = 1;
+
+void hashChunk(kj::ArrayPtr<const kj::byte> data, kj::ArrayPtr<kj::byte> hash) {
+  crypto_generichash_blake2b(hash.begin(), hash.size(), data.begin(), data.size(), nullptr, 0);
+}
+
+}  // namespace
+
+// =======================================================================================
+// ContentChunker
+
+ContentChunker::ContentChunker(kj::InputStream& input)
+    : input(input), buffer(kj::heapArray<kj::byte>(MAX_SIZE * 2)) {}
+
+kj::ArrayPtr<const kj::byte> ContentChunker::next() {
+  // Keep at least MAX_SIZE bytes buffered where possible, so that boundaries don't depend on how
+  // the input happened to be split into reads.
+  if (end - start < MAX_SIZE && !eof) {
+    memmove(buffer.begin(), buffer.begin() + start, end - start);
+    end -= start;
+    start = 0;
+
+    size_t wanted = buffer.size() - end;
+    size_t n = input.tryRead(buffer.begin() + end, wanted, wanted);
+    end += n;
+    eof = n < wanted;
+  }
+
+  const kj::byte* data = buffer.begin() + start;
+  size_t size = findBoundary(data, end - start);
+  start += size;
+  return kj::arrayPtr(data, size);
+}
+
+// =======================================================================================
+// ChunkStore
+
+ChunkStore::ChunkStore(kj::StringPtr path)
+    : dirfd(raiiOpen(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) {}
+
+void ChunkStore::create(kj::StringPtr path) {
+  auto makeDirectory = [](kj::StringPtr dir) {
+    if (mkdir(dir.cStr(), 0777) < 0) {
+      int error = errno;
+      if (error == EEXIST) return;
+      KJ_FAIL_SYSCALL("mkdir()", error, dir);
+    }
+    // mkdir() applied our umask.
+    KJ_SYSCALL(chmod(dir.cStr(), 0777), dir);
+  };
+
+  recursivelyCreateParent(path);
+  makeDirectory(path);
+  for (uint i = 0; i < 256; i++) {
+    kj::byte prefix = i;
+    makeDirectory(kj::str(path, '/', kj::encodeHex(kj::arrayPtr(&prefix, 1))));
+  }
+}
+
+kj::String ChunkStore::pathFor(kj::ArrayPtr<const kj::byte> hash) {
+  KJ_REQUIRE(hash.size() == HASH_SIZE, "bad chunk hash", hash.size());
+  auto hex = kj::encodeHex(hash);
+  return kj::str(hex.slice(0, 2), '/', hex.slice(2));
+}
+
+kj::Array<kj::byte> ChunkStore::add(kj::ArrayPtr<const kj::byte> data) {
+  auto hash = kj::heapArray<kj::byte>(HASH_SIZE);
+  hashChunk(data, hash);
+
+  auto path = pathFor(hash);
+  if (faccessat(dirfd, path.cStr(), F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+    return hash;
+  }
+
+  uLongf compressedSize = compressBound(data.size());
+  auto content = kj::heapArray<kj::byte>(1 + kj::max(size_t(compressedSize), data.size()));
+  if (compress2(content.begin() + 1, &compressedSize, data.begin(), data.size(), 6) == Z_OK &&
+      compressedSize < data.size()) {
+    content[0] = FORMAT_ZLIB;
+  } else {
+    content[0] = FORMAT_STORED;
+    memcpy(content.begin() + 1, data.begin(), data.size());
+    compressedSize = data.size();
+  }
+
+  // Write under a temporary name and then rename, so that a chunk which exists is complete. If
+  // two backups add the same chunk at once, one harmlessly replaces the other.
+  auto tempPath = kj::str(path.slice(0, 2), "/tmp.", getpid(), '.', tempCounter++);
+  {
+    auto fd = raiiOpenAt(dirfd, tempPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    // Whatever our umask, the back-end needs to read this to export the backup as a zip.
+    KJ_SYSCALL(fchmod(fd, 0644));
+    kj::FdOutputStream(fd.get()).write(content.begin(), 1 + compressedSize);
+  }
+  KJ_SYSCALL(renameat(dirfd, tempPath.cStr(), dirfd, path.cStr()), path);
+
+  return hash;
+}
+
+kj::Array<kj::byte> ChunkStore::get(kj::ArrayPtr<const kj::byte> hash, size_t size) {
+  auto path = pathFor(hash);
+
+  kj::Array<kj::byte> content;
+  KJ_IF_MAYBE(fd, raiiOpenAtIfExists(dirfd, path, O_RDONLY | O_CLOEXEC)) {
+    content = readAllBytes(*fd);
+  } else {
+    KJ_FAIL_REQUIRE("backup chunk is missing", path);
+  }
+  KJ_REQUIRE(content.size() > 0, "backup chunk is corrupt", path);
+
+  kj::Array<kj::byte> data;
+  auto encoded = content.slice(1, content.size());
+  if (content[0] == FORMAT_STORED) {
+    data = kj::heapArray<kj::byte>(encoded);
+  } else {
+    KJ_REQUIRE(content[0] == FORMAT_ZLIB, "backup chunk is corrupt", path);
+    data = kj::heapArray<kj::byte>(size);
+    uLongf decompressedSize = size;
+    int result = uncompress(data.begin(), &decompressedSize, encoded.begin(), encoded.size());
+    KJ_REQUIRE(result == Z_OK && decompressedSize == size, "backup chunk is corrupt", path);
+  }
+
+  kj::byte actual[HASH_SIZE];
+  hashChunk(data, kj::arrayPtr(actual, HASH_SIZE));
+  KJ_REQUIRE(data.size() == size && memcmp(actual, hash.begin(), HASH_SIZE) == 0,
+             "backup chunk is corrupt", path);
+
+  return data;
+}
+
+void ChunkStore::sync() {
+  KJ_SYSCALL(syncfs(dirfd));
+}
+
+uint64_t ChunkStore::sweep(kj::Function<bool(kj::ArrayPtr<const kj::byte> hash)> isLive) {
+  uint64_t count = 0;
+  for (uint i = 0; i < 256; i++) {
+    kj::byte prefix = i;
+    auto subdir = kj::encodeHex(kj::arrayPtr(&prefix, 1));
+    kj::AutoCloseFd subdirFd;
+    KJ_IF_MAYBE(fd, raiiOpenAtIfExists(dirfd, subdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) {
+      subdirFd = kj::mv(*fd);
+    } else {
+      continue;
+    }
+
+    for (auto& name: listDirectoryFd(subdirFd)) {
+      auto hash = kj::decodeHex(kj::str(subdir, name));
+      if (!hash.hadErrors && hash.size() == HASH_SIZE && isLive(hash)) continue;
+
+      while (unlinkat(subdirFd, name.cStr(), 0) < 0) {
+        int error = errno;
+        if (error == ENOENT) {
+          break;
+        } else if (error != EINTR) {
+          KJ_FAIL_SYSCALL("unlinkat()", error, subdir, name);
+        }
+      }
+      ++count;
+    }
+  }
+  return count;
+}
+
+}  // namespace sandstorm
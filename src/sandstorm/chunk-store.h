@@ -0,0 +1,95 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_CHUNK_STORE_H_
+#define SANDSTORM_CHUNK_STORE_H_
+
+#include <kj/io.h>
+#include <kj/function.h>
+
+namespace sandstorm {
+
+class ContentChunker {
+  // Splits a stream into content-defined chunks. Boundaries go wherever a rolling hash of the
+  // preceding 64 bytes matches a pattern, so inserting or deleting data only changes the chunks
+  // around the edit, rather than shifting every chunk after it as fixed-size blocks would.
+  //
+  // This is the "gear" hash with FastCDC's normalized chunking, which keeps most chunks near
+  // AVERAGE_SIZE. The boundaries must never change, or data backed up before the change would no
+  // longer be deduplicated against data backed up after it.
+
+public:
+  static constexpr size_t MIN_SIZE = 16u << 10;
+  static constexpr size_t AVERAGE_SIZE = 64u << 10;
+  static constexpr size_t MAX_SIZE = 256u << 10;
+
+  explicit ContentChunker(kj::InputStream& input);
+  KJ_DISALLOW_COPY(ContentChunker);
+
+  kj::ArrayPtr<const kj::byte> next();
+  // Returns the next chunk, or an empty array at the end of the input. The chunk remains valid
+  // until the next call.
+
+private:
+  kj::InputStream& input;
+  kj::Array<kj::byte> buffer;
+  size_t start = 0;
+  size_t end = 0;
+  bool eof = false;
+};
+
+class ChunkStore {
+  // A directory of chunks, each named for the BLAKE2b-256 hash of its content and spread across
+  // 256 subdirectories by the hash's first byte. A chunk is stored once no matter how many backups
+  // contain it, deflated unless that doesn't make it smaller.
+  //
+  // Nothing records which backups use which chunks. Instead, sweep() deletes every chunk that the
+  // caller can't find in any remaining backup.
+
+public:
+  static constexpr size_t HASH_SIZE = 32;
+
+  explicit ChunkStore(kj::StringPtr path);
+  KJ_DISALLOW_COPY(ChunkStore);
+
+  static void create(kj::StringPtr path);
+  // Creates the store, if it doesn't exist yet. The directories are world-writable, like grain
+  // directories, because backups write to them as the sandbox user.
+
+  kj::Array<kj::byte> add(kj::ArrayPtr<const kj::byte> data);
+  // Stores a chunk, unless the store already has it, and returns its hash.
+
+  kj::Array<kj::byte> get(kj::ArrayPtr<const kj::byte> hash, size_t size);
+  // Reads a chunk. Throws if it is missing, or if its content doesn't match `hash` and `size`.
+
+  void sync();
+  // Waits until the chunks added so far are safely on disk.
+
+  uint64_t sweep(kj::Function<bool(kj::ArrayPtr<const kj::byte> hash)> isLive);
+  // Deletes every chunk for which `isLive` returns false, along with any other stray files, such
+  // as those left by a backup that crashed. Returns the number of files deleted. Must not run
+  // while anything is adding chunks.
+
+private:
+  kj::AutoCloseFd dirfd;
+  uint tempCounter = 0;
+
+  static kj::String pathFor(kj::ArrayPtr<const kj::byte> hash);
+};
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_CHUNK_STORE_H_
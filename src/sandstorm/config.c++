@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <kj/debug.h>
 #include <kj/parse/char.h>
 
@@ -159,6 +160,61 @@ kj::Maybe<UserIds> getUserIds(kj::StringPtr name) {
   }
 }
 
+static bool parseGrainLimit(Config& config, kj::StringPtr key, kj::StringPtr value) {
+  // Handles "GRAIN_<LIMIT>" and "GRAIN_<LIMIT>:<package-id>". Returns false if `key` isn't one
+  // of these.
+
+  kj::String name;
+  kj::Maybe<kj::String> packageId;
+  KJ_IF_MAYBE(colon, key.findFirst(':')) {
+    name = kj::heapString(key.slice(0, *colon));
+    packageId = kj::heapString(key.slice(*colon + 1));
+  } else {
+    name = kj::heapString(key);
+  }
+
+  auto number = [&]() -> uint64_t {
+    return KJ_REQUIRE_NONNULL(parseUInt64(value, 10), "invalid config value", key, value);
+  };
+  auto weight = [&]() -> uint {
+    auto n = number();
+    KJ_REQUIRE(n >= 1 && n <= 10000, "weight must be between 1 and 10000", key, value);
+    return n;
+  };
+
+  Cgroup::Limits update;
+  if (name == "GRAIN_CPU_WEIGHT") {
+    update.cpuWeight = weight();
+  } else if (name == "GRAIN_CPU_LIMIT_PERCENT") {
+    // Percentage of one CPU, so 200 means two whole CPUs. The kernel rejects quotas under 1ms,
+    // which would make every grain fail to start, so catch that here.
+    Cgroup::CpuMax max;
+    auto percent = number();
+    KJ_REQUIRE(percent >= 1, "CPU limit must be at least 1 percent", key, value);
+    max.quotaUsec = percent * max.periodUsec / 100;
+    KJ_REQUIRE(max.quotaUsec >= 1000, "CPU limit is too small", key, value);
+    update.cpuMax = max;
+  } else if (name == "GRAIN_MEMORY_HIGH_MB") {
+    update.memoryHigh = number() << 20;
+  } else if (name == "GRAIN_MEMORY_MAX_MB") {
+    update.memoryMax = number() << 20;
+  } else if (name == "GRAIN_IO_WEIGHT") {
+    update.ioWeight = weight();
+  } else if (name == "GRAIN_PIDS_MAX") {
+    update.pidsMax = number();
+  } else {
+    return false;
+  }
+
+  KJ_IF_MAYBE(p, packageId) {
+    auto& limits = config.packageGrainLimits[kj::mv(*p)];
+    limits = limits.overriddenBy(update);
+  } else {
+    config.grainLimits = config.grainLimits.overriddenBy(update);
+  }
+  return true;
+}
+
 Config readConfig(const char *path, bool parseUids) {
   // Read and return the config file.
   //
@@ -268,6 +324,18 @@ Config readConfig(const char *path, bool parseUids) {
       config.useExperimentalSeccompFilter = value == "true" || value == "yes";
     } else if (key == "LOG_SECCOMP_VIOLATIONS") {
       config.logSeccompViolations = value == "true" || value == "yes";
+    } else if (key == "GRAIN_HIBERNATION_MINUTES") {
+      KJ_IF_MAYBE(p, parseUInt(value, 10)) {
+        config.grainHibernationMinutes = *p;
+      } else {
+        KJ_FAIL_REQUIRE("invalid config value GRAIN_HIBERNATION_MINUTES", value);
+      }
+    } else if (key == "GRAIN_HIBERNATION_RECLAIM_MB") {
+      KJ_IF_MAYBE(p, parseUInt(value, 10)) {
+        config.grainHibernationReclaimMb = *p;
+      } else {
+        KJ_FAIL_REQUIRE("invalid config value GRAIN_HIBERNATION_RECLAIM_MB", value);
+      }
     } else if (key == "ALLOW_LEGACY_RELAXED_CSP") {
       KJ_LOG(WARNING,
           "The option ALLOW_LEGACY_RELAXED_CSP will be removed "
@@ -275,6 +343,15 @@ Config readConfig(const char *path, bool parseUids) {
           "should be modified to embed those resources in the app "
           "package instead.");
       config.allowLegacyRelaxedCSP = value == "true" || value == "yes";
+    } else if (key == "GRAIN_MEMORY_MERGE") {
+      config.grainMemoryMerge = value == "true" || value == "yes";
+    } else if (key.startsWith("GRAIN_MEMORY_MERGE:")) {
+      config.packageGrainMemoryMerge[kj::heapString(key.slice(strlen("GRAIN_MEMORY_MERGE:")))] =
+          value == "true" || value == "yes";
+    } else if (key == "INCREMENTAL_BACKUPS") {
+      config.incrementalBackups = value == "true" || value == "yes";
+    } else if (parseGrainLimit(config, key, value)) {
+      // Handled.
     } else {
       KJ_LOG(WARNING, "Ignoring unrecognized config option", key);
     }
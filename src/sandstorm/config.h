@@ -2,6 +2,8 @@
 #define SANDSTORM_CONFIG_H_
 
 #include <kj/string.h>
+#include <map>
+#include "cgroup2.h"
 
 namespace sandstorm {
 
@@ -37,6 +39,22 @@ struct Config {
 
   bool useExperimentalSeccompFilter = false;
   bool logSeccompViolations = false;
+
+  uint grainHibernationMinutes = 30;
+  uint grainHibernationReclaimMb = 0;
+
+  Cgroup::Limits grainLimits;
+  std::map<kj::String, Cgroup::Limits> packageGrainLimits;
+  // Resource controls applied to each grain's cgroup, from the GRAIN_* settings. Settings with a
+  // ":<package-id>" suffix apply only to grains of that package, overriding the defaults.
+
+  bool grainMemoryMerge = false;
+  std::map<kj::String, bool> packageGrainMemoryMerge;
+  // Whether grains' memory may be deduplicated by KSM, from GRAIN_MEMORY_MERGE, with the same
+  // per-package overrides.
+
+  bool incrementalBackups = false;
+  // Whether grain backups are deduplicated into a chunk store, from INCREMENTAL_BACKUPS.
 };
 
 // Read and return the config file from `path`.
@@ -0,0 +1,185 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "log-ring.h"
+#include "test-util.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+namespace sandstorm {
+namespace {
+
+struct TestLog {
+  // A temporary directory holding a log, with the app's end of it open for appending.
+
+  TempDir dir;
+  kj::String path = dir / "log";
+  kj::AutoCloseFd appFd = raiiOpen(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC);
+  kj::String written;  // everything written so far
+
+  void write(size_t size) {
+    // Write `size` bytes of recognizable text.
+    kj::Vector<char> text(size);
+    for (size_t i = 0; i < size; i++) {
+      size_t pos = written.size() + i;
+      text.add(pos % 64 == 63 ? '\n' : char('a' + pos % 26));
+    }
+    kj::FdOutputStream(appFd.get()).write(text.begin(), text.size());
+    written = kj::str(written, text.asPtr());
+  }
+};
+
+kj::String readRange(LogRing& ring, uint64_t position) {
+  kj::Vector<char> result;
+  for (;;) {
+    auto data = ring.read(position, 70);
+    if (data.size() == 0) break;
+    result.addAll(data.asPtr().asChars());
+  }
+  return kj::heapString(result.asPtr());
+}
+
+KJ_TEST("LogRing seals, compresses and discards segments") {
+  TestLog log;
+  auto io = kj::setupAsyncIo();
+  LogRing ring(io.unixEventPort, io.provider->getTimer(), log.path, 100, 3);
+
+  log.write(50);
+  KJ_EXPECT(!ring.maybeSeal());
+  KJ_EXPECT(ring.getStart() == 0);
+  KJ_EXPECT(ring.getEnd() == 50);
+  KJ_EXPECT(readRange(ring, 0) == log.written);
+
+  // 250 bytes make two segments, the second with the 50-byte remainder.
+  log.write(200);
+  KJ_EXPECT(ring.maybeSeal());
+  KJ_EXPECT(ring.getEnd() == 250);
+  KJ_EXPECT(access(kj::str(log.path, ".0.gz").cStr(), F_OK) == 0);
+  KJ_EXPECT(access(kj::str(log.path, ".1.gz").cStr(), F_OK) == 0);
+  KJ_EXPECT(readRange(ring, 0) == log.written);
+  KJ_EXPECT(readRange(ring, 120) == log.written.slice(120));
+
+  // Now the app's writes go into an empty file again, and reads span segments and the file.
+  log.write(30);
+  KJ_EXPECT(readRange(ring, 0) == log.written);
+
+  // Two more segments push out the oldest.
+  log.write(100);
+  ring.seal();
+  log.write(100);
+  ring.seal();
+  KJ_EXPECT(access(kj::str(log.path, ".0.gz").cStr(), F_OK) < 0);
+  KJ_EXPECT(ring.getStart() == 100);
+  KJ_EXPECT(ring.getEnd() == log.written.size());
+
+  uint64_t position = 0;
+  ring.read(position, 1);
+  KJ_EXPECT(position == 101, "reading discarded data skips ahead");
+  KJ_EXPECT(readRange(ring, 0) == log.written.slice(100));
+}
+
+KJ_TEST("LogRing recovers its index from disk") {
+  TestLog log;
+  auto io = kj::setupAsyncIo();
+
+  {
+    LogRing ring(io.unixEventPort, io.provider->getTimer(), log.path, 100, 3);
+    log.write(200);
+    ring.seal();
+    log.write(10);
+  }
+
+  // A log.1 left by the old rotation scheme becomes the newest segment. (It's really older than
+  // the others, but that only matters once.)
+  {
+    auto legacy = raiiOpen(kj::str(log.path, ".1"), O_WRONLY | O_CREAT | O_CLOEXEC);
+    kj::FdOutputStream(legacy.get()).write("legacy\n", 7);
+  }
+
+  LogRing ring(io.unixEventPort, io.provider->getTimer(), log.path, 100, 3);
+  KJ_EXPECT(access(kj::str(log.path, ".1").cStr(), F_OK) < 0);
+  KJ_EXPECT(ring.getEnd() - ring.getStart() == 217);
+  KJ_EXPECT(readRange(ring, 0) ==
+            kj::str(log.written.slice(0, 200), "legacy\n", log.written.slice(200)));
+}
+
+KJ_TEST("LogRing chops down oversized logs") {
+  TestLog log;
+  log.write(1000);
+
+  auto io = kj::setupAsyncIo();
+  LogRing ring(io.unixEventPort, io.provider->getTimer(), log.path, 100, 3);
+  KJ_EXPECT(ring.getEnd() == 1000);
+  KJ_EXPECT(ring.getStart() == 700);
+  KJ_EXPECT(readRange(ring, 0) == log.written.slice(700));
+}
+
+class CollectingStream final: public ByteStream::Server {
+public:
+  kj::Vector<char> received;
+
+protected:
+  kj::Promise<void> write(WriteContext context) override {
+    received.addAll(context.getParams().getData().asChars());
+    return kj::READY_NOW;
+  }
+};
+
+KJ_TEST("LogRing::watch") {
+  TestLog log;
+  auto io = kj::setupAsyncIo();
+  LogRing ring(io.unixEventPort, io.provider->getTimer(), log.path, 100, 3);
+
+  log.write(150);
+  ring.seal();
+  log.write(20);
+
+  auto server = kj::heap<CollectingStream>();
+  auto& received = server->received;
+  ByteStream::Client stream = kj::mv(server);
+
+  auto waitFor = [&](size_t size) {
+    for (uint i = 0; i < 100 && received.size() < size; i++) {
+      io.provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(io.waitScope);
+    }
+    KJ_EXPECT(received.size() == size, received.size(), size);
+  };
+
+  // The backlog spans the sealed segment and the current file.
+  auto handle = ring.watch(60, stream);
+  waitFor(60);
+  KJ_EXPECT(kj::heapString(received.asPtr()) == log.written.slice(110));
+
+  // New writes are pushed, including across a seal.
+  log.write(100);
+  waitFor(160);
+  log.write(5);
+  waitFor(165);
+  KJ_EXPECT(kj::heapString(received.asPtr()) == log.written.slice(110));
+
+  // After the handle is dropped, nothing more is sent.
+  handle = nullptr;
+  io.waitScope.poll();
+  log.write(10);
+  io.provider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(io.waitScope);
+  KJ_EXPECT(received.size() == 165);
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -0,0 +1,398 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "log-ring.h"
+#include "util.h"
+#include <kj/debug.h>
+#include <kj/compat/gzip.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <algorithm>
+
+namespace sandstorm {
+
+static constexpr size_t WATCH_CHUNK_SIZE = 64u << 10;
+// Most data a watcher sends in one write().
+
+static constexpr kj::Duration SEAL_CHECK_INTERVAL = 10 * kj::SECONDS;
+// How often run() checks the size of the current segment. The log can overshoot the segment size
+// by whatever is written in this time, which just makes for a bigger segment.
+
+class LogRing::Watcher final: public Handle::Server {
+public:
+  Watcher(LogRing& ringParam, uint64_t position, ByteStream::Client stream)
+      : ring(ringParam), position(position), stream(kj::mv(stream)) {
+    ringParam.addWatcher(*this);
+    notify();
+  }
+  ~Watcher() noexcept(false) {
+    KJ_IF_MAYBE(r, ring) {
+      r->removeWatcher(*this);
+    }
+  }
+
+  void notify() {
+    // Sends whatever the stream hasn't seen yet. If a send is already in flight, the loop in
+    // pump() will pick up the new data once it completes, so this only ever has one write
+    // outstanding.
+    if (!sending) {
+      sending = true;
+      sendTask = kj::evalLater([this]() { return pump(); })
+          .eagerlyEvaluate([](kj::Exception&& exception) {
+        // Leave `sending` set so we stop trying; the receiver will drop its handle.
+        KJ_LOG(ERROR, exception);
+      });
+    }
+  }
+
+  void detach() {
+    ring = nullptr;
+  }
+
+private:
+  kj::Maybe<LogRing&> ring;
+  uint64_t position;
+  ByteStream::Client stream;
+  bool sending = false;
+  kj::Promise<void> sendTask = nullptr;
+
+  kj::Promise<void> pump() {
+    KJ_IF_MAYBE(r, ring) {
+      auto data = r->read(position, WATCH_CHUNK_SIZE);
+      if (data.size() > 0) {
+        auto req = stream.writeRequest();
+        req.setData(data);
+        return req.send().then([this]() {
+          return pump();
+        });
+      }
+    }
+
+    sending = false;
+    return kj::READY_NOW;
+  }
+};
+
+struct LogRing::Inotify {
+  kj::AutoCloseFd fd;
+  kj::UnixEventPort::FdObserver observer;
+  kj::Promise<void> task = nullptr;
+
+  Inotify(kj::UnixEventPort& eventPort, kj::AutoCloseFd fdParam)
+      : fd(kj::mv(fdParam)),
+        observer(eventPort, fd, kj::UnixEventPort::FdObserver::OBSERVE_READ) {}
+};
+
+LogRing::LogRing(kj::UnixEventPort& eventPort, kj::Timer& timer, kj::StringPtr path,
+                 size_t segmentSize, uint maxSegments)
+    : eventPort(eventPort), timer(timer), path(kj::heapString(path)),
+      segmentSize(segmentSize), maxSegments(maxSegments),
+      logFd(raiiOpen(path, O_RDWR | O_CREAT | O_CLOEXEC)) {
+  KJ_REQUIRE(segmentSize > 0 && maxSegments > 0);
+  loadSegments();
+
+  // Grains from before logs were segmented may have a huge log, which we chop down to size now.
+  maybeSeal();
+}
+
+LogRing::~LogRing() noexcept(false) {
+  for (auto watcher: watchers) {
+    watcher->detach();
+  }
+}
+
+kj::String LogRing::segmentPath(uint seq) {
+  return kj::str(path, '.', seq, ".gz");
+}
+
+void LogRing::loadSegments() {
+  // Rebuild the segment index from the files on disk. Positions only have to be consistent
+  // within this process, so we number them from the start of the oldest segment.
+
+  kj::String dir;
+  kj::StringPtr name;
+  KJ_IF_MAYBE(slash, path.findLast('/')) {
+    dir = kj::heapString(path.slice(0, *slash));
+    name = path.slice(*slash + 1);
+  } else {
+    dir = kj::heapString(".");
+    name = path;
+  }
+  auto prefix = kj::str(name, '.');
+
+  kj::Vector<Segment> found;
+  for (auto& file: listDirectory(dir)) {
+    if (!file.startsWith(prefix)) continue;
+    auto filePath = kj::str(dir, '/', file);
+
+    if (file.endsWith(".gz.tmp")) {
+      // Left over from a crash while sealing.
+      KJ_SYSCALL(unlink(filePath.cStr()));
+      continue;
+    }
+    if (!file.endsWith(".gz")) continue;
+
+    KJ_IF_MAYBE(seq, parseUInt(kj::str(file.slice(prefix.size(), file.size() - 3)), 10)) {
+      // gzip ends with the uncompressed size (mod 2^32, which segments never reach) as a
+      // little-endian 32-bit number.
+      auto fd = raiiOpen(filePath, O_RDONLY | O_CLOEXEC);
+      struct stat stats;
+      KJ_SYSCALL(fstat(fd, &stats));
+      kj::byte trailer[4];
+      ssize_t n = 0;
+      if (stats.st_size >= 18) {
+        KJ_SYSCALL(n = pread(fd, trailer, sizeof(trailer), stats.st_size - sizeof(trailer)));
+      }
+      if (n != sizeof(trailer)) {
+        KJ_LOG(WARNING, "discarding corrupt log segment", filePath);
+        KJ_SYSCALL(unlink(filePath.cStr()));
+        continue;
+      }
+      uint64_t size = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) |
+                      (uint64_t(trailer[3]) << 24);
+      found.add(Segment { *seq, 0, size });
+    }
+  }
+
+  std::sort(found.begin(), found.end(),
+      [](const Segment& a, const Segment& b) { return a.seq < b.seq; });
+
+  for (auto& segment: found) {
+    segment.start = base;
+    base += segment.size;
+    segments.push_back(segment);
+  }
+  if (!found.empty()) {
+    nextSeq = found.back().seq + 1;
+  }
+
+  // Import the single old log file kept by the previous rotation scheme.
+  auto legacyPath = kj::str(path, ".1");
+  KJ_IF_MAYBE(legacy, raiiOpenIfExists(legacyPath, O_RDONLY | O_CLOEXEC)) {
+    auto data = readAllBytes(*legacy);
+    for (size_t offset = 0; offset < data.size(); offset += segmentSize) {
+      writeSegment(data.slice(offset, kj::min(data.size(), offset + segmentSize)));
+    }
+    KJ_SYSCALL(unlink(legacyPath.cStr()));
+  }
+
+  while (segments.size() > maxSegments) {
+    KJ_SYSCALL(unlink(segmentPath(segments.front().seq).cStr()));
+    segments.pop_front();
+  }
+}
+
+void LogRing::writeSegment(kj::ArrayPtr<const kj::byte> data) {
+  // Compress `data` into a new segment that starts at `base`, and advance `base` past it. We
+  // write to a temporary file and rename it into place so that a crash can't leave a truncated
+  // segment behind.
+
+  uint seq = nextSeq++;
+  auto name = segmentPath(seq);
+  auto tmpName = kj::str(name, ".tmp");
+  {
+    auto fd = raiiOpen(tmpName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+    kj::FdOutputStream out(fd.get());
+    kj::GzipOutputStream gzip(out, Z_BEST_SPEED);
+    gzip.write(data.begin(), data.size());
+  }
+  KJ_SYSCALL(rename(tmpName.cStr(), name.cStr()));
+
+  segments.push_back(Segment { seq, base, data.size() });
+  base += data.size();
+
+  while (segments.size() > maxSegments) {
+    auto oldName = segmentPath(segments.front().seq);
+    KJ_SYSCALL_HANDLE_ERRORS(unlink(oldName.cStr())) {
+      case ENOENT:
+        break;
+      default:
+        KJ_FAIL_SYSCALL("unlink(log segment)", error, oldName);
+    }
+    segments.pop_front();
+  }
+}
+
+bool LogRing::maybeSeal() {
+  struct stat stats;
+  KJ_SYSCALL(fstat(logFd, &stats));
+  if (stats.st_size >= segmentSize) {
+    seal();
+    return true;
+  } else {
+    return false;
+  }
+}
+
+void LogRing::seal() {
+  struct stat stats;
+  KJ_SYSCALL(fstat(logFd, &stats));
+
+  // There's no point reading more than we'd retain.
+  uint64_t limit = uint64_t(segmentSize) * maxSegments;
+  uint64_t skip = stats.st_size > limit ? stats.st_size - limit : 0;
+
+  // Read up to EOF, which may be past `stats.st_size` by now, and truncate immediately after.
+  // Anything the app manages to write in between is lost, but that window is very short. (The
+  // app's stderr is opened with O_APPEND, so it carries on writing at the new end of file.)
+  kj::Vector<kj::byte> data(stats.st_size - skip);
+  for (;;) {
+    size_t used = data.size();
+    data.resize(used + WATCH_CHUNK_SIZE);
+    ssize_t n;
+    KJ_SYSCALL(n = pread(logFd, data.begin() + used, WATCH_CHUNK_SIZE, skip + used));
+    data.resize(used + n);
+    if (n == 0) break;
+  }
+  KJ_SYSCALL(ftruncate(logFd, 0));
+
+  base += skip;
+  if (data.size() == 0) return;
+
+  // Cut the data into segments of `segmentSize`, with any remainder going into the last one.
+  size_t count = kj::max(data.size() / segmentSize, size_t(1));
+  for (size_t i = 0; i < count; i++) {
+    size_t begin = i * segmentSize;
+    size_t end = i + 1 == count ? data.size() : begin + segmentSize;
+    writeSegment(data.asPtr().slice(begin, end));
+  }
+
+  // Watchers that haven't caught up will want the newest segment next.
+  cachedSeq = segments.back().seq;
+  cachedContent = kj::heapArray<kj::byte>(
+      data.asPtr().slice(data.size() - segments.back().size, data.size()));
+}
+
+uint64_t LogRing::getStart() {
+  return segments.empty() ? base : segments.front().start;
+}
+
+uint64_t LogRing::getEnd() {
+  struct stat stats;
+  KJ_SYSCALL(fstat(logFd, &stats));
+  return base + stats.st_size;
+}
+
+kj::ArrayPtr<const kj::byte> LogRing::segmentContent(const Segment& segment) {
+  KJ_IF_MAYBE(s, cachedSeq) {
+    if (*s == segment.seq) return cachedContent;
+  }
+
+  auto fd = raiiOpen(segmentPath(segment.seq), O_RDONLY | O_CLOEXEC);
+  kj::FdInputStream raw(fd.get());
+  kj::GzipInputStream gzip(raw);
+  auto content = kj::heapArray<kj::byte>(segment.size);
+  size_t n = gzip.tryRead(content.begin(), content.size(), content.size());
+  KJ_REQUIRE(n == content.size(), "log segment is shorter than its trailer says",
+             segment.seq, n, segment.size);
+
+  cachedSeq = segment.seq;
+  cachedContent = kj::mv(content);
+  return cachedContent;
+}
+
+kj::Array<kj::byte> LogRing::read(uint64_t& position, size_t maxBytes) {
+  for (auto& segment: segments) {
+    // Skip over anything discarded, including gaps left where seal() dropped an oversized log.
+    if (position < segment.start) position = segment.start;
+
+    if (position < segment.start + segment.size) {
+      auto content = segmentContent(segment);
+      size_t offset = position - segment.start;
+      auto result = kj::heapArray<kj::byte>(
+          content.slice(offset, kj::min(content.size(), offset + maxBytes)));
+      position += result.size();
+      return result;
+    }
+  }
+  if (position < base) position = base;
+
+  auto buffer = kj::heapArray<kj::byte>(maxBytes);
+  ssize_t n;
+  KJ_SYSCALL(n = pread(logFd, buffer.begin(), buffer.size(), position - base));
+  position += n;
+  if (size_t(n) == buffer.size()) {
+    return kj::mv(buffer);
+  } else {
+    return kj::heapArray<kj::byte>(buffer.slice(0, n));
+  }
+}
+
+kj::Promise<void> LogRing::run() {
+  return timer.afterDelay(SEAL_CHECK_INTERVAL).then([this]() {
+    maybeSeal();
+    return run();
+  });
+}
+
+Handle::Client LogRing::watch(uint64_t backlog, ByteStream::Client stream) {
+  uint64_t end = getEnd();
+  uint64_t start = end - kj::min(backlog, end - getStart());
+  return kj::heap<Watcher>(*this, start, kj::mv(stream));
+}
+
+void LogRing::addWatcher(Watcher& watcher) {
+  watchers.insert(&watcher);
+
+  if (inotify == nullptr) {
+    int fd;
+    KJ_SYSCALL(fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    auto newInotify = kj::heap<Inotify>(eventPort, kj::AutoCloseFd(fd));
+    KJ_SYSCALL(inotify_add_watch(newInotify->fd, path.cStr(), IN_MODIFY));
+    newInotify->task = inotifyLoop(*newInotify).eagerlyEvaluate([](kj::Exception&& exception) {
+      KJ_LOG(ERROR, "log watch failed", exception);
+    });
+    inotify = kj::mv(newInotify);
+  }
+}
+
+void LogRing::removeWatcher(Watcher& watcher) {
+  watchers.erase(&watcher);
+  if (watchers.empty()) {
+    inotify = nullptr;
+  }
+}
+
+kj::Promise<void> LogRing::inotifyLoop(Inotify& inotify) {
+  return inotify.observer.whenBecomesReadable().then([this,&inotify]() {
+    // Exhaust all events from the inotify queue, because edge triggering. We don't have to
+    // interpret them because we're only waiting on one kind of event.
+    for (;;) {
+      kj::byte buffer[sizeof(struct inotify_event) + NAME_MAX + 1];
+      ssize_t n;
+      KJ_NONBLOCKING_SYSCALL(n = ::read(inotify.fd, buffer, sizeof(buffer)));
+      if (n < 0) break;
+      KJ_ASSERT(n > 0);
+    }
+
+    // A watched log is a good time to check the size, since we're awake anyway.
+    maybeSeal();
+    notifyWatchers();
+    return inotifyLoop(inotify);
+  });
+}
+
+void LogRing::notifyWatchers() {
+  for (auto watcher: watchers) {
+    watcher->notify();
+  }
+}
+
+}  // namespace sandstorm
@@ -0,0 +1,117 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_LOG_RING_H_
+#define SANDSTORM_LOG_RING_H_
+
+#include <kj/async-unix.h>
+#include <kj/async-io.h>
+#include <kj/io.h>
+#include <sandstorm/util.capnp.h>
+#include <deque>
+#include <set>
+
+namespace sandstorm {
+
+class LogRing {
+  // A grain's debug log, kept as a ring of segments so that it stays bounded in size without
+  // being copied over and over.
+  //
+  // The supervisor and the app write to `path` directly (it is their stderr). Once that file
+  // reaches `segmentSize`, it is sealed: its contents are gzipped into `<path>.<n>.gz` and it is
+  // truncated. Only the newest `maxSegments` sealed segments are kept.
+  //
+  // Every byte ever written has a "position" in the log. The segments' positions are kept in
+  // memory (and recovered from the gzip trailers at startup), so finding where a backlog starts
+  // means looking at no more than `maxSegments` entries and decompressing at most one segment,
+  // however large the log has grown.
+  //
+  // Watchers share a single inotify watch on `path`, which only exists while someone is
+  // watching.
+
+public:
+  static constexpr size_t SEGMENT_SIZE = 256u << 10;
+  static constexpr uint MAX_SEGMENTS = 8;
+
+  LogRing(kj::UnixEventPort& eventPort, kj::Timer& timer, kj::StringPtr path,
+          size_t segmentSize = SEGMENT_SIZE, uint maxSegments = MAX_SEGMENTS);
+  ~LogRing() noexcept(false);
+  KJ_DISALLOW_COPY(LogRing);
+
+  kj::Promise<void> run();
+  // Periodically seals the current segment if it has grown big enough. Never returns.
+
+  Handle::Client watch(uint64_t backlog, ByteStream::Client stream);
+  // Writes the last `backlog` bytes of the log to `stream`, followed by everything written
+  // later, until the returned handle is dropped.
+
+  bool maybeSeal();
+  // Seals the current segment if it has reached the segment size. Returns true if it did.
+
+  void seal();
+  // Seals the current segment now, unless it's empty.
+
+  uint64_t getStart();
+  uint64_t getEnd();
+  // Positions of the oldest byte still retained and of the end of the log.
+
+  kj::Array<kj::byte> read(uint64_t& position, size_t maxBytes);
+  // Returns up to `maxBytes` of the log starting at `position`, and advances `position` past
+  // them. If `position` refers to data that has been discarded, skips ahead to the oldest byte
+  // still retained first. Returns an empty array at the end of the log.
+
+private:
+  class Watcher;
+
+  struct Segment {
+    uint seq;       // file is `<path>.<seq>.gz`
+    uint64_t start; // position of the first byte
+    uint64_t size;  // uncompressed size
+  };
+
+  kj::UnixEventPort& eventPort;
+  kj::Timer& timer;
+  kj::String path;
+  size_t segmentSize;
+  uint maxSegments;
+  kj::AutoCloseFd logFd;
+
+  std::deque<Segment> segments;  // oldest first
+  uint64_t base = 0;             // position of the first byte of `path`
+  uint nextSeq = 0;
+
+  kj::Maybe<uint> cachedSeq;
+  kj::Array<kj::byte> cachedContent;
+  // Decompressed content of one segment, so that a watcher reading through it doesn't inflate it
+  // once per chunk.
+
+  struct Inotify;
+  std::set<Watcher*> watchers;
+  kj::Maybe<kj::Own<Inotify>> inotify;  // non-null while `watchers` is non-empty
+
+  kj::String segmentPath(uint seq);
+  void loadSegments();
+  void writeSegment(kj::ArrayPtr<const kj::byte> data);
+  kj::ArrayPtr<const kj::byte> segmentContent(const Segment& segment);
+  void addWatcher(Watcher& watcher);
+  void removeWatcher(Watcher& watcher);
+  kj::Promise<void> inotifyLoop(Inotify& inotify);
+  void notifyWatchers();
+};
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_LOG_RING_H_
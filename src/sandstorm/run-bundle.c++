@@ -2397,14 +2397,49 @@ private:
         grainsCgroup = Cgroup("/run/cgroup2").getOrMakeChild("grains");
       });
 
+      // Enable the controllers needed for per-grain resource limits and accounting. cgroup v2
+      // only allows this in a cgroup with no processes of its own, so first move the server's
+      // processes into a leaf cgroup.
+      KJ_IF_MAYBE(grains, grainsCgroup) {
+        KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() {
+          static const kj::StringPtr CONTROLLERS[] = { "cpu", "memory", "io", "pids" };
+          Cgroup root("/run/cgroup2");
+          auto server = root.getOrMakeChild("server");
+          root.movePidsTo(server);
+          if (!root.enableControllers(CONTROLLERS) || !grains->enableControllers(CONTROLLERS)) {
+            KJ_LOG(WARNING, "not all cgroup controllers are available; some grain resource "
+                            "limits won't be enforced");
+          }
+        })) {
+          KJ_LOG(WARNING, "couldn't enable cgroup controllers", *e);
+        }
+      }
+
+      std::map<kj::String, Cgroup::Limits> packageGrainLimits;
+      for (auto& entry: config.packageGrainLimits) {
+        packageGrainLimits.insert(std::make_pair(kj::heapString(entry.first), entry.second));
+      }
+      std::map<kj::String, bool> packageGrainMemoryMerge;
+      for (auto& entry: config.packageGrainMemoryMerge) {
+        packageGrainMemoryMerge.insert(std::make_pair(kj::heapString(entry.first), entry.second));
+      }
+
       paf.fulfiller->fulfill(kj::heap<BackendImpl>(
         *io.lowLevelProvider,
+        io.unixEventPort,
         network,
         server.getBootstrap().castAs<SandstormCoreFactory>(),
         kj::mv(grainsCgroup),
         sandboxUid,
         config.useExperimentalSeccompFilter,
-        config.logSeccompViolations));
+        config.logSeccompViolations,
+        config.grainHibernationMinutes * kj::MINUTES,
+        uint64_t(config.grainHibernationReclaimMb) << 20,
+        config.grainLimits,
+        kj::mv(packageGrainLimits),
+        config.grainMemoryMerge,
+        kj::mv(packageGrainMemoryMerge),
+        config.incrementalBackups));
 
       auto gatewayServer = kj::heap<capnp::TwoPartyServer>(kj::refcounted<CapRedirector>([&]() {
         return server.getBootstrap().castAs<SandstormCoreFactory>()
@@ -34,7 +34,9 @@
 #include <capnp/compat/json.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <algorithm>
 #include <map>
+#include <set>
 #include <unordered_map>
 #include <time.h>
 #include <stdlib.h>
@@ -189,6 +191,14 @@ public:
       } else if (upgrade) {
         KJ_ASSERT(nread <= actual && nread >= 0);
         return kj::arrayPtr(buffer + nread, actual - nread);
+      } else if (headersComplete && status_code / 100 == 2 &&
+                 status_code != 204 && status_code != 205 &&
+                 findHeader("x-sandstorm-sendfile") != nullptr) {
+        // The app wants us to serve the response body directly from a file. Whatever body the
+        // app itself sent (normally none) is ignored. (204 and 205 responses have no body, so
+        // for those the header is ignored instead.)
+        startSendfile(KJ_ASSERT_NONNULL(findHeader("x-sandstorm-sendfile")));
+        return kj::arrayPtr(buffer, 0);
       } else if (messageComplete || actual == 0) {
         // The parser is done or the stream has closed.
         KJ_ASSERT(headersComplete, "HTTP response from sandboxed app had incomplete headers.");
@@ -224,7 +234,7 @@ public:
   }
 
   void pumpStream(kj::Own<kj::AsyncIoStream>&& stream) {
-    if (isStreaming) {
+    if (isStreaming && !sendingFile) {
       responseInput = kj::mv(stream);
       startPumpStream();
     }
@@ -512,6 +522,79 @@ private:
   kj::Own<kj::AsyncIoStream> responseInput;
   byte buffer[8192];
 
+  bool sendingFile = false;
+  kj::Maybe<kj::AutoCloseFd> sendfileFd;
+  uint64_t sendfileOffset = 0;
+  uint64_t sendfileRemaining = 0;
+  // If the app responded with X-Sandstorm-Sendfile, the file we're streaming in its place.
+  // (`sendfileFd` is dropped once it's all sent, or never set if the body is to be ignored.)
+
+  static constexpr size_t SENDFILE_CHUNK_SIZE = 1u << 20;
+  // Files served via X-Sandstorm-Sendfile are sent in much bigger writes than proxied bodies,
+  // since we don't have to wait for the app to produce the bytes.
+
+  void startSendfile(kj::StringPtr path) {
+    // Serve the response body from `path`, which must be inside the grain's writable storage,
+    // instead of having the app stream it to us over the loopback connection. This lets apps that
+    // serve big user files (file sharing, sync, etc.) avoid touching the bytes at all.
+
+    KJ_REQUIRE(path.startsWith("/var/"),
+        "X-Sandstorm-Sendfile path must be under /var.", path);
+    auto varDir = raiiOpen("/var", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    auto fd = KJ_REQUIRE_NONNULL(
+        raiiOpenAtIfExistsContained(varDir, kj::Path::parse(path.slice(strlen("/var/"))),
+                                    O_RDONLY | O_CLOEXEC),
+        "X-Sandstorm-Sendfile file doesn't exist.", path);
+    uint64_t size = getFileSize(fd, path);
+    sendingFile = true;
+    isStreaming = true;
+    body = kj::Vector<char>();
+
+    auto req = responseStream.expectSizeRequest();
+    req.setSize(size);
+    taskSet.add(req.send().ignoreResult());
+
+    if (ignoreBody) {
+      // A HEAD request. The client gets the size, but no body; pumpSendfile() will just say
+      // we're done.
+      size = 0;
+    } else {
+      sendfileFd = kj::mv(fd);
+    }
+    sendfileRemaining = size;
+
+    taskSet.add(pumpSendfile().catch_([this](kj::Exception&&) {
+      // Error while writing. Drop the response stream, so that Sandstorm knows no more data is
+      // coming.
+      responseStream = nullptr;
+      aborted = true;
+    }));
+  }
+
+  kj::Promise<void> pumpSendfile() {
+    if (sendfileRemaining == 0) {
+      sendfileFd = nullptr;
+      auto promise = responseStream.doneRequest().send().ignoreResult();
+      responseStream = nullptr;
+      return kj::mv(promise);
+    }
+
+    // pread() straight into the RPC message so that each chunk is copied exactly once.
+    size_t size = kj::min(sendfileRemaining, SENDFILE_CHUNK_SIZE);
+    auto req = responseStream.writeRequest();
+    auto data = capnp::Orphanage::getForMessageContaining(ByteStream::WriteParams::Builder(req))
+        .newOrphan<capnp::Data>(size);
+    ssize_t n;
+    KJ_SYSCALL(n = pread(KJ_ASSERT_NONNULL(sendfileFd), data.get().begin(), size, sendfileOffset));
+    KJ_ASSERT(n > 0, "X-Sandstorm-Sendfile file was truncated while being sent.");
+    data.truncate(n);
+    req.adoptData(kj::mv(data));
+    sendfileOffset += n;
+    sendfileRemaining -= n;
+
+    return req.send().then([this]() { return pumpSendfile(); });
+  }
+
   kj::Promise<void> pumpWrites() {
     if (nextWriteSize > 0) {
       // Send the current write and allocate a new one.
@@ -921,10 +1004,25 @@ public:
 
   void pump() {
     // Repeatedly read from serverStream and write to clientStream.
-    tasks.add(serverStream->tryRead(buffer, 1, sizeof(buffer))
+
+    if (bytesInFlight >= MAX_BYTES_IN_FLIGHT) {
+      // The client isn't keeping up. Stop reading from the app until some of our sends complete;
+      // the app will then block on its socket buffer rather than us buffering without bound.
+      readStalled = true;
+      return;
+    }
+
+    tasks.add(serverStream->tryRead(buffer.begin(), 1, buffer.size())
         .then([this](size_t amount) {
       if (amount > 0) {
-        sendData(kj::arrayPtr(buffer, amount));
+        // Each read takes everything the app has written so far (up to the buffer size), so
+        // when the app sends many small frames back-to-back they go out in one sendBytes().
+        sendData(buffer.slice(0, amount));
+        if (amount == buffer.size() && buffer.size() < MAX_READ_BUFFER_SIZE) {
+          // We filled the buffer, so the app is producing data faster than we're consuming it.
+          // Read in bigger chunks from now on.
+          buffer = kj::heapArray<byte>(buffer.size() * 2);
+        }
         pump();
       } else {
         // EOF.
@@ -938,7 +1036,25 @@ public:
     auto request = clientStream.sendBytesRequest(
         capnp::MessageSize { data.size() / sizeof(capnp::word) + 8, 0 });
     request.setMessage(data);
-    tasks.add(request.send());
+
+    size_t size = data.size();
+    bytesInFlight += size;
+    tasks.add(request.send().then([this, size]() {
+      sendDone(size);
+    }, [this, size](kj::Exception&& exception) {
+      // A failed send still has to release its bytes, or enough failures would stall reading
+      // from the app forever. The error itself goes to taskFailed().
+      sendDone(size);
+      kj::throwFatalException(kj::mv(exception));
+    }));
+  }
+
+  void sendDone(size_t size) {
+    bytesInFlight -= size;
+    if (readStalled && bytesInFlight < MAX_BYTES_IN_FLIGHT) {
+      readStalled = false;
+      pump();
+    }
   }
 
 protected:
@@ -960,11 +1076,22 @@ private:
   // The promise working on writing data to serverStream.  AsyncIoStream wants only one write() at
   // a time, so new writes have to wait for the previous write to finish.
 
+  static constexpr size_t INITIAL_READ_BUFFER_SIZE = 4096;
+  static constexpr size_t MAX_READ_BUFFER_SIZE = 64u << 10;
+  static constexpr size_t MAX_BYTES_IN_FLIGHT = 256u << 10;
+
+  kj::Array<byte> buffer = kj::heapArray<byte>(INITIAL_READ_BUFFER_SIZE);
+  // Grows (up to MAX_READ_BUFFER_SIZE) whenever a read fills it completely.
+
+  size_t bytesInFlight = 0;
+  // Bytes passed to clientStream.sendBytes() whose calls haven't completed yet.
+
+  bool readStalled = false;
+  // True if pump() stopped reading because bytesInFlight hit MAX_BYTES_IN_FLIGHT.
+
   kj::TaskSet tasks;
   // Pending calls to clientStream.sendBytes() and serverStream.read().
 
-  byte buffer[4096];
-
   void taskFailed(kj::Exception&& exception) override {
     // TODO(soon):  What do we do when a server -> client send throws?  Probably just ignore it;
     //   WebSocket datagrams are intended to be one-way and thus the application protocol on top of
@@ -1144,10 +1271,15 @@ kj::Maybe<T&> findInMap(std::map<kj::StringPtr, T>& map, const kj::StringPtr& id
 
 class BridgeContext: private kj::TaskSet::ErrorHandler {
 public:
-  BridgeContext(SandstormApi<BridgeObjectId>::Client apiCap, spk::BridgeConfig::Reader config)
-      : apiCap(kj::mv(apiCap)), config(config),
+  BridgeContext(SandstormApi<BridgeObjectId>::Client apiCap, spk::BridgeConfig::Reader config,
+                kj::Timer& timer)
+      : apiCap(kj::mv(apiCap)), config(config), timer(timer),
         identitiesDir(openIdentitiesDir(config)),
-        trashDir(openTrashDir(config)), tasks(*this) {}
+        trashDir(openTrashDir(config)), tasks(*this) {
+    if (config.getSaveIdentityCaps()) {
+      tasks.add(cleanupLoop());
+    }
+  }
 
   kj::String formatPermissions(capnp::List<bool>::Reader userPermissions) {
     auto configPermissions = config.getViewInfo().getPermissions();
@@ -1171,24 +1303,35 @@ public:
     auto textId = textIdentityId(identityId);
 
     kj::StringPtr textIdRef = textId;
-    if(liveIdentities.insert(std::make_pair(
-        textIdRef, IdentityRecord { kj::mv(textId), kj::cp(identity) })).second) {
+    auto insertResult = liveIdentities.insert(std::make_pair(
+        textIdRef, IdentityRecord { kj::mv(textId), kj::cp(identity), timer.now(),
+                                    identityGeneration }));
+    if (insertResult.second) {
       // Newly-added to the map. Check if it's on disk.
 
-      // Note that we know now that textIdRef will live forever, since it's in the map.
+      // Note that the map entry may be evicted later, so tasks below must hold their own copy of
+      // the ID rather than pointing into the entry.
 
       if (faccessat(identitiesDir, textIdRef.cStr(), F_OK, AT_SYMLINK_NOFOLLOW) != 0) {
         // Not yet recorded to disk. Need to save a SturdyRef.
-        saveIdentityInternal(textIdRef, kj::mv(identity));
+        saveIdentityInternal(kj::heapString(textIdRef), kj::mv(identity));
       } else {
         // Try restoring the existing SturdyRef and re-save on failure.
         tasks.add(loadIdentityFromDisk(textIdRef).whenResolved().catch_(
-            [this, textIdRef, KJ_MVCAP(identity)](auto error) mutable {
+            [this, textId = kj::heapString(textIdRef), KJ_MVCAP(identity)](auto error) mutable {
           if (error.getType() == kj::Exception::Type::FAILED) {
-            saveIdentityInternal(textIdRef, kj::mv(identity));
+            saveIdentityInternal(kj::mv(textId), kj::mv(identity));
           }
         }));
       }
+    } else {
+      auto& record = insertResult.first->second;
+      record.lastUsed = timer.now();
+      if (record.generation != identityGeneration) {
+        // Our copy is known to be disconnected, but this one is fresh.
+        record.identity = kj::mv(identity);
+        record.generation = identityGeneration;
+      }
     }
   }
 
@@ -1205,53 +1348,28 @@ public:
     auto iter = liveIdentities.find(textId);
     if (iter == liveIdentities.end()) {
       // Not in the map. Load from disk.
-      Identity::Client identity = loadIdentityFromDisk(textId);
-
-      tasks.add(identity.whenResolved().then([this, KJ_MVCAP(textId), identity]() mutable {
-        // Successfully resolved. Add to map.
-        kj::StringPtr textIdRef = textId;
-        KJ_ASSERT(liveIdentities.insert(std::make_pair(
-          textIdRef, IdentityRecord { kj::mv(textId), kj::mv(identity) })).second);
-      }, [] (auto e) {
-        // Ignore the error here because the returned capability will report it upon use.
-      }));
-
-      return kj::mv(identity);
-    } else {
-      // Identity is in the map.
-      Identity::Client identity = iter->second.identity;
-
-      // We need to verify the capability is still connected. Send a dummy call to check. We'll
-      // use a known-invalid type ID / method number and expect to get an UNIMPLEMENTED error.
-      auto ping = identity.typelessRequest(0, 65535, capnp::MessageSize { 4, 0 });
-      ping.initAsAnyStruct(0, 0);
-      return ping.send().then([identity](auto&&) mutable -> kj::Promise<Identity::Client> {
-        // Weird, we shouldn't get here.
-        KJ_LOG(ERROR, "dummy ping request should have failed with UNIMPLEMENTED");
-
-        // But clearly we are still connected, so continue.
-        return kj::mv(identity);
-      }, [this,KJ_MVCAP(textId),identity](kj::Exception&& e2) mutable
-                                      -> kj::Promise<Identity::Client> {
-        if (e2.getType() == kj::Exception::Type::DISCONNECTED) {
-          // Disconnected. We'll need to reload from disk.
-          Identity::Client newIdentity = loadIdentityFromDisk(textId);
-          tasks.add(newIdentity.whenResolved().then([this, KJ_MVCAP(textId), newIdentity]() mutable {
-            // Save the new identity to the map so that we don't have to reload it again.
-            auto iter = liveIdentities.find(textId);
-            KJ_ASSERT(iter != liveIdentities.end());
-            iter->second.identity = kj::mv(newIdentity);
-          }, [] (auto e) {
-            // Ignore the error here because the returned capability will report it upon use.
-          }));
+      return reloadIdentity(kj::mv(textId));
+    }
 
-          return kj::mv(newIdentity);
-        } else {
-          // Some other error -- meaning we're NOT disconnected, so go ahead and use the cap.
-          return kj::mv(identity);
-        }
-      });
+    iter->second.lastUsed = timer.now();
+    if (iter->second.generation != identityGeneration) {
+      // We've already seen that this cap is disconnected.
+      return reloadIdentity(kj::mv(textId));
+    } else if (livenessCheckDone && timer.now() - lastLivenessCheck < LIVENESS_CHECK_INTERVAL) {
+      // We checked our connection recently, so just return the cap without another round trip.
+      return iter->second.identity;
     }
+
+    // Wait for a (shared) liveness check, then look again.
+    return checkLiveness(iter->second.identity)
+        .then([this, KJ_MVCAP(textId)]() mutable -> Identity::Client {
+      auto iter = liveIdentities.find(textId);
+      if (iter != liveIdentities.end() && iter->second.generation == identityGeneration) {
+        return iter->second.identity;
+      } else {
+        return reloadIdentity(kj::mv(textId));
+      }
+    });
   }
 
   kj::Maybe<SessionContext::Client&> findSessionContext(const kj::StringPtr& id) {
@@ -1264,35 +1382,61 @@ public:
 
   kj::Maybe<SessionInfo::Reader> findSessionInfo(const kj::StringPtr& id) {
     KJ_IF_MAYBE(record, findInMap(sessions, id)) {
-      return record->sessionInfo;
+      return *record->sessionInfo;
     } else {
       return nullptr;
     }
   }
 
   void eraseSession(const kj::StringPtr& id) {
-    sessions.erase(id);
+    // Drop one reference to the session. The record is removed once every WebSessionImpl that
+    // registered this ID has been destroyed.
+    auto iter = sessions.find(id);
+    if (iter != sessions.end() && --iter->second.refcount == 0) {
+      sessions.erase(iter);
+    }
   }
 
   void insertSession(const kj::StringPtr& id, SessionContext::Client& session, SessionInfo::Reader sessionInfo) {
-    sessions.insert({
-      kj::StringPtr(id),
-      SessionRecord {session, sessionInfo}
-    });
+    // Add a reference to the session, creating the record if needed. Each call must be balanced
+    // by a call to eraseSession().
+    auto iter = sessions.find(id);
+    if (iter == sessions.end()) {
+      auto textId = kj::heapString(id);
+      kj::StringPtr key = textId;
+      sessions.insert(std::make_pair(key,
+          SessionRecord { kj::mv(textId), session, capnp::clone(sessionInfo), 1 }));
+    } else {
+      // The same session was opened again (e.g. after the previous WebSession was dropped but
+      // before it was destroyed). The most recent one wins.
+      iter->second.sessionCtx = session;
+      iter->second.sessionInfo = capnp::clone(sessionInfo);
+      ++iter->second.refcount;
+    }
+  }
+
+  void getStats(SandstormHttpBridge::GetStatsResults::Builder results) {
+    results.setLiveSessions(sessions.size());
+    results.setCachedIdentities(liveIdentities.size());
+    results.setEvictedIdentities(evictedIdentityCount);
+    results.setSweptTrashEntries(sweptTrashCount);
   }
 
 private:
   SandstormApi<BridgeObjectId>::Client apiCap;
   spk::BridgeConfig::Reader config;
+  kj::Timer& timer;
   kj::AutoCloseFd identitiesDir;
   kj::AutoCloseFd trashDir;
 
   struct SessionRecord {
-    SessionRecord(const SessionRecord& other) = default;
+    SessionRecord(const SessionRecord& other) = delete;
     SessionRecord(SessionRecord&& other) = default;
 
-    SessionContext::Client& sessionCtx;
-    SessionInfo::Reader sessionInfo;
+    kj::String id;
+    SessionContext::Client sessionCtx;
+    kj::Own<SessionInfo::Reader> sessionInfo;
+    uint refcount;
   };
   std::map<kj::StringPtr, SessionRecord> sessions;
 
@@ -1302,11 +1446,155 @@ private:
 
     kj::String textId;
     Identity::Client identity;
+    kj::TimePoint lastUsed;
+
+    uint generation;
+    // Value of `identityGeneration` when `identity` was obtained. If it's no longer current,
+    // `identity` is known to be disconnected.
   };
   std::map<kj::StringPtr, IdentityRecord> liveIdentities;
+  // Identity caps we've restored or been handed recently. Entries that go unused for
+  // IDENTITY_IDLE_TIMEOUT are evicted, as are the least-recently-used entries beyond
+  // MAX_CACHED_IDENTITIES; they'll be restored from `identitiesDir` again if needed.
+
+  uint identityGeneration = 0;
+  // Incremented whenever we find that our cached identity caps have become disconnected. They all
+  // reach us through the same connection, so when one breaks, they all do.
+
+  kj::Maybe<kj::ForkedPromise<void>> livenessCheck;
+  bool livenessCheckDone = false;
+  kj::TimePoint lastLivenessCheck = kj::origin<kj::TimePoint>();
+  // The most recent check of whether cached identities are still connected. Calls to
+  // loadIdentity() made while a check is in flight share it rather than each pinging their own
+  // cap.
+
+  static constexpr auto LIVENESS_CHECK_INTERVAL = 1 * kj::SECONDS;
+
+  uint64_t evictedIdentityCount = 0;
+  uint64_t sweptTrashCount = 0;
+
+  std::set<kj::String> pendingDrops;
+  // Trash entries whose drop() is in flight, which sweepTrash() leaves alone. (Declared before
+  // `tasks`, whose drop() tasks remove themselves from it when destroyed.)
 
   kj::TaskSet tasks;
 
+  static constexpr auto CLEANUP_PERIOD = 5 * kj::MINUTES;
+  static constexpr auto IDENTITY_IDLE_TIMEOUT = 30 * kj::MINUTES;
+  static constexpr size_t MAX_CACHED_IDENTITIES = 1024;
+
+  static constexpr size_t TRASH_SWEEP_BATCH_SIZE = 64;
+  // Max number of drop()s to retry per cleanup pass, so that a big backlog of trash is cleared
+  // gradually rather than in one burst of drop() calls.
+
+  kj::String trashSweepCursor;
+  // Name of the last trash entry the previous pass retried. Each pass picks up after it, in name
+  // order, so that entries whose drop() keeps failing don't keep the rest from being reached.
+
+  kj::Promise<void> cleanupLoop() {
+    return timer.afterDelay(CLEANUP_PERIOD).then([this]() {
+      // A pass that fails (e.g. on an I/O error) mustn't stop the ones after it.
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() { evictIdleIdentities(); })) {
+        KJ_LOG(ERROR, "identity eviction failed", *exception);
+      }
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() { sweepTrash(); })) {
+        KJ_LOG(ERROR, "trash sweep failed", *exception);
+      }
+      return cleanupLoop();
+    });
+  }
+
+  void evictIdleIdentities() {
+    auto now = timer.now();
+
+    // TODO(perf): If we were more clever we could make this O(number of expired entries) rather
+    //   than O(number of entries), but with entries capped at MAX_CACHED_IDENTITIES it doesn't
+    //   matter.
+    auto iter = liveIdentities.begin();
+    while (iter != liveIdentities.end()) {
+      auto next = iter;
+      ++next;
+      if (now - iter->second.lastUsed >= IDENTITY_IDLE_TIMEOUT) {
+        liveIdentities.erase(iter);
+        ++evictedIdentityCount;
+      }
+      iter = next;
+    }
+
+    if (liveIdentities.size() > MAX_CACHED_IDENTITIES) {
+      // Still too many. Evict the least-recently-used down to the limit.
+      kj::Vector<std::map<kj::StringPtr, IdentityRecord>::iterator> entries(liveIdentities.size());
+      for (auto i = liveIdentities.begin(); i != liveIdentities.end(); ++i) {
+        entries.add(i);
+      }
+      size_t excess = entries.size() - MAX_CACHED_IDENTITIES;
+      std::nth_element(entries.begin(), entries.begin() + excess, entries.end(),
+          [](auto& a, auto& b) { return a->second.lastUsed < b->second.lastUsed; });
+      for (auto& entry: entries.asPtr().slice(0, excess)) {
+        liveIdentities.erase(entry);
+        ++evictedIdentityCount;
+      }
+    }
+  }
+
+  void sweepTrash() {
+    // Garbage-collect the trash directory. Entries normally remove themselves as soon as the
+    // drop() in dropIdentity() completes; anything still around a full cleanup period later means
+    // that drop() never finished (e.g. the grain shut down first), so retry it.
+
+    auto now = time(nullptr);
+    auto minAgeSeconds = CLEANUP_PERIOD / kj::SECONDS;
+
+    auto names = listDirectoryFd(trashDir);
+    std::sort(names.begin(), names.end());
+    auto start = std::upper_bound(names.begin(), names.end(), trashSweepCursor) - names.begin();
+
+    size_t retried = 0;
+    for (auto i: kj::indices(names)) {
+      if (retried >= TRASH_SWEEP_BATCH_SIZE) break;
+      auto& name = names[(start + i) % names.size()];
+      if (pendingDrops.count(name) != 0) continue;
+
+      struct stat stats;
+      KJ_SYSCALL_HANDLE_ERRORS(fstatat(trashDir, name.cStr(), &stats, AT_SYMLINK_NOFOLLOW)) {
+        case ENOENT:
+          // Already removed by a drop() that just completed.
+          continue;
+        default:
+          KJ_FAIL_SYSCALL("fstatat(trash)", error, name);
+      }
+      // Entries are renamed here from `identities`, and rename() leaves a symlink's mtime alone but
+      // updates its ctime, so the ctime is when the entry was trashed.
+      if (now - stats.st_ctime < minAgeSeconds) continue;
+
+      ++retried;
+      trashSweepCursor = kj::heapString(name);
+      dropTrashed(kj::mv(name), true);
+    }
+  }
+
+  void dropTrashed(kj::String name, bool isRetry) {
+    // Calls drop() on the token that the trash entry `name` is named after (percent-encoded), and
+    // removes the entry once that succeeds.
+
+    auto req = apiCap.dropRequest();
+    req.setToken(kj::decodeBinaryUriComponent(name));
+    pendingDrops.insert(kj::heapString(name));
+    auto unpend = kj::defer([this, pending = kj::heapString(name)]() {
+      pendingDrops.erase(pending);
+    });
+    tasks.add(req.send().then([KJ_MVCAP(name), isRetry, this](auto response) -> void {
+      KJ_SYSCALL_HANDLE_ERRORS(unlinkat(trashDir, name.cStr(), 0)) {
+        case ENOENT:
+          // Replaced and removed by a newer drop() of the same token.
+          break;
+        default:
+          KJ_FAIL_SYSCALL("unlinkat(trash)", error, name);
+      }
+      if (isRetry) ++sweptTrashCount;
+    }).attach(kj::mv(unpend)));
+  }
+
   virtual void taskFailed(kj::Exception&& exception) override {
     KJ_LOG(ERROR, exception);
   }
@@ -1331,6 +1619,75 @@ private:
                     O_RDONLY | O_DIRECTORY | O_CLOEXEC);
   }
 
+  kj::Promise<void> checkLiveness(Identity::Client sample) {
+    // Verify that the cached identity caps are still connected, bumping `identityGeneration` if
+    // not. `sample` is the cap to probe if a new check needs to be started.
+
+    if (!livenessCheckDone) {
+      KJ_IF_MAYBE(check, livenessCheck) {
+        return check->addBranch();
+      }
+    }
+
+    // Send a dummy call to check. We'll use a known-invalid type ID / method number and expect
+    // to get an UNIMPLEMENTED error.
+    auto ping = sample.typelessRequest(0, 65535, capnp::MessageSize { 4, 0 });
+    ping.initAsAnyStruct(0, 0);
+    auto generation = identityGeneration;
+    livenessCheckDone = false;
+    auto promise = ping.send().then([](auto&&) {
+      // Weird, we shouldn't get here.
+      KJ_LOG(ERROR, "dummy ping request should have failed with UNIMPLEMENTED");
+
+      // But clearly we are still connected, so continue.
+    }, [this, generation](kj::Exception&& e) {
+      if (e.getType() == kj::Exception::Type::DISCONNECTED && identityGeneration == generation) {
+        // Disconnected. Every cached identity will need to be reloaded from disk.
+        ++identityGeneration;
+      }
+      // Some other error -- meaning we're NOT disconnected.
+    }).then([this]() {
+      lastLivenessCheck = timer.now();
+      livenessCheckDone = true;
+    }).fork();
+
+    auto result = promise.addBranch();
+    livenessCheck = kj::mv(promise);
+    return kj::mv(result);
+  }
+
+  Identity::Client reloadIdentity(kj::String textId) {
+    // Restore the identity from disk and (re)place it in the map, so that concurrent and
+    // subsequent loadIdentity() calls for the same ID share the restore.
+
+    Identity::Client identity = loadIdentityFromDisk(textId);
+    auto generation = identityGeneration;
+
+    auto iter = liveIdentities.find(textId);
+    if (iter == liveIdentities.end()) {
+      auto recordId = kj::heapString(textId);
+      kj::StringPtr recordIdRef = recordId;
+      liveIdentities.insert(std::make_pair(recordIdRef,
+          IdentityRecord { kj::mv(recordId), identity, timer.now(), generation }));
+    } else {
+      iter->second.identity = identity;
+      iter->second.lastUsed = timer.now();
+      iter->second.generation = generation;
+    }
+
+    tasks.add(identity.whenResolved().catch_(
+        [this, KJ_MVCAP(textId), generation](kj::Exception&& e) {
+      // Couldn't restore. Forget it so that the next call tries again; the returned capability
+      // will report the error upon use.
+      auto iter = liveIdentities.find(textId);
+      if (iter != liveIdentities.end() && iter->second.generation == generation) {
+        liveIdentities.erase(iter);
+      }
+    }));
+
+    return identity;
+  }
+
   Identity::Client loadIdentityFromDisk(kj::StringPtr textId) {
     KJ_ASSERT(textId.size() == 32, "invalid identity ID", textId);
     for (char c: textId) {
@@ -1351,14 +1708,14 @@ private:
     return req.send().getCap().castAs<Identity>();
   }
 
-  void saveIdentityInternal(kj::StringPtr textId, Identity::Client identity) {
+  void saveIdentityInternal(kj::String textId, Identity::Client identity) {
     // Writes the identity to disk, assuming that either we have not saved this identity yet
     // or we have recently observed our existing save to be broken.
 
     auto req = apiCap.saveRequest();
     req.setCap(identity);
     req.initLabel().setDefaultText("user identity");
-    tasks.add(req.send().then([this,textId](auto result) -> void {
+    tasks.add(req.send().then([this,KJ_MVCAP(textId)](auto result) -> void {
       // Sandstorm tokens are primarily text but use percent-encoding to be safe.
       auto tokenText = kj::encodeUriComponent(result.getToken());
 
@@ -1389,15 +1746,10 @@ private:
       auto trashSymlink = kj::heapString(buf);
       KJ_SYSCALL(renameat(identitiesDir, symlink.cStr(), trashDir, trashSymlink.cStr()));
 
-      auto req = apiCap.dropRequest();
-      req.setToken(kj::decodeBinaryUriComponent(buf));
-      tasks.add(req.send().then([KJ_MVCAP(trashSymlink), this](auto response) -> void {
-        KJ_SYSCALL(unlinkat(trashDir, trashSymlink.cStr(), 0));
-      }));
-
-      // TODO(someday): Implement some kind of garbage collection that clears out the trash
-      // directory periodically, to handle the rare case when the above drop() task fails to
-      // run to completion.
+      // If this drop() fails to run to completion, sweepTrash() will retry it later.
+      if (pendingDrops.count(trashSymlink) == 0) {
+        dropTrashed(kj::mv(trashSymlink), false);
+      }
     }
   }
 };
@@ -2039,53 +2391,50 @@ public:
     auto email = context.getParams().getEmail();
     auto id = genRandomString();
 
-    // TODO(perf): The following does a lot more copying than necessary.
+    // Write to temp file. Prefix name with _ in case `id` starts with '.'.
+    auto tmpFilename = kj::str("/var/mail/tmp/_", id);
+    auto mailFd = raiiOpen(tmpFilename, O_WRONLY | O_CREAT | O_EXCL);
 
-    // Construct the mail file.
-    kj::Vector<kj::String> lines;
+    // Construct the mail file. The text parts are written straight out of the incoming message,
+    // without copying; only the attachments need to be transformed (base64-encoded).
+    MessageWriter out(mailFd);
 
-    addDateHeader(lines, email.getDate());
+    addDateHeader(out, email.getDate());
 
-    addHeader(lines, "To", email.getTo());
-    addHeader(lines, "From", email.getFrom());
-    addHeader(lines, "Reply-To", email.getReplyTo());
-    addHeader(lines, "CC", email.getCc());
-    addHeader(lines, "BCC", email.getBcc());
-    addHeader(lines, "Subject", email.getSubject());
+    addHeader(out, "To", email.getTo());
+    addHeader(out, "From", email.getFrom());
+    addHeader(out, "Reply-To", email.getReplyTo());
+    addHeader(out, "CC", email.getCc());
+    addHeader(out, "BCC", email.getBcc());
+    addHeader(out, "Subject", email.getSubject());
 
-    addHeader(lines, "Message-Id", email.getMessageId());
-    addHeader(lines, "References", email.getReferences());
-    addHeader(lines, "In-Reply-To", email.getInReplyTo());
+    addHeader(out, "Message-Id", email.getMessageId());
+    addHeader(out, "References", email.getReferences());
+    addHeader(out, "In-Reply-To", email.getInReplyTo());
 
-    addHeader(lines, "Content-Type",
+    addHeader(out, "Content-Type",
         kj::str("multipart/alternative; boundary=", id));
 
-    lines.add(nullptr);  // blank line starts body.
+    out.addLine("");  // blank line starts body.
 
     if (email.hasText()) {
-      lines.add(kj::str("--", id));
-      addHeader(lines, "Content-Type", kj::str("text/plain; charset=UTF-8"));
-      lines.add(nullptr);
-      lines.add(kj::str(email.getText()));
+      out.addLine(kj::str("--", id));
+      addHeader(out, "Content-Type", "text/plain; charset=UTF-8");
+      out.addLine("");
+      out.addLine(email.getText());
     }
     if (email.hasHtml()) {
-      lines.add(kj::str("--", id));
-      addHeader(lines, "Content-Type", kj::str("text/html; charset=UTF-8"));
-      lines.add(nullptr);
-      lines.add(kj::str(email.getHtml()));
+      out.addLine(kj::str("--", id));
+      addHeader(out, "Content-Type", "text/html; charset=UTF-8");
+      out.addLine("");
+      out.addLine(email.getHtml());
     }
     for (auto attachment : email.getAttachments()) {
-      addAttachment(lines, id, attachment);
+      addAttachment(out, id, attachment);
     }
-    lines.add(kj::str("--", id, "--"));
-
-    lines.add(nullptr);
-    auto text = kj::strArray(lines, "\n");
+    out.addLine(kj::str("--", id, "--"));
 
-    // Write to temp file. Prefix name with _ in case `id` starts with '.'.
-    auto tmpFilename = kj::str("/var/mail/tmp/_", id);
-    auto mailFd = raiiOpen(tmpFilename, O_WRONLY | O_CREAT | O_EXCL);
-    kj::FdOutputStream((int)mailFd).write(text.begin(), text.size());
+    out.flush();
     mailFd = nullptr;
 
     // Move to final location.
@@ -2095,6 +2444,69 @@ public:
   }
 
 private:
+  class MessageWriter {
+    // Builds up a mail file as a list of byte ranges, most of which point directly into the
+    // EmailMessage we were given, and writes them out with writev().
+
+  public:
+    explicit MessageWriter(int fd): output(fd) {}
+
+    void add(kj::ArrayPtr<const char> text) {
+      // Append `text`, which must stay valid until the next flush().
+      pieces.add(text.asBytes());
+    }
+
+    void add(kj::String&& text) {
+      add(text.asArray());
+      owned.add(kj::mv(text));
+    }
+
+    void addLine(kj::StringPtr line) {
+      add(line);
+      add(NEWLINE);
+    }
+
+    void addLine(kj::String&& line) {
+      add(kj::mv(line));
+      add(NEWLINE);
+    }
+
+    void addBase64(kj::ArrayPtr<const byte> data) {
+      // Append `data` base64-encoded in 76-column lines, per RFC 2045. We encode a block at a time
+      // and flush after each, so that a large attachment is never held in memory encoded in full.
+
+      static constexpr size_t BYTES_PER_LINE = 57;  // encodes to 76 chars
+      static constexpr size_t CHARS_PER_LINE = 76;
+      static constexpr size_t BYTES_PER_BLOCK = BYTES_PER_LINE * 1024;
+
+      while (data.size() > 0) {
+        auto block = data.slice(0, kj::min(data.size(), BYTES_PER_BLOCK));
+        data = data.slice(block.size(), data.size());
+
+        auto encoded = kj::encodeBase64(block, false);
+        for (size_t i = 0; i < encoded.size(); i += CHARS_PER_LINE) {
+          add(encoded.slice(i, kj::min(encoded.size(), i + CHARS_PER_LINE)));
+          add(NEWLINE);
+        }
+        owned.add(kj::mv(encoded));
+        flush();
+      }
+    }
+
+    void flush() {
+      output.write(pieces.asPtr());
+      pieces.clear();
+      owned.clear();
+    }
+
+  private:
+    kj::FdOutputStream output;
+    kj::Vector<kj::ArrayPtr<const byte>> pieces;
+    kj::Vector<kj::String> owned;
+
+    static constexpr kj::StringPtr NEWLINE = "\n"_kj;
+  };
+
   static kj::String genRandomString() {
     // Generate a unique random string.
 
@@ -2126,9 +2538,19 @@ private:
     return kj::String(chars.finish());
   }
 
-  static void addHeader(kj::Vector<kj::String>& lines, kj::StringPtr name, kj::StringPtr value) {
+  static void addHeader(MessageWriter& out, kj::StringPtr name, kj::StringPtr value) {
+    if (value.size() > 0) {
+      out.add(name);
+      out.add(HEADER_SEPARATOR);
+      out.addLine(value);
+    }
+  }
+
+  static void addHeader(MessageWriter& out, kj::StringPtr name, kj::String&& value) {
     if (value.size() > 0) {
-      lines.add(kj::str(name, ": ", value));
+      out.add(name);
+      out.add(HEADER_SEPARATOR);
+      out.addLine(kj::mv(value));
     }
   }
 
@@ -2142,42 +2564,45 @@ private:
     }
   }
 
-  static void addHeader(kj::Vector<kj::String>& lines, kj::StringPtr name,
+  static void addHeader(MessageWriter& out, kj::StringPtr name,
                         EmailAddress::Reader email) {
-    addHeader(lines, name, formatAddress(email));
+    addHeader(out, name, formatAddress(email));
   }
 
-  static void addHeader(kj::Vector<kj::String>& lines, kj::StringPtr name,
+  static void addHeader(MessageWriter& out, kj::StringPtr name,
                         capnp::List<EmailAddress>::Reader emails) {
-    addHeader(lines, name, kj::strArray(KJ_MAP(e, emails) { return formatAddress(e); }, ", "));
+    addHeader(out, name, kj::strArray(KJ_MAP(e, emails) { return formatAddress(e); }, ", "));
   }
 
-  static void addHeader(kj::Vector<kj::String>& lines, kj::StringPtr name,
+  static void addHeader(MessageWriter& out, kj::StringPtr name,
                         capnp::List<capnp::Text>::Reader items) {
     // Used for lists of message IDs (e.g. References an In-Reply-To). Each ID should be "quoted"
     // with <>.
-    addHeader(lines, name, kj::strArray(KJ_MAP(i, items) { return kj::str('<', i, '>'); }, " "));
+    addHeader(out, name, kj::strArray(KJ_MAP(i, items) { return kj::str('<', i, '>'); }, " "));
   }
 
-  static void addDateHeader(kj::Vector<kj::String>& lines, int64_t nanoseconds) {
+  static void addDateHeader(MessageWriter& out, int64_t nanoseconds) {
     time_t seconds(nanoseconds / 1000000000u);
     struct tm *tm = gmtime(&seconds);
     char date[40];
     strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %z", tm);
 
-    addHeader(lines, "Date", date);
+    addHeader(out, "Date", kj::heapString(date));
   }
 
-  static void addAttachment(kj::Vector<kj::String>& lines, kj::StringPtr boundaryId, EmailAttachment::Reader & attachment) {
-    lines.add(kj::str("--", boundaryId));
-    addHeader(lines, "Content-Type", attachment.getContentType());
-    addHeader(lines, "Content-Disposition", attachment.getContentDisposition());
-    addHeader(lines, "Content-Transfer-Encoding", "base64");
-    addHeader(lines, "Content-Id", attachment.getContentId());
-    lines.add(nullptr);
+  static void addAttachment(MessageWriter& out, kj::StringPtr boundaryId,
+                            EmailAttachment::Reader attachment) {
+    out.addLine(kj::str("--", boundaryId));
+    addHeader(out, "Content-Type", attachment.getContentType());
+    addHeader(out, "Content-Disposition", attachment.getContentDisposition());
+    addHeader(out, "Content-Transfer-Encoding", "base64");
+    addHeader(out, "Content-Id", attachment.getContentId());
+    out.addLine("");
 
-    lines.add(kj::encodeBase64(attachment.getContent(), true));
+    out.addBase64(attachment.getContent());
   }
+
+  static constexpr kj::StringPtr HEADER_SEPARATOR = ": "_kj;
 };
 
 class RequestSessionImpl final: public WebSession::Server {
@@ -2379,6 +2804,11 @@ public:
     return kj::READY_NOW;
   }
 
+  kj::Promise<void> getStats(GetStatsContext context) override {
+    bridgeContext.getStats(context.getResults());
+    return kj::READY_NOW;
+  }
+
   kj::Promise<void> saveIdentity(SaveIdentityContext context) override {
     auto identity = context.getParams().getIdentity();
     context.releaseParams();
@@ -2822,35 +3252,100 @@ public:
 
   kj::Promise<void> connectLoop(kj::Own<kj::NetworkAddress>&& address,
                                 kj::Timer& timer,
+                                kj::TimePoint startTime,
                                 bool loggedSlowStartupMessage,
-                                int numTriesSoFar) {
-    return address->connect().then([loggedSlowStartupMessage](auto x) -> void {
-      if (loggedSlowStartupMessage) {
-        KJ_LOG(WARNING, "App successfully started listening for TCP connections!");
-      }
+                                kj::Duration retryDelay) {
+    return address->connect().then([this, &timer, startTime](auto x) -> void {
+      // Record how long the app took to come up. Cold-start latency is the thing users notice
+      // most, so it's useful to have this in the grain log.
+      auto elapsed = timer.now() - startTime;
+      context.warning(kj::str(
+          "** HTTP-BRIDGE: App started listening for TCP connections after ",
+          elapsed / kj::MILLISECONDS, " ms (",
+          sawReadinessNotification ? "notified via NOTIFY_SOCKET" : "detected by polling", ")."));
     }).catch_(
-        [KJ_MVCAP(address), &timer, loggedSlowStartupMessage, numTriesSoFar, this]
+        [KJ_MVCAP(address), &timer, startTime, loggedSlowStartupMessage, retryDelay, this]
         (kj::Exception&& e) mutable {
-      if (!loggedSlowStartupMessage) {
-        numTriesSoFar++;
-      }
-      if (!loggedSlowStartupMessage && numTriesSoFar == (30 * 100)) {
-        // After 30 seconds (30 * 100 centiseconds) of failure, log a message once.
+      if (!loggedSlowStartupMessage && timer.now() - startTime >= 30 * kj::SECONDS) {
+        // After 30 seconds of failure, log a message once.
         KJ_LOG(WARNING, "App isn't listening for TCP connections after 30 seconds. Continuing "
                "to attempt to connect",
                address->toString());
         loggedSlowStartupMessage = true;
       }
-      // Wait 10ms and try again.
-      return timer.afterDelay(10 * kj::MILLISECONDS).then(
-          [KJ_MVCAP(address), &timer, loggedSlowStartupMessage, numTriesSoFar, this]
+
+      // Wait and try again. We poll quickly during the first second since most apps are up by
+      // then, but back off after that so that slow-booting apps don't eat thousands of failed
+      // connects. Apps that send a readiness notification cut the wait short, so they get no
+      // polling slack at all.
+      kj::Promise<void> wait = timer.afterDelay(retryDelay);
+      if (!sawReadinessNotification) {
+        KJ_IF_MAYBE(r, readinessNotification) {
+          wait = wait.exclusiveJoin(r->addBranch().then([this]() {
+            sawReadinessNotification = true;
+          }));
+        }
+      }
+      if (timer.now() - startTime >= 1 * kj::SECONDS) {
+        retryDelay = kj::min(retryDelay * 2, MAX_CONNECT_RETRY_DELAY);
+      }
+
+      return wait.then(
+          [KJ_MVCAP(address), &timer, startTime, loggedSlowStartupMessage, retryDelay, this]
           () mutable -> kj::Promise<void> {
-        return connectLoop(kj::mv(address), timer,
-                           loggedSlowStartupMessage, numTriesSoFar);
+        return connectLoop(kj::mv(address), timer, startTime,
+                           loggedSlowStartupMessage, retryDelay);
       });
     });
   }
 
+  static constexpr kj::Duration MIN_CONNECT_RETRY_DELAY = 10 * kj::MILLISECONDS;
+  static constexpr kj::Duration MAX_CONNECT_RETRY_DELAY = 160 * kj::MILLISECONDS;
+
+  static constexpr const char* READINESS_SOCKET_PATH = "/tmp/sandstorm-notify";
+
+  kj::AutoCloseFd openReadinessSocket() {
+    // Creates the datagram socket whose path we pass to the app in $NOTIFY_SOCKET. Apps (or
+    // their frameworks) which support systemd's sd_notify() protocol will send "READY=1" here
+    // once they're listening, which lets us skip the rest of the polling delay. Apps that don't
+    // know about it are unaffected; we keep polling for them.
+
+    int sockFd;
+    KJ_SYSCALL(sockFd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+    kj::AutoCloseFd result(sockFd);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, READINESS_SOCKET_PATH);
+
+    unlink(READINESS_SOCKET_PATH);  // Clear stale socket, if any.
+    KJ_SYSCALL(bind(result, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)));
+    return result;
+  }
+
+  kj::Promise<void> readinessLoop(kj::UnixEventPort::FdObserver& observer, int sockFd) {
+    for (;;) {
+      char buffer[1024];
+      ssize_t n;
+      KJ_NONBLOCKING_SYSCALL(n = recv(sockFd, buffer, sizeof(buffer), 0));
+      if (n < 0) {
+        // EAGAIN; wait for more.
+        return observer.whenBecomesReadable().then([this, &observer, sockFd]() {
+          return readinessLoop(observer, sockFd);
+        });
+      }
+
+      // sd_notify() messages are newline-separated VAR=VALUE assignments. We only care about
+      // READY=1; ignore everything else (STATUS=, MAINPID=, etc.).
+      for (auto line: split(kj::arrayPtr(buffer, n), '\n')) {
+        if (trimArray(line) == kj::StringPtr("READY=1").asArray()) {
+          return kj::READY_NOW;
+        }
+      }
+    }
+  }
+
   class ErrorHandlerImpl: public kj::TaskSet::ErrorHandler {
   public:
     void taskFailed(kj::Exception&& exception) override {
@@ -2866,6 +3361,10 @@ public:
     KJ_SYSCALL(setenv("HTTP_PROXY", proxyEnv.cStr(), true));
     KJ_SYSCALL(setenv("no_proxy", "localhost,127.0.0.1", true));
 
+    // Bind the readiness socket before forking so that it already exists when the app starts.
+    auto readinessFd = openReadinessSocket();
+    KJ_SYSCALL(setenv("NOTIFY_SOCKET", READINESS_SOCKET_PATH, true));
+
     pid_t child;
     KJ_SYSCALL(child = fork());
     if (child == 0) {
@@ -2910,8 +3409,17 @@ public:
             "** HTTP-BRIDGE: Uncaught exception waiting for child process:\n", e));
       });
 
-      auto connectPromise =
-        connectLoop(address->clone(), ioContext.provider->getTimer(), false, 0);
+      kj::UnixEventPort::FdObserver readinessObserver(
+          ioContext.unixEventPort, readinessFd, kj::UnixEventPort::FdObserver::OBSERVE_READ);
+      readinessNotification = readinessLoop(readinessObserver, readinessFd)
+          .eagerlyEvaluate([](kj::Exception&& e) -> kj::Promise<void> {
+        KJ_LOG(ERROR, "error reading app readiness notifications", e);
+        return kj::NEVER_DONE;
+      }).fork();
+
+      auto& timer = ioContext.provider->getTimer();
+      auto connectPromise = connectLoop(address->clone(), timer, timer.now(), false,
+                                        MIN_CONNECT_RETRY_DELAY);
 
       // We potentially re-traverse the BridgeConfig on every request, so make sure to max out the
       // traversal limit.
@@ -2922,7 +3430,7 @@ public:
       auto config = reader.getRoot<spk::BridgeConfig>();
 
       auto apiPaf = kj::newPromiseAndFulfiller<SandstormApi<BridgeObjectId>::Client>();
-      BridgeContext bridgeContext(kj::mv(apiPaf.promise), config);
+      BridgeContext bridgeContext(kj::mv(apiPaf.promise), config, ioContext.provider->getTimer());
 
       kj::Maybe<kj::Own<kj::Promise<AppHooks<>::Client>>> appHooksPromise = nullptr;
 
@@ -3000,6 +3508,11 @@ private:
   kj::Own<SaveMembranePolicy> appMembranePolicy;
   kj::Maybe<kj::Own<kj::PromiseFulfiller<AppHooks<>::Client>>> appHooksFulfiller;
 
+  kj::Maybe<kj::ForkedPromise<void>> readinessNotification;
+  // Resolves when the app sends READY=1 to $NOTIFY_SOCKET (which it may never do).
+
+  bool sawReadinessNotification = false;
+
   kj::Promise<int> onChildExit(pid_t pid) {
     int status;
     int waitResult;
@@ -0,0 +1,137 @@
+// This program prints the syscall-number dispatch for filter.s, generated from the policy table
+// in syscall-policy.h.
+//
+// Rather than comparing the syscall number against every entry in turn, which costs up to a
+// couple hundred instructions on every syscall the app makes, we emit a balanced binary search:
+// each internal node is a single `jge`, and each leaf compares against a handful of syscalls
+// and then either returns directly or jumps to the argument checks in filter.s. A syscall thus
+// runs through about a dozen instructions regardless of where it sits in the table.
+//
+// The output expects the syscall number in the accumulator. Syscalls that don't appear in the
+// table get ENOSYS.
+
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct rule {
+  unsigned int nr;
+  const char* name;
+  const char* action;  // bpf_asm instruction to execute on a match
+};
+
+#define ALLOW(name) { SYS_##name, #name, "ret #SECCOMP_RET_ALLOW" },
+#define CHECK_ARGS(name, label) { SYS_##name, #name, "jmp " #label },
+#define RETURN(name, value) { SYS_##name, #name, "ret #" #value },
+
+static struct rule rules[] = {
+#include "syscall-policy.h"
+};
+
+#undef ALLOW
+#undef CHECK_ARGS
+#undef RETURN
+
+#define RULE_COUNT (sizeof(rules) / sizeof(rules[0]))
+
+// Leaves compare against at most this many syscalls. Smaller leaves make the tree deeper; larger
+// ones make the linear part longer. Four keeps both around the same size.
+#define LEAF_SIZE 4
+
+// BPF conditional jumps have 8-bit offsets.
+#define MAX_COND_JUMP 255
+
+static int labelCounter = 0;
+
+static int compareRules(const void* a, const void* b) {
+  unsigned int x = ((const struct rule*)a)->nr;
+  unsigned int y = ((const struct rule*)b)->nr;
+  return x < y ? -1 : x > y;
+}
+
+static size_t firstWithSameAction(size_t lo, size_t i) {
+  // Within a leaf, syscalls with the same action share a single copy of it.
+  size_t j;
+  for (j = lo; j < i; j++) {
+    if (strcmp(rules[j].action, rules[i].action) == 0) break;
+  }
+  return j;
+}
+
+static size_t treeSize(size_t lo, size_t hi);
+
+static int needsFarJump(size_t lo, size_t mid) {
+  return treeSize(lo, mid) > MAX_COND_JUMP;
+}
+
+static size_t treeSize(size_t lo, size_t hi) {
+  // Number of instructions emitTree(lo, hi) will print.
+  if (hi - lo <= LEAF_SIZE) {
+    size_t size = hi - lo + 1;  // a jeq per syscall, plus ret ENOSYS
+    for (size_t i = lo; i < hi; i++) {
+      if (firstWithSameAction(lo, i) == i) size++;
+    }
+    return size;
+  } else {
+    size_t mid = lo + (hi - lo) / 2;
+    return 1 + needsFarJump(lo, mid) + treeSize(lo, mid) + treeSize(mid, hi);
+  }
+}
+
+static void emitLeaf(size_t lo, size_t hi) {
+  int label = labelCounter++;
+
+  for (size_t i = lo; i < hi; i++) {
+    printf("    jeq #SYS_%s, leaf_%d_%zu\n", rules[i].name, label, firstWithSameAction(lo, i));
+  }
+  printf("    ret #RET_ENOSYS\n");
+  for (size_t i = lo; i < hi; i++) {
+    if (firstWithSameAction(lo, i) == i) {
+      printf("leaf_%d_%zu: %s\n", label, i, rules[i].action);
+    }
+  }
+}
+
+static void emitTree(size_t lo, size_t hi) {
+  if (hi - lo <= LEAF_SIZE) {
+    emitLeaf(lo, hi);
+    return;
+  }
+
+  size_t mid = lo + (hi - lo) / 2;
+  int label = labelCounter++;
+
+  if (needsFarJump(lo, mid)) {
+    // The left subtree is too big to jump over conditionally, so hop via an unconditional jump.
+    printf("    jge #SYS_%s, tree_%d_far, tree_%d_left\n", rules[mid].name, label, label);
+    printf("tree_%d_far: jmp tree_%d_right\n", label, label);
+    printf("tree_%d_left:\n", label);
+  } else {
+    printf("    jge #SYS_%s, tree_%d_right\n", rules[mid].name, label);
+  }
+
+  emitTree(lo, mid);
+  printf("tree_%d_right:\n", label);
+  emitTree(mid, hi);
+}
+
+int main(void) {
+  qsort(rules, RULE_COUNT, sizeof(rules[0]), compareRules);
+
+  for (size_t i = 1; i < RULE_COUNT; i++) {
+    if (rules[i].nr == rules[i - 1].nr) {
+      fprintf(stderr, "syscall-policy.h: %s and %s are the same syscall\n",
+              rules[i - 1].name, rules[i].name);
+      return 1;
+    }
+  }
+
+  printf("// Generated by gen-syscall-tree from syscall-policy.h. DO NOT EDIT.\n");
+  printf("// %zu syscalls, %zu instructions.\n", RULE_COUNT, treeSize(0, RULE_COUNT));
+  emitTree(0, RULE_COUNT);
+  return 0;
+}
+
+// vim: set ts=2 sw=2 et :
@@ -0,0 +1,236 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The sandbox's syscall policy, one line per syscall. gen-syscall-tree turns this into a
+// binary search on the syscall number (syscall-tree.s), which filter.s includes. Syscalls not
+// listed here fail with ENOSYS.
+//
+// The including file must define:
+//
+//   ALLOW(name)              The syscall is allowed regardless of its arguments.
+//   CHECK_ARGS(name, label)  Jump to `label` in filter.s, which examines the arguments.
+//   RETURN(name, value)      Deny the syscall, returning the seccomp action `value`, which is
+//                            one of the constants from constants.h.
+//
+// There's no need to keep this list sorted; the generator sorts it by syscall number.
+
+// These are all OK, regardless of arguments:
+ALLOW(accept)
+ALLOW(accept4)
+ALLOW(access)
+ALLOW(alarm)
+ALLOW(bind)
+ALLOW(brk)
+ALLOW(chdir)
+ALLOW(chmod)
+ALLOW(close)
+ALLOW(clock_getres)
+ALLOW(clock_gettime)
+ALLOW(clock_nanosleep)
+ALLOW(connect)
+ALLOW(creat)
+ALLOW(dup)
+ALLOW(dup2)
+ALLOW(dup3)
+ALLOW(epoll_create)
+ALLOW(epoll_create1)
+ALLOW(epoll_ctl)
+ALLOW(epoll_pwait)
+ALLOW(epoll_wait)
+ALLOW(eventfd)
+ALLOW(eventfd2)
+ALLOW(execve)
+ALLOW(exit)
+ALLOW(exit_group)
+ALLOW(faccessat)
+ALLOW(fchdir)
+ALLOW(fchmod)
+ALLOW(fchmodat)
+ALLOW(fcntl)
+ALLOW(fdatasync)
+ALLOW(flock)
+ALLOW(fork)
+ALLOW(fstat)
+ALLOW(fstatfs)
+ALLOW(fsync)
+ALLOW(ftruncate)
+ALLOW(futex)
+ALLOW(getcwd)
+ALLOW(getdents)
+ALLOW(getdents64)
+ALLOW(getegid)
+ALLOW(geteuid)
+ALLOW(getgid)
+ALLOW(getgroups)
+ALLOW(getitimer)
+ALLOW(getpeername)
+ALLOW(getpgid)
+ALLOW(getpgrp)
+ALLOW(getpid)
+ALLOW(getppid)
+ALLOW(getrandom)
+ALLOW(getresuid)
+ALLOW(getresgid)
+ALLOW(getrlimit)
+ALLOW(getrusage)
+ALLOW(getsid)
+ALLOW(getsockname)
+ALLOW(getsockopt)
+ALLOW(gettid)
+ALLOW(gettimeofday)
+ALLOW(getuid)
+ALLOW(inotify_add_watch)
+ALLOW(inotify_init)
+ALLOW(inotify_init1)
+ALLOW(inotify_rm_watch)
+ALLOW(kill)
+ALLOW(link)
+ALLOW(linkat)
+ALLOW(listen)
+ALLOW(lseek)
+ALLOW(lstat)
+ALLOW(mkdir)
+ALLOW(mkdirat)
+ALLOW(mremap)
+ALLOW(msync)
+ALLOW(munmap)
+ALLOW(nanosleep)
+ALLOW(newfstatat)
+ALLOW(open)
+ALLOW(openat)
+ALLOW(pause)
+ALLOW(pipe)
+ALLOW(pipe2)
+ALLOW(poll)
+ALLOW(ppoll)
+ALLOW(pread64)
+ALLOW(prlimit64)
+ALLOW(pselect6)
+ALLOW(pwrite64)
+ALLOW(read)
+ALLOW(readv)
+ALLOW(readlink)
+ALLOW(readlinkat)
+ALLOW(rename)
+ALLOW(renameat)
+ALLOW(rmdir)
+ALLOW(rt_sigaction)
+ALLOW(rt_sigpending)
+ALLOW(rt_sigprocmask)
+ALLOW(rt_sigqueueinfo)
+ALLOW(rt_sigreturn)
+ALLOW(rt_sigsuspend)
+ALLOW(rt_sigtimedwait)
+ALLOW(sched_getaffinity)
+ALLOW(sched_setaffinity)
+ALLOW(select)
+ALLOW(sendfile)
+ALLOW(set_tid_address)
+ALLOW(setitimer)
+ALLOW(setrlimit)
+ALLOW(setsid)
+ALLOW(shutdown)
+ALLOW(sigaltstack)
+ALLOW(signalfd)
+ALLOW(signalfd4)
+ALLOW(stat)
+ALLOW(statfs)
+ALLOW(symlink)
+ALLOW(symlinkat)
+ALLOW(sysinfo)
+ALLOW(tgkill)
+ALLOW(timer_create)
+ALLOW(timer_delete)
+ALLOW(timer_getoverrun)
+ALLOW(timer_gettime)
+ALLOW(timer_settime)
+ALLOW(timerfd_create)
+ALLOW(timerfd_gettime)
+ALLOW(timerfd_settime)
+ALLOW(times)
+ALLOW(tkill)
+ALLOW(truncate)
+ALLOW(umask)
+ALLOW(uname)
+ALLOW(unlink)
+ALLOW(unlinkat)
+ALLOW(utime)
+ALLOW(utimensat)
+ALLOW(utimes)
+ALLOW(vfork)
+ALLOW(wait4)
+ALLOW(write)
+ALLOW(writev)
+
+// Architecture specific: if we ever support non-x86_64
+// machines, we'll want to pay attention to this list:
+ALLOW(arch_prctl)
+
+// TODO: should we filter any of the flags for these?
+ALLOW(madvise)
+ALLOW(mmap)
+ALLOW(mprotect)
+ALLOW(recvfrom)
+ALLOW(recvmsg)
+ALLOW(sendmsg)
+ALLOW(sendto)
+ALLOW(setsockopt)
+
+// These might be okay; examine the arguments:
+CHECK_ARGS(clone, sys_clone)
+CHECK_ARGS(ioctl, sys_ioctl)
+// These both use the same filtering logic, so we
+// jump to the same place.
+CHECK_ARGS(socket, sys_socket)
+CHECK_ARGS(socketpair, sys_socket)
+
+// Anything else we deny. Depending on the syscall the
+// exact behavior differs, but nothing else is allowed
+// through.
+
+// Performance hints, so it's safe to silently no-op these. (SECCOMP_RET_ERRNO on its own
+// sets errno = 0.)
+RETURN(sched_yield, SECCOMP_RET_ERRNO)
+RETURN(fadvise64, SECCOMP_RET_ERRNO)
+
+// These would normally be denied without elevated privileges anyway, so return
+// the right error code:
+RETURN(chown, RET_EPERM)
+RETURN(chroot, RET_EPERM)
+RETURN(fchown, RET_EPERM)
+RETURN(fchownat, RET_EPERM)
+RETURN(lchown, RET_EPERM)
+RETURN(mount, RET_EPERM)
+
+// Extended file attribute calls. A filesystem might
+// genuinely not support these, so apps can reasonably be
+// expected to handle ENOTSUP:
+RETURN(getxattr, RET_ENOTSUP)
+RETURN(setxattr, RET_ENOTSUP)
+RETURN(listxattr, RET_ENOTSUP)
+RETURN(removexattr, RET_ENOTSUP)
+RETURN(fgetxattr, RET_ENOTSUP)
+RETURN(fsetxattr, RET_ENOTSUP)
+RETURN(flistxattr, RET_ENOTSUP)
+RETURN(fremovexattr, RET_ENOTSUP)
+
+// For some older syscalls, ENOSYS is implausible, so provide
+// more reasonable errors (preferably which can happen according
+// to the docs).
+RETURN(prctl, RET_EINVAL)
+RETURN(ptrace, RET_EPERM)
+
+// vim: set ts=2 sw=2 et :
@@ -0,0 +1,87 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "snapshot.h"
+#include "test-util.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+namespace sandstorm {
+namespace {
+
+KJ_TEST("snapshotTree copies a tree, or says it can't") {
+  // Most of this only runs if /tmp supports reflinks, which XFS and btrfs do and ext4 and tmpfs
+  // don't. A loopback-mounted XFS image will do.
+  TempDir dir;
+
+  KJ_SYSCALL(mkdir((dir / "grain").cStr(), 0770));
+  KJ_SYSCALL(mkdir((dir / "grain/sub").cStr(), 0755));
+  KJ_SYSCALL(mkdir((dir / "grain/empty").cStr(), 0700));
+  writeFile(dir / "grain/file", "hello\n");
+  writeFile(dir / "grain/sub/run.sh", "#!/bin/sh\n", 0755);
+  KJ_SYSCALL(symlink("file", (dir / "grain/link").cStr()));
+  KJ_SYSCALL(mkfifo((dir / "grain/fifo").cStr(), 0600));
+
+  struct timespec times[2] = { { 0, UTIME_OMIT }, { 1234567890, 0 } };
+  KJ_SYSCALL(utimensat(AT_FDCWD, (dir / "grain/file").cStr(), times, 0));
+  KJ_SYSCALL(utimensat(AT_FDCWD, (dir / "grain/sub").cStr(), times, 0));
+  KJ_SYSCALL(chmod((dir / "grain/sub").cStr(), 0555));
+  KJ_DEFER(chmod((dir / "grain/sub").cStr(), 0755));
+
+  if (!snapshotTree(dir / "grain", dir / "snapshot")) {
+    KJ_LOG(WARNING, "filesystem doesn't support reflinks; only checked that we noticed", dir.path);
+    return;
+  }
+
+  // Changes after the snapshot don't show up in it.
+  writeFile(dir / "grain/file", "changed\n");
+
+  KJ_EXPECT(readAll(dir / "snapshot/file") == "hello\n");
+  KJ_EXPECT(readAll(dir / "snapshot/sub/run.sh") == "#!/bin/sh\n");
+  KJ_EXPECT(readAll(dir / "snapshot/link") == "hello\n");
+  KJ_EXPECT(access((dir / "snapshot/fifo").cStr(), F_OK) < 0);
+
+  struct stat original, copy;
+  KJ_SYSCALL(stat((dir / "snapshot/file").cStr(), &copy));
+  KJ_EXPECT(copy.st_mtime == 1234567890);
+  KJ_EXPECT((copy.st_mode & 07777) == 0644);
+  KJ_SYSCALL(stat((dir / "snapshot/sub").cStr(), &copy));
+  KJ_EXPECT(copy.st_mtime == 1234567890);
+  KJ_EXPECT((copy.st_mode & 07777) == 0555);
+  KJ_SYSCALL(stat((dir / "snapshot/sub/run.sh").cStr(), &copy));
+  KJ_EXPECT((copy.st_mode & 07777) == 0755);
+  KJ_SYSCALL(stat((dir / "snapshot/empty").cStr(), &copy));
+  KJ_EXPECT(S_ISDIR(copy.st_mode));
+  KJ_SYSCALL(lstat((dir / "snapshot/link").cStr(), &copy));
+  KJ_EXPECT(S_ISLNK(copy.st_mode));
+
+  KJ_SYSCALL(stat((dir / "grain/sub/run.sh").cStr(), &original));
+  KJ_IF_MAYBE(origin, getSnapshotOrigin(dir / "snapshot/sub/run.sh")) {
+    KJ_EXPECT(origin->inode == original.st_ino);
+    KJ_EXPECT(origin->ctime.tv_sec == original.st_ctim.tv_sec);
+    KJ_EXPECT(origin->ctime.tv_nsec == original.st_ctim.tv_nsec);
+  }
+  KJ_EXPECT(getSnapshotOrigin(dir / "grain/sub/run.sh") == nullptr);
+
+  deleteSnapshot(dir / "snapshot");
+  KJ_EXPECT(access((dir / "snapshot").cStr(), F_OK) < 0);
+}
+
+}  // namespace
+}  // namespace sandstorm
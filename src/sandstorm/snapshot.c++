@@ -0,0 +1,176 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "snapshot.h"
+#include "util.h"
+#include <kj/debug.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/xattr.h>
+
+// In case kernel headers are old.
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+namespace sandstorm {
+
+namespace {
+
+const char ORIGIN_XATTR[] = "user.sandstorm.origin";
+
+struct OriginXattr {
+  // Value of ORIGIN_XATTR. Snapshots don't outlive the server that made them, so host byte order
+  // is fine.
+
+  uint64_t inode;
+  int64_t ctimeSec;
+  int64_t ctimeNsec;
+};
+
+void copyAttributes(int fd, const struct stat& stats, kj::StringPtr name) {
+  KJ_SYSCALL(fchmod(fd, stats.st_mode & 07777), name);
+  struct timespec times[2] = { stats.st_atim, stats.st_mtim };
+  KJ_SYSCALL(futimens(fd, times), name);
+}
+
+bool cloneFile(int fromDir, kj::StringPtr fromName, int toDir, kj::StringPtr toName,
+               const struct stat& stats) {
+  auto in = raiiOpenAt(fromDir, fromName, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  auto out = raiiOpenAt(toDir, toName,
+                        O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+
+  while (ioctl(out, FICLONE, in.get()) < 0) {
+    int error = errno;
+    switch (error) {
+      case EINTR:
+        continue;
+      case EOPNOTSUPP:
+      case ENOTTY:
+      case EXDEV:
+      case EINVAL:
+        // The filesystem can't do it (EINVAL is btrfs refusing to mix checksummed and
+        // nodatasum files).
+        return false;
+      default:
+        KJ_FAIL_SYSCALL("ioctl(FICLONE)", error, fromName);
+    }
+  }
+
+  // Best effort: without it, the clone just looks like a changed file.
+  OriginXattr origin = { stats.st_ino, stats.st_ctim.tv_sec, stats.st_ctim.tv_nsec };
+  fsetxattr(out, ORIGIN_XATTR, &origin, sizeof(origin), 0);
+
+  copyAttributes(out, stats, toName);
+  return true;
+}
+
+void copySymlink(int fromDir, kj::StringPtr name, int toDir, const struct stat& stats) {
+  char target[PATH_MAX];
+  ssize_t n;
+  KJ_SYSCALL(n = readlinkat(fromDir, name.cStr(), target, sizeof(target)), name);
+  KJ_REQUIRE(size_t(n) < sizeof(target), "symlink target too long", name);
+  target[n] = '\0';
+  KJ_SYSCALL(symlinkat(target, toDir, name.cStr()), name);
+
+  struct timespec times[2] = { stats.st_atim, stats.st_mtim };
+  KJ_SYSCALL(utimensat(toDir, name.cStr(), times, AT_SYMLINK_NOFOLLOW), name);
+}
+
+bool cloneDirectory(int fromDir, int toDir) {
+  for (auto& name: listDirectoryFd(fromDir)) {
+    struct stat stats;
+    KJ_SYSCALL(fstatat(fromDir, name.cStr(), &stats, AT_SYMLINK_NOFOLLOW), name);
+
+    if (S_ISREG(stats.st_mode)) {
+      if (!cloneFile(fromDir, name, toDir, name, stats)) return false;
+    } else if (S_ISLNK(stats.st_mode)) {
+      copySymlink(fromDir, name, toDir, stats);
+    } else if (S_ISDIR(stats.st_mode)) {
+      // Start out writable by us, whatever the original's mode, so we can fill it.
+      KJ_SYSCALL(mkdirat(toDir, name.cStr(), 0700), name);
+      auto from = raiiOpenAt(fromDir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      auto to = raiiOpenAt(toDir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (!cloneDirectory(from, to)) return false;
+
+      // Filling it changed its mtime, so restore that last.
+      copyAttributes(to, stats, name);
+    }
+  }
+  return true;
+}
+
+void deleteAt(int dirfd, kj::StringPtr name) {
+  struct stat stats;
+  KJ_SYSCALL(fstatat(dirfd, name.cStr(), &stats, AT_SYMLINK_NOFOLLOW), name);
+  if (S_ISDIR(stats.st_mode)) {
+    if ((stats.st_mode & 0700) != 0700) {
+      KJ_SYSCALL(fchmodat(dirfd, name.cStr(), 0700, 0), name);
+    }
+    auto fd = raiiOpenAt(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    for (auto& child: listDirectoryFd(fd)) {
+      deleteAt(fd, child);
+    }
+    KJ_SYSCALL(unlinkat(dirfd, name.cStr(), AT_REMOVEDIR), name);
+  } else {
+    KJ_SYSCALL(unlinkat(dirfd, name.cStr(), 0), name);
+  }
+}
+
+}  // namespace
+
+bool snapshotTree(kj::StringPtr from, kj::StringPtr to) {
+  struct stat stats;
+  KJ_SYSCALL(lstat(from.cStr(), &stats), from);
+
+  if (S_ISDIR(stats.st_mode)) {
+    KJ_SYSCALL(mkdir(to.cStr(), 0700), to);
+    auto fromFd = raiiOpen(from, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    auto toFd = raiiOpen(to, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (!cloneDirectory(fromFd, toFd)) return false;
+    copyAttributes(toFd, stats, to);
+    return true;
+  } else if (S_ISREG(stats.st_mode)) {
+    return cloneFile(AT_FDCWD, from, AT_FDCWD, to, stats);
+  } else {
+    KJ_FAIL_REQUIRE("can only snapshot regular files and directories", from);
+  }
+}
+
+void deleteSnapshot(kj::StringPtr path) {
+  KJ_REQUIRE(!path.endsWith("/"),
+      "refusing to recursively delete directory name with trailing / to reduce risk of "
+      "catastrophic empty-string bugs");
+  if (access(path.cStr(), F_OK) < 0 && errno == ENOENT) return;
+  deleteAt(AT_FDCWD, path);
+}
+
+kj::Maybe<SnapshotOrigin> getSnapshotOrigin(kj::StringPtr path) {
+  OriginXattr origin;
+  ssize_t n = lgetxattr(path.cStr(), ORIGIN_XATTR, &origin, sizeof(origin));
+  if (n != sizeof(origin)) return nullptr;
+
+  SnapshotOrigin result;
+  result.inode = origin.inode;
+  result.ctime.tv_sec = origin.ctimeSec;
+  result.ctime.tv_nsec = origin.ctimeNsec;
+  return result;
+}
+
+}  // namespace sandstorm
@@ -0,0 +1,57 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_SNAPSHOT_H_
+#define SANDSTORM_SNAPSHOT_H_
+
+#include <kj/string.h>
+#include <kj/common.h>
+#include <sys/stat.h>
+
+namespace sandstorm {
+
+bool snapshotTree(kj::StringPtr from, kj::StringPtr to);
+// Makes `to`, which must not exist yet, a point-in-time copy of the file or directory tree at
+// `from`. File contents are cloned with reflinks (FICLONE) rather than copied, so this takes
+// time proportional to the number of files, not their size, and uses no extra space until one
+// side is modified. Modes and timestamps are kept; so are symlinks. Other special files are
+// skipped, as backups skip them.
+//
+// Returns false if the filesystem can't clone files (or `to` is on a different filesystem). On
+// false or an exception, `to` may be left partly populated, for the caller to delete with
+// deleteSnapshot().
+
+void deleteSnapshot(kj::StringPtr path);
+// Deletes a snapshot, or what's left of one, if it exists. Unlike recursivelyDelete(), this
+// copes with the read-only directories that snapshots of read-only directories contain.
+
+struct SnapshotOrigin {
+  // Identity of the file a snapshot file was cloned from. A clone is a new inode with a new
+  // ctime, so without this, code that recognizes unchanged files by inode and ctime would think
+  // every file in every snapshot had changed.
+
+  ino_t inode;
+  struct timespec ctime;
+};
+
+kj::Maybe<SnapshotOrigin> getSnapshotOrigin(kj::StringPtr path);
+// Returns the origin of a regular file in a snapshot made by snapshotTree(), or null if it
+// wasn't recorded (e.g. the filesystem doesn't support user extended attributes). Only trust
+// this for files known to be in such a snapshot: anyone who can write a file can set it.
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_SNAPSHOT_H_
@@ -60,6 +60,7 @@
 #include "id-to-text.h"
 #include "appid-replacements.h"
 #include "config.h"
+#include "xz.h"
 
 namespace sandstorm {
 
@@ -157,6 +158,99 @@ private:
   bool committed = false;
 };
 
+// =======================================================================================
+
+class BufferRing {
+  // A few large buffers passed round from a producer thread to a consumer thread and back, so
+  // that data moves between them without being copied: the producer fills a buffer in place and
+  // the consumer uses it in place. Buffers are page-aligned.
+
+public:
+  static constexpr uint BUFFER_COUNT = 4;
+  static constexpr size_t BUFFER_SIZE = 1u << 20;
+
+  BufferRing() {
+    for (auto& buffer: buffers) {
+      buffer = reinterpret_cast<byte*>(aligned_alloc(4096, BUFFER_SIZE));
+      KJ_ASSERT(buffer != nullptr, "out of memory");
+    }
+  }
+  ~BufferRing() {
+    for (auto buffer: buffers) free(buffer);
+  }
+  KJ_DISALLOW_COPY(BufferRing);
+
+  kj::ArrayPtr<byte> startWrite() {
+    // Waits for a free buffer and returns it, for the producer to fill.
+    uint index = state.when([](const State& s) {
+      return s.error != nullptr || s.filled < BUFFER_COUNT;
+    }, [](State& s) {
+      s.throwIfAborted();
+      return s.writeIndex;
+    });
+    return kj::arrayPtr(buffers[index % BUFFER_COUNT], BUFFER_SIZE);
+  }
+
+  void finishWrite(size_t size) {
+    // Hands the buffer returned by startWrite() to the consumer, with its first `size` bytes
+    // filled in.
+    auto lock = state.lockExclusive();
+    lock->sizes[lock->writeIndex++ % BUFFER_COUNT] = size;
+    ++lock->filled;
+  }
+
+  void finish() {
+    // Marks the end of the data.
+    state.lockExclusive()->finished = true;
+  }
+
+  kj::ArrayPtr<const byte> startRead() {
+    // Waits for the next filled buffer and returns its contents, or returns an empty array at the
+    // end of the data.
+    return state.when([](const State& s) {
+      return s.error != nullptr || s.filled > 0 || s.finished;
+    }, [this](State& s) -> kj::ArrayPtr<const byte> {
+      s.throwIfAborted();
+      if (s.filled == 0) return nullptr;
+      uint index = s.readIndex % BUFFER_COUNT;
+      return kj::arrayPtr(buffers[index], s.sizes[index]);
+    });
+  }
+
+  void finishRead() {
+    // Hands the buffer returned by startRead() back to the producer.
+    auto lock = state.lockExclusive();
+    ++lock->readIndex;
+    --lock->filled;
+  }
+
+  void abort(kj::Exception&& exception) {
+    // Makes the other side's next (or current) startWrite() or startRead() throw `exception`,
+    // unless the ring was already aborted.
+    auto lock = state.lockExclusive();
+    if (lock->error == nullptr) lock->error = kj::mv(exception);
+  }
+
+private:
+  struct State {
+    uint writeIndex = 0;
+    uint readIndex = 0;
+    uint filled = 0;
+    size_t sizes[BUFFER_COUNT];
+    bool finished = false;
+    kj::Maybe<kj::Exception> error;
+
+    void throwIfAborted() {
+      KJ_IF_MAYBE(e, error) {
+        kj::throwFatalException(kj::cp(*e));
+      }
+    }
+  };
+
+  byte* buffers[BUFFER_COUNT];
+  kj::MutexGuarded<State> state;
+};
+
 class SpkTool final: public AbstractMain {
   // Main class for the Sandstorm spk tool.
 
@@ -1399,50 +1493,64 @@ private:
       kj::Function<kj::String(kj::StringPtr problem)> validationError) {
     // Read package form spkfd, check the validity and signature, and return the appId. Also write
     // the uncompressed archive to `tmpfile`.
+    //
+    // This is a pipeline of three threads: one reads the input and hashes it, this one
+    // decompresses it, and one hashes the archive and writes it out. They pass buffers through
+    // BufferRings, so the data isn't copied between them.
 
     // We need to compute the hash of the input. The input could be a pipe (not a file), therefore
-    // we need to read it in chunks, hash the content, and write back out to the pipe that xz will
-    // use as input below. We'll do all that in a thread to keep the code simple.
+    // we need to read it in chunks, hashing each before passing it on for decompression.
     byte packageHash[crypto_hash_sha256_BYTES];
-    Pipe spkPipe = Pipe::make();
-    auto hashThread = new kj::Thread([&]() {
-      crypto_hash_sha256_state packageHashState;
-      KJ_ASSERT(crypto_hash_sha256_init(&packageHashState) == 0);
-
-      byte buffer[8192];
-      kj::FdOutputStream out(kj::mv(spkPipe.writeEnd));
-      for (;;) {
-        ssize_t n;
-        KJ_SYSCALL(n = read(spkfd, buffer, sizeof(buffer)));
-        if (n == 0) break;
-        KJ_ASSERT(crypto_hash_sha256_update(&packageHashState, buffer, n) == 0);
-        out.write(buffer, n);
-      }
+    BufferRing spkRing;
+    auto readThread = kj::heap<kj::Thread>([&]() {
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        crypto_hash_sha256_state packageHashState;
+        KJ_ASSERT(crypto_hash_sha256_init(&packageHashState) == 0);
+
+        kj::FdInputStream in(spkfd);
+        for (;;) {
+          auto buffer = spkRing.startWrite();
+          size_t n = in.tryRead(buffer.begin(), buffer.size(), buffer.size());
+          if (n == 0) break;
+          KJ_ASSERT(crypto_hash_sha256_update(&packageHashState, buffer.begin(), n) == 0);
+          spkRing.finishWrite(n);
+          if (n < buffer.size()) break;
+        }
 
-      KJ_ASSERT(crypto_hash_sha256_final(&packageHashState, packageHash));
+        KJ_ASSERT(crypto_hash_sha256_final(&packageHashState, packageHash) == 0);
+        spkRing.finish();
+      })) {
+        spkRing.abort(kj::mv(*exception));
+      }
     });
+    // If we return early, stop the thread at its next buffer.
+    KJ_DEFER(spkRing.abort(KJ_EXCEPTION(DISCONNECTED, "verification stopped early")));
+
+    kj::ArrayPtr<const byte> chunk;
+    auto nextChunk = [&]() {
+      if (chunk.size() > 0) spkRing.finishRead();
+      chunk = spkRing.startRead();
+      return chunk;
+    };
 
-    // Check the magic number.
+    // Check the magic number. (Buffers are only short at the end of the input.)
     auto expectedMagic = spk::MAGIC_NUMBER.get();
-    byte magic[expectedMagic.size()];
-    kj::FdInputStream(spkPipe.readEnd.get()).read(magic, expectedMagic.size());
-    for (uint i: kj::indices(expectedMagic)) {
-      if (magic[i] != expectedMagic[i]) {
-        return validationError("Does not appear to be an .spk (bad magic number).");
+    auto magic = nextChunk();
+    if (magic.size() < expectedMagic.size() ||
+        memcmp(magic.begin(), expectedMagic.begin(), expectedMagic.size()) != 0) {
+      return validationError("Does not appear to be an .spk (bad magic number).");
+    }
+
+    // Decompress the remaining bytes in the SPK.
+    auto rest = magic.slice(expectedMagic.size(), magic.size());
+    XzInputStream in([&]() -> kj::ArrayPtr<const byte> {
+      if (rest.size() > 0) {
+        auto result = rest;
+        rest = nullptr;
+        return result;
       }
-    }
-
-    // Decompress the remaining bytes in the SPK using xz.
-    Pipe pipe = Pipe::make();
-
-    Subprocess::Options childOptions({"xz", "-dc"});
-    childOptions.stdin = spkPipe.readEnd;
-    childOptions.stdout = pipe.writeEnd;
-    Subprocess child(kj::mv(childOptions));
-
-    spkPipe.readEnd = nullptr;
-    pipe.writeEnd = nullptr;
-    kj::FdInputStream in(kj::mv(pipe.readEnd));
+      return nextChunk();
+    });
 
     // Read in the signature.
     byte publicKey[crypto_sign_PUBLICKEYBYTES];
@@ -1476,30 +1584,53 @@ private:
     }
 
     // Copy archive part to a temp file, computing hash in the meantime.
-    crypto_hash_sha512_state hashState;
-    crypto_hash_sha512_init(&hashState);
-    kj::FdOutputStream tmpOut(tmpfile);
+    byte hash[crypto_hash_sha512_BYTES];
+    BufferRing archiveRing;
+    kj::Maybe<kj::Exception> writeError;
+    auto writeThread = kj::heap<kj::Thread>([&]() {
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        crypto_hash_sha512_state hashState;
+        crypto_hash_sha512_init(&hashState);
+        kj::FdOutputStream tmpOut(tmpfile);
+        for (;;) {
+          auto buffer = archiveRing.startRead();
+          if (buffer.size() == 0) break;
+          crypto_hash_sha512_update(&hashState, buffer.begin(), buffer.size());
+          tmpOut.write(buffer.begin(), buffer.size());
+          archiveRing.finishRead();
+        }
+        crypto_hash_sha512_final(&hashState, hash);
+      })) {
+        writeError = kj::cp(*exception);
+        archiveRing.abort(kj::mv(*exception));
+      }
+    });
+    KJ_DEFER(archiveRing.abort(KJ_EXCEPTION(DISCONNECTED, "verification stopped early")));
+
     uint64_t totalRead = 0;
     for (;;) {
-      byte buffer[8192];
-      size_t n = in.tryRead(buffer, 1, sizeof(buffer));
+      auto buffer = archiveRing.startWrite();
+      size_t n = in.tryRead(buffer.begin(), buffer.size(), buffer.size());
       if (n == 0) break;
-      crypto_hash_sha512_update(&hashState, buffer, n);
       totalRead += n;
       KJ_REQUIRE(totalRead <= APP_SIZE_LIMIT, "App too big after decompress.");
-      tmpOut.write(buffer, n);
+      archiveRing.finishWrite(n);
+      if (n < buffer.size()) break;
     }
 
-    child.waitForSuccess();
-    hashThread = nullptr;  // joins thread
+    archiveRing.finish();
+    writeThread = nullptr;  // joins thread
+    KJ_IF_MAYBE(e, writeError) {
+      kj::throwFatalException(kj::mv(*e));
+    }
 
-    // The spk pipe thread should have exited now, completing the hash.
+    // Decompression consumed all of the input, so the read thread is finishing the hash, if it
+    // hasn't already.
+    readThread = nullptr;  // joins thread
     static_assert(PACKAGE_ID_BYTE_SIZE <= crypto_hash_sha256_BYTES, "package ID size changed?");
     auto packageIdBytes = kj::arrayPtr(packageHash, PACKAGE_ID_BYTE_SIZE);
 
     // Check that hashes match.
-    byte hash[crypto_hash_sha512_BYTES];
-    crypto_hash_sha512_final(&hashState, hash);
     if (memcmp(expectedHash, hash, crypto_hash_sha512_BYTES) != 0) {
       return validationError("Signature didn't match package contents.");
     }
@@ -1719,8 +1850,7 @@ private:
       int spkfd, kj::StringPtr dirname, kj::StringPtr tmpNear,
       kj::Function<kj::String(kj::StringPtr problem)> validationError) {
     // TODO(security):  We could at this point chroot into the output directory and unshare
-    //   various resources for extra security, if not for the fact that we need to invoke xz
-    //   later on.  Maybe link against the xz library so that we don't have to exec it?
+    //   various resources for extra security, now that xz runs in-process.
 
     auto tmpfile = openTemporary(tmpNear);
     auto appId = verifyImpl(spkfd, tmpfile, nullptr, kj::mv(validationError));
@@ -0,0 +1,125 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "storage-usage.h"
+#include "test-util.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+namespace sandstorm {
+namespace {
+
+KJ_TEST("StorageUsageCache keeps per-user totals") {
+  StorageUsageCache cache;
+  kj::String onDisk[] = { kj::str("grain1"), kj::str("grain2"), kj::str("grain3") };
+  cache.reconcile(onDisk);
+
+  // Nobody's total is known until every grain's owner is.
+  cache.addGrain("grain1", "alice");
+  cache.addGrain("grain2", "alice");
+  KJ_EXPECT(cache.getUserSize("alice") == nullptr);
+  cache.addGrain("grain3", "bob");
+  KJ_EXPECT(cache.getUserSize("alice") == nullptr);  // sizes still unknown
+
+  cache.setMeasuredSize("grain1", 100, 1000);
+  cache.setReportedSize("grain2", 20);
+  cache.setReportedSize("grain3", 3);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(cache.getUserSize("alice")) == 120);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(cache.getUserSize("bob")) == 3);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(cache.getUserSize("carol")) == 0);
+
+  // Reports and measurements count the same tree, so the newest wins either way.
+  cache.setReportedSize("grain1", 5);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(cache.getGrainSize("grain1")) == 5);
+
+  cache.setReportedSize("grain2", 50);
+  cache.addGrain("grain1", "bob");
+  KJ_EXPECT(KJ_ASSERT_NONNULL(cache.getUserSize("alice")) == 50);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(cache.getUserSize("bob")) == 8);
+
+  cache.removeGrain("grain2");
+  cache.setReportedSize("grain2", 1);  // late report for a deleted grain
+  KJ_EXPECT(cache.getGrainSize("grain2") == nullptr);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(cache.getUserSize("alice")) == 0);
+
+  cache.invalidate("grain3");
+  KJ_EXPECT(cache.getUserSize("bob") == nullptr);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(cache.getStalestGrain(2000)) == "grain3");
+  cache.setMeasuredSize("grain3", 7, 1500);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(cache.getStalestGrain(2000)) == "grain1");
+  KJ_EXPECT(cache.getStalestGrain(1000) == nullptr);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(cache.getUserSize("bob")) == 12);
+
+  // A grain with no directory yet isn't taken to be empty, nor measured again right away.
+  cache.invalidate("grain3");
+  cache.setMissing("grain3", 1600);
+  KJ_EXPECT(cache.getGrainSize("grain3") == nullptr);
+  KJ_EXPECT(cache.getUserSize("bob") == nullptr);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(cache.getStalestGrain(2000)) == "grain1");
+  cache.setReportedSize("grain3", 9);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(cache.getUserSize("bob")) == 14);
+}
+
+KJ_TEST("StorageUsageCache saves and loads") {
+  StorageUsageCache cache;
+  kj::String onDisk[] = { kj::str("grain1"), kj::str("grain2") };
+  cache.reconcile(onDisk);
+  cache.addGrain("grain1", "alice");
+  cache.setMeasuredSize("grain1", 4096, 1234);
+  KJ_EXPECT(cache.isDirty());
+
+  auto text = cache.save();
+  KJ_EXPECT(!cache.isDirty());
+
+  StorageUsageCache loaded;
+  loaded.load(kj::str(text, "garbage line\n"));
+  KJ_EXPECT(loaded.save() == text);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(loaded.getGrainSize("grain1")) == 4096);
+  KJ_EXPECT(loaded.getGrainSize("grain2") == nullptr);
+  KJ_EXPECT(loaded.getUserSize("alice") == nullptr);
+
+  // A grain deleted while we weren't running.
+  kj::String remaining[] = { kj::str("grain1") };
+  loaded.reconcile(remaining);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(loaded.getUserSize("alice")) == 4096);
+}
+
+KJ_TEST("measureStorageUsage counts allocated space") {
+  TempDir dir;
+
+  auto file = dir / "file";
+  auto data = kj::heapArray<kj::byte>(65536);
+  memset(data.begin(), 'x', data.size());
+  writeFile(file, data);
+  KJ_SYSCALL(link(file.cStr(), (dir / "link").cStr()));
+
+  struct stat dirStats, fileStats;
+  KJ_SYSCALL(lstat(dir.path.cStr(), &dirStats));
+  KJ_SYSCALL(lstat(file.cStr(), &fileStats));
+
+  // The hard-linked file counts once, split between its two names.
+  uint64_t expected = (dirStats.st_blocks + fileStats.st_blocks) * 512;
+  KJ_EXPECT(measureStorageUsage(dir.path) == expected);
+  KJ_EXPECT(measureStorageUsage(dir.path, 1000) == expected);
+}
+
+}  // namespace
+}  // namespace sandstorm
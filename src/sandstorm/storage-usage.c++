@@ -0,0 +1,316 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "storage-usage.h"
+#include "util.h"
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <set>
+#include <sys/stat.h>
+#include <time.h>
+
+namespace sandstorm {
+
+namespace {
+
+class EntryBudget {
+  // Paces a walk to a number of entries per second.
+
+public:
+  explicit EntryBudget(uint perSecond): perSecond(perSecond) {
+    KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &start));
+  }
+
+  void spend() {
+    if (perSecond == 0 || ++count % CHECK_INTERVAL != 0) return;
+
+    // Sleep until the time at which we're allowed to have visited `count` entries.
+    uint64_t allowedNs = count * 1000000000ull / perSecond;
+    struct timespec target;
+    target.tv_sec = start.tv_sec + allowedNs / 1000000000ull;
+    target.tv_nsec = start.tv_nsec + allowedNs % 1000000000ull;
+    if (target.tv_nsec >= 1000000000) {
+      ++target.tv_sec;
+      target.tv_nsec -= 1000000000;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, nullptr) == EINTR) {}
+  }
+
+private:
+  static constexpr uint CHECK_INTERVAL = 64;
+
+  uint perSecond;
+  uint64_t count = 0;
+  struct timespec start;
+};
+
+uint64_t measure(kj::StringPtr path, EntryBudget& budget, bool isRoot) {
+  KJ_REQUIRE(!path.endsWith("/"),
+      "refusing to recursively traverse directory name with trailing / to reduce risk of "
+      "catastrophic empty-string bugs");
+
+  budget.spend();
+
+  // Below the root, anything may be deleted while we walk, especially in a throttled walk of a
+  // running grain. Something that's gone takes no space.
+  struct stat stats;
+  KJ_SYSCALL_HANDLE_ERRORS(lstat(path.cStr(), &stats)) {
+    default:
+      if (error == ENOENT && !isRoot) return 0;
+      KJ_FAIL_SYSCALL("lstat", error, path);
+  }
+
+  // Count blocks, not length, because what we care about is allocated space.
+  uint64_t total = stats.st_blocks * 512;
+
+  if (S_ISDIR(stats.st_mode)) {
+    KJ_IF_MAYBE(dir, raiiOpenIfExists(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) {
+      for (auto& file: listDirectoryFd(*dir)) {
+        total += measure(kj::str(path, '/', file), budget, false);
+      }
+    }
+  } else if (stats.st_nlink != 0) {
+    // Don't overcount hard links. (Note that st_nlink can in fact be zero in cases where we are
+    // racing with directory modifications, so we check for that to avoid divide-by-zero crashes.)
+    total /= stats.st_nlink;
+  }
+
+  return total;
+}
+
+}  // namespace
+
+uint64_t measureStorageUsage(kj::StringPtr path, uint maxEntriesPerSecond) {
+  EntryBudget budget(maxEntriesPerSecond);
+  return measure(path, budget, true);
+}
+
+// =======================================================================================
+
+void StorageUsageCache::load(kj::StringPtr text) {
+  grains.clear();
+  users.clear();
+  unknownOwners = 0;
+
+  for (auto& line: splitLines(text)) {
+    auto fields = splitSpace(line);
+    kj::Maybe<uint64_t> size;
+    kj::Maybe<uint64_t> measuredAt;
+    if (fields.size() == 4) {
+      auto sizeText = kj::str(fields[2]);
+      if (sizeText != "-") size = parseUInt64(sizeText, 10);
+      measuredAt = parseUInt64(kj::str(fields[3]), 10);
+    }
+
+    if (fields.size() != 4 || (size == nullptr && kj::str(fields[2]) != "-") ||
+        measuredAt == nullptr || grains.count(kj::str(fields[0])) != 0) {
+      KJ_LOG(ERROR, "ignoring bad line in storage usage cache", line);
+      continue;
+    }
+
+    auto& grain = insert(kj::str(fields[0]));
+    auto ownerId = kj::str(fields[1]);
+    if (ownerId != "-") {
+      grain.ownerId = kj::mv(ownerId);
+      --unknownOwners;
+    }
+    grain.size = size;
+    grain.measuredAt = KJ_ASSERT_NONNULL(measuredAt);
+    attribute(grain);
+  }
+
+  dirty = false;
+}
+
+kj::String StorageUsageCache::save() {
+  kj::Vector<kj::String> lines(grains.size() + 1);
+  lines.add(kj::str("# grain owner size measured-at\n"));
+  for (auto& entry: grains) {
+    auto& grain = entry.second;
+    kj::String size;
+    KJ_IF_MAYBE(s, grain.size) {
+      size = kj::str(*s);
+    } else {
+      size = kj::str("-");
+    }
+    lines.add(kj::str(grain.id, ' ', grain.ownerId == nullptr ? "-" : grain.ownerId.cStr(), ' ',
+                      size, ' ', grain.measuredAt, '\n'));
+  }
+
+  dirty = false;
+  return kj::strArray(lines, "");
+}
+
+void StorageUsageCache::reconcile(kj::ArrayPtr<const kj::String> grainIds) {
+  std::set<kj::StringPtr> onDisk;
+  for (auto& id: grainIds) {
+    onDisk.insert(id);
+    if (grains.count(id) == 0) {
+      insert(kj::str(id));
+    }
+  }
+
+  for (auto iter = grains.begin(); iter != grains.end();) {
+    if (onDisk.count(iter->first) == 0) {
+      auto& grain = (iter++)->second;
+      removeGrain(grain.id);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+void StorageUsageCache::addGrain(kj::StringPtr grainId, kj::StringPtr ownerId) {
+  auto iter = grains.find(grainId);
+  Grain& grain = iter == grains.end() ? insert(kj::str(grainId)) : iter->second;
+  if (grain.ownerId == ownerId) return;
+
+  unattribute(grain);
+  if (grain.ownerId == nullptr) --unknownOwners;
+  grain.ownerId = kj::str(ownerId);
+  attribute(grain);
+  dirty = true;
+}
+
+void StorageUsageCache::setReportedSize(kj::StringPtr grainId, uint64_t size) {
+  auto iter = grains.find(grainId);
+  if (iter == grains.end()) return;
+
+  updateSize(iter->second, size);
+}
+
+void StorageUsageCache::setMeasuredSize(kj::StringPtr grainId, uint64_t size, int64_t now) {
+  auto iter = grains.find(grainId);
+  if (iter == grains.end()) return;
+
+  updateSize(iter->second, size);
+  iter->second.measuredAt = now;
+}
+
+void StorageUsageCache::setMissing(kj::StringPtr grainId, int64_t now) {
+  auto iter = grains.find(grainId);
+  if (iter == grains.end()) return;
+
+  iter->second.measuredAt = now;
+  dirty = true;
+}
+
+void StorageUsageCache::invalidate(kj::StringPtr grainId) {
+  auto iter = grains.find(grainId);
+  if (iter == grains.end()) return;
+
+  auto& grain = iter->second;
+  unattribute(grain);
+  grain.size = nullptr;
+  grain.measuredAt = 0;
+  attribute(grain);
+  dirty = true;
+}
+
+void StorageUsageCache::removeGrain(kj::StringPtr grainId) {
+  auto iter = grains.find(grainId);
+  if (iter == grains.end()) return;
+
+  unattribute(iter->second);
+  if (iter->second.ownerId == nullptr) --unknownOwners;
+  grains.erase(iter);
+  dirty = true;
+}
+
+kj::Maybe<uint64_t> StorageUsageCache::getGrainSize(kj::StringPtr grainId) const {
+  auto iter = grains.find(grainId);
+  if (iter == grains.end()) return nullptr;
+  return iter->second.size;
+}
+
+kj::Maybe<uint64_t> StorageUsageCache::getUserSize(kj::StringPtr userId) const {
+  // Until we know every grain's owner, any grain might be this user's.
+  if (unknownOwners > 0) return nullptr;
+
+  auto iter = users.find(userId);
+  if (iter == users.end()) return uint64_t(0);
+  if (iter->second.unknownSizes > 0) return nullptr;
+  return iter->second.total;
+}
+
+kj::Maybe<kj::String> StorageUsageCache::getStalestGrain(int64_t measuredBefore) const {
+  const Grain* stalest = nullptr;
+  for (auto& entry: grains) {
+    auto& grain = entry.second;
+    if (grain.measuredAt < measuredBefore &&
+        (stalest == nullptr || grain.measuredAt < stalest->measuredAt)) {
+      stalest = &grain;
+    }
+  }
+
+  if (stalest == nullptr) return nullptr;
+  return kj::str(stalest->id);
+}
+
+StorageUsageCache::Grain& StorageUsageCache::insert(kj::String grainId) {
+  Grain grain;
+  grain.id = kj::mv(grainId);
+  kj::StringPtr key = grain.id;
+  auto& result = grains.insert(std::make_pair(key, kj::mv(grain))).first->second;
+  ++unknownOwners;
+  dirty = true;
+  return result;
+}
+
+void StorageUsageCache::updateSize(Grain& grain, uint64_t size) {
+  unattribute(grain);
+  grain.size = size;
+  attribute(grain);
+  dirty = true;
+}
+
+void StorageUsageCache::attribute(const Grain& grain) {
+  if (grain.ownerId == nullptr) return;
+
+  auto iter = users.find(grain.ownerId);
+  if (iter == users.end()) {
+    User user;
+    user.id = kj::str(grain.ownerId);
+    kj::StringPtr key = user.id;
+    iter = users.insert(std::make_pair(key, kj::mv(user))).first;
+  }
+
+  auto& user = iter->second;
+  ++user.grainCount;
+  KJ_IF_MAYBE(size, grain.size) {
+    user.total += *size;
+  } else {
+    ++user.unknownSizes;
+  }
+}
+
+void StorageUsageCache::unattribute(const Grain& grain) {
+  if (grain.ownerId == nullptr) return;
+
+  auto iter = users.find(grain.ownerId);
+  KJ_ASSERT(iter != users.end());
+  auto& user = iter->second;
+  KJ_IF_MAYBE(size, grain.size) {
+    user.total -= *size;
+  } else {
+    --user.unknownSizes;
+  }
+  if (--user.grainCount == 0) {
+    users.erase(iter);
+  }
+}
+
+}  // namespace sandstorm
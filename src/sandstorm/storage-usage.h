@@ -0,0 +1,120 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_STORAGE_USAGE_H_
+#define SANDSTORM_STORAGE_USAGE_H_
+
+#include <kj/string.h>
+#include <kj/array.h>
+#include <map>
+
+namespace sandstorm {
+
+uint64_t measureStorageUsage(kj::StringPtr path, uint maxEntriesPerSecond = 0);
+// Walks the tree at `path` and returns the space allocated to it, counting each hard-linked file
+// once. Files deleted during the walk count as nothing. If `maxEntriesPerSecond` is non-zero, sleeps as needed to stat no more than that many
+// entries per second, so that a background walk doesn't starve everything else of disk I/O.
+
+class StorageUsageCache {
+  // The storage used by each grain and, summed from those, by each user, so that quota checks
+  // don't have to walk grain directories.
+  //
+  // The cache only holds numbers; the backend feeds it. Sizes come from measuring grain
+  // directories and from supervisors' reports, which count the same tree, so whichever is newer
+  // wins. Owners come from the front-end's calls, most of which name the grain's owner. Each user's total is kept up to date
+  // as grains change, so looking one up doesn't visit the user's grains.
+  //
+  // The cache is saved as text, one grain per line.
+
+public:
+  StorageUsageCache() = default;
+  KJ_DISALLOW_COPY(StorageUsageCache);
+
+  void load(kj::StringPtr text);
+  // Replaces the contents with those of a string returned by save(). Lines that don't parse are
+  // logged and skipped.
+
+  kj::String save();
+  // Serializes the contents, and clears the dirty flag.
+
+  inline bool isDirty() const { return dirty; }
+  // Whether anything changed since the last save().
+
+  void reconcile(kj::ArrayPtr<const kj::String> grainIds);
+  // Makes the cache cover exactly the given grains -- those on disk -- adding any that are
+  // missing with no owner or size, and dropping any that are gone.
+
+  void addGrain(kj::StringPtr grainId, kj::StringPtr ownerId);
+  // Records the grain's owner, adding it to the cache if it's not there yet.
+
+  void setReportedSize(kj::StringPtr grainId, uint64_t size);
+  // Records a size reported by the grain's supervisor. Ignored if the grain isn't in the cache,
+  // since a report can arrive after the grain was deleted.
+
+  void setMeasuredSize(kj::StringPtr grainId, uint64_t size, int64_t now);
+  // Records a size from measureStorageUsage(), started at `now` (in seconds since the epoch).
+
+  void setMissing(kj::StringPtr grainId, int64_t now);
+  // Records that the grain's directory didn't exist to be measured at `now`, e.g. because the
+  // grain is still being created. Its size is left as it was -- for a new grain, unknown until
+  // its supervisor reports one -- but it won't be measured again until the next rescan.
+
+  void invalidate(kj::StringPtr grainId);
+  // Forgets the grain's size, e.g. because its files were replaced.
+
+  void removeGrain(kj::StringPtr grainId);
+
+  kj::Maybe<uint64_t> getGrainSize(kj::StringPtr grainId) const;
+  // Null if the grain isn't in the cache or hasn't been measured.
+
+  kj::Maybe<uint64_t> getUserSize(kj::StringPtr userId) const;
+  // Total size of the user's grains. Null if that isn't known yet, because some grain's size or
+  // (for any grain at all) owner hasn't been learned.
+
+  kj::Maybe<kj::String> getStalestGrain(int64_t measuredBefore) const;
+  // Returns the grain measured longest ago, or null if all were measured at or after
+  // `measuredBefore`. Grains never measured come first.
+
+private:
+  struct Grain {
+    kj::String id;
+    kj::String ownerId;   // empty if unknown
+    kj::Maybe<uint64_t> size;
+    int64_t measuredAt = 0;
+  };
+
+  struct User {
+    kj::String id;
+    uint64_t total = 0;
+    uint grainCount = 0;
+    uint unknownSizes = 0;
+  };
+
+  std::map<kj::StringPtr, Grain> grains;
+  std::map<kj::StringPtr, User> users;
+  uint unknownOwners = 0;
+  bool dirty = false;
+
+  Grain& insert(kj::String grainId);
+  void updateSize(Grain& grain, uint64_t size);
+  void attribute(const Grain& grain);
+  void unattribute(const Grain& grain);
+  // Add the grain to, or take it away from, its owner's total.
+};
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_STORAGE_USAGE_H_
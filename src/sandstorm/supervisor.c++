@@ -21,6 +21,7 @@
 #include <kj/async-io.h>
 #include <kj/async-unix.h>
 #include <kj/io.h>
+#include <kj/thread.h>
 #include <capnp/rpc-twoparty.h>
 #include <capnp/rpc.capnp.h>
 #include <capnp/membrane.h>
@@ -50,6 +51,7 @@
 #include <grp.h>
 #include <sys/inotify.h>
 #include <map>
+#include <set>
 #include <unordered_map>
 #include <execinfo.h>
 #include <linux/netlink.h>
@@ -79,11 +81,30 @@
 #include "send-fd.h"
 #include "util.h"
 #include "sandbox.h"
+#include "log-ring.h"
 
 // In case kernel headers are old.
 #ifndef PR_SET_NO_NEW_PRIVS
 #define PR_SET_NO_NEW_PRIVS 38
 #endif
+#ifndef PR_SET_MEMORY_MERGE
+#define PR_SET_MEMORY_MERGE 67
+#endif
+#ifndef __NR_open_tree
+#define __NR_open_tree 428
+#endif
+#ifndef __NR_move_mount
+#define __NR_move_mount 429
+#endif
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
 
 namespace sandstorm {
 
@@ -103,6 +124,15 @@ static sock_fprog seccomp_fprog = sock_fprog {
 class DiskUsageWatcher: private kj::TaskSet::ErrorHandler {
   // Class which watches a directory tree, counts up the total disk usage, and fires events when
   // it changes. Uses inotify. Which turns out to be... harder than it should be.
+  //
+  // inotify needs a watch per directory, and watches are a per-user resource
+  // (fs.inotify.max_user_watches) shared by every grain. If we run out, we fall back to
+  // periodically re-counting the tree with statx(), a budgeted batch at a time so that a huge
+  // grain can't monopolize the supervisor or the disk.
+  //
+  // (fanotify with FAN_REPORT_DFID_NAME would avoid per-directory watches entirely, but marking
+  // a mount or filesystem requires CAP_SYS_ADMIN in the initial user namespace, which the
+  // supervisor has given up by the time it starts watching.)
 
 public:
   DiskUsageWatcher(kj::UnixEventPort& eventPort, kj::Timer& timer, SandstormCore::Client core)
@@ -111,9 +141,6 @@ public:
   kj::Promise<void> init() {
     // Start watching the current directory.
 
-    // Note: this function is also called to restart watching from scratch when the inotify event
-    //   queue overflows (hopefully rare).
-
     int fd;
     KJ_SYSCALL(fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
     inotifyFd = kj::AutoCloseFd(fd);
@@ -131,6 +158,20 @@ public:
   }
 
 private:
+  static constexpr uint SCAN_BUDGET = 1000;
+  static constexpr kj::Duration SCAN_TICK = 100 * kj::MILLISECONDS;
+  // When rescanning after an inotify queue overflow, or counting in polling mode, we stat at
+  // most SCAN_BUDGET files per SCAN_TICK.
+
+  static constexpr kj::Duration POLL_INTERVAL = 5 * kj::MINUTES;
+  // In polling mode, how long to wait between passes over the tree.
+
+  static constexpr kj::Duration REPORT_DELAY = 500 * kj::MILLISECONDS;
+  static constexpr kj::Duration REPORT_MIN_INTERVAL = 5 * kj::SECONDS;
+  // We wait REPORT_DELAY after a change before reporting, to gather other changes, and never
+  // report more often than once per REPORT_MIN_INTERVAL. A grain unpacking a big archive thus
+  // costs the front-end a database write every few seconds rather than one per file.
+
   kj::UnixEventPort& eventPort;
   kj::Timer& timer;
   SandstormCore::Client core;
@@ -139,6 +180,7 @@ private:
   uint64_t totalSize;
   uint64_t reportedSize = kj::maxValue;
   bool reportInFlight = false;
+  kj::TimePoint lastReportTime = kj::origin<kj::TimePoint>();
 
   struct ChildInfo {
     kj::String name;
@@ -156,22 +198,57 @@ private:
   // to finish processing a list of events received from inotify before we mess with the watch
   // descriptor table.
 
+  kj::Vector<int> pendingRescans;
+  // Watch descriptors whose directories need to be reconciled against the disk because the
+  // inotify queue overflowed, so we may have missed events on them.
+
+  struct PartialRescan {
+    int wd;
+    kj::Vector<kj::String> names;
+    size_t next = 0;
+  };
+  kj::Maybe<PartialRescan> currentRescan;
+  // The directory being reconciled, if we ran out of budget partway through it. `names` is
+  // everything that was on disk or in the table when we started; `next` indexes the first name
+  // not yet checked.
+
+  struct OpenDir {
+    DIR* dir;
+    kj::String path;  // null = root directory
+
+    OpenDir(DIR* dir, kj::String path): dir(dir), path(kj::mv(path)) {}
+    ~OpenDir() { closedir(dir); }
+    KJ_DISALLOW_COPY(OpenDir);
+  };
+
+  kj::Vector<kj::String> pendingScans;
+  kj::Maybe<kj::Own<OpenDir>> currentScan;
+  uint64_t scanTotal = 0;
+  // State of the current pass over the tree in polling mode. pendingScans is a stack of
+  // directories not yet started.
+
+  bool useStatx = true;
+  // Cleared the first time statx() fails with ENOSYS or EPERM, after which polling uses
+  // fstatat() instead.
+
   kj::TaskSet tasks;
 
-  void addPendingWatches() {
-    // Start watching everything that has been added to the pendingWatches list.
+  bool addPendingWatches() {
+    // Start watching everything that has been added to the pendingWatches list. Returns false if
+    // we ran out of inotify watches.
 
     // We treat pendingWatches as a stack here in order to get DFS traversal of the directory tree.
     while (pendingWatches.size() > 0) {
       auto path = kj::mv(pendingWatches.end()[-1]);
       pendingWatches.removeLast();
-      addWatch(kj::mv(path));
+      if (!addWatch(kj::mv(path))) return false;
     }
+    return true;
   }
 
-  void addWatch(kj::String&& path) {
+  bool addWatch(kj::String&& path) {
     // Start watching `path`. This is idempotent -- it's safe to watch the same path multiple
-    // times.
+    // times. Returns false if no more inotify watches are available.
 
     static const uint32_t FLAGS =
         IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO |
@@ -221,7 +298,7 @@ private:
           }
         }
 
-        return;
+        return true;
       }
 
       // Error occurred.
@@ -235,12 +312,12 @@ private:
         case ENOTDIR:
           // Apparently there is no longer a directory at this path. Perhaps it was deleted.
           // No matter.
-          return;
+          return true;
 
         case ENOSPC:
           // No more inotify watches available.
-          // TODO(someday): Revert to some sort of polling mode? For now, fall through to error
-          //   case.
+          return false;
+
         default:
           KJ_FAIL_SYSCALL("inotify_add_watch", error, path);
       }
@@ -248,9 +325,18 @@ private:
   }
 
   kj::Promise<void> readLoop() {
-    addPendingWatches();
+    if (!addPendingWatches()) {
+      return startPolling();
+    }
     maybeReportSize();
-    return observer->whenBecomesReadable().then([this]() {
+
+    auto ready = observer->whenBecomesReadable();
+    if (pendingRescans.size() > 0 || currentRescan != nullptr) {
+      // Don't wait for another event before continuing the rescan.
+      ready = ready.exclusiveJoin(timer.afterDelay(SCAN_TICK));
+    }
+
+    return ready.then([this]() {
       alignas(uint64_t) kj::byte buffer[4096];
 
       for (;;) {
@@ -258,7 +344,8 @@ private:
         KJ_NONBLOCKING_SYSCALL(n = read(inotifyFd, buffer, sizeof(buffer)));
 
         if (n < 0) {
-          // EAGAIN; try again later.
+          // EAGAIN; caught up with inotify. Continue any rescan, then wait for more.
+          rescanSome();
           return readLoop();
         }
 
@@ -275,10 +362,16 @@ private:
           pos += eventSize;
 
           if (event->mask & IN_Q_OVERFLOW) {
-            // Queue overflow; start over from scratch.
-            inotifyFd = nullptr;
-            KJ_LOG(WARNING, "inotify event queue overflow; restarting watch from scratch");
-            return init();
+            // Queue overflow. We've lost events but not watches, so rather than start over from
+            // scratch, reconcile each watched directory against the disk, a budgeted batch at a
+            // time. Meanwhile we keep the sizes we have, which are probably close.
+            KJ_LOG(WARNING, "inotify event queue overflow; rescanning watched directories");
+            pendingRescans.clear();
+            currentRescan = nullptr;
+            for (auto& entry: watchMap) {
+              pendingRescans.add(entry.first);
+            }
+            continue;
           }
 
           auto iter = watchMap.find(event->wd);
@@ -303,8 +396,82 @@ private:
     });
   }
 
-  void childEvent(WatchInfo& watchInfo, kj::StringPtr name) {
+  void rescanSome() {
+    // Reconcile pending rescans until we've checked about SCAN_BUDGET files. A directory too big
+    // to finish within the budget is picked up where we left off next time.
+
+    for (uint checked = 0; checked < SCAN_BUDGET;) {
+      KJ_IF_MAYBE(rescan, currentRescan) {
+        if (rescan->next == rescan->names.size()) {
+          currentRescan = nullptr;
+          continue;
+        }
+
+        // Look the watch up again each time, since childEvent() may remove watches.
+        auto iter = watchMap.find(rescan->wd);
+        if (iter == watchMap.end()) {
+          currentRescan = nullptr;  // removed in the meantime
+          continue;
+        }
+
+        childEvent(iter->second, rescan->names[rescan->next++], true);
+        ++checked;
+      } else if (pendingRescans.size() > 0) {
+        int wd = pendingRescans.back();
+        pendingRescans.removeLast();
+
+        auto iter = watchMap.find(wd);
+        if (iter == watchMap.end()) continue;  // removed in the meantime
+        auto& watchInfo = iter->second;
+
+        // Check every name that is either on disk or in our table. Copy the names, since
+        // childEvent() may remove them from the table.
+        std::set<kj::StringPtr> seen;
+        kj::Vector<kj::String> names;
+        const char* pathPtr = watchInfo.path == nullptr ? "." : watchInfo.path.cStr();
+        DIR* dir = opendir(pathPtr);
+        if (dir != nullptr) {
+          KJ_DEFER(closedir(dir));
+          for (;;) {
+            errno = 0;
+            struct dirent* entry = readdir(dir);
+            if (entry == nullptr) {
+              int error = errno;
+              if (error == 0) {
+                break;
+              } else {
+                KJ_FAIL_SYSCALL("readdir", error, pathPtr);
+              }
+            }
+
+            kj::StringPtr name = entry->d_name;
+            if (name != "." && name != "..") {
+              names.add(kj::heapString(name));
+            }
+          }
+        }
+        for (auto& name: names) {
+          seen.insert(name);
+        }
+        for (auto& child: watchInfo.childSizes) {
+          if (seen.count(child.first) == 0) {
+            names.add(kj::heapString(child.first));
+          }
+        }
+
+        currentRescan = PartialRescan { wd, kj::mv(names) };
+      } else {
+        break;
+      }
+    }
+  }
+
+  void childEvent(WatchInfo& watchInfo, kj::StringPtr name, bool rescanning = false) {
     // Called to update the child table when we receive an inotify event with the given name.
+    //
+    // `rescanning` is true when reconciling after a queue overflow, in which case
+    // subdirectories we already know about have their own rescan pending and needn't be
+    // re-watched.
 
     // OK, we received notification that something happened to the child named `name`.
     // Unfortunately, we don't have any idea how long ago this event happened. Worse, any
@@ -322,6 +489,7 @@ private:
     totalSize += usage.bytes;
 
     auto iter = watchInfo.childSizes.find(name);
+    bool wasKnown = iter != watchInfo.childSizes.end();
     if (usage.bytes == 0) {
       // There is no longer a child by this name on disk. Remove whatever is in the map.
       if (iter != watchInfo.childSizes.end()) {
@@ -349,7 +517,7 @@ private:
     // start watching the directory. In the moved-in case, we are probably already watching the
     // directory, however it is necessary to redo the watch because the path has changed and the
     // directory state may have become inconsistent in the time that the path was wrong.
-    if (usage.isDir) {
+    if (usage.isDir && !(rescanning && wasKnown)) {
       // We can't actually add the new watch now because we need to process the remaining
       // events from the last read() in order to make sure we're caught up with inotify's
       // state.
@@ -357,6 +525,124 @@ private:
     }
   }
 
+  kj::Promise<void> startPolling() {
+    KJ_LOG(WARNING, "out of inotify watches; falling back to periodically scanning grain storage. "
+                    "Consider raising fs.inotify.max_user_watches.");
+
+    // Give back all our watches so that other grains can use them.
+    observer = nullptr;
+    inotifyFd = nullptr;
+    watchMap.clear();
+    pendingWatches.clear();
+    pendingRescans.clear();
+    currentRescan = nullptr;
+
+    // We keep reporting the partial total we had until the first pass completes.
+    pendingScans.add(nullptr);  // root directory
+    scanTotal = 0;
+    return pollLoop();
+  }
+
+  kj::Promise<void> pollLoop() {
+    if (scanSome()) {
+      // Pass complete.
+      totalSize = scanTotal;
+      maybeReportSize();
+
+      pendingScans.add(nullptr);
+      scanTotal = 0;
+      return timer.afterDelay(POLL_INTERVAL).then([this]() { return pollLoop(); });
+    } else {
+      return timer.afterDelay(SCAN_TICK).then([this]() { return pollLoop(); });
+    }
+  }
+
+  bool scanSome() {
+    // Continue the current polling pass, statting up to SCAN_BUDGET files. Returns true if the
+    // pass is complete, in which case scanTotal is the size of the tree.
+
+    for (uint budget = SCAN_BUDGET; budget > 0;) {
+      KJ_IF_MAYBE(current, currentScan) {
+        errno = 0;
+        struct dirent* entry = readdir((*current)->dir);
+        if (entry == nullptr) {
+          int error = errno;
+          if (error != 0) {
+            KJ_FAIL_SYSCALL("readdir", error, (*current)->path);
+          }
+          currentScan = nullptr;
+          continue;
+        }
+
+        kj::StringPtr name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        --budget;
+
+        uint64_t blocks = 0;
+        uint64_t nlink = 0;
+        mode_t mode = 0;
+        int fd = dirfd((*current)->dir);
+        int error = 0;
+        if (useStatx) {
+          // Unlike lstat(), statx() lets us ask for only the fields we need, and relative to the
+          // open directory saves a path walk per file.
+          struct statx stats;
+          if (statx(fd, name.cStr(), AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                    STATX_TYPE | STATX_NLINK | STATX_BLOCKS, &stats) < 0) {
+            error = errno;
+          } else {
+            blocks = stats.stx_blocks;
+            nlink = stats.stx_nlink;
+            mode = stats.stx_mode;
+          }
+          if (error == ENOSYS || error == EPERM) {
+            // Old kernel, or a seccomp filter (e.g. in a container) that doesn't know statx().
+            KJ_LOG(WARNING, "statx() unavailable; falling back to fstatat()", error);
+            useStatx = false;
+          }
+        }
+        if (!useStatx) {
+          struct stat stats;
+          if (fstatat(fd, name.cStr(), &stats, AT_SYMLINK_NOFOLLOW) < 0) {
+            error = errno;
+          } else {
+            error = 0;
+            blocks = stats.st_blocks;
+            nlink = stats.st_nlink;
+            mode = stats.st_mode;
+          }
+        }
+        if (error == ENOENT) continue;  // deleted since readdir()
+        if (error != 0) {
+          KJ_FAIL_SYSCALL(useStatx ? "statx" : "fstatat", error, (*current)->path, name);
+        }
+
+        // Same accounting as getDiskUsage().
+        uint64_t bytes = blocks * 512;
+        if (nlink != 0) bytes /= nlink;
+        scanTotal += bytes;
+
+        if (S_ISDIR(mode)) {
+          auto& parent = (*current)->path;
+          pendingScans.add(parent == nullptr ? kj::heapString(name) : kj::str(parent, '/', name));
+        }
+      } else if (pendingScans.size() > 0) {
+        auto path = kj::mv(pendingScans.back());
+        pendingScans.removeLast();
+        DIR* dir = opendir(path == nullptr ? "." : path.cStr());
+        if (dir == nullptr) {
+          int error = errno;
+          if (error == ENOENT || error == ENOTDIR) continue;  // deleted or replaced
+          KJ_FAIL_SYSCALL("opendir", error, path);
+        }
+        currentScan = kj::heap<OpenDir>(dir, kj::mv(path));
+      } else {
+        return true;
+      }
+    }
+    return false;
+  }
+
   struct DiskUsage {
     kj::String path;
     uint64_t bytes;
@@ -418,9 +704,10 @@ private:
 
     reportInFlight = true;
 
-    // Wait 500ms before reporting to gather other changes.
-    tasks.add(timer.afterDelay(500 * kj::MILLISECONDS)
+    auto delay = kj::max(REPORT_DELAY, lastReportTime + REPORT_MIN_INTERVAL - timer.now());
+    tasks.add(timer.afterDelay(delay)
         .then([this]() -> kj::Promise<void> {
+      lastReportTime = timer.now();
       auto req = core.reportGrainSizeRequest();
       uint64_t sizeBeingReported = totalSize;
       req.setBytes(sizeBeingReported);
@@ -452,6 +739,92 @@ private:
   }
 };
 
+// =======================================================================================
+// Storage sync
+
+class StorageSyncer {
+  // Implements Supervisor.syncStorage(). syncfs() flushes the whole filesystem, which can take
+  // seconds when many grains are writing at once (e.g. when the server is shutting down), so we
+  // run it on a worker thread rather than block the RPC loop, and we group-commit: one flush
+  // satisfies every request that arrived before it started. Requests that arrive while a flush
+  // is running wait for the next one, since the running flush may have missed their writes.
+  //
+  // syncfs() rather than fsync() of individual files because we don't know which files the app
+  // has dirtied; fsync()ing every file in the grain would cost far more than one syncfs().
+
+public:
+  StorageSyncer(kj::UnixEventPort& eventPort, kj::Timer& timer)
+      : eventPort(eventPort), timer(timer),
+        storageDir(raiiOpen(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)),
+        lastFlush(kj::Promise<void>(kj::READY_NOW).fork()) {}
+
+  kj::Promise<void> sync() {
+    KJ_IF_MAYBE(next, nextFlush) {
+      // A flush is scheduled but hasn't started yet; join it.
+      return next->addBranch();
+    }
+
+    // Schedule a flush to start when the previous one is done and the coalescing window has
+    // passed, whichever is later.
+    auto flush = lastFlush.addBranch().then([this]() {
+      return timer.afterDelay(COALESCE_WINDOW);
+    }).then([this]() {
+      // From here on, new requests must wait for the next flush.
+      nextFlush = nullptr;
+      return flushOnThread();
+    }).fork();
+
+    auto result = flush.addBranch();
+    lastFlush = flush.addBranch().catch_([](kj::Exception&&) {}).fork();
+    nextFlush = kj::mv(flush);
+    return result;
+  }
+
+private:
+  static constexpr kj::Duration COALESCE_WINDOW = 20 * kj::MILLISECONDS;
+
+  kj::UnixEventPort& eventPort;
+  kj::Timer& timer;
+  kj::AutoCloseFd storageDir;
+  kj::ForkedPromise<void> lastFlush;
+  kj::Maybe<kj::ForkedPromise<void>> nextFlush;
+
+  struct Flush {
+    kj::AutoCloseFd doneEvent;
+    kj::UnixEventPort::FdObserver observer;
+    int error = 0;
+    kj::Own<kj::Thread> thread;
+    // Declared last so that it's destroyed, joining the thread, before the rest.
+
+    Flush(kj::UnixEventPort& eventPort, kj::AutoCloseFd doneEventParam)
+        : doneEvent(kj::mv(doneEventParam)),
+          observer(eventPort, doneEvent, kj::UnixEventPort::FdObserver::OBSERVE_READ) {}
+  };
+
+  kj::Promise<void> flushOnThread() {
+    int eventFd;
+    KJ_SYSCALL(eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    auto flush = kj::heap<Flush>(eventPort, kj::AutoCloseFd(eventFd));
+    auto promise = flush->observer.whenBecomesReadable();
+
+    Flush& state = *flush;
+    state.thread = kj::heap<kj::Thread>([&state, dirFd = storageDir.get()]() {
+      if (syncfs(dirFd) < 0) {
+        state.error = errno;
+      }
+      uint64_t one = 1;
+      ssize_t n = write(state.doneEvent, &one, sizeof(one));
+      (void)n;  // can't fail: the counter can't overflow from a single write
+    });
+
+    return promise.then([&state]() {
+      if (state.error != 0) {
+        KJ_FAIL_SYSCALL("syncfs", state.error);
+      }
+    }).attach(kj::mv(flush));
+  }
+};
+
 // =======================================================================================
 // Termination handling:  Must kill child if parent terminates.
 //
@@ -460,6 +833,8 @@ private:
 pid_t childPid = 0;
 bool keepAlive = true;
 uint32_t wakelockCount = 0;
+bool hibernate = false;
+bool reportedIdle = false;
 
 void logSafely(const char* text) {
   // Log a message in an async-signal-safe way.
@@ -474,6 +849,16 @@ void logSafely(const char* text) {
 #define SANDSTORM_LOG(text) \
   logSafely("** SANDSTORM SUPERVISOR: " text "\n")
 
+void notifyParent(const char* line) {
+  // After "Listening...", each line the supervisor writes to stdout reports a change in the
+  // grain's state to the back-end (see BackendImpl::RunningGrain::watchSupervisor()). This is
+  // async-signal-safe. Errors are ignored; the back-end treats these as hints.
+
+  if (write(STDOUT_FILENO, line, strlen(line)) < 0) {
+    // Nothing useful to do.
+  }
+}
+
 void killChild() {
   if (childPid != 0) {
     kill(childPid, SIGKILL);
@@ -502,6 +887,15 @@ void signalHandler(int signo) {
       } else if (wakelockCount > 0) {
         SANDSTORM_LOG("Grain has been backgrounded; staying up for now.");
         return;
+      } else if (hibernate && !reportedIdle) {
+        // Ask the back-end to freeze us rather than shutting down. Once frozen, nothing happens
+        // until a call thaws us, at which point the pending SIGALRM sees keepAlive set and we
+        // start counting again. If the back-end doesn't freeze us, we shut down one period late.
+        SANDSTORM_LOG("Grain no longer in use; hibernating.");
+        reportedIdle = true;
+        keepAlive = true;
+        notifyParent("Idle...\n");
+        return;
       }
       SANDSTORM_LOG("Grain no longer in use; shutting down.");
       killChildAndExit(0);
@@ -573,6 +967,27 @@ SupervisorMain::SupervisorMain(kj::ProcessContext& context)
 }
 
 kj::MainFunc SupervisorMain::getMain() {
+  if (context.getProgramName().endsWith("warm-supervisor")) {
+    return getWarmMain();
+  } else {
+    return getGrainMain();
+  }
+}
+
+kj::MainFunc SupervisorMain::getWarmMain() {
+  return kj::MainBuilder(context, "Sandstorm version " SANDSTORM_VERSION,
+                         "Prepares a Sandstorm grain supervisor without yet knowing which grain "
+                         "it will run. Once ready, writes a line to stdout, then reads the "
+                         "remaining supervisor arguments from stdin, separated by NUL bytes, "
+                         "and continues as if they had been passed on the command line.")
+      .addOptionWithArg({"uid"}, KJ_BIND_METHOD(*this, setUid), "<uid>",
+                        "Use setuid sandbox rather than userns. Must start as root, but swiches "
+                        "to <uid> to run the app.")
+      .callAfterParsing(KJ_BIND_METHOD(*this, runWarm))
+      .build();
+}
+
+kj::MainFunc SupervisorMain::getGrainMain() {
   return kj::MainBuilder(context, "Sandstorm version " SANDSTORM_VERSION,
                          "Runs a Sandstorm grain supervisor for the grain <grain-id>, which is "
                          "an instance of app <app-id>.  Executes <command> inside the grain "
@@ -606,6 +1021,13 @@ kj::MainFunc SupervisorMain::getMain() {
       .addOption({"log-seccomp-violations"},
                  [this]() { logSeccompViolations = true; return true; },
                  "Log seccomp filter violations")
+      .addOption({"hibernate"}, [this]() { sandstorm::hibernate = true; return true; },
+                 "When the grain goes idle, write a line to stdout asking the parent to freeze "
+                 "it, rather than shutting down immediately.")
+      .addOption({"memory-merge"}, [this]() { memoryMerge = true; return true; },
+                 "Let the kernel merge identical pages of the sandboxed processes with those of "
+                 "other grains (KSM), and periodically write a line to stdout reporting how much "
+                 "was merged. Requires Linux 6.4 and privileged mode; otherwise ignored.")
       .expectArg("<app-name>", KJ_BIND_METHOD(*this, setAppName))
       .expectArg("<grain-id>", KJ_BIND_METHOD(*this, setGrainId))
       .expectOneOrMoreArgs("<command>", KJ_BIND_METHOD(*this, addCommandArg))
@@ -720,6 +1142,30 @@ kj::MainBuilder::Validity SupervisorMain::run() {
   }
 }
 
+kj::MainBuilder::Validity SupervisorMain::runWarm() {
+  // Everything here must be independent of the grain, the app, and the grain-specific flags
+  // (--dev in particular changes how unshareOuter() maps IDs, so the back-end never uses warm
+  // supervisors for dev grains).
+  KJ_SYSCALL(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0));
+  closeFds();
+  setResourceLimits();
+  unshareOuter();
+  devTemplate = makeDevTemplate();
+  prewarmed = true;
+
+  kj::FdOutputStream(STDOUT_FILENO).write("Warm...\n", 8);
+
+  // Wait for our assignment. The back-end closes the pipe after writing it.
+  auto input = readAll(STDIN_FILENO);
+  auto args = KJ_MAP(arg, split(input.asArray(), '\0')) { return kj::heapString(arg); };
+  auto argPtrs = KJ_MAP(arg, args) -> kj::StringPtr { return arg; };
+  getGrainMain()(context.getProgramName(), argPtrs);
+
+  // run() never returns, so we only get here if parsing failed, in which case MainBuilder
+  // already reported the error and exited.
+  return true;
+}
+
 // =====================================================================================
 
 void SupervisorMain::bind(kj::StringPtr src, kj::StringPtr dst, unsigned long flags) {
@@ -768,17 +1214,58 @@ kj::String SupervisorMain::realPath(kj::StringPtr path) {
 
 // =====================================================================================
 
+static uint64_t monotonicNs() {
+  struct timespec ts;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void SupervisorMain::endPhase(kj::StringPtr name) {
+  auto now = monotonicNs();
+  phaseTimes.add(kj::str(name, "=", (now - phaseStartNs) / 1000, "us"));
+  phaseStartNs = now;
+}
+
 void SupervisorMain::setupSupervisor() {
-  // Enable no_new_privs so that once we drop privileges we can never regain them through e.g.
-  // execing a suid-root binary.  Sandboxed apps should not need that.
-  KJ_SYSCALL(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0));
+  phaseStartNs = monotonicNs();
 
-  closeFds();
-  setResourceLimits();
-  checkPaths();
-  unshareOuter();
+  if (prewarmed) {
+    // runWarm() already did everything below except checkPaths(), which must run as the target
+    // user. In privileged mode unshareOuter() left us with euid 0, so step down temporarily.
+    KJ_IF_MAYBE(u, sandboxUid) {
+      KJ_SYSCALL(seteuid(*u));
+    }
+    checkPaths();
+    KJ_IF_MAYBE(u, sandboxUid) {
+      KJ_SYSCALL(seteuid(0));
+    }
+    endPhase("paths");
+  } else {
+    // Enable no_new_privs so that once we drop privileges we can never regain them through e.g.
+    // execing a suid-root binary.  Sandboxed apps should not need that.
+    KJ_SYSCALL(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0));
+
+    closeFds();
+    setResourceLimits();
+    endPhase("fds");
+    checkPaths();
+    endPhase("paths");
+    unshareOuter();
+    endPhase("unshare");
+  }
+  if (memoryMerge && sandboxUid != nullptr) {
+    // KsmWatcher reads the app's /proc entries after we've chrooted away from /proc. Merging
+    // doesn't work in userns mode, so there's nothing to watch there.
+    procDir = raiiOpen("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
   setupFilesystem();
   setupStdio();
+  endPhase("stdio");
+
+  // stderr is now the grain's log.
+  logSafely(kj::str("** SANDSTORM SUPERVISOR: Sandbox setup",
+                    prewarmed ? " (prewarmed): " : ": ",
+                    kj::strArray(phaseTimes, " "), "\n").cStr());
 
   // Note:  permanentlyDropSuperuser() is performed post-fork; see comment in function def.
 }
@@ -936,11 +1423,11 @@ void SupervisorMain::unshareOuter() {
 }
 
 void SupervisorMain::makeCharDeviceNode(
-    const char *name, const char* realName, int major, int minor) {
+    kj::StringPtr dir, const char *name, const char* realName, int major, int minor) {
   // Creating a real device node with mknod won't work on any current kernel, and we're
   // currently stuck with the filesystem being nodev, so even if mknod were to work, the
   // resulting device node wouldn't function.
-  auto dst = kj::str("dev/", name);
+  auto dst = kj::str(dir, '/', name);
   KJ_SYSCALL(mknod(dst.cStr(), S_IFREG | 0666, 0));
   KJ_SYSCALL(mount(kj::str("/dev/", realName).cStr(), dst.cStr(), nullptr, MS_BIND, nullptr));
 }
@@ -951,6 +1438,64 @@ void mountTmpFs(const char *name, const char *dest) {
                      "size=16m,nr_inodes=4k,mode=770"));
 }
 
+void SupervisorMain::mountDev(kj::StringPtr dir) {
+  // Mount the sandbox's dev at `dir`: a read-only tmpfs that contains a few safe device nodes.
+
+  KJ_SYSCALL(mount("sandstorm-dev", dir.cStr(), "tmpfs",
+                   MS_NOATIME | MS_NOSUID | MS_NOEXEC | MS_NODEV,
+                   "size=1m,nr_inodes=16,mode=755"));
+  makeCharDeviceNode(dir, "null", "null", 1, 3);
+  makeCharDeviceNode(dir, "zero", "zero", 1, 5);
+  makeCharDeviceNode(dir, "random", "urandom", 1, 9);
+  makeCharDeviceNode(dir, "urandom", "urandom", 1, 9);
+
+  // Create /dev/shm so shm_open() and friends work. Note that even though /dev
+  // is already a tmpfs, we need to mount a separate tmpfs for /dev/shm, because
+  // the former will be read-only.
+  //
+  // TODO: it might be nice to have /dev/shm and /tmp share the same partition,
+  // so we don't have to strictly separate their storage capacity. We could mount
+  // a single tmpfs somewhere invisible, create subdirectories, and then bind-mount
+  // them to their final destinations.
+  auto shm = kj::str(dir, "/shm");
+  KJ_SYSCALL(mkdir(shm.cStr(), 0700));
+  mountTmpFs("sandstorm-shm", shm.cStr());
+
+  KJ_SYSCALL(mount(dir.cStr(), dir.cStr(), nullptr,
+                   MS_REMOUNT | MS_BIND | MS_NOEXEC | MS_NOSUID | MS_NODEV | MS_RDONLY,
+                   nullptr));
+}
+
+kj::Maybe<kj::AutoCloseFd> SupervisorMain::makeDevTemplate() {
+  // Build dev at a staging mount point, then detach a recursive copy of it with open_tree().
+  // The copy is independent of the staging mounts and survives until attached or closed.
+  //
+  // Nothing here depends on the grain or the package, so the warm pool can do it ahead of
+  // demand. Returns null if the kernel lacks open_tree() (before 5.2) or won't let us use it.
+
+  const char* staging = "/tmp/sandstorm-grain";
+  if (mkdir(staging, 0770) < 0) {
+    int error = errno;
+    if (error != EEXIST) {
+      KJ_FAIL_SYSCALL("mkdir(staging)", error, staging);
+    }
+  }
+
+  mountDev(staging);
+  int fd = syscall(__NR_open_tree, AT_FDCWD, staging,
+                   OPEN_TREE_CLONE | O_CLOEXEC | AT_RECURSIVE);
+  int error = errno;
+  KJ_SYSCALL(umount2(staging, MNT_DETACH));
+
+  if (fd >= 0) {
+    return kj::AutoCloseFd(fd);
+  } else if (error == ENOSYS || error == EPERM || error == EINVAL) {
+    return nullptr;
+  } else {
+    KJ_FAIL_SYSCALL("open_tree", error);
+  }
+}
+
 void SupervisorMain::setupFilesystem() {
   // The root of our mount namespace will be the app package itself.  We optionally create
   // tmp, dev, and var.  tmp is an ordinary tmpfs.  dev is a read-only tmpfs that contains
@@ -970,6 +1515,7 @@ void SupervisorMain::setupFilesystem() {
 
   // Bind the app package to "sandbox", which will be the grain's root directory.
   bind(pkgPath, "/tmp/sandstorm-grain", MS_NODEV | MS_RDONLY);
+  endPhase("root");
 
   // Change to that directory.
   KJ_SYSCALL(chdir("/tmp/sandstorm-grain"));
@@ -985,30 +1531,17 @@ void SupervisorMain::setupFilesystem() {
     //    delete.
     mountTmpFs("sandstorm-tmp", "tmp");
   }
+  endPhase("tmp");
   if (access("dev", F_OK) == 0) {
-    KJ_SYSCALL(mount("sandstorm-dev", "dev", "tmpfs",
-                     MS_NOATIME | MS_NOSUID | MS_NOEXEC | MS_NODEV,
-                     "size=1m,nr_inodes=16,mode=755"));
-    makeCharDeviceNode("null", "null", 1, 3);
-    makeCharDeviceNode("zero", "zero", 1, 5);
-    makeCharDeviceNode("random", "urandom", 1, 9);
-    makeCharDeviceNode("urandom", "urandom", 1, 9);
-
-    // Create /dev/shm so shm_open() and friends work. Note that even though /dev
-    // is already a tmpfs, we need to mount a separate tmpfs for /dev/shm, because
-    // the former will be read-only.
-    //
-    // TODO: it might be nice to have /dev/shm and /tmp share the same partition,
-    // so we don't have to strictly separate their storage capacity. We could mount
-    // a single tmpfs somewhere invisible, create subdirectories, and then bind-mount
-    // them to their final destinations.
-    KJ_SYSCALL(mkdir("dev/shm", 0700));
-    mountTmpFs("sandstorm-shm", "dev/shm");
-
-    KJ_SYSCALL(mount("dev", "dev", nullptr,
-                     MS_REMOUNT | MS_BIND | MS_NOEXEC | MS_NOSUID | MS_NODEV | MS_RDONLY,
-                     nullptr));
+    KJ_IF_MAYBE(fd, devTemplate) {
+      KJ_SYSCALL(syscall(__NR_move_mount, fd->get(), "", AT_FDCWD, "dev",
+                         MOVE_MOUNT_F_EMPTY_PATH));
+    } else {
+      mountDev("dev");
+    }
   }
+  devTemplate = nullptr;
+  endPhase("dev");
   if (access("var", F_OK) == 0) {
     bind(kj::str(varPath, "/sandbox"), "var", MS_NODEV);
   }
@@ -1032,6 +1565,7 @@ void SupervisorMain::setupFilesystem() {
     }
   }
 
+  endPhase("binds");
 
   // OK, everything is bound, so we can pivot_root.
   KJ_SYSCALL(syscall(SYS_pivot_root, "/tmp/sandstorm-grain", "/tmp/sandstorm-grain"));
@@ -1043,6 +1577,7 @@ void SupervisorMain::setupFilesystem() {
   KJ_SYSCALL(fchdir(oldRootDir));
   KJ_SYSCALL(umount2(".", MNT_DETACH));
   KJ_SYSCALL(fchdir(supervisorDir));
+  endPhase("pivot");
 
   // Now "." is the grain's storage directory and "/" is the sandbox directory, i.e.
   // "/" == "./sandbox". Yes, this means the root directory is _below_ the current directory.
@@ -1061,8 +1596,8 @@ void SupervisorMain::setupStdio() {
     KJ_SYSCALL(dup2(devNull, STDIN_FILENO));
     KJ_SYSCALL(close(devNull));
 
-    // We direct stderr to a log file for debugging purposes.
-    // TODO(soon):  Rotate logs.
+    // We direct stderr to a log file for debugging purposes. LogRing (see runSupervisor())
+    // keeps it from growing without bound.
     int log;
     KJ_SYSCALL(log = open("log", O_WRONLY | O_APPEND | O_CLOEXEC));
     KJ_SYSCALL(dup2(log, STDERR_FILENO));
@@ -1321,6 +1856,24 @@ void SupervisorMain::permanentlyDropSuperuser() {
   umask(0007);
 }
 
+void SupervisorMain::maybeEnableMemoryMerge() {
+  // Mark the app's address space as mergeable by KSM if --memory-merge was passed. The flag is
+  // inherited across fork() and exec(), so it covers the app's whole process tree, and grains of
+  // the same package end up sharing their identical interpreter heaps and code pages.
+  //
+  // This needs CAP_SYS_RESOURCE in the root user namespace, so it must happen before we drop
+  // privileges, and it won't work in userns mode. It also needs Linux 6.4. In all of these cases
+  // the app just runs without merging.
+  if (memoryMerge) {
+    if (prctl(PR_SET_MEMORY_MERGE, 1, 0, 0, 0) < 0) {
+      int error = errno;
+      if (error != EINVAL && error != EPERM) {
+        KJ_FAIL_SYSCALL("prctl(PR_SET_MEMORY_MERGE)", error);
+      }
+    }
+  }
+}
+
 void SupervisorMain::enterSandbox() {
   // Fully enter the sandbox.  Called only by the child process.
   KJ_SYSCALL(chdir("/"));
@@ -1331,6 +1884,9 @@ void SupervisorMain::enterSandbox() {
   // Mount proc if --proc was passed.
   maybeFinishMountingProc();
 
+  // Opt in to KSM if --memory-merge was passed.
+  maybeEnableMemoryMerge();
+
   // Now actually drop all credentials.
   permanentlyDropSuperuser();
 
@@ -1472,6 +2028,64 @@ private:
   kj::Own<kj::PromiseFulfiller<void>> fulfiller;
 };
 
+class InternedRequirements final: public kj::Refcounted {
+  // An immutable list of MembraneRequirements, shared by every policy with the same list.
+  //
+  // Apps that receive many capabilities through the powerbox end up with lots of policies whose
+  // requirements are identical (e.g. the same user holding the same permissions on the same
+  // grain), so rather than each keeping its own copy, we keep one copy of each distinct list.
+
+public:
+  static kj::Own<InternedRequirements> intern(
+      capnp::List<MembraneRequirement>::Reader requirements) {
+    // We encode the list the same way newOwnCapnp() does. The encoding doubles as the lookup key:
+    // it's deterministic, so identical lists produce identical bytes.
+    auto words = kj::heapArray<capnp::word>(requirements.totalSize().wordCount + 1);
+    memset(words.asBytes().begin(), 0, words.asBytes().size());
+    capnp::copyToUnchecked(requirements, words);
+
+    auto& table = getTable();
+    auto iter = table.find(words.asBytes());
+    if (iter != table.end()) {
+      return kj::addRef(*iter->second);
+    }
+
+    auto result = kj::refcounted<InternedRequirements>(kj::mv(words));
+    table.insert(std::make_pair(result->words.asBytes(), result.get()));
+    return kj::mv(result);
+  }
+
+  explicit InternedRequirements(kj::Array<capnp::word> words)
+      : words(kj::mv(words)),
+        list(capnp::readMessageUnchecked<capnp::List<MembraneRequirement>>(
+            this->words.begin())) {}
+  // Use intern() instead.
+
+  ~InternedRequirements() noexcept(false) {
+    getTable().erase(words.asBytes());
+  }
+
+  capnp::List<MembraneRequirement>::Reader get() const { return list; }
+
+private:
+  kj::Array<capnp::word> words;
+  capnp::List<MembraneRequirement>::Reader list;
+
+  struct BytesLess {
+    bool operator()(kj::ArrayPtr<const byte> a, kj::ArrayPtr<const byte> b) const {
+      int cmp = memcmp(a.begin(), b.begin(), kj::min(a.size(), b.size()));
+      return cmp < 0 || (cmp == 0 && a.size() < b.size());
+    }
+  };
+  typedef std::map<kj::ArrayPtr<const byte>, InternedRequirements*, BytesLess> Table;
+
+  static Table& getTable() {
+    // Leaked, so that policies still alive during static destruction can remove themselves.
+    static Table* table = new Table;
+    return *table;
+  }
+};
+
 class RequirementsMembranePolicy final: public capnp::MembranePolicy, public kj::Refcounted {
   // A MembranePolicy that revokes when some MembraneRequirements are no longer held.
 
@@ -1488,7 +2102,7 @@ public:
       kj::Own<RequirementsMembranePolicy> parent)
       : sandstormCore(kj::mv(sandstormCore)),
         childInfo(ChildInfo {
-          newOwnCapnp(requirements),
+          InternedRequirements::intern(requirements),
           parent->mergeRevoked(kj::mv(revoked)).fork(),
           kj::mv(observer),
           kj::mv(parent)
@@ -1502,6 +2116,7 @@ public:
       uint64_t interfaceId, uint16_t methodId, capnp::Capability::Client target) override {
     // Don't shut down as long as we're receiving inbound calls.
     sandstorm::keepAlive = true;
+    sandstorm::reportedIdle = false;
 
     if (interfaceId == capnp::typeId<capnp::Persistent<>>() ||
         interfaceId == capnp::typeId<SystemPersistent>()) {
@@ -1565,16 +2180,27 @@ public:
     // to enforce the membrane requirements from here on out.
 
     KJ_IF_MAYBE(c, childInfo) {
-      auto req = kj::mv(external).castAs<SystemPersistent>()
-          .addRequirementsRequest();
       // TODO(soon): Also merge requirements from exportPolicy.
-      // TODO(soon): We actually have to make several addRequirements() calls to send across all
-      //   the observers for our parents, ugh.
-      req.adoptRequirements(kj::downcast<RequirementsMembranePolicy>(importPolicy)
-          .collectRequirements(capnp::Orphanage::getForMessageContaining(
-              SystemPersistent::AddRequirementsParams::Builder(req))));
-      req.setObserver(c->observer);
-      return req.send().getCap();
+      auto& policy = kj::downcast<RequirementsMembranePolicy>(importPolicy);
+      auto observers = policy.collectObservers();
+      if (observers.size() == 0) observers.add(c->observer);
+
+      // The host needs every observer in the chain, and addRequirements() takes only one, so we
+      // make one call per observer, each wrapping the last. They're pipelined, so this costs no
+      // round trips. The observers must be the ones the host gave us, not objects of our own,
+      // or the exported capability would be revoked whenever this grain shut down.
+      auto cap = kj::mv(external).castAs<SystemPersistent>();
+      for (auto i: kj::indices(observers)) {
+        auto req = cap.addRequirementsRequest();
+        if (i == 0) {
+          req.adoptRequirements(policy.collectRequirements(
+              capnp::Orphanage::getForMessageContaining(
+                  SystemPersistent::AddRequirementsParams::Builder(req))));
+        }
+        req.setObserver(kj::mv(observers[i]));
+        cap = req.send().getCap();
+      }
+      return kj::mv(cap);
     } else {
       // We weren't enforcing any requirements anyway.
       return kj::mv(external);
@@ -1582,27 +2208,29 @@ public:
   }
 
   capnp::Orphan<capnp::List<MembraneRequirement>> collectRequirements(capnp::Orphanage orphanage) {
-    kj::Vector<capnp::List<MembraneRequirement>::Reader> parts;
+    // Returns the requirements of this policy and all its ancestors.
 
-    auto ptr = this;
-    bool empty = true;
-    for (;;) {
+    auto requirements = getAllRequirements().get();
+    if (requirements.size() == 0) {
+      return {};
+    } else {
+      return orphanage.newOrphanCopy(requirements);
+    }
+  }
+
+  kj::Vector<SystemPersistent::RevocationObserver::Client> collectObservers() {
+    // Returns the observers of this policy and all its ancestors, nearest first.
+
+    kj::Vector<SystemPersistent::RevocationObserver::Client> result;
+    for (auto ptr = this;;) {
       KJ_IF_MAYBE(c, ptr->childInfo) {
-        if (c->requirements.size() > 0) {
-          empty = false;
-          parts.add(c->requirements);
-        }
+        result.add(c->observer);
         ptr = c->parent;
       } else {
         break;
       }
     }
-
-    if (empty) {
-      return {};
-    } else {
-      return orphanage.newOrphanConcat(parts.asPtr());
-    }
+    return result;
   }
 
   kj::Own<RequirementsMembranePolicy> addRequirements(
@@ -1624,7 +2252,7 @@ private:
   SandstormCore::Client sandstormCore;
 
   struct ChildInfo {
-    OwnCapnp<capnp::List<MembraneRequirement>> requirements;
+    kj::Own<InternedRequirements> requirements;
     kj::ForkedPromise<void> revoked;
     SystemPersistent::RevocationObserver::Client observer;
     kj::Own<RequirementsMembranePolicy> parent;
@@ -1632,6 +2260,43 @@ private:
 
   kj::Maybe<ChildInfo> childInfo;
 
+  kj::Maybe<kj::Own<InternedRequirements>> allRequirements;
+  // Memoized getAllRequirements(). A policy's chain never changes, so we only flatten it once,
+  // however many times its capabilities are saved or passed on.
+
+  InternedRequirements& getAllRequirements() {
+    KJ_IF_MAYBE(a, allRequirements) {
+      return **a;
+    }
+
+    kj::Vector<InternedRequirements*> parts;
+    for (auto ptr = this;;) {
+      KJ_IF_MAYBE(c, ptr->childInfo) {
+        if (c->requirements->get().size() > 0) {
+          parts.add(c->requirements.get());
+        }
+        ptr = c->parent;
+      } else {
+        break;
+      }
+    }
+
+    kj::Own<InternedRequirements> result;
+    if (parts.size() == 1) {
+      // Common case: only one policy in the chain has requirements, so its list is the answer.
+      result = kj::addRef(*parts[0]);
+    } else {
+      auto lists = KJ_MAP(part, parts) { return part->get(); };
+      capnp::MallocMessageBuilder scratch;
+      result = InternedRequirements::intern(
+          scratch.getOrphanage().newOrphanConcat(lists.asPtr()).getReader());
+    }
+
+    auto& ref = *result;
+    allRequirements = kj::mv(result);
+    return ref;
+  }
+
   kj::Promise<void> mergeRevoked(kj::Promise<void>&& promise) {
     KJ_IF_MAYBE(c, childInfo) {
       return promise.exclusiveJoin(c->revoked.addBranch());
@@ -1794,9 +2459,17 @@ SystemPersistent::Client newIncomingSaveHandler(AppPersistent<>::Client&& cap,
 
 // -----------------------------------------------------------------------------
 
+static void incrementWakelock() {
+  if (sandstorm::wakelockCount++ == 0) {
+    // Tell the back-end not to evict us under memory pressure.
+    notifyParent("Wakelock\n");
+  }
+}
+
 static void decrementWakelock() {
   --sandstorm::wakelockCount;
   if (sandstorm::wakelockCount == 0) {
+    notifyParent("NoWakelock\n");
     SANDSTORM_LOG("Grain's backgrounding has been disabled; staying up for now.");
     // Stay alive for one more keepAlive tick after disabling backgrounding.
     sandstorm::keepAlive = true;
@@ -1821,7 +2494,7 @@ public:
     WrappedOngoingNotification(OngoingNotification::Client ongoingNotification,
                                WakelockSet& wakelockSet)
       : ongoingNotification(ongoingNotification), wakelockSet(wakelockSet), isCancelled(false) {
-      ++sandstorm::wakelockCount;
+      incrementWakelock();
     }
     WrappedOngoingNotification(WrappedOngoingNotification&&) = delete;
     KJ_DISALLOW_COPY(WrappedOngoingNotification);
@@ -1863,7 +2536,7 @@ public:
 
   capnp::RemotePromise<sandstorm::SandstormCore::MakeTokenResults>
   save(OngoingNotification::Client client) {
-    ++sandstorm::wakelockCount;
+    incrementWakelock();
     auto id = counter++;
     wakelockMap.insert(std::make_pair(id, WakeLockInfo(client)));
     auto req = sandstormCore.makeTokenRequest();
@@ -2085,13 +2758,15 @@ private:
 
 class SupervisorMain::SupervisorImpl final: public Supervisor::Server {
 public:
-  inline SupervisorImpl(kj::UnixEventPort& eventPort, MainView<>::Client&& mainView,
+  inline SupervisorImpl(MainView<>::Client&& mainView,
                         kj::Own<RequirementsMembranePolicy> rootMembranePolicy,
-                        WakelockSet& wakelockSet, kj::AutoCloseFd startAppEvent,
+                        WakelockSet& wakelockSet, StorageSyncer& storageSyncer,
+                        LogRing& logRing, kj::AutoCloseFd startAppEvent,
                         SandstormCore::Client sandstormCore, kj::Own<CapRedirector> coreRedirector)
-      : eventPort(eventPort), mainView(kj::mv(mainView)),
+      : mainView(kj::mv(mainView)),
         rootMembranePolicy(kj::mv(rootMembranePolicy)),
-        wakelockSet(wakelockSet), sandstormCore(kj::mv(sandstormCore)),
+        wakelockSet(wakelockSet), storageSyncer(storageSyncer), logRing(logRing),
+        sandstormCore(kj::mv(sandstormCore)),
         coreRedirector(kj::mv(coreRedirector)), startAppEvent(kj::mv(startAppEvent)) {}
 
   kj::Promise<void> getMainView(GetMainViewContext context) override {
@@ -2103,6 +2778,7 @@ public:
 
   kj::Promise<void> keepAlive(KeepAliveContext context) override {
     sandstorm::keepAlive = true;
+    sandstorm::reportedIdle = false;
 
     auto params = context.getParams();
     if (params.hasCore()) {
@@ -2113,9 +2789,7 @@ public:
   }
 
   kj::Promise<void> syncStorage(SyncStorageContext context) override {
-    auto fd = raiiOpen(".", O_RDONLY | O_DIRECTORY);
-    KJ_SYSCALL(syncfs(fd));
-    return kj::READY_NOW;
+    return storageSyncer.sync();
   }
 
   kj::Promise<void> shutdown(ShutdownContext context) override {
@@ -2125,42 +2799,9 @@ public:
 
   kj::Promise<void> watchLog(WatchLogContext context) override {
     auto params = context.getParams();
-    auto logFile = sandstorm::raiiOpen("log", O_RDONLY | O_CLOEXEC);
-
-    // Seek to desired start point.
-    struct stat stats;
-    KJ_SYSCALL(fstat(logFile, &stats));
-    uint64_t requestedBacklog = params.getBacklogAmount();
-    uint64_t backlog = kj::min(requestedBacklog, stats.st_size);
-    KJ_SYSCALL(lseek(logFile, stats.st_size - backlog, SEEK_SET));
-
-    // If the existing log file doesn't cover the whole request, check the previous log file.
-    kj::Maybe<kj::Promise<void>> firstWrite;
-    if (stats.st_size < requestedBacklog) {
-      KJ_IF_MAYBE(log1, raiiOpenIfExists("log.1", O_RDONLY)) {
-        struct stat stats1;
-        KJ_SYSCALL(fstat(*log1, &stats1));
-        uint64_t requestedBacklog1 = requestedBacklog - stats.st_size;
-        uint64_t backlog1 = kj::min(requestedBacklog1, stats1.st_size);
-        KJ_SYSCALL(lseek(*log1, stats1.st_size - backlog1, SEEK_SET));
-
-        kj::FdInputStream in(log1->get());
-        auto req = params.getStream().writeRequest();
-        auto data = req.initData(backlog1);
-        in.read(data.begin(), backlog1);
-        firstWrite = req.send();
-      }
-    }
-
-    // Create the watcher.
-    auto watcher = kj::heap<LogWatcher>(eventPort, "log", kj::mv(logFile), params.getStream());
-
-    KJ_IF_MAYBE(f, firstWrite) {
-      watcher->addTask(kj::mv(*f));
-    }
-
+    auto handle = logRing.watch(params.getBacklogAmount(), params.getStream());
     context.releaseParams();
-    context.getResults(capnp::MessageSize { 4, 1 }).setHandle(kj::mv(watcher));
+    context.getResults(capnp::MessageSize { 4, 1 }).setHandle(kj::mv(handle));
     return kj::READY_NOW;
   }
 
@@ -2253,10 +2894,11 @@ public:
   }
 
 private:
-  kj::UnixEventPort& eventPort;
   MainView<>::Client mainView;  // INTERNAL TO rootMembranePolicy; use carefully
   kj::Own<RequirementsMembranePolicy> rootMembranePolicy;
   WakelockSet& wakelockSet;
+  StorageSyncer& storageSyncer;
+  LogRing& logRing;
   SandstormCore::Client sandstormCore;
   kj::Own<CapRedirector> coreRedirector;
   kj::AutoCloseFd startAppEvent;
@@ -2271,99 +2913,6 @@ private:
       startAppEvent = nullptr;
     }
   }
-
-  class LogWatcher final: public Handle::Server, private kj::TaskSet::ErrorHandler {
-  public:
-    explicit LogWatcher(kj::UnixEventPort& eventPort, kj::StringPtr logPath,
-                        kj::AutoCloseFd logFileParam, ByteStream::Client stream)
-        : logFile(kj::mv(logFileParam)),
-          inotify(makeInotifyFd()),
-          inotifyObserver(eventPort, inotify, kj::UnixEventPort::FdObserver::OBSERVE_READ),
-          stream(kj::mv(stream)),
-          tasks(*this) {
-      KJ_SYSCALL(inotify_add_watch(inotify, logPath.cStr(), IN_MODIFY));
-      tasks.add(watchLoop());
-    }
-
-    void addTask(kj::Promise<void> task) {
-      // HACK for watchLog().
-      tasks.add(kj::mv(task));
-    }
-
-  private:
-    kj::AutoCloseFd logFile;
-    kj::AutoCloseFd inotify;
-    kj::UnixEventPort::FdObserver inotifyObserver;
-    ByteStream::Client stream;
-    kj::TaskSet tasks;
-    off_t lastOffset = 0;
-
-    void taskFailed(kj::Exception&& exception) override {
-      KJ_LOG(ERROR, exception);
-    }
-
-    // Read all unread data from logFile and send it to the stream.
-    kj::Promise<void> copyLog() {
-      auto req = stream.writeRequest();
-      auto orphanage =
-          capnp::Orphanage::getForMessageContaining<ByteStream::WriteParams::Builder>(req);
-      auto orphan = orphanage.newOrphan<capnp::Data>(4096);
-      auto data = orphan.get();
-
-      size_t n = kj::FdInputStream(logFile.get())
-          .tryRead(data.begin(), data.size(), data.size());
-      bool done = n < data.size();
-      if (done) {
-        orphan.truncate(n);
-      }
-      req.adoptData(kj::mv(orphan));
-
-      if(done) {
-        return req.send();
-      } else {
-        return req.send().then([this]() {
-          return copyLog();
-        });
-      }
-    }
-
-    kj::Promise<void> watchLoop() {
-      // Exhaust all events from the inotify queue, because edge triggering.
-      // Luckily we don't actually have to interpret the events because we're only waiting on
-      // one type of event.
-      for (;;) {
-        byte buffer[sizeof(struct inotify_event) + NAME_MAX + 1];
-        ssize_t n;
-        KJ_NONBLOCKING_SYSCALL(n = read(inotify, buffer, sizeof(buffer)));
-        if (n < 0) break;
-        KJ_ASSERT(n > 0);
-      }
-
-      // Check for recent rotation.
-      struct stat stats;
-      KJ_SYSCALL(fstat(logFile, &stats));
-      if (lastOffset > stats.st_size) {
-        // Looks like log was rotated.
-        lastOffset = 0;
-        KJ_SYSCALL(lseek(logFile, 0, SEEK_SET));
-      }
-
-      return copyLog().then([this]() {
-        KJ_SYSCALL(lastOffset = lseek(logFile, 0, SEEK_CUR));
-
-        // OK, now wait for more.
-        return inotifyObserver.whenBecomesReadable().then([this]() {
-          return watchLoop();
-        });
-      });
-    }
-
-    static kj::AutoCloseFd makeInotifyFd() {
-      int ifd;
-      KJ_SYSCALL(ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
-      return kj::AutoCloseFd(ifd);
-    }
-  };
 };
 
 // -----------------------------------------------------------------------------
@@ -2406,6 +2955,95 @@ void SupervisorMain::setupSeccomp() {
   }
 }
 
+class KsmWatcher {
+  // Periodically tells the back-end how much of the app's memory KSM has merged, when
+  // --memory-merge is on. The back-end can't read this itself: /proc/<pid>/ksm_stat requires
+  // ptrace access to the process, and the app runs as the sandbox user. The supervisor runs as
+  // the same user, so it can, through a handle on /proc opened before we chrooted.
+
+public:
+  KsmWatcher(kj::Timer& timer, kj::AutoCloseFd procDir)
+      : timer(timer), procDir(kj::mv(procDir)) {}
+
+  kj::Promise<void> run() {
+    return timer.afterDelay(POLL_INTERVAL).then([this]() {
+      uint64_t bytes = measure();
+      if (bytes != lastReported) {
+        lastReported = bytes;
+        notifyParent(kj::str("KsmMergedBytes ", bytes, "\n").cStr());
+      }
+      return run();
+    });
+  }
+
+private:
+  static constexpr kj::Duration POLL_INTERVAL = 30 * kj::SECONDS;
+
+  kj::Timer& timer;
+  kj::AutoCloseFd procDir;
+  uint64_t lastReported = 0;
+
+  uint64_t measure() {
+    // Sum over the app's process tree. Threads share their process's address space, so only
+    // processes are counted, but any thread may have forked, so we need every thread's children.
+    // Without CONFIG_PROC_CHILDREN we only see the app's root process.
+    uint64_t pages = 0;
+    kj::Vector<kj::String> pending;
+    if (childPid != 0) pending.add(kj::str(childPid));
+    while (pending.size() > 0) {
+      auto pid = kj::mv(pending.back());
+      pending.removeLast();
+      pages += readMergingPages(pid);
+
+      KJ_IF_MAYBE(tasks, tryListDirectory(kj::str(pid, "/task"))) {
+        for (auto& tid: *tasks) {
+          KJ_IF_MAYBE(text, tryRead(kj::str(pid, "/task/", tid, "/children"))) {
+            for (auto word: splitSpace(text->asArray())) {
+              pending.add(kj::str(word));
+            }
+          }
+        }
+      }
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+  }
+
+  uint64_t readMergingPages(kj::StringPtr pid) {
+    // Returns zero if the kernel doesn't say (before 5.19) or the process is gone.
+    KJ_IF_MAYBE(text, tryRead(kj::str(pid, "/ksm_stat"))) {
+      // Linux 6.1 added ksm_stat, and later kernels added ksm_merging_pages to it.
+      for (auto& line: splitLines(*text)) {
+        auto words = splitSpace(line.asArray());
+        if (words.size() == 2 && kj::str(words[0]) == "ksm_merging_pages") {
+          return parseUInt64(kj::str(words[1]), 10).orDefault(0);
+        }
+      }
+    }
+    KJ_IF_MAYBE(text, tryRead(kj::str(pid, "/ksm_merging_pages"))) {
+      return parseUInt64(trim(*text), 10).orDefault(0);
+    }
+    return 0;
+  }
+
+  kj::Maybe<kj::String> tryRead(kj::StringPtr path) {
+    int fd = openat(procDir, path.cStr(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+    kj::AutoCloseFd ownFd(fd);
+    kj::Maybe<kj::String> result;
+    kj::runCatchingExceptions([&]() { result = readAll(ownFd.get()); });
+    return kj::mv(result);
+  }
+
+  kj::Maybe<kj::Array<kj::String>> tryListDirectory(kj::StringPtr path) {
+    int fd = openat(procDir, path.cStr(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+    kj::AutoCloseFd ownFd(fd);
+    kj::Maybe<kj::Array<kj::String>> result;
+    kj::runCatchingExceptions([&]() { result = listDirectoryFd(ownFd.get()); });
+    return kj::mv(result);
+  }
+};
+
 [[noreturn]] void SupervisorMain::runSupervisor(int apiFd, kj::AutoCloseFd startEventFd) {
   // We're currently in a somewhat dangerous state: our root directory is controlled
   // by the app.  If glibc reads, say, /etc/nsswitch.conf, the grain could take control
@@ -2480,18 +3118,27 @@ void SupervisorMain::setupSeccomp() {
   // TODO(someday):  If there are multiple front-ends, or the front-ends restart a lot, we'll
   //   want to wrap the UiView and cache session objects.  Perhaps we could do this by making
   //   them persistable, though it's unclear how that would work with SessionContext.
+  StorageSyncer storageSyncer(ioContext.unixEventPort, ioContext.provider->getTimer());
+  LogRing logRing(ioContext.unixEventPort, ioContext.provider->getTimer(), "log");
   Supervisor::Client mainCap = kj::heap<SupervisorImpl>(
-      ioContext.unixEventPort, kj::mv(app), kj::mv(rootMembranePolicy),
-      wakelockSet, kj::mv(startEventFd), coreCap, kj::addRef(*coreRedirector));
+      kj::mv(app), kj::mv(rootMembranePolicy),
+      wakelockSet, storageSyncer, logRing, kj::mv(startEventFd), coreCap, kj::addRef(*coreRedirector));
+
+  // Report KSM merging, if it's on.
+  kj::Promise<void> ksmTask = kj::NEVER_DONE;
+  KJ_IF_MAYBE(dir, procDir) {
+    auto watcher = kj::heap<KsmWatcher>(ioContext.provider->getTimer(), kj::mv(*dir));
+    ksmTask = watcher->run().attach(kj::mv(watcher));
+  }
 
   auto acceptTask = systemConnector->run(ioContext, kj::mv(mainCap), kj::mv(coreRedirector));
 
-  // Wait for disconnect or accept loop failure or disk watch failure, then exit. Also rotate log
-  // every 512k (thus having at most 1MB of logs at a time).
+  // Wait for disconnect or accept loop failure or disk watch failure, then exit. Meanwhile, the
+  // log ring keeps the log to a bounded number of compressed segments.
   acceptTask.exclusiveJoin(kj::mv(diskWatcherTask))
             .exclusiveJoin(appNetwork.onDisconnect())
-            .exclusiveJoin(rotateLog(ioContext.provider->getTimer(),
-                                     STDERR_FILENO, "log", 512u << 10))
+            .exclusiveJoin(logRing.run())
+            .exclusiveJoin(kj::mv(ksmTask))
             .wait(ioContext.waitScope);
 
   // Only onDisconnect() would return normally (rather than throw), so the app must have
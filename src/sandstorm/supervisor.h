@@ -42,6 +42,8 @@ public:
   SupervisorMain(kj::ProcessContext& context);
 
   kj::MainFunc getMain() override;
+  // Returns the warm-supervisor main if invoked as "warm-supervisor", otherwise the regular
+  // supervisor main.
 
   void setIsNew(bool isNew);
   void setMountProc(bool mountProc);
@@ -82,6 +84,12 @@ public:
 
   kj::MainBuilder::Validity run();
 
+  kj::MainBuilder::Validity runWarm();
+  // Performs the grain-independent part of setupSupervisor(), reports readiness on stdout, then
+  // blocks until the rest of the supervisor command line (NUL-separated) arrives on stdin and
+  // proceeds as if started with that command line. The back-end keeps a small pool of these
+  // parked so that starting a grain doesn't pay for process and namespace setup.
+
 private:
   kj::ProcessContext& context;
 
@@ -99,11 +107,28 @@ private:
   bool seccompDumpPfc = false;
   bool useExperimentalSeccompFilter = false;
   bool logSeccompViolations = false;
+  bool memoryMerge = false;
+  bool prewarmed = false;  // runWarm() already did the grain-independent setup
   kj::Maybe<uid_t> sandboxUid;  // nullptr = use userns
 
+  kj::Maybe<kj::AutoCloseFd> procDir;
+  // The supervisor's /proc, kept open for KsmWatcher when --memory-merge is on.
+
+  kj::Maybe<kj::AutoCloseFd> devTemplate;
+  // A detached, fully-populated copy of the sandbox's /dev, built by runWarm() so that
+  // setupFilesystem() can attach it with one move_mount() instead of building it per grain.
+  // Null if not prewarmed or the kernel lacks the new mount API.
+
+  uint64_t phaseStartNs = 0;
+  kj::Vector<kj::String> phaseTimes;
+  // Duration of each step of sandbox setup, logged once the log file is open.
+
   class SandstormApiImpl;
   class SupervisorImpl;
 
+  kj::MainFunc getGrainMain();
+  kj::MainFunc getWarmMain();
+
   void bind(kj::StringPtr src, kj::StringPtr dst, unsigned long flags = 0);
   kj::String realPath(kj::StringPtr path);
   void setupSupervisor();
@@ -113,7 +138,11 @@ private:
   void writeSetgroupsIfPresent(const char *contents);
   void writeUserNSMap(const char *type, kj::StringPtr contents);
   void unshareOuter();
-  void makeCharDeviceNode(const char *name, const char* realName, int major, int minor);
+  void makeCharDeviceNode(kj::StringPtr dir, const char *name, const char* realName,
+                          int major, int minor);
+  void mountDev(kj::StringPtr dir);
+  kj::Maybe<kj::AutoCloseFd> makeDevTemplate();
+  void endPhase(kj::StringPtr name);
   void setupFilesystem();
   void setupStdio();
   void setupSeccomp();
@@ -123,6 +152,7 @@ private:
   bool checkIfIpTablesLoaded();
   void maybeFinishMountingProc();
   void permanentlyDropSuperuser();
+  void maybeEnableMemoryMerge();
   void enterSandbox();
   [[noreturn]] void runChild(int apiFd, kj::AutoCloseFd startEventFd);
 
@@ -0,0 +1,63 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_TEST_UTIL_H_
+#define SANDSTORM_TEST_UTIL_H_
+// Fixtures shared by the `*-test.c++` files. Only tests should include this.
+
+#include "util.h"
+#include <kj/debug.h>
+#include <kj/io.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+namespace sandstorm {
+
+class TempDir {
+  // A directory that is created empty and deleted, with everything in it, when the object is
+  // destroyed.
+
+public:
+  explicit TempDir(kj::StringPtr parent = "/tmp")
+      : path(kj::str(parent, "/sandstorm-test.XXXXXX")) {
+    KJ_REQUIRE(mkdtemp(path.begin()) != nullptr, "mkdtemp", path);
+  }
+  ~TempDir() noexcept(false) {
+    recursivelyDelete(path);
+  }
+  KJ_DISALLOW_COPY(TempDir);
+
+  kj::String path;
+
+  kj::String operator/(kj::StringPtr name) const { return kj::str(path, '/', name); }
+  // Path of `name` within the directory.
+};
+
+inline void writeFile(kj::StringPtr path, kj::ArrayPtr<const kj::byte> content,
+                      mode_t mode = 0644) {
+  // Creates or replaces the file at `path`.
+  kj::FdOutputStream(raiiOpen(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode))
+      .write(content.begin(), content.size());
+}
+
+inline void writeFile(kj::StringPtr path, kj::StringPtr content, mode_t mode = 0644) {
+  writeFile(path, content.asBytes(), mode);
+}
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_TEST_UTIL_H_
@@ -228,6 +228,32 @@ KJ_TEST("SubprocessSet") {
   promiseCat.wait(io.waitScope);
 }
 
+KJ_TEST("SubprocessSet leaves other subprocesses alone") {
+  auto io = kj::setupAsyncIo();
+
+  SubprocessSet set(io.unixEventPort);
+
+  // While a slow child is waited for asynchronously, the event loop keeps running...
+  Subprocess slow({"sleep", "0.2"});
+  bool slowDone = false;
+  auto promise = set.waitForSuccess(slow).then([&]() { slowDone = true; });
+
+  Subprocess other({"true"});
+  io.provider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(io.waitScope);
+  KJ_EXPECT(!slowDone);
+
+  // ...and the SIGCHLD from a child outside the set doesn't cause the set to reap it.
+  other.waitForSuccess();
+
+  promise.wait(io.waitScope);
+  KJ_EXPECT(slowDone);
+
+  // A child that exited before being added to the set is still noticed.
+  Subprocess quick({"true"});
+  io.provider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(io.waitScope);
+  set.waitForSuccess(quick).wait(io.waitScope);
+}
+
 KJ_TEST("raiiOpenAtIfExistsContained") {
   {
     char tempdir[] = "/tmp/sandstorm-test.XXXXXX";
@@ -799,8 +799,19 @@ kj::Promise<int> SubprocessSet::waitForExit(Subprocess& subprocess) {
 }
 
 kj::Promise<int> SubprocessSet::waitForExitOrSignal(Subprocess& subprocess) {
+  // The child may have exited already, in which case its SIGCHLD may have been consumed by an
+  // earlier iteration of waitLoop().
+  pid_t pid = subprocess.getPid();
+  int status;
+  pid_t result;
+  KJ_SYSCALL(result = waitpid(pid, &status, WNOHANG), subprocess.name);
+  if (result != 0) {
+    subprocess.notifyExited(status);
+    return status;
+  }
+
   auto paf = kj::newPromiseAndFulfiller<int>();
-  waitMap->pids.insert(std::make_pair(subprocess.getPid(),
+  waitMap->pids.insert(std::make_pair(pid,
       WaitMap::ProcInfo { kj::mv(paf.fulfiller), &subprocess }));
   subprocess.subprocessSet = *this;
   return paf.promise.then([](int status) {
@@ -826,20 +837,19 @@ kj::Promise<int> SubprocessSet::waitForExitOrSignal(Subprocess&& subprocess) {
 
 kj::Promise<void> SubprocessSet::waitLoop() {
   return eventPort.onSignal(SIGCHLD).then([this](auto&&) {
-    while (!waitMap->pids.empty()) {
+    // We only reap our own children, by PID, so that other code in this process can still wait
+    // for its subprocesses synchronously. The set is normally small, so checking each member on
+    // every SIGCHLD is cheap.
+    for (auto iter = waitMap->pids.begin(); iter != waitMap->pids.end();) {
       int status;
       pid_t pid;
-      KJ_SYSCALL(pid = waitpid(-1, &status, WNOHANG));
-      if (pid == 0) break;
-
-      auto iter = waitMap->pids.find(pid);
-      if (iter == waitMap->pids.end()) {
-        KJ_LOG(ERROR, "waitpid() returned unexpected PID; is this process running subprocesses "
-                      "outside this set?", pid);
+      KJ_SYSCALL(pid = waitpid(iter->first, &status, WNOHANG));
+      if (pid == 0) {
+        ++iter;
       } else {
         iter->second.subprocess->notifyExited(status);
         iter->second.fulfiller->fulfill(kj::mv(status));
-        waitMap->pids.erase(iter);
+        iter = waitMap->pids.erase(iter);
       }
     }
     return waitLoop();
@@ -403,8 +403,9 @@ private:
 
 class SubprocessSet {
   // Represents a set of subprocesses and allows you to asynchronously wait for them to complete.
-  // In order to use SubprocessSet, it is necessary that *all* subprocesses of this process are
-  // managed through it, and wait() is always called immediately on creation of a new subprocess.
+  // Only subprocesses passed to one of the wait methods are reaped, so other subprocesses can
+  // still be waited for synchronously, as long as nothing else in the process calls
+  // waitpid(-1, ...) or ignores SIGCHLD.
   //
   // TODO(cleanup): This functionality should be merged into KJ's async I/O library.
 
@@ -0,0 +1,77 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "worker-pool.h"
+#include <kj/async-io.h>
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <unistd.h>
+
+namespace sandstorm {
+namespace {
+
+KJ_TEST("WorkerPool returns results and exceptions") {
+  auto io = kj::setupAsyncIo();
+  WorkerPool pool(2, 1);
+
+  KJ_EXPECT(pool.run([]() { return kj::str("hello"); }).wait(io.waitScope) == "hello");
+  pool.runHeavy([]() {}).wait(io.waitScope);
+  KJ_EXPECT_THROW_MESSAGE("oops", pool.run([]() -> int {
+    KJ_FAIL_ASSERT("oops");
+  }).wait(io.waitScope));
+}
+
+KJ_TEST("WorkerPool caps heavy jobs") {
+  auto io = kj::setupAsyncIo();
+  WorkerPool pool(3, 1);
+
+  struct Counts {
+    uint heavyRunning = 0;
+    uint maxHeavyRunning = 0;
+    uint heavyFinished = 0;
+    kj::Maybe<uint> heavyFinishedBeforeLight;
+  };
+  kj::MutexGuarded<Counts> counts;
+
+  auto heavy = [&]() {
+    {
+      auto lock = counts.lockExclusive();
+      lock->maxHeavyRunning = kj::max(lock->maxHeavyRunning, ++lock->heavyRunning);
+    }
+    usleep(50000);
+    auto lock = counts.lockExclusive();
+    --lock->heavyRunning;
+    ++lock->heavyFinished;
+  };
+
+  kj::Vector<kj::Promise<void>> promises;
+  promises.add(pool.runHeavy(heavy));
+  promises.add(pool.runHeavy(heavy));
+  promises.add(pool.runHeavy(heavy));
+  // Queued behind the heavy jobs, but doesn't wait for them all.
+  promises.add(pool.run([&]() {
+    auto lock = counts.lockExclusive();
+    lock->heavyFinishedBeforeLight = lock->heavyFinished;
+  }));
+  kj::joinPromises(promises.releaseAsArray()).wait(io.waitScope);
+
+  auto lock = counts.lockShared();
+  KJ_EXPECT(lock->maxHeavyRunning == 1);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(lock->heavyFinishedBeforeLight) < 3);
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -0,0 +1,74 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "worker-pool.h"
+#include <kj/debug.h>
+
+namespace sandstorm {
+
+WorkerPool::WorkerPool(uint threadCount, uint maxHeavy): maxHeavy(maxHeavy) {
+  KJ_REQUIRE(threadCount > 0 && maxHeavy > 0);
+
+  auto builder = kj::heapArrayBuilder<kj::Own<kj::Thread>>(threadCount);
+  for (uint i = 0; i < threadCount; i++) {
+    builder.add(kj::heap<kj::Thread>([this]() { workerLoop(); }));
+  }
+  threads = builder.finish();
+}
+
+WorkerPool::~WorkerPool() noexcept(false) {
+  state.lockExclusive()->shuttingDown = true;
+  // Destroying `threads` joins them.
+}
+
+void WorkerPool::add(kj::Function<void()> func, bool heavy) {
+  state.lockExclusive()->queue.push_back(Job { kj::mv(func), heavy });
+}
+
+kj::Maybe<size_t> WorkerPool::nextJob(const State& state) const {
+  for (size_t i = 0; i < state.queue.size(); i++) {
+    if (!state.queue[i].heavy || state.heavyRunning < maxHeavy) {
+      return i;
+    }
+  }
+  return nullptr;
+}
+
+void WorkerPool::workerLoop() {
+  for (;;) {
+    kj::Maybe<Job> job = state.when([this](const State& state) {
+      return state.shuttingDown || nextJob(state) != nullptr;
+    }, [this](State& state) -> kj::Maybe<Job> {
+      if (state.shuttingDown) return nullptr;
+
+      size_t i = KJ_ASSERT_NONNULL(nextJob(state));
+      Job job = kj::mv(state.queue[i]);
+      state.queue.erase(state.queue.begin() + i);
+      if (job.heavy) ++state.heavyRunning;
+      return kj::mv(job);
+    });
+
+    KJ_IF_MAYBE(j, job) {
+      // Exceptions were already caught, and passed on to the job's promise.
+      j->func();
+      if (j->heavy) --state.lockExclusive()->heavyRunning;
+    } else {
+      return;
+    }
+  }
+}
+
+}  // namespace sandstorm
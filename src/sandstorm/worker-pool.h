@@ -0,0 +1,118 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_WORKER_POOL_H_
+#define SANDSTORM_WORKER_POOL_H_
+
+#include <kj/async.h>
+#include <kj/function.h>
+#include <kj/mutex.h>
+#include <kj/thread.h>
+#include <deque>
+
+namespace sandstorm {
+
+class WorkerPool {
+  // A fixed set of threads for blocking work -- mostly filesystem work -- that would otherwise
+  // stall the event loop, and with it every other request.
+  //
+  // Jobs run in the order they were submitted, except that at most `maxHeavy` heavy jobs run at
+  // once, and others may overtake heavy jobs waiting for their turn. Heavy jobs are those that
+  // can take arbitrarily long, like deleting a whole grain; the cap keeps some threads free for
+  // quick jobs.
+
+public:
+  WorkerPool(uint threadCount, uint maxHeavy);
+  ~WorkerPool() noexcept(false);
+  // Waits for jobs already running to finish. Jobs still queued are dropped, and their promises
+  // rejected.
+
+  KJ_DISALLOW_COPY(WorkerPool);
+
+  template <typename Func>
+  auto run(Func&& func) -> kj::Promise<decltype(func())>;
+  template <typename Func>
+  auto runHeavy(Func&& func) -> kj::Promise<decltype(func())>;
+  // Calls `func` on a worker thread and returns its result, or its exception, on the calling
+  // thread's event loop.
+  //
+  // Cancelling the returned promise stops the job if it hasn't started yet, but doesn't interrupt
+  // it once it has. So `func` must own everything it uses, rather than referring to anything
+  // whose lifetime is tied to the promise.
+
+private:
+  struct Job {
+    kj::Function<void()> func;
+    bool heavy;
+  };
+
+  struct State {
+    std::deque<Job> queue;
+    uint heavyRunning = 0;
+    bool shuttingDown = false;
+  };
+
+  const uint maxHeavy;
+  kj::MutexGuarded<State> state;
+  kj::Array<kj::Own<kj::Thread>> threads;
+
+  template <typename Func>
+  auto submit(Func&& func, bool heavy) -> kj::Promise<decltype(func())>;
+  void add(kj::Function<void()> func, bool heavy);
+  void workerLoop();
+  kj::Maybe<size_t> nextJob(const State& state) const;
+
+  template <typename T, typename Func>
+  static void fulfill(const kj::CrossThreadPromiseFulfiller<T>& fulfiller, Func& func) {
+    fulfiller.fulfill(func());
+  }
+  template <typename Func>
+  static void fulfill(const kj::CrossThreadPromiseFulfiller<void>& fulfiller, Func& func) {
+    func();
+    fulfiller.fulfill();
+  }
+};
+
+// =======================================================================================
+// inline implementation details
+
+template <typename Func>
+auto WorkerPool::run(Func&& func) -> kj::Promise<decltype(func())> {
+  return submit(kj::fwd<Func>(func), false);
+}
+
+template <typename Func>
+auto WorkerPool::runHeavy(Func&& func) -> kj::Promise<decltype(func())> {
+  return submit(kj::fwd<Func>(func), true);
+}
+
+template <typename Func>
+auto WorkerPool::submit(Func&& func, bool heavy) -> kj::Promise<decltype(func())> {
+  auto paf = kj::newPromiseAndCrossThreadFulfiller<decltype(func())>();
+  add([func = kj::fwd<Func>(func), fulfiller = kj::mv(paf.fulfiller)]() mutable {
+    // Don't bother if the promise was cancelled while the job was queued.
+    if (!fulfiller->isWaiting()) return;
+
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() { fulfill(*fulfiller, func); })) {
+      fulfiller->reject(kj::mv(*exception));
+    }
+  }, heavy);
+  return kj::mv(paf.promise);
+}
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_WORKER_POOL_H_
@@ -0,0 +1,115 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "xz.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <lzma.h>
+#include <string.h>
+
+namespace sandstorm {
+namespace {
+
+kj::Array<kj::byte> compress(kj::ArrayPtr<const kj::byte> input) {
+  // Several small blocks, so that the decoder has something to do in parallel.
+  lzma_mt options;
+  memset(&options, 0, sizeof(options));
+  options.threads = 4;
+  options.block_size = 64u << 10;
+  options.preset = 1;
+  options.check = LZMA_CHECK_CRC64;
+
+  lzma_stream lzma = LZMA_STREAM_INIT;
+  KJ_ASSERT(lzma_stream_encoder_mt(&lzma, &options) == LZMA_OK);
+  KJ_DEFER(lzma_end(&lzma));
+
+  kj::Vector<kj::byte> output;
+  kj::byte buffer[4096];
+  lzma.next_in = input.begin();
+  lzma.avail_in = input.size();
+  for (;;) {
+    lzma.next_out = buffer;
+    lzma.avail_out = sizeof(buffer);
+    lzma_ret ret = lzma_code(&lzma, LZMA_FINISH);
+    output.addAll(buffer, buffer + sizeof(buffer) - lzma.avail_out);
+    if (ret == LZMA_STREAM_END) break;
+    KJ_ASSERT(ret == LZMA_OK);
+  }
+  return output.releaseAsArray();
+}
+
+kj::Array<kj::byte> makeInput() {
+  auto input = kj::heapArray<kj::byte>(1u << 20);
+  uint32_t state = 1;
+  for (auto& b: input) {
+    // Compressible, but not trivially.
+    state = state * 1103515245 + 12345;
+    b = 'a' + (state >> 16) % 8;
+  }
+  return input;
+}
+
+kj::Array<kj::byte> decompress(kj::ArrayPtr<const kj::byte> compressed, size_t chunkSize) {
+  XzInputStream in([&]() {
+    auto chunk = compressed.slice(0, kj::min(chunkSize, compressed.size()));
+    compressed = compressed.slice(chunk.size(), compressed.size());
+    return chunk;
+  });
+
+  kj::Vector<kj::byte> output;
+  kj::byte buffer[10000];
+  for (;;) {
+    size_t n = in.tryRead(buffer, 1, sizeof(buffer));
+    if (n == 0) break;
+    output.addAll(buffer, buffer + n);
+  }
+  return output.releaseAsArray();
+}
+
+KJ_TEST("XzInputStream decompresses multi-block streams") {
+  auto input = makeInput();
+  auto compressed = compress(input);
+
+  for (size_t chunkSize: { size_t(7), size_t(4096), compressed.size() }) {
+    auto output = decompress(compressed, chunkSize);
+    KJ_EXPECT(output.asPtr() == input.asPtr(), chunkSize);
+  }
+
+  // Concatenated streams decompress to the concatenation, as with `xz -dc`.
+  kj::Vector<kj::byte> twice;
+  twice.addAll(compressed);
+  twice.addAll(compressed);
+  KJ_EXPECT(decompress(twice.asPtr(), 4096).size() == input.size() * 2);
+}
+
+KJ_TEST("XzInputStream rejects bad input") {
+  auto input = makeInput();
+  auto compressed = compress(input);
+
+  KJ_EXPECT_THROW_MESSAGE("truncated",
+      decompress(compressed.slice(0, compressed.size() / 2), 4096));
+
+  auto corrupt = kj::heapArray(compressed.asPtr());
+  corrupt[corrupt.size() / 2] ^= 0x55;
+  KJ_EXPECT_THROW_MESSAGE("xz decompression failed", decompress(corrupt, 4096));
+
+  kj::byte garbage[] = "not xz at all";
+  KJ_EXPECT_THROW_MESSAGE("not in .xz format", decompress(garbage, 4096));
+}
+
+}  // namespace
+}  // namespace sandstorm
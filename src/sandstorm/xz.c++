@@ -0,0 +1,100 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "xz.h"
+#include <kj/debug.h>
+#include <lzma.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace sandstorm {
+
+struct XzInputStream::Stream {
+  lzma_stream lzma = LZMA_STREAM_INIT;
+
+  ~Stream() {
+    lzma_end(&lzma);
+  }
+};
+
+static kj::StringPtr describeLzmaError(lzma_ret ret) {
+  switch (ret) {
+    case LZMA_MEM_ERROR: return "out of memory";
+    case LZMA_MEMLIMIT_ERROR: return "memory limit reached";
+    case LZMA_FORMAT_ERROR: return "not in .xz format";
+    case LZMA_OPTIONS_ERROR: return "unsupported options";
+    case LZMA_DATA_ERROR: return "compressed data is corrupt";
+    case LZMA_BUF_ERROR: return "compressed data is truncated";
+    default: return "unexpected error";
+  }
+}
+
+XzInputStream::XzInputStream(kj::Function<kj::ArrayPtr<const kj::byte>()> nextChunk,
+                             uint threadCount)
+    : nextChunk(kj::mv(nextChunk)), stream(kj::heap<Stream>()) {
+#if LZMA_VERSION >= 50040002  // 5.4.0, the first release with the multithreaded decoder
+  lzma_mt options;
+  memset(&options, 0, sizeof(options));
+  // Like `xz -dc`, accept several streams one after another.
+  options.flags = LZMA_CONCATENATED;
+  options.threads = kj::max(threadCount, 1u);
+
+  // As xz does: use threads only while that takes less than a quarter of RAM, beyond which
+  // decoding continues on one thread rather than failing.
+  uint64_t physmem = lzma_physmem();
+  options.memlimit_threading = physmem == 0 ? uint64_t(1) << 30 : physmem / 4;
+  options.memlimit_stop = UINT64_MAX;
+
+  lzma_ret ret = lzma_stream_decoder_mt(&stream->lzma, &options);
+#else
+  // Older liblzma can only decode on the calling thread.
+  (void)threadCount;
+  lzma_ret ret = lzma_stream_decoder(&stream->lzma, UINT64_MAX, LZMA_CONCATENATED);
+#endif
+  KJ_ASSERT(ret == LZMA_OK, "couldn't start xz decoder", describeLzmaError(ret));
+}
+
+XzInputStream::~XzInputStream() noexcept(false) {}
+
+size_t XzInputStream::tryRead(void* buffer, size_t minBytes, size_t maxBytes) {
+  auto& lzma = stream->lzma;
+  lzma.next_out = reinterpret_cast<uint8_t*>(buffer);
+  lzma.avail_out = maxBytes;
+
+  while (!outputDone && maxBytes - lzma.avail_out < minBytes) {
+    if (lzma.avail_in == 0 && !inputDone) {
+      auto chunk = nextChunk();
+      inputDone = chunk.size() == 0;
+      lzma.next_in = chunk.begin();
+      lzma.avail_in = chunk.size();
+    }
+
+    lzma_ret ret = lzma_code(&lzma, inputDone ? LZMA_FINISH : LZMA_RUN);
+    if (ret == LZMA_STREAM_END) {
+      outputDone = true;
+    } else if (ret != LZMA_OK) {
+      KJ_FAIL_REQUIRE("xz decompression failed", describeLzmaError(ret));
+    }
+  }
+
+  return maxBytes - lzma.avail_out;
+}
+
+uint XzInputStream::defaultThreadCount() {
+  return kj::max(lzma_cputhreads(), 1u);
+}
+
+}  // namespace sandstorm
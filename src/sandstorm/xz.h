@@ -0,0 +1,59 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_XZ_H_
+#define SANDSTORM_XZ_H_
+
+#include <kj/io.h>
+#include <kj/function.h>
+
+namespace sandstorm {
+
+class XzInputStream final: public kj::InputStream {
+  // Decompresses .xz data in-process with liblzma, as `xz -dc` would.
+  //
+  // With liblzma 5.4 or later, uses the multithreaded decoder, which decodes the blocks of a
+  // multi-block stream (as `xz --threads=0` writes for large inputs) in parallel. Single-block
+  // streams, and all streams with older liblzma, are decoded on the calling thread.
+  //
+  // Compressed input is pulled from `nextChunk`, which returns the next piece of input, or an
+  // empty array at the end. Each piece need only remain valid until the next call, so a caller
+  // can hand over its own buffers without copying them.
+
+public:
+  explicit XzInputStream(kj::Function<kj::ArrayPtr<const kj::byte>()> nextChunk,
+                         uint threadCount = defaultThreadCount());
+  ~XzInputStream() noexcept(false);
+  KJ_DISALLOW_COPY(XzInputStream);
+
+  size_t tryRead(void* buffer, size_t minBytes, size_t maxBytes) override;
+  // Throws if the input is corrupt or truncated. Trailing garbage is an error too.
+
+  static uint defaultThreadCount();
+  // One per CPU.
+
+private:
+  struct Stream;
+
+  kj::Function<kj::ArrayPtr<const kj::byte>()> nextChunk;
+  kj::Own<Stream> stream;
+  bool inputDone = false;
+  bool outputDone = false;
+};
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_XZ_H_
@@ -0,0 +1,163 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "zip.h"
+#include "test-util.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+namespace sandstorm {
+namespace {
+
+kj::Array<kj::byte> makeContent(size_t size, bool compressible) {
+  auto result = kj::heapArray<kj::byte>(size);
+  uint32_t state = 12345;
+  for (auto& b: result) {
+    state = state * 1103515245 + 12345;
+    b = compressible ? "abcdefgh\n"[(state >> 16) % 9] : state >> 16;
+  }
+  return result;
+}
+
+void addTree(ZipWriter& zip, kj::StringPtr root, kj::StringPtr name) {
+  // Like BackupMain::addToZip(), but relative to `root`.
+  auto path = kj::str(root, '/', name);
+  struct stat stats;
+  KJ_SYSCALL(lstat(path.cStr(), &stats));
+  if (S_ISREG(stats.st_mode)) {
+    zip.addFile(name, raiiOpen(path, O_RDONLY | O_CLOEXEC), stats);
+  } else if (S_ISLNK(stats.st_mode)) {
+    char target[256];
+    ssize_t n;
+    KJ_SYSCALL(n = readlink(path.cStr(), target, sizeof(target)));
+    zip.addSymlink(name, kj::heapString(target, n), stats);
+  } else if (S_ISDIR(stats.st_mode)) {
+    auto children = listDirectory(path);
+    if (children.size() == 0) {
+      zip.addDirectory(name, stats);
+    }
+    for (auto& child: children) {
+      addTree(zip, root, kj::str(name, '/', child));
+    }
+  }
+}
+
+KJ_TEST("ZipWriter and ZipReader round trip") {
+  TempDir src, dst;
+
+  // Several chunks, so that threads compress parts of the same file.
+  auto big = makeContent(ZipWriter::CHUNK_SIZE * 5 + 123, true);
+  auto random = makeContent(ZipWriter::CHUNK_SIZE + 7, false);
+
+  KJ_SYSCALL(mkdir((src / "data").cStr(), 0755));
+  KJ_SYSCALL(mkdir((src / "data/sub").cStr(), 0755));
+  KJ_SYSCALL(mkdir((src / "data/empty").cStr(), 0700));
+  writeFile(src / "data/small.txt", kj::StringPtr("hello\n").asBytes());
+  writeFile(src / "data/big.txt", big);
+  writeFile(src / "data/photo.jpg", random);
+  writeFile(src / "data/sub/empty", "");
+  writeFile(src / "data/sub/run.sh", kj::StringPtr("#!/bin/sh\n").asBytes(), 0755);
+  KJ_SYSCALL(symlink("small.txt", (src / "data/link").cStr()));
+  writeFile(src / "metadata", kj::StringPtr("meta").asBytes());
+  writeFile(src / "other", kj::StringPtr("not restored").asBytes());
+
+  struct timespec times[2] = { { 0, UTIME_OMIT }, { 1234567890, 0 } };
+  KJ_SYSCALL(utimensat(AT_FDCWD, (src / "data/small.txt").cStr(), times, 0));
+
+  auto zipPath = dst / "backup.zip";
+  {
+    auto out = raiiOpen(zipPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC);
+    ZipWriter zip(out, 3);
+    for (auto& name: { "data", "metadata", "other" }) {
+      addTree(zip, src.path, name);
+    }
+    zip.finish();
+  }
+
+  // Info-ZIP should agree that the archive is valid, if it's installed.
+  if (access("/usr/bin/unzip", X_OK) == 0) {
+    Subprocess({"unzip", "-tqq", zipPath}).waitForSuccess();
+  }
+
+  auto out = dst / "out";
+  KJ_SYSCALL(mkdir(out.cStr(), 0755));
+  {
+    auto file = raiiOpen(zipPath, O_RDONLY | O_CLOEXEC);
+    auto dir = raiiOpen(out, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    ZipReader(file).extract(dir, [](kj::StringPtr name) {
+      return name == "metadata" || name == "data" || name.startsWith("data/");
+    });
+  }
+
+  KJ_EXPECT(readAll(kj::str(out, "/data/small.txt")) == "hello\n");
+  auto readBytes = [&](kj::StringPtr name) {
+    return readAllBytes(raiiOpen(kj::str(out, '/', name), O_RDONLY | O_CLOEXEC));
+  };
+  KJ_EXPECT(readBytes("data/big.txt").asPtr() == big.asPtr());
+  KJ_EXPECT(readBytes("data/photo.jpg").asPtr() == random.asPtr());
+  KJ_EXPECT(readAll(kj::str(out, "/data/sub/empty")) == "");
+  KJ_EXPECT(readAll(kj::str(out, "/metadata")) == "meta");
+  KJ_EXPECT(access(kj::str(out, "/other").cStr(), F_OK) < 0);
+
+  struct stat stats;
+  KJ_SYSCALL(lstat(kj::str(out, "/data/link").cStr(), &stats));
+  KJ_EXPECT(S_ISLNK(stats.st_mode));
+  KJ_SYSCALL(stat(kj::str(out, "/data/link").cStr(), &stats));
+  KJ_EXPECT(stats.st_size == 6);
+
+  KJ_SYSCALL(stat(kj::str(out, "/data/sub/run.sh").cStr(), &stats));
+  KJ_EXPECT((stats.st_mode & 0111) != 0);
+  KJ_SYSCALL(stat(kj::str(out, "/data/small.txt").cStr(), &stats));
+  KJ_EXPECT(stats.st_mtime == 1234567890);
+  KJ_SYSCALL(stat(kj::str(out, "/data/empty").cStr(), &stats));
+  KJ_EXPECT(S_ISDIR(stats.st_mode));
+}
+
+KJ_TEST("ZipReader refuses to write outside the target directory") {
+  TempDir src, dst;
+  writeFile(src / "file", kj::StringPtr("evil").asBytes());
+  struct stat stats;
+  KJ_SYSCALL(stat((src / "file").cStr(), &stats));
+  auto linkStats = stats;
+  linkStats.st_mode = S_IFLNK | 0777;
+
+  auto zipPath = src / "evil.zip";
+  {
+    auto out = raiiOpen(zipPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC);
+    ZipWriter zip(out, 0);
+    zip.addFile("../escaped", raiiOpen(src / "file", O_RDONLY), stats);
+    zip.addFile("/absolute", raiiOpen(src / "file", O_RDONLY), stats);
+    zip.addSymlink("link", src.path, linkStats);
+    zip.addFile("link/through-link", raiiOpen(src / "file", O_RDONLY), stats);
+    zip.finish();
+  }
+
+  auto out = dst / "out";
+  KJ_SYSCALL(mkdir(out.cStr(), 0755));
+  auto file = raiiOpen(zipPath, O_RDONLY | O_CLOEXEC);
+  auto dir = raiiOpen(out, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  KJ_EXPECT_THROW(FAILED, ZipReader(file).extract(dir, [](kj::StringPtr) { return true; }));
+
+  KJ_EXPECT(access((dst / "escaped").cStr(), F_OK) < 0);
+  KJ_EXPECT(access((src / "through-link").cStr(), F_OK) < 0);
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -0,0 +1,949 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "zip.h"
+#include "util.h"
+#include <kj/debug.h>
+#include <zlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+namespace sandstorm {
+
+namespace {
+
+// Record signatures and field values, from PKWARE's APPNOTE.TXT.
+constexpr uint32_t LOCAL_HEADER_SIG = 0x04034b50;
+constexpr uint32_t DESCRIPTOR_SIG = 0x08074b50;
+constexpr uint32_t CENTRAL_HEADER_SIG = 0x02014b50;
+constexpr uint32_t END_SIG = 0x06054b50;
+constexpr uint32_t ZIP64_END_SIG = 0x06064b50;
+constexpr uint32_t ZIP64_LOCATOR_SIG = 0x07064b50;
+
+constexpr uint16_t METHOD_STORE = 0;
+constexpr uint16_t METHOD_DEFLATE = 8;
+constexpr uint16_t FLAG_ENCRYPTED = 1 << 0;
+constexpr uint16_t FLAG_DESCRIPTOR = 1 << 3;
+
+constexpr uint16_t EXTRA_ZIP64 = 0x0001;
+constexpr uint16_t EXTRA_TIMESTAMP = 0x5455;  // "UT"
+
+constexpr uint16_t VERSION_DEFAULT = 20;
+constexpr uint16_t VERSION_ZIP64 = 45;
+constexpr uint16_t HOST_UNIX = 3;
+constexpr uint16_t MADE_BY = HOST_UNIX << 8 | 63;
+
+constexpr uint16_t MAX16 = 0xffff;
+constexpr uint32_t MAX32 = 0xffffffff;
+
+constexpr uint64_t ZIP64_LOCAL_THRESHOLD = 0xf0000000;
+// Files at least this big get Zip64 local headers and data descriptors, since their compressed
+// size might not fit in 32 bits. (Deflate expands incompressible data slightly.)
+
+constexpr size_t WINDOW_SIZE = 32768;
+constexpr size_t IO_BUFFER_SIZE = 65536;
+
+class ByteWriter {
+  // Little-endian serialization of zip records.
+
+public:
+  void u8(uint8_t v) { bytes.add(v); }
+  void u16(uint16_t v) { u8(v); u8(v >> 8); }
+  void u32(uint32_t v) { u16(v); u16(v >> 16); }
+  void u64(uint64_t v) { u32(v); u32(v >> 32); }
+  void add(kj::ArrayPtr<const kj::byte> data) { bytes.addAll(data); }
+
+  size_t size() { return bytes.size(); }
+  kj::ArrayPtr<const kj::byte> get() { return bytes; }
+
+private:
+  kj::Vector<kj::byte> bytes;
+};
+
+uint16_t get16(const kj::byte* p) { return p[0] | p[1] << 8; }
+uint32_t get32(const kj::byte* p) { return get16(p) | uint32_t(get16(p + 2)) << 16; }
+uint64_t get64(const kj::byte* p) { return get32(p) | uint64_t(get32(p + 4)) << 32; }
+
+void toDosTime(time_t t, uint16_t& date, uint16_t& time) {
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  int year = kj::min(kj::max(tm.tm_year - 80, 0), 127);
+  if (tm.tm_year < 80) {
+    // DOS time starts in 1980.
+    date = 1 << 5 | 1;
+    time = 0;
+  } else {
+    date = year << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday;
+    time = tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2;
+  }
+}
+
+time_t fromDosTime(uint16_t date, uint16_t time) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_year = (date >> 9) + 80;
+  tm.tm_mon = ((date >> 5) & 15) - 1;
+  tm.tm_mday = date & 31;
+  tm.tm_hour = time >> 11;
+  tm.tm_min = (time >> 5) & 63;
+  tm.tm_sec = (time & 31) * 2;
+  return timegm(&tm);
+}
+
+bool isCompressedFormat(kj::StringPtr name) {
+  // Deflating these again takes time and saves nothing.
+  static const kj::StringPtr EXTENSIONS[] = {
+    "7z", "avi", "br", "bz2", "docx", "flac", "gif", "gz", "heic", "jar", "jpeg", "jpg", "lz4",
+    "m4a", "m4v", "mkv", "mov", "mp3", "mp4", "odp", "ods", "odt", "ogg", "opus", "png", "pptx",
+    "spk", "tgz", "webm", "webp", "xlsx", "xz", "zip", "zst",
+  };
+
+  KJ_IF_MAYBE(dot, name.findLast('.')) {
+    auto extension = name.slice(*dot + 1);
+    if (extension.size() > 4) return false;
+    char lower[5];
+    for (size_t i = 0; i < extension.size(); i++) {
+      char c = extension[i];
+      lower[i] = 'A' <= c && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+    lower[extension.size()] = '\0';
+    for (auto& e: EXTENSIONS) {
+      if (e == kj::StringPtr(lower)) return true;
+    }
+  }
+  return false;
+}
+
+void preadAll(int fd, kj::ArrayPtr<kj::byte> buffer, uint64_t offset) {
+  while (buffer.size() > 0) {
+    ssize_t n;
+    KJ_SYSCALL(n = pread(fd, buffer.begin(), buffer.size(), offset));
+    KJ_REQUIRE(n > 0, "zip file is truncated");
+    buffer = buffer.slice(n, buffer.size());
+    offset += n;
+  }
+}
+
+class SequentialReader {
+  // Reads a file front to back, possibly skipping ahead, but never going back.
+
+public:
+  explicit SequentialReader(int fd): fd(fd), buffer(kj::heapArray<kj::byte>(IO_BUFFER_SIZE)) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  void seek(uint64_t target) {
+    KJ_REQUIRE(target >= position, "zip entries overlap");
+    uint64_t skip = target - position;
+    if (skip <= available.size()) {
+      available = available.slice(skip, available.size());
+    } else {
+      available = nullptr;
+    }
+    position = target;
+  }
+
+  kj::ArrayPtr<const kj::byte> read(size_t maxBytes) {
+    // Returns at least one and at most `maxBytes` bytes. The result is valid until the next call.
+    if (available.size() == 0) {
+      ssize_t n;
+      KJ_SYSCALL(n = pread(fd, buffer.begin(), buffer.size(), position));
+      KJ_REQUIRE(n > 0, "zip file is truncated");
+      available = buffer.slice(0, n);
+    }
+    auto result = available.slice(0, kj::min(maxBytes, available.size()));
+    available = available.slice(result.size(), available.size());
+    position += result.size();
+    return result;
+  }
+
+  void readExactly(kj::byte* dst, size_t size) {
+    while (size > 0) {
+      auto chunk = read(size);
+      memcpy(dst, chunk.begin(), chunk.size());
+      dst += chunk.size();
+      size -= chunk.size();
+    }
+  }
+
+  uint64_t getPosition() { return position; }
+
+private:
+  int fd;
+  kj::Array<kj::byte> buffer;
+  kj::ArrayPtr<kj::byte> available;
+  uint64_t position = 0;
+};
+
+}  // namespace
+
+// =======================================================================================
+// ZipWriter
+
+struct ZipWriter::Entry {
+  kj::String name;  // with a trailing slash for directories
+  mode_t mode;
+  time_t mtime;
+  uint16_t method = METHOD_STORE;
+  uint16_t flags = 0;
+  bool zip64Local = false;
+
+  uint32_t crc = 0;
+  uint64_t compressedSize = 0;
+  uint64_t size = 0;
+  uint64_t localOffset = 0;
+};
+
+struct ZipWriter::Job {
+  // One chunk of a file, to be processed on a worker thread.
+
+  kj::Array<kj::byte> input;
+  kj::Array<kj::byte> dictionary;  // the 32k of input preceding this chunk, if any
+  bool compress;
+  bool last;  // last chunk of the file, so finish the deflate stream
+  int level;
+
+  kj::Array<kj::byte> output;
+  size_t inputSize = 0;
+  size_t outputSize = 0;
+  uint32_t crc = 0;
+  kj::Maybe<kj::Exception> error;
+
+  bool done = false;
+  // Protected by the queue's mutex.
+
+  void run() {
+    inputSize = input.size();
+    crc = crc32(0, input.begin(), input.size());
+
+    if (!compress) {
+      output = kj::mv(input);
+      outputSize = inputSize;
+      return;
+    }
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    KJ_ASSERT(deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+    KJ_DEFER(deflateEnd(&z));
+    if (dictionary.size() > 0) {
+      KJ_ASSERT(deflateSetDictionary(&z, dictionary.begin(), dictionary.size()) == Z_OK);
+    }
+
+    // A sync flush rather than finishing the stream leaves the output byte-aligned and without
+    // an end marker, so the chunks can simply be concatenated.
+    int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+    output = kj::heapArray<kj::byte>(deflateBound(&z, input.size()) + 16);
+    z.next_in = input.begin();
+    z.avail_in = input.size();
+    for (;;) {
+      z.next_out = output.begin() + outputSize;
+      z.avail_out = output.size() - outputSize;
+      int result = ::deflate(&z, flush);
+      KJ_ASSERT(result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR, result);
+      outputSize = output.size() - z.avail_out;
+      if (last ? result == Z_STREAM_END : z.avail_out > 0) break;
+
+      auto bigger = kj::heapArray<kj::byte>(output.size() * 2);
+      memcpy(bigger.begin(), output.begin(), outputSize);
+      output = kj::mv(bigger);
+    }
+
+    input = nullptr;
+    dictionary = nullptr;
+  }
+};
+
+struct ZipWriter::Item {
+  enum Kind { HEADER, DATA, LITERAL, DESCRIPTOR };
+
+  Kind kind;
+  Entry& entry;
+  kj::Own<Job> job;             // DATA
+  kj::Array<kj::byte> literal;  // LITERAL
+
+  Item(Kind kind, Entry& entry): kind(kind), entry(entry) {}
+};
+
+struct ZipWriter::Queue {
+  std::deque<Job*> pending;
+  bool shuttingDown = false;
+};
+
+ZipWriter::ZipWriter(int fd, uint threadCount, int compressionLevel)
+    : rawOutput(fd), output(rawOutput), compressionLevel(compressionLevel),
+      maxInFlight(kj::max(threadCount, 1u) * 4),
+      queue(kj::heap<kj::MutexGuarded<Queue>>()) {
+  for (uint i = 0; i < threadCount; i++) {
+    threads.add(kj::heap<kj::Thread>([this]() { runWorker(); }));
+  }
+}
+
+ZipWriter::~ZipWriter() noexcept(false) {
+  queue->lockExclusive()->shuttingDown = true;
+  threads.clear();
+}
+
+uint ZipWriter::defaultThreadCount() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return kj::min(kj::max(n, 1L), 8L);
+}
+
+void ZipWriter::runWorker() {
+  for (;;) {
+    Job* job = queue->when([](const Queue& q) { return q.shuttingDown || !q.pending.empty(); },
+                           [](Queue& q) -> Job* {
+      if (q.shuttingDown) return nullptr;
+      auto result = q.pending.front();
+      q.pending.pop_front();
+      return result;
+    });
+    if (job == nullptr) return;
+
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() { job->run(); })) {
+      job->error = kj::mv(*exception);
+    }
+    {
+      auto lock = queue->lockExclusive();
+      job->done = true;
+    }
+  }
+}
+
+ZipWriter::Entry& ZipWriter::addEntry(kj::StringPtr name, const struct stat& stats) {
+  auto entry = kj::heap<Entry>();
+  entry->name = S_ISDIR(stats.st_mode) ? kj::str(name, '/') : kj::heapString(name);
+  entry->mode = stats.st_mode;
+  entry->mtime = stats.st_mtime;
+  KJ_REQUIRE(entry->name.size() <= MAX16, "file name too long for zip", name);
+
+  auto& result = *entry;
+  entries.add(kj::mv(entry));
+  return result;
+}
+
+void ZipWriter::addFile(kj::StringPtr name, int fd, const struct stat& stats) {
+  kj::FdInputStream input(fd);
+  addFile(name, input, stats);
+}
+
+void ZipWriter::addFile(kj::StringPtr name, kj::InputStream& input, const struct stat& stats) {
+  auto& entry = addEntry(name, stats);
+  entry.method = isCompressedFormat(name) ? METHOD_STORE : METHOD_DEFLATE;
+  entry.flags = FLAG_DESCRIPTOR;
+  entry.zip64Local = uint64_t(stats.st_size) >= ZIP64_LOCAL_THRESHOLD;
+  items.push_back(kj::heap<Item>(Item::HEADER, entry));
+
+  auto readChunk = [&]() {
+    auto buffer = kj::heapArray<kj::byte>(CHUNK_SIZE);
+    size_t n = input.tryRead(buffer.begin(), buffer.size(), buffer.size());
+    return n == buffer.size() ? kj::mv(buffer) : kj::heapArray<kj::byte>(buffer.slice(0, n));
+  };
+
+  // We read one chunk ahead so that we know which chunk is the last.
+  bool compress = entry.method == METHOD_DEFLATE;
+  auto chunk = readChunk();
+  kj::Array<kj::byte> dictionary;
+  for (;;) {
+    auto next = chunk.size() < CHUNK_SIZE ? kj::Array<kj::byte>() : readChunk();
+
+    auto job = kj::heap<Job>();
+    job->compress = compress;
+    job->last = next.size() == 0;
+    job->level = compressionLevel;
+    job->dictionary = kj::mv(dictionary);
+    if (compress && !job->last) {
+      dictionary = kj::heapArray<kj::byte>(chunk.slice(chunk.size() - WINDOW_SIZE, chunk.size()));
+    }
+    job->input = kj::mv(chunk);
+
+    bool last = job->last;
+    submit(kj::mv(job), entry);
+    if (last) break;
+    chunk = kj::mv(next);
+  }
+
+  items.push_back(kj::heap<Item>(Item::DESCRIPTOR, entry));
+}
+
+void ZipWriter::addSymlink(kj::StringPtr name, kj::StringPtr target, const struct stat& stats) {
+  auto& entry = addEntry(name, stats);
+  entry.crc = crc32(0, target.asBytes().begin(), target.size());
+  entry.size = entry.compressedSize = target.size();
+  items.push_back(kj::heap<Item>(Item::HEADER, entry));
+
+  auto item = kj::heap<Item>(Item::LITERAL, entry);
+  item->literal = kj::heapArray(target.asBytes());
+  items.push_back(kj::mv(item));
+}
+
+void ZipWriter::addDirectory(kj::StringPtr name, const struct stat& stats) {
+  auto& entry = addEntry(name, stats);
+  items.push_back(kj::heap<Item>(Item::HEADER, entry));
+}
+
+void ZipWriter::submit(kj::Own<Job> job, Entry& entry) {
+  while (inFlight >= maxInFlight) {
+    writeOne();
+  }
+
+  auto& ref = *job;
+  auto item = kj::heap<Item>(Item::DATA, entry);
+  item->job = kj::mv(job);
+  items.push_back(kj::mv(item));
+  ++inFlight;
+
+  if (threads.empty()) {
+    ref.run();
+    ref.done = true;
+  } else {
+    queue->lockExclusive()->pending.push_back(&ref);
+  }
+}
+
+void ZipWriter::writeOne() {
+  auto item = kj::mv(items.front());
+  items.pop_front();
+  auto& entry = item->entry;
+
+  switch (item->kind) {
+    case Item::HEADER:
+      writeLocalHeader(entry);
+      break;
+
+    case Item::DATA: {
+      auto& job = *item->job;
+      queue->when([&job](const Queue&) { return job.done; }, [](Queue&) {});
+      --inFlight;
+      KJ_IF_MAYBE(exception, job.error) {
+        kj::throwFatalException(kj::mv(*exception));
+      }
+      entry.crc = crc32_combine(entry.crc, job.crc, job.inputSize);
+      entry.size += job.inputSize;
+      entry.compressedSize += job.outputSize;
+      write(job.output.slice(0, job.outputSize));
+      break;
+    }
+
+    case Item::LITERAL:
+      write(item->literal);
+      break;
+
+    case Item::DESCRIPTOR:
+      writeDescriptor(entry);
+      break;
+  }
+}
+
+void ZipWriter::write(kj::ArrayPtr<const kj::byte> data) {
+  output.write(data.begin(), data.size());
+  offset += data.size();
+}
+
+void ZipWriter::writeLocalHeader(Entry& entry) {
+  entry.localOffset = offset;
+  bool descriptor = entry.flags & FLAG_DESCRIPTOR;
+  uint16_t date, time;
+  toDosTime(entry.mtime, date, time);
+
+  ByteWriter w;
+  w.u32(LOCAL_HEADER_SIG);
+  w.u16(entry.zip64Local ? VERSION_ZIP64 : VERSION_DEFAULT);
+  w.u16(entry.flags);
+  w.u16(entry.method);
+  w.u16(time);
+  w.u16(date);
+  w.u32(descriptor ? 0 : entry.crc);
+  if (entry.zip64Local) {
+    w.u32(MAX32);
+    w.u32(MAX32);
+  } else {
+    w.u32(descriptor ? 0 : entry.compressedSize);
+    w.u32(descriptor ? 0 : entry.size);
+  }
+  w.u16(entry.name.size());
+  w.u16((entry.zip64Local ? 20 : 0) + 9);
+  w.add(entry.name.asBytes());
+  if (entry.zip64Local) {
+    w.u16(EXTRA_ZIP64);
+    w.u16(16);
+    w.u64(descriptor ? 0 : entry.size);
+    w.u64(descriptor ? 0 : entry.compressedSize);
+  }
+  w.u16(EXTRA_TIMESTAMP);
+  w.u16(5);
+  w.u8(1);  // mtime present
+  w.u32(entry.mtime);
+  write(w.get());
+}
+
+void ZipWriter::writeDescriptor(Entry& entry) {
+  ByteWriter w;
+  w.u32(DESCRIPTOR_SIG);
+  w.u32(entry.crc);
+  if (entry.zip64Local) {
+    w.u64(entry.compressedSize);
+    w.u64(entry.size);
+  } else {
+    KJ_REQUIRE(entry.compressedSize < MAX32 && entry.size < MAX32,
+               "file grew past 4GB while being added to zip", entry.name);
+    w.u32(entry.compressedSize);
+    w.u32(entry.size);
+  }
+  write(w.get());
+}
+
+void ZipWriter::writeCentralDirectory() {
+  uint64_t start = offset;
+
+  for (auto& entry: entries) {
+    bool bigSize = entry->size >= MAX32;
+    bool bigCompressed = entry->compressedSize >= MAX32;
+    bool bigOffset = entry->localOffset >= MAX32;
+    bool zip64 = bigSize || bigCompressed || bigOffset;
+
+    ByteWriter extra;
+    if (zip64) {
+      extra.u16(EXTRA_ZIP64);
+      extra.u16(8 * (bigSize + bigCompressed + bigOffset));
+      if (bigSize) extra.u64(entry->size);
+      if (bigCompressed) extra.u64(entry->compressedSize);
+      if (bigOffset) extra.u64(entry->localOffset);
+    }
+    extra.u16(EXTRA_TIMESTAMP);
+    extra.u16(5);
+    extra.u8(1);
+    extra.u32(entry->mtime);
+
+    uint16_t date, time;
+    toDosTime(entry->mtime, date, time);
+
+    ByteWriter w;
+    w.u32(CENTRAL_HEADER_SIG);
+    w.u16(MADE_BY);
+    w.u16(zip64 || entry->zip64Local ? VERSION_ZIP64 : VERSION_DEFAULT);
+    w.u16(entry->flags);
+    w.u16(entry->method);
+    w.u16(time);
+    w.u16(date);
+    w.u32(entry->crc);
+    w.u32(bigCompressed ? MAX32 : entry->compressedSize);
+    w.u32(bigSize ? MAX32 : entry->size);
+    w.u16(entry->name.size());
+    w.u16(extra.size());
+    w.u16(0);  // comment length
+    w.u16(0);  // disk number
+    w.u16(0);  // internal attributes
+    w.u32(uint32_t(entry->mode) << 16 | (S_ISDIR(entry->mode) ? 0x10 : 0));  // 0x10 = MS-DOS dir
+    w.u32(bigOffset ? MAX32 : entry->localOffset);
+    w.add(entry->name.asBytes());
+    w.add(extra.get());
+    write(w.get());
+  }
+
+  uint64_t size = offset - start;
+  uint64_t count = entries.size();
+
+  ByteWriter w;
+  if (count >= MAX16 || size >= MAX32 || start >= MAX32) {
+    uint64_t zip64End = offset;
+    w.u32(ZIP64_END_SIG);
+    w.u64(44);  // size of the rest of this record
+    w.u16(MADE_BY);
+    w.u16(VERSION_ZIP64);
+    w.u32(0);  // disk number
+    w.u32(0);  // disk with central directory
+    w.u64(count);
+    w.u64(count);
+    w.u64(size);
+    w.u64(start);
+
+    w.u32(ZIP64_LOCATOR_SIG);
+    w.u32(0);  // disk with zip64 end record
+    w.u64(zip64End);
+    w.u32(1);  // total disks
+  }
+
+  w.u32(END_SIG);
+  w.u16(0);
+  w.u16(0);
+  w.u16(kj::min(count, uint64_t(MAX16)));
+  w.u16(kj::min(count, uint64_t(MAX16)));
+  w.u32(kj::min(size, uint64_t(MAX32)));
+  w.u32(kj::min(start, uint64_t(MAX32)));
+  w.u16(0);  // comment length
+  write(w.get());
+}
+
+void ZipWriter::finish() {
+  while (!items.empty()) {
+    writeOne();
+  }
+  writeCentralDirectory();
+  output.flush();
+}
+
+// =======================================================================================
+// ZipReader
+
+struct ZipReader::Entry {
+  kj::String name;  // without a trailing slash
+  mode_t mode;      // including the file type
+  time_t mtime;
+  uint16_t flags;
+  uint16_t method;
+  uint32_t crc;
+  uint64_t compressedSize;
+  uint64_t size;
+  uint64_t localOffset;
+};
+
+ZipReader::ZipReader(int fd): fd(fd) {
+  readCentralDirectory();
+}
+
+ZipReader::~ZipReader() noexcept(false) {}
+
+void ZipReader::readCentralDirectory() {
+  struct stat stats;
+  KJ_SYSCALL(fstat(fd, &stats));
+  uint64_t fileSize = stats.st_size;
+
+  // The end record is at least 22 bytes, followed by a comment of up to 64k.
+  auto tail = kj::heapArray<kj::byte>(kj::min(fileSize, uint64_t(22 + MAX16)));
+  uint64_t tailStart = fileSize - tail.size();
+  preadAll(fd, tail, tailStart);
+
+  kj::Maybe<size_t> endPos;
+  for (size_t i = tail.size() >= 22 ? tail.size() - 22 + 1 : 0; i-- > 0;) {
+    if (get32(tail.begin() + i) == END_SIG) {
+      endPos = i;
+      break;
+    }
+  }
+  const kj::byte* end = tail.begin() + KJ_REQUIRE_NONNULL(endPos, "not a zip file");
+  uint64_t endOffset = tailStart + (end - tail.begin());
+
+  uint64_t count = get16(end + 10);
+  uint64_t cdSize = get32(end + 12);
+  uint64_t cdOffset = get32(end + 16);
+
+  if ((count == MAX16 || cdSize == MAX32 || cdOffset == MAX32) && endOffset >= 20) {
+    kj::byte locator[20];
+    preadAll(fd, kj::arrayPtr(locator, sizeof(locator)), endOffset - 20);
+    if (get32(locator) == ZIP64_LOCATOR_SIG) {
+      kj::byte record[56];
+      preadAll(fd, kj::arrayPtr(record, sizeof(record)), get64(locator + 8));
+      KJ_REQUIRE(get32(record) == ZIP64_END_SIG, "corrupt zip: bad Zip64 end record");
+      count = get64(record + 32);
+      cdSize = get64(record + 40);
+      cdOffset = get64(record + 48);
+    }
+  }
+
+  KJ_REQUIRE(cdOffset <= endOffset && cdSize <= endOffset - cdOffset,
+             "corrupt zip: bad central directory location");
+
+  auto cd = kj::heapArray<kj::byte>(cdSize);
+  preadAll(fd, cd, cdOffset);
+
+  const kj::byte* p = cd.begin();
+  for (uint64_t i = 0; i < count; i++) {
+    KJ_REQUIRE(cd.end() - p >= 46 && get32(p) == CENTRAL_HEADER_SIG,
+               "corrupt zip: bad central directory entry");
+    uint16_t madeBy = get16(p + 4);
+    uint16_t nameSize = get16(p + 28);
+    uint16_t extraSize = get16(p + 30);
+    uint16_t commentSize = get16(p + 32);
+    uint32_t externalAttributes = get32(p + 38);
+    KJ_REQUIRE(size_t(cd.end() - p) >= 46u + nameSize + extraSize + commentSize,
+               "corrupt zip: bad central directory entry");
+
+    auto entry = kj::heap<Entry>();
+    entry->flags = get16(p + 8);
+    entry->method = get16(p + 10);
+    entry->mtime = fromDosTime(get16(p + 14), get16(p + 12));
+    entry->crc = get32(p + 16);
+    entry->compressedSize = get32(p + 20);
+    entry->size = get32(p + 24);
+    entry->localOffset = get32(p + 42);
+
+    auto name = kj::arrayPtr(reinterpret_cast<const char*>(p + 46), nameSize);
+    bool isDirectory = nameSize > 0 && name[nameSize - 1] == '/';
+    if (isDirectory) name = name.slice(0, nameSize - 1);
+    entry->name = kj::heapString(name);
+
+    const kj::byte* extra = p + 46 + nameSize;
+    const kj::byte* extraEnd = extra + extraSize;
+    while (extraEnd - extra >= 4) {
+      uint16_t tag = get16(extra);
+      uint16_t size = get16(extra + 2);
+      const kj::byte* data = extra + 4;
+      if (size > extraEnd - data) break;
+
+      if (tag == EXTRA_ZIP64) {
+        // Present only for the fields that overflowed, in this order.
+        const kj::byte* field = data;
+        for (uint64_t* value: { &entry->size, &entry->compressedSize, &entry->localOffset }) {
+          if (*value == MAX32 && data + size - field >= 8) {
+            *value = get64(field);
+            field += 8;
+          }
+        }
+      } else if (tag == EXTRA_TIMESTAMP && size >= 5 && (data[0] & 1)) {
+        entry->mtime = get32(data + 1);
+      }
+      extra = data + size;
+    }
+
+    mode_t mode = externalAttributes >> 16;
+    if (madeBy >> 8 != HOST_UNIX || (mode & S_IFMT) == 0) {
+      mode = isDirectory ? S_IFDIR | 0755 : S_IFREG | 0644;
+    }
+    if (isDirectory) mode = S_IFDIR | (mode & 07777);
+    entry->mode = mode;
+
+    entries.add(kj::mv(entry));
+    p += 46 + nameSize + extraSize + commentSize;
+  }
+}
+
+// =======================================================================================
+// TreeExtractor
+
+TreeExtractor::TreeExtractor(int dirfd): dirfd(dirfd) {
+  umaskValue = umask(0);
+  umask(umaskValue);
+}
+
+TreeExtractor::~TreeExtractor() noexcept(false) {}
+
+kj::Maybe<int> TreeExtractor::openParent(kj::StringPtr name, kj::StringPtr& leaf) {
+  // Creates the parent directories of `name` as needed and returns the innermost, with `leaf` set
+  // to the last component. Returns null if the name is unsafe.
+
+  if (name.size() == 0 || name.startsWith("/") || name.findFirst('\0') != nullptr) {
+    return nullptr;
+  }
+
+  kj::Vector<kj::String> storage;
+  size_t pos = 0;
+  for (;;) {
+    KJ_IF_MAYBE(slash, name.slice(pos).findFirst('/')) {
+      storage.add(kj::heapString(name.slice(pos, pos + *slash)));
+      pos += *slash + 1;
+    } else {
+      storage.add(kj::heapString(name.slice(pos)));
+      break;
+    }
+  }
+  for (auto& part: storage) {
+    if (part.size() == 0 || part == "." || part == "..") return nullptr;
+  }
+
+  leaf = name.slice(name.size() - storage.back().size());
+  auto parentPath = name.slice(0, name.size() - leaf.size());
+  if (parentPath.size() == 0) return dirfd;
+  if (parentPath == cachedPath && cachedFd != nullptr) return cachedFd.get();
+
+  int at = dirfd;
+  kj::AutoCloseFd current;
+  for (auto& part: storage.asPtr().slice(0, storage.size() - 1)) {
+    while (mkdirat(at, part.cStr(), 0777) < 0) {
+      int error = errno;
+      if (error == EEXIST) break;
+      if (error != EINTR) KJ_FAIL_SYSCALL("mkdirat()", error, name);
+    }
+    current = raiiOpenAt(at, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    at = current;
+  }
+
+  cachedPath = kj::heapString(parentPath);
+  cachedFd = kj::mv(current);
+  return cachedFd.get();
+}
+
+kj::Maybe<kj::AutoCloseFd> TreeExtractor::createFile(kj::StringPtr name, mode_t mode) {
+  kj::StringPtr leaf;
+  KJ_IF_MAYBE(parent, openParent(name, leaf)) {
+    return raiiOpenAt(*parent, leaf, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                      mode & 0777);
+  } else {
+    KJ_LOG(WARNING, "skipping archive entry with unsafe name", name);
+    return nullptr;
+  }
+}
+
+void TreeExtractor::createSymlink(kj::StringPtr name, kj::StringPtr target) {
+  kj::StringPtr leaf;
+  KJ_IF_MAYBE(parent, openParent(name, leaf)) {
+    while (symlinkat(target.cStr(), *parent, leaf.cStr()) < 0) {
+      int error = errno;
+      if (error == EEXIST) {
+        KJ_SYSCALL(unlinkat(*parent, leaf.cStr(), 0), name);
+      } else if (error != EINTR) {
+        KJ_FAIL_SYSCALL("symlinkat()", error, name);
+      }
+    }
+  } else {
+    KJ_LOG(WARNING, "skipping archive entry with unsafe name", name);
+  }
+}
+
+void TreeExtractor::createDirectory(kj::StringPtr name, mode_t mode, struct timespec mtime) {
+  kj::StringPtr leaf;
+  KJ_IF_MAYBE(parent, openParent(name, leaf)) {
+    mode = mode & 0777 & ~umaskValue;
+    if (mkdirat(*parent, leaf.cStr(), mode) < 0) {
+      int error = errno;
+      if (error != EEXIST) KJ_FAIL_SYSCALL("mkdirat()", error, name);
+      // Created earlier as some other entry's parent. (Or it's not a directory, in which case
+      // this throws.)
+      auto dir = raiiOpenAt(*parent, leaf, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      KJ_SYSCALL(fchmod(dir, mode), name);
+    }
+    directories.add(Directory { kj::heapString(name), mtime });
+  } else {
+    KJ_LOG(WARNING, "skipping archive entry with unsafe name", name);
+  }
+}
+
+void TreeExtractor::finish() {
+  // Children come after their parents in archives, so go backwards.
+  for (auto i = directories.size(); i-- > 0;) {
+    auto& dir = directories[i];
+    kj::StringPtr leaf;
+    int parent = KJ_ASSERT_NONNULL(openParent(dir.name, leaf));
+    struct timespec times[2] = { { 0, UTIME_OMIT }, dir.mtime };
+    KJ_SYSCALL(utimensat(parent, leaf.cStr(), times, AT_SYMLINK_NOFOLLOW), dir.name);
+  }
+  directories.clear();
+}
+
+// =======================================================================================
+// ZipReader extraction
+
+namespace {
+
+void readEntryData(SequentialReader& in, uint64_t compressedSize, uint16_t method,
+                   uint64_t expectedSize, uint32_t expectedCrc, kj::StringPtr name,
+                   kj::OutputStream& out) {
+  uint32_t crc = 0;
+  uint64_t size = 0;
+  uint64_t remaining = compressedSize;
+
+  auto emit = [&](kj::ArrayPtr<const kj::byte> data) {
+    size += data.size();
+    KJ_REQUIRE(size <= expectedSize, "zip entry is larger than it claims", name);
+    crc = crc32(crc, data.begin(), data.size());
+    out.write(data.begin(), data.size());
+  };
+
+  if (method == METHOD_STORE) {
+    while (remaining > 0) {
+      auto chunk = in.read(kj::min(remaining, uint64_t(IO_BUFFER_SIZE)));
+      remaining -= chunk.size();
+      emit(chunk);
+    }
+  } else {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    KJ_ASSERT(inflateInit2(&z, -15) == Z_OK);
+    KJ_DEFER(inflateEnd(&z));
+
+    kj::byte buffer[IO_BUFFER_SIZE];
+    for (;;) {
+      if (z.avail_in == 0 && remaining > 0) {
+        auto chunk = in.read(kj::min(remaining, uint64_t(IO_BUFFER_SIZE)));
+        remaining -= chunk.size();
+        z.next_in = const_cast<kj::byte*>(chunk.begin());
+        z.avail_in = chunk.size();
+      }
+
+      z.next_out = buffer;
+      z.avail_out = sizeof(buffer);
+      int result = inflate(&z, Z_NO_FLUSH);
+      KJ_REQUIRE(result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR,
+                 "zip entry is corrupt", name, result);
+      emit(kj::arrayPtr(buffer, sizeof(buffer) - z.avail_out));
+
+      if (result == Z_STREAM_END) break;
+      KJ_REQUIRE(result != Z_BUF_ERROR || remaining > 0 || z.avail_in > 0,
+                 "zip entry is truncated", name);
+    }
+  }
+
+  KJ_REQUIRE(size == expectedSize && crc == expectedCrc, "zip entry is corrupt", name);
+}
+
+}  // namespace
+
+void ZipReader::extract(int dirfd, kj::Function<bool(kj::StringPtr name)> filter) {
+  kj::Vector<Entry*> selected;
+  for (auto& entry: entries) {
+    if (filter(entry->name)) selected.add(entry.get());
+  }
+  std::sort(selected.begin(), selected.end(),
+            [](Entry* a, Entry* b) { return a->localOffset < b->localOffset; });
+
+  SequentialReader in(fd);
+  TreeExtractor extractor(dirfd);
+
+  for (auto entry: selected) {
+    if (S_ISDIR(entry->mode)) {
+      extractor.createDirectory(entry->name, entry->mode, { entry->mtime, 0 });
+      continue;
+    }
+
+    KJ_REQUIRE(!(entry->flags & FLAG_ENCRYPTED), "encrypted zip entries aren't supported",
+               entry->name);
+    KJ_REQUIRE(entry->method == METHOD_STORE || entry->method == METHOD_DEFLATE,
+               "unsupported zip compression method", entry->name, entry->method);
+
+    in.seek(entry->localOffset);
+    kj::byte header[30];
+    in.readExactly(header, sizeof(header));
+    KJ_REQUIRE(get32(header) == LOCAL_HEADER_SIG, "corrupt zip: bad local header", entry->name);
+    in.seek(in.getPosition() + get16(header + 26) + get16(header + 28));
+
+    if (S_ISLNK(entry->mode)) {
+      KJ_REQUIRE(entry->size < PATH_MAX, "zip entry symlink target too long", entry->name);
+      kj::VectorOutputStream target;
+      readEntryData(in, entry->compressedSize, entry->method, entry->size, entry->crc,
+                    entry->name, target);
+      extractor.createSymlink(entry->name, kj::heapString(target.getArray().asChars()));
+    } else KJ_IF_MAYBE(file, extractor.createFile(entry->name, entry->mode)) {
+      {
+        kj::FdOutputStream rawOut(file->get());
+        kj::BufferedOutputStreamWrapper out(rawOut);
+        readEntryData(in, entry->compressedSize, entry->method, entry->size, entry->crc,
+                      entry->name, out);
+        out.flush();
+      }
+      struct timespec times[2] = { { 0, UTIME_OMIT }, { entry->mtime, 0 } };
+      KJ_SYSCALL(futimens(*file, times), entry->name);
+    }
+  }
+
+  extractor.finish();
+}
+
+}  // namespace sandstorm
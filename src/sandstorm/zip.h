@@ -0,0 +1,160 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2026 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_ZIP_H_
+#define SANDSTORM_ZIP_H_
+
+#include <kj/io.h>
+#include <kj/function.h>
+#include <kj/mutex.h>
+#include <kj/thread.h>
+#include <kj/vector.h>
+#include <sys/stat.h>
+#include <deque>
+
+namespace sandstorm {
+
+class ZipWriter {
+  // Writes a zip archive to a file descriptor in a single streaming pass, so the output may be a
+  // pipe.
+  //
+  // File contents are compressed on a pool of threads: each file is cut into chunks that are
+  // deflated independently (each primed with the 32k of input before it, as pigz does) and then
+  // concatenated, so even a single large file keeps every thread busy. Chunks are written out in
+  // order as they complete, and only a bounded number are in flight at once. Files whose names
+  // indicate an already-compressed format are stored rather than deflated.
+  //
+  // Entries record Unix permissions and mtimes, and symlinks are stored as links, as `zip -y`
+  // would. Zip64 extensions are used where sizes or offsets require them.
+
+public:
+  static constexpr size_t CHUNK_SIZE = 256u << 10;
+
+  explicit ZipWriter(int fd, uint threadCount = defaultThreadCount(),
+                     int compressionLevel = 6);
+  ~ZipWriter() noexcept(false);
+  KJ_DISALLOW_COPY(ZipWriter);
+
+  void addFile(kj::StringPtr name, int fd, const struct stat& stats);
+  void addFile(kj::StringPtr name, kj::InputStream& input, const struct stat& stats);
+  void addSymlink(kj::StringPtr name, kj::StringPtr target, const struct stat& stats);
+  void addDirectory(kj::StringPtr name, const struct stat& stats);
+  // Adds an entry. `name` is the path within the archive, without a trailing slash. For files,
+  // `stats.st_size` need only be accurate enough to say whether the file is at least 4GB.
+
+  void finish();
+  // Waits for all compression to complete and writes the central directory. Must be called
+  // before destruction, unless unwinding.
+
+  static uint defaultThreadCount();
+  // One per CPU, up to a limit.
+
+private:
+  struct Entry;
+  struct Job;
+  struct Item;
+  struct Queue;
+
+  kj::FdOutputStream rawOutput;
+  kj::BufferedOutputStreamWrapper output;
+  uint64_t offset = 0;
+  int compressionLevel;
+
+  kj::Vector<kj::Own<Entry>> entries;
+  std::deque<kj::Own<Item>> items;
+  // Output not yet written, in order. Items for chunks wait for their Job to complete.
+
+  uint inFlight = 0;
+  uint maxInFlight;
+  kj::Own<kj::MutexGuarded<Queue>> queue;
+  kj::Vector<kj::Own<kj::Thread>> threads;
+  // Declared last so that the threads are joined before anything they use is destroyed.
+
+  Entry& addEntry(kj::StringPtr name, const struct stat& stats);
+  void submit(kj::Own<Job> job, Entry& entry);
+  void writeOne();
+  void write(kj::ArrayPtr<const kj::byte> data);
+  void writeLocalHeader(Entry& entry);
+  void writeDescriptor(Entry& entry);
+  void writeCentralDirectory();
+  void runWorker();
+};
+
+class TreeExtractor {
+  // Creates the files and directories of an archive under a directory. It never writes outside
+  // the directory: names containing `..` or starting with `/` are skipped with a warning, and no
+  // path component is followed if it is a symlink.
+
+public:
+  explicit TreeExtractor(int dirfd);
+  ~TreeExtractor() noexcept(false);
+  KJ_DISALLOW_COPY(TreeExtractor);
+
+  kj::Maybe<kj::AutoCloseFd> createFile(kj::StringPtr name, mode_t mode);
+  // Creates a file, replacing any existing one, and returns it open for writing. Returns null if
+  // the name is unsafe.
+
+  void createSymlink(kj::StringPtr name, kj::StringPtr target);
+  void createDirectory(kj::StringPtr name, mode_t mode, struct timespec mtime);
+  // Parent directories are created as needed, so only empty directories need be created
+  // explicitly. Directory mtimes are set by finish(), since creating their contents changes them.
+
+  void finish();
+
+private:
+  int dirfd;
+  mode_t umaskValue;
+
+  kj::String cachedPath;
+  kj::AutoCloseFd cachedFd;
+  // The last parent directory opened. Entries are usually grouped by directory.
+
+  struct Directory {
+    kj::String name;
+    struct timespec mtime;
+  };
+  kj::Vector<Directory> directories;
+
+  kj::Maybe<int> openParent(kj::StringPtr name, kj::StringPtr& leaf);
+};
+
+class ZipReader {
+  // Reads a zip archive from a file. The central directory is read first, and then the entries'
+  // data is read in a single sequential pass.
+  //
+  // Files are extracted with a TreeExtractor, so never outside the target directory.
+
+public:
+  explicit ZipReader(int fd);
+  ~ZipReader() noexcept(false);
+  KJ_DISALLOW_COPY(ZipReader);
+
+  void extract(int dirfd, kj::Function<bool(kj::StringPtr name)> filter);
+  // Extracts all entries for which `filter` returns true into the directory `dirfd`. Names are
+  // passed to `filter` without any trailing slash.
+
+private:
+  struct Entry;
+
+  int fd;
+  kj::Vector<kj::Own<Entry>> entries;
+
+  void readCentralDirectory();
+};
+
+}  // namespace sandstorm
+
+#endif  // SANDSTORM_ZIP_H_